@@ -0,0 +1,337 @@
+/*
+ * Micro-benchmarks for the station's building blocks, pio run -e native_micro && .pio/build/native_micro/program [options]
+ *
+ * Times the SAS token helpers, the telemetry JSON, the menu on the card against the shim's MIFARE card
+ * and the camera slave request helpers against a slave that answers straight away. The clock is the
+ * simulated one, so the request delays and the bus time cost nothing and what's left is our own code.
+ * The SAS token is signed by the host's mbedTLS, not the shim's SHA-256, so it costs what the library does.
+ * Allocations are what the heap guard counts (memguard.h), operator new and in this build malloc, calloc
+ * and realloc as well, which is where mbedTLS gets its contexts from.
+ *
+ * --save FILE writes the results as one JSON object per line, --baseline FILE compares a run against one
+ * of those and fails if anything got slower by more than --threshold percent or allocates more than before.
+ * There's no baseline in the tree, the times only compare on one machine and against the real libraries
+ * the station is built with. Save one before a change and compare after it, on the same machine:
+ *
+ *   .pio/build/native_micro/program --save /tmp/before.json
+ *   .pio/build/native_micro/program --baseline /tmp/before.json
+ */
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <az_iot_hub_client.h>
+#include <az_span.h>
+
+#include "IotTokenHelper.h"
+#include "config.h"
+#include "i2cbus.h"
+#include "memguard.h"
+#include "nfc.h"
+#include "slave.h"
+
+// src/main.cpp
+size_t createTelemetryData(char *buffer, size_t size, const char *deviceId, const menu &menu, float rating);
+
+// Only the bus recovery would look at the pins, nothing hangs here
+#define MICRO_CAM_SDA 4
+#define MICRO_CAM_SCL 5
+#define MICRO_NFC_SDA 15
+#define MICRO_NFC_SCL 14
+#define MICRO_NFC_IRQ 13
+#define MICRO_NFC_VEN 12
+
+#define MICRO_DEVICE_KEY "bWljcm8tYmVuY2gtZGV2aWNlLWtleS0zMi1ieXRlcyE="
+#define MICRO_MIN_MS 200        // Default least time per benchmark, the batch doubles until it gets there
+#define MICRO_THRESHOLD 25.0    // Default percent slower than the baseline that still passes, runs on one machine vary by about 10
+#define MICRO_NAME_LEN 32
+
+// The camera slave, takes every command and has a full answer ready for any read
+class CMicroSlave : public CSimI2CDevice
+{
+public:
+  void onReceive(const uint8_t *data, size_t len) override
+  {
+    if( len >= sizeof(request) )
+      m_command = data[offsetof(request, command)];
+  }
+
+  size_t onRequest(uint8_t *data, size_t len) override
+  {
+    memset(data, m_command, len);
+    return len;
+  }
+
+private:
+  uint8_t m_command = 0;
+};
+
+struct result {
+  char name[MICRO_NAME_LEN];
+  double flNsOp;
+  double flAllocsOp;
+  double flBytesOp;
+};
+
+static int s_iMinMs = MICRO_MIN_MS;
+static std::vector<result> s_results;
+
+// Doubles the batch until it runs for s_iMinMs of wall time, the allocations come from the last batch
+static void Run(const char *name, const std::function<void()> &op)
+{
+  op(); // Whatever only happens on the first call isn't what's being measured
+
+  uint64_t ulIterations = 1;
+  for( ;; )
+  {
+    heapGuardStats before = getHeapGuardStats();
+    auto start = std::chrono::steady_clock::now();
+    for( uint64_t i = 0; i < ulIterations; i++ )
+      op();
+    double flNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    heapGuardStats after = getHeapGuardStats();
+
+    if( flNs >= s_iMinMs * 1e6 || ulIterations >= (1ULL << 40) )
+    {
+      result r = {};
+      strncpy(r.name, name, sizeof(r.name) - 1);
+      r.flNsOp = flNs / ulIterations;
+      r.flAllocsOp = (double)(after.iAllocations - before.iAllocations) / ulIterations;
+      r.flBytesOp = (double)(after.uBytes - before.uBytes) / ulIterations;
+      s_results.push_back(r);
+      printf("  %-22s %12.1f ns/op %8.2f allocs/op %10.1f bytes/op  (%llu ops)\n", r.name, r.flNsOp, r.flAllocsOp,
+        r.flBytesOp, (unsigned long long)ulIterations);
+      return;
+    }
+    ulIterations *= 2;
+  }
+}
+
+static bool Save(const char *fileName)
+{
+  FILE *file = fopen(fileName, "w");
+  if( !file )
+    return false;
+
+  for( auto &r : s_results )
+    fprintf(file, "{\"name\":\"%s\",\"nsOp\":%.1f,\"allocsOp\":%.2f,\"bytesOp\":%.1f}\n", r.name, r.flNsOp, r.flAllocsOp, r.flBytesOp);
+  fclose(file);
+  return true;
+}
+
+static bool Load(const char *fileName, std::vector<result> &results)
+{
+  FILE *file = fopen(fileName, "r");
+  if( !file )
+    return false;
+
+  char line[256];
+  while( fgets(line, sizeof(line), file) )
+  {
+    result r = {};
+    if( sscanf(line, "{\"name\":\"%31[^\"]\",\"nsOp\":%lf,\"allocsOp\":%lf,\"bytesOp\":%lf}", r.name, &r.flNsOp, &r.flAllocsOp, &r.flBytesOp) == 4 )
+      results.push_back(r);
+  }
+  fclose(file);
+  return true;
+}
+
+// Time may go up by the threshold, allocations not at all. True if nothing regressed
+static bool Compare(const std::vector<result> &baseline, double flThreshold)
+{
+  printf("Against the baseline, %.0f%% slower is still fine:\n", flThreshold);
+  bool bOk = true;
+  for( auto &r : s_results )
+  {
+    const result *base = nullptr;
+    for( auto &b : baseline )
+    {
+      if( !strcmp(b.name, r.name) )
+        base = &b;
+    }
+    if( !base )
+    {
+      printf("  %-22s not in the baseline\n", r.name);
+      continue;
+    }
+
+    double flDelta = base->flNsOp > 0 ? (r.flNsOp - base->flNsOp) * 100.0 / base->flNsOp : 0;
+    bool bSlower = flDelta > flThreshold;
+    bool bMoreAllocs = r.flAllocsOp > base->flAllocsOp || r.flBytesOp > base->flBytesOp;
+    bOk &= !bSlower && !bMoreAllocs;
+    printf("  %-22s %+7.1f%% time, %+.2f allocs/op, %+.1f bytes/op%s%s\n", r.name, flDelta, r.flAllocsOp - base->flAllocsOp,
+      r.flBytesOp - base->flBytesOp, bSlower ? "  SLOWER" : "", bMoreAllocs ? "  MORE ALLOCATIONS" : "");
+  }
+  for( auto &b : baseline )
+  {
+    bool bFound = false;
+    for( auto &r : s_results )
+      bFound |= !strcmp(b.name, r.name);
+    if( !bFound )
+      printf("  %-22s only in the baseline\n", b.name);
+  }
+  return bOk;
+}
+
+static void Usage(const char *name)
+{
+  printf("Usage: %s [--min-ms MS] [--save FILE] [--baseline FILE] [--threshold PERCENT]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  const char *saveFile = nullptr;
+  const char *baselineFile = nullptr;
+  double flThreshold = MICRO_THRESHOLD;
+  for( int i = 1; i < argc; i++ )
+  {
+    std::string arg = argv[i];
+    if( arg == "--min-ms" && i + 1 < argc )
+      s_iMinMs = atoi(argv[++i]);
+    else if( arg == "--save" && i + 1 < argc )
+      saveFile = argv[++i];
+    else if( arg == "--baseline" && i + 1 < argc )
+      baselineFile = argv[++i];
+    else if( arg == "--threshold" && i + 1 < argc )
+      flThreshold = atof(argv[++i]);
+    else
+    {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<result> baseline;
+  if( baselineFile && !Load(baselineFile, baseline) )
+  {
+    fprintf(stderr, "Can't read %s\n", baselineFile);
+    return 2;
+  }
+
+  SimClockEnable(true);
+  Serial.SimSetEnabled(false);
+  g_Config.Defaults();
+
+  // SAS token, same client setup as CIoTHub::initIoTHub()
+  static const char s_szHost[] = "micro-bench.azure-devices.net";
+  static const char s_szDevice[] = "micro-bench-station";
+  az_iot_hub_client client;
+  az_iot_hub_client_options options = az_iot_hub_client_options_default();
+  if( az_result_failed(az_iot_hub_client_init(&client, az_span_create((uint8_t *)s_szHost, strlen(s_szHost)),
+        az_span_create((uint8_t *)s_szDevice, strlen(s_szDevice)), &options)) )
+  {
+    fprintf(stderr, "Hub client init failed\n");
+    return 1;
+  }
+  static char s_szDeviceKey[] = MICRO_DEVICE_KEY;
+  static uint8_t s_signature[512];
+  static uint8_t s_token[256];
+  az_span token = generate_sas_token(&client, az_span_create_from_str(s_szDeviceKey), AZ_SPAN_FROM_BUFFER(s_signature),
+    60, AZ_SPAN_FROM_BUFFER(s_token));
+  if( az_span_size(token) == 0 || az_span_size(token) >= (int32_t)sizeof(s_token) )
+  {
+    fprintf(stderr, "Generating the SAS token failed\n");
+    return 1;
+  }
+  static char s_szToken[sizeof(s_token)];
+  memcpy(s_szToken, s_token, az_span_size(token));
+  s_szToken[az_span_size(token)] = 0;
+
+  // A full menu, the longest telemetry there is and every byte of the block used
+  menu fullMenu;
+  fullMenu.Clear();
+  fullMenu.iUserID = 42;
+  fullMenu.iMenuLen = MENU_MAX_ITEMS;
+  for( int i = 0; i < MENU_MAX_ITEMS; i++ )
+    fullMenu.iaMenu[i] = 100 + i;
+
+  CSimMifareCard card;
+  card.setPresent(true);
+  Electroniccats_PN7150::setSimModel(&card);
+  g_NfcBus.begin(MICRO_NFC_SDA, MICRO_NFC_SCL, NFC_I2C_FREQ);
+  static CNFCHandler s_nfc;
+  s_nfc.setup(&Wire1, MICRO_NFC_SDA, MICRO_NFC_SCL, MICRO_NFC_IRQ, MICRO_NFC_VEN);
+  if( s_nfc.WriteMenu(fullMenu) )
+  {
+    fprintf(stderr, "Writing the menu to the card failed\n");
+    return 1;
+  }
+
+  static CMicroSlave s_slave;
+  Wire.attachDevice(I2C_DEV_ADDR, &s_slave);
+  g_CamBus.begin(MICRO_CAM_SDA, MICRO_CAM_SCL, g_Config.iI2CFreq);
+
+  // From here on every operator new is counted
+  armHeapGuard();
+
+  static volatile uint32_t s_uSink = 0;
+  printf("Micro-benchmarks, at least %d ms each:\n", s_iMinMs);
+
+  Run("sas token", [&]()
+  {
+    az_span sas = generate_sas_token(&client, az_span_create_from_str(s_szDeviceKey), AZ_SPAN_FROM_BUFFER(s_signature),
+      60, AZ_SPAN_FROM_BUFFER(s_token));
+    s_uSink += az_span_size(sas);
+  });
+  Run("sas expiration", [&]()
+  {
+    s_uSink += getSasTokenExpiration(s_szToken);
+  });
+
+  Run("telemetry json", [&]()
+  {
+    char szData[256];
+    s_uSink += createTelemetryData(szData, sizeof(szData), s_szDevice, fullMenu, 73.5f);
+  });
+
+  Run("nfc write menu", [&]()
+  {
+    s_uSink += s_nfc.WriteMenu(fullMenu);
+  });
+  Run("nfc read menu", [&]()
+  {
+    menu out;
+    s_uSink += s_nfc.ReadMenu(out) + out.iMenuLen;
+  });
+
+  Run("i2c transmit", [&]()
+  {
+    I2cTransmit(++g_iRequestCount, CMD_IS_SCANNING);
+  });
+  Run("i2c transmit data", [&]()
+  {
+    uint8_t chunk[64] = {};
+    s_uSink += I2cTransmitData(++g_iRequestCount, CMD_FW_CHUNK, chunk, sizeof(chunk));
+  });
+  Run("i2c request num", [&]()
+  {
+    float flResult;
+    requestNum<float>(++g_iRequestCount, CMD_GET_RESULT, &flResult);
+    s_uSink += (uint32_t)flResult;
+  });
+  Run("i2c request string", [&]()
+  {
+    char szVersion[16];
+    requestString(++g_iRequestCount, CMD_GET_VERSION, szVersion, sizeof(szVersion));
+    s_uSink += szVersion[0];
+  });
+
+  if( saveFile )
+  {
+    if( !Save(saveFile) )
+    {
+      fprintf(stderr, "Can't write %s\n", saveFile);
+      return 2;
+    }
+    printf("Saved to %s\n", saveFile);
+  }
+
+  if( baselineFile )
+    return Compare(baseline, flThreshold) ? 0 : 1;
+  return 0;
+}
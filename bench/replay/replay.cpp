@@ -0,0 +1,572 @@
+/*
+ * Replays a capture from a station, pio run -e native_replay && .pio/build/native_replay/program capture.bin [options]
+ *
+ * The capture is the capture partition off a station (include/capture.h), or the file station_bench --capture
+ * writes. Runs the real setup()/loop() from src/main.cpp on the simulated clock with the recorded config, and
+ * whatever the station read (camera slave answers, card answers, card arrivals and removals, button presses)
+ * comes from the capture at the same time it did on the station. The station captures again while it runs,
+ * and what it sent out (slave commands, card commands, MQTT publishes) is compared against the recording,
+ * both what and when.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Preferences.h>
+#include <esp_partition.h>
+
+#include "../station/sim_components.h"
+#include "capture.h"
+#include "config.h"
+#include "i2cbus.h"
+#include "slave.h"
+
+void setup();
+void loop();
+
+#define REPLAY_TAIL_MS 5000 // Keeps running this long after the last record, for what the last input set off
+#define REPLAY_INPUT_LEAD_MS 100 // Most a card leaves before the station noticed it in the capture
+#define REPLAY_READ_SLACK_MS 5 // A read goes into the capture once it's done, the replay answers it while it's under way
+#define REPLAY_SHOW_MISMATCHES 5
+#define REPLAY_TOLERANCE_MS 250  // Default for how far an output may drift from the capture and still count as the same
+
+struct captured {
+  uint8_t uType;
+  uint8_t uArg;
+  unsigned long ulTime; // Station's millis()
+  std::vector<uint8_t> data;
+};
+
+static std::vector<captured> s_recorded;
+static long s_lOffset = 0; // Replay's millis() minus the station's at the same point
+
+static unsigned long RecordedNow(unsigned long ulNow)
+{
+  return ulNow - s_lOffset;
+}
+
+// Everything up to the end marker, false if it doesn't start like a capture this build can use
+static bool Parse(const std::vector<uint8_t> &data, std::vector<captured> &out, captureStart &start)
+{
+  size_t pos = 0;
+  unsigned long ulTime = 0;
+  while( pos + sizeof(captureRecord) <= data.size() )
+  {
+    captureRecord record;
+    memcpy(&record, data.data() + pos, sizeof(record));
+    pos += sizeof(record);
+    if( record.uType == CAPTURE_END || pos + record.uLength > data.size() )
+      break;
+
+    captured entry;
+    entry.uType = record.uType;
+    entry.uArg = record.uArg;
+    entry.data.assign(data.begin() + pos, data.begin() + pos + record.uLength);
+    pos += record.uLength;
+
+    ulTime += record.uDeltaMs;
+    if( entry.uType == CAPTURE_CLOCK && entry.data.size() == sizeof(uint32_t) )
+    {
+      uint32_t ulMillis;
+      memcpy(&ulMillis, entry.data.data(), sizeof(ulMillis));
+      ulTime = ulMillis;
+      continue;
+    }
+    if( entry.uType == CAPTURE_START )
+    {
+      if( !out.empty() || entry.data.size() != sizeof(captureStart) )
+        return false;
+      memcpy(&start, entry.data.data(), sizeof(start));
+      if( start.uMagic != CAPTURE_MAGIC || start.uVersion != CAPTURE_VERSION || start.uConfigSize != sizeof(stationConfig) )
+        return false;
+      ulTime = start.ulMillis;
+    }
+    else if( out.empty() )
+      return false;
+
+    entry.ulTime = ulTime;
+    out.push_back(std::move(entry));
+  }
+
+  return !out.empty();
+}
+
+static uint8_t SlaveCommand(const captured &entry)
+{
+  return entry.data.size() >= sizeof(request) ? entry.data[offsetof(request, command)] : 0;
+}
+
+// The entry closest to ulTime out of the ones listed, ties go to the earlier one
+static const captured *Nearest(const std::vector<size_t> &entries, unsigned long ulTime)
+{
+  const captured *best = nullptr;
+  unsigned long ulBest = 0;
+  for( size_t i : entries )
+  {
+    const captured &entry = s_recorded[i];
+    unsigned long ulDistance = entry.ulTime > ulTime ? entry.ulTime - ulTime : ulTime - entry.ulTime;
+    if( !best || ulDistance < ulBest )
+    {
+      best = &entry;
+      ulBest = ulDistance;
+    }
+  }
+  return best;
+}
+
+// The camera slave as it was in the capture. A read gets what the slave answered to the same command,
+// the same number of reads after it, last before that point in time. Polls land on the answer the
+// slave had then, however often the replay asks
+class CReplaySlave : public CSimI2CDevice
+{
+public:
+  CReplaySlave()
+  {
+    uint8_t uCommand = 0;
+    int iRead = 0;
+    for( size_t i = 0; i < s_recorded.size(); i++ )
+    {
+      const captured &entry = s_recorded[i];
+      if( entry.uType == CAPTURE_I2C_WRITE )
+      {
+        uCommand = SlaveCommand(entry);
+        iRead = 0;
+      }
+      else if( entry.uType == CAPTURE_I2C_READ )
+        m_reads[Key(uCommand, iRead++)].push_back(i);
+    }
+  }
+
+  void onReceive(const uint8_t *data, size_t len) override
+  {
+    m_uCommand = len >= sizeof(request) ? data[offsetof(request, command)] : 0;
+    m_iRead = 0;
+  }
+
+  size_t onRequest(uint8_t *data, size_t len) override
+  {
+    memset(data, 0, len);
+    auto it = m_reads.find(Key(m_uCommand, m_iRead++));
+    if( it == m_reads.end() )
+    {
+      m_iUnknown++;
+      return len;
+    }
+
+    unsigned long ulNow = RecordedNow(millis()) + REPLAY_READ_SLACK_MS;
+    const captured *answer = &s_recorded[it->second.front()];
+    for( size_t i : it->second )
+    {
+      if( s_recorded[i].ulTime > ulNow )
+        break;
+      answer = &s_recorded[i];
+    }
+
+    // Failed on the station too
+    if( answer->uArg != I2C_OK )
+      return 0;
+    memcpy(data, answer->data.data(), std::min(len, answer->data.size()));
+    return len;
+  }
+
+  int GetUnknown() { return m_iUnknown; }
+
+private:
+  static int Key(uint8_t uCommand, int iRead) { return uCommand << 8 | std::min(iRead, 0xFF); }
+
+  std::map<int, std::vector<size_t>> m_reads;
+  uint8_t m_uCommand = 0;
+  int m_iRead = 0;
+  int m_iUnknown = 0; // Reads the capture has nothing for, answered with zeros
+};
+
+// The cards as they were in the capture, and every command gets what the card answered closest in time.
+// A card arriving raises the IRQ and wakes the station right then, so it arrives exactly when it was seen.
+// Leaving makes no interrupt, the station only notices on its next look, so all the capture says is that
+// it left since the record before. It goes halfway between the two but at most REPLAY_INPUT_LEAD_MS early,
+// that way a replay that runs a little early or late still sees it at the same point. Waiting for the
+// removal watches the card the whole time, that one is exact
+class CReplayCard : public CSimNFCModel
+{
+public:
+  CReplayCard()
+  {
+    bool bPresent = false;
+    unsigned long ulLast = 0;
+    for( size_t i = 0; i < s_recorded.size(); i++ )
+    {
+      const captured &entry = s_recorded[i];
+      if( (entry.uType == CAPTURE_NFC_DETECT || entry.uType == CAPTURE_NFC_IRQ) && (entry.uArg != 0) != bPresent )
+      {
+        bPresent = !bPresent;
+        unsigned long ulLead = bPresent ? 0 : std::min((entry.ulTime - ulLast) / 2, (unsigned long)REPLAY_INPUT_LEAD_MS);
+        m_presence.push_back({ entry.ulTime - ulLead, bPresent });
+      }
+      else if( entry.uType == CAPTURE_NFC_REMOVED && bPresent )
+      {
+        bPresent = false;
+        m_presence.push_back({ entry.ulTime - 1, false });
+      }
+      else if( entry.uType == CAPTURE_NFC_CMD && i + 1 < s_recorded.size() && s_recorded[i + 1].uType == CAPTURE_NFC_RESP )
+      {
+        m_exact[entry.data].push_back(i + 1);
+        if( !entry.data.empty() )
+          m_similar[Similar(entry.data.data(), entry.data.size())].push_back(i + 1);
+      }
+      ulLast = entry.ulTime;
+    }
+
+    // Whoever was at the reader when the capture ended walks off, nothing would take their card away otherwise
+    if( bPresent )
+      m_presence.push_back({ ulLast + 1, false });
+  }
+
+  bool isTagPresent() override
+  {
+    unsigned long ulNow = RecordedNow(millis());
+    bool bPresent = false;
+    for( auto &change : m_presence )
+    {
+      if( change.first > ulNow )
+        break;
+      bPresent = change.second;
+    }
+    return bPresent;
+  }
+
+  bool exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen) override
+  {
+    unsigned long ulNow = RecordedNow(millis());
+    const captured *answer = nullptr;
+    auto exact = m_exact.find(std::vector<uint8_t>(cmd, cmd + cmdLen));
+    if( exact != m_exact.end() )
+      answer = Nearest(exact->second, ulNow);
+    else if( cmdLen )
+    {
+      // A write with other data than the station had, the card says the same about it
+      auto similar = m_similar.find(Similar(cmd, cmdLen));
+      if( similar != m_similar.end() )
+        answer = Nearest(similar->second, ulNow);
+    }
+
+    if( !answer )
+    {
+      m_iUnknown++;
+      return false;
+    }
+    if( answer->uArg == NFC_ERROR )
+      return false;
+
+    *respLen = (uint8_t)answer->data.size();
+    memcpy(resp, answer->data.data(), answer->data.size());
+    return true;
+  }
+
+  int GetUnknown() { return m_iUnknown; }
+
+private:
+  static int Similar(const uint8_t *cmd, size_t len) { return cmd[0] << 8 | (int)len; }
+
+  std::vector<std::pair<unsigned long, bool>> m_presence;
+  std::map<std::vector<uint8_t>, std::vector<size_t>> m_exact;
+  std::map<int, std::vector<size_t>> m_similar;
+  int m_iUnknown = 0;
+};
+
+static std::vector<unsigned long> s_buttons;
+static size_t s_uNextButton = 0;
+static unsigned long s_ulReleaseAt = 0; // 0 if the button isn't down
+
+static void ApplyInputs(unsigned long ulNow)
+{
+  if( s_ulReleaseAt && (long)(ulNow - s_ulReleaseAt) >= 0 )
+  {
+    SimSetPin(SIM_SCAN_BUTTON, HIGH);
+    s_ulReleaseAt = 0;
+  }
+  // Held down like a finger would, a press shorter than the debounce doesn't count
+  while( s_uNextButton < s_buttons.size() && s_buttons[s_uNextButton] <= RecordedNow(ulNow) )
+  {
+    SimSetPin(SIM_SCAN_BUTTON, LOW);
+    s_ulReleaseAt = ulNow + SIM_PRESS_MS;
+    s_uNextButton++;
+  }
+}
+
+static void OnDelay(uint64_t ulFromUs, uint64_t ulToUs)
+{
+  (void)ulFromUs;
+  ApplyInputs((unsigned long)(ulToUs / 1000));
+}
+
+// Polls go as often as the loop happens to run, only what they set off has to match
+static bool IsSlavePoll(uint8_t uCommand)
+{
+  return uCommand == CMD_IS_SCANNING || uCommand == CMD_GET_RESULT || uCommand == CMD_GET_PROGRESS || uCommand == CMD_GET_ETA
+    || uCommand == CMD_FW_STATUS || uCommand == CMD_GET_VERSION;
+}
+
+// What one record says to the outside, without what's allowed to differ
+static bool Output(const captured &entry, const char *&category, std::vector<uint8_t> &content)
+{
+  content.clear();
+  switch( entry.uType )
+  {
+    case CAPTURE_I2C_WRITE:
+      if( IsSlavePoll(SlaveCommand(entry)) )
+        return false;
+      // The request number goes up with every poll too
+      category = "slave commands";
+      content.push_back(SlaveCommand(entry));
+      if( entry.data.size() > sizeof(request) )
+        content.insert(content.end(), entry.data.begin() + sizeof(request), entry.data.end());
+      return true;
+
+    case CAPTURE_NFC_CMD:
+      category = "card commands";
+      content = entry.data;
+      return true;
+
+    case CAPTURE_PUBLISH:
+      category = "mqtt publishes";
+      content = entry.data;
+      content.push_back(entry.uArg);
+      return true;
+  }
+  return false;
+}
+
+static std::string Describe(const captured &entry)
+{
+  std::string text;
+  if( entry.uType == CAPTURE_PUBLISH )
+  {
+    for( uint8_t c : entry.data )
+      text += c >= 0x20 && c < 0x7F ? (char)c : ' ';
+  }
+  else
+  {
+    char hex[4];
+    for( uint8_t b : entry.data )
+    {
+      snprintf(hex, sizeof(hex), "%02x ", b);
+      text += hex;
+    }
+  }
+  return text.size() > 100 ? text.substr(0, 100) + "..." : text;
+}
+
+static unsigned long Percentile(const std::vector<unsigned long> &sorted, int p)
+{
+  if( sorted.empty() )
+    return 0;
+
+  // Nearest rank
+  size_t rank = (sorted.size() * p + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+struct outputs {
+  std::vector<const captured *> entries;
+  std::vector<std::vector<uint8_t>> contents;
+};
+
+// Both sides in order, true if everything matched
+static bool Compare(const std::vector<captured> &recorded, const std::vector<captured> &replayed, long lOffset, unsigned long ulTolerance)
+{
+  std::map<std::string, outputs> expected, actual;
+  std::map<uint8_t, std::pair<int, int>> polls;
+  const char *category;
+  std::vector<uint8_t> content;
+  for( auto &entry : recorded )
+  {
+    if( Output(entry, category, content) )
+    {
+      expected[category].entries.push_back(&entry);
+      expected[category].contents.push_back(content);
+    }
+    else if( entry.uType == CAPTURE_I2C_WRITE )
+      polls[SlaveCommand(entry)].first++;
+  }
+  for( auto &entry : replayed )
+  {
+    if( Output(entry, category, content) )
+    {
+      actual[category].entries.push_back(&entry);
+      actual[category].contents.push_back(content);
+    }
+    else if( entry.uType == CAPTURE_I2C_WRITE )
+      polls[SlaveCommand(entry)].second++;
+  }
+
+  bool bMatched = true;
+  for( const char *name : { "slave commands", "card commands", "mqtt publishes" } )
+  {
+    outputs &want = expected[name];
+    outputs &got = actual[name];
+    size_t uCommon = std::min(want.entries.size(), got.entries.size());
+    int iMismatches = 0;
+    int iLate = 0;
+    long lMaxDrift = 0;
+    std::vector<unsigned long> drifts;
+    for( size_t i = 0; i < uCommon; i++ )
+    {
+      long lDrift = (long)(got.entries[i]->ulTime - lOffset) - (long)want.entries[i]->ulTime;
+      drifts.push_back(labs(lDrift));
+      if( labs(lDrift) > labs(lMaxDrift) )
+        lMaxDrift = lDrift;
+      if( (unsigned long)labs(lDrift) > ulTolerance )
+        iLate++;
+
+      if( want.contents[i] == got.contents[i] )
+        continue;
+      if( iMismatches++ < REPLAY_SHOW_MISMATCHES )
+      {
+        printf("    %s #%u at %lu ms differs\n      recorded %s\n      replayed %s\n", name, (unsigned)i, want.entries[i]->ulTime,
+          Describe(*want.entries[i]).c_str(), Describe(*got.entries[i]).c_str());
+      }
+    }
+    std::sort(drifts.begin(), drifts.end());
+
+    bool bSame = iMismatches == 0 && iLate == 0 && want.entries.size() == got.entries.size();
+    bMatched &= bSame;
+    printf("  %-20s %u recorded, %u replayed, %d differ, %d off by more than %lu ms, drift p50 %lu ms, p99 %lu ms, max %+ld ms%s\n", name,
+      (unsigned)want.entries.size(), (unsigned)got.entries.size(), iMismatches, iLate, ulTolerance, Percentile(drifts, 50),
+      Percentile(drifts, 99), lMaxDrift, bSame ? "" : "  MISMATCH");
+  }
+
+  for( auto &poll : polls )
+    printf("  slave poll 0x%02x        %d recorded, %d replayed\n", poll.first, poll.second.first, poll.second.second);
+
+  return bMatched;
+}
+
+static bool ReadFile(const char *fileName, std::vector<uint8_t> &data)
+{
+  FILE *file = fopen(fileName, "rb");
+  if( !file )
+    return false;
+
+  uint8_t buffer[4096];
+  size_t uRead;
+  while( (uRead = fread(buffer, 1, sizeof(buffer), file)) > 0 )
+    data.insert(data.end(), buffer, buffer + uRead);
+  fclose(file);
+  return true;
+}
+
+static void Usage(const char *name)
+{
+  printf("Usage: %s CAPTURE.bin [--tolerance MS] [--verbose]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  bool bVerbose = false;
+  unsigned long ulTolerance = REPLAY_TOLERANCE_MS;
+  const char *captureFile = nullptr;
+  for( int i = 1; i < argc; i++ )
+  {
+    std::string arg = argv[i];
+    if( arg == "--verbose" )
+      bVerbose = true;
+    else if( arg == "--tolerance" && i + 1 < argc )
+      ulTolerance = strtoul(argv[++i], nullptr, 10);
+    else if( arg[0] != '-' && !captureFile )
+      captureFile = argv[i];
+    else
+    {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+  if( !captureFile )
+  {
+    Usage(argv[0]);
+    return 2;
+  }
+
+  std::vector<uint8_t> data;
+  captureStart recordedStart;
+  if( !ReadFile(captureFile, data) )
+  {
+    fprintf(stderr, "Failed reading %s\n", captureFile);
+    return 1;
+  }
+  if( !Parse(data, s_recorded, recordedStart) )
+  {
+    fprintf(stderr, "%s isn't a version %d capture from a station built like this one\n", captureFile, CAPTURE_VERSION);
+    return 1;
+  }
+  unsigned long ulRecordedEnd = s_recorded.back().ulTime;
+
+  for( auto &entry : s_recorded )
+  {
+    if( entry.uType == CAPTURE_BUTTON )
+      s_buttons.push_back(entry.ulTime);
+  }
+
+  CSimBroker broker;
+  uint16_t port = broker.Start();
+  if( !port )
+  {
+    fprintf(stderr, "Failed starting the local MQTT broker\n");
+    return 1;
+  }
+  setenv("NATIVE_MQTT_HOST", "127.0.0.1", 1);
+  setenv("NATIVE_MQTT_PORT", std::to_string(port).c_str(), 1);
+
+  CReplaySlave slave;
+  CReplayCard card;
+  Wire.attachDevice(SIM_SLAVE_ADDR, &slave);
+  Electroniccats_PN7150::setSimModel(&card);
+
+  // The station's config, capturing again so there's something to compare
+  g_Config = recordedStart.config;
+  g_Config.iCapture = 1;
+  g_Config.Save();
+
+  Serial.SimSetEnabled(bVerbose);
+  SimClockEnable(true);
+
+  setup();
+
+  // The capture starts at the end of setup() on both sides
+  s_lOffset = (long)(millis() - recordedStart.ulMillis);
+  SimSetDelayHook(OnDelay);
+
+  while( (long)(RecordedNow(millis()) - (ulRecordedEnd + REPLAY_TAIL_MS)) < 0 )
+  {
+    ApplyInputs(millis());
+    loop();
+  }
+  updateCapture();
+  Serial.SimSetEnabled(true);
+
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CAPTURE_SUBTYPE, CAPTURE_PARTITION);
+  std::vector<uint8_t> replayData(partition->size);
+  esp_partition_read(partition, 0, replayData.data(), replayData.size());
+  std::vector<captured> replayed;
+  captureStart replayStart;
+  if( !Parse(replayData, replayed, replayStart) )
+  {
+    fprintf(stderr, "Replay didn't capture anything\n");
+    return 1;
+  }
+  // Past the end of the recording the station wasn't fed anything anymore
+  while( !replayed.empty() && replayed.back().ulTime - s_lOffset > ulRecordedEnd + REPLAY_TAIL_MS / 2 )
+    replayed.pop_back();
+
+  printf("Replay of %s: %u records over %.1f s, %u buttons\n", captureFile, (unsigned)s_recorded.size(),
+    (ulRecordedEnd - recordedStart.ulMillis) / 1000.0, (unsigned)s_buttons.size());
+  bool bMatched = Compare(s_recorded, replayed, s_lOffset, ulTolerance);
+  printf("  not in the capture   %d slave reads, %d card commands\n", slave.GetUnknown(), card.GetUnknown());
+  printf("  %s\n", bMatched ? "station did the same" : "station did something else");
+
+  broker.Stop();
+  return bMatched ? 0 : 1;
+}
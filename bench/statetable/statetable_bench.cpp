@@ -0,0 +1,113 @@
+/*
+ * State table dispatch benchmark, pio run -e native_statetable && .pio/build/native_statetable/program [--steps N]
+ *
+ * Runs the station's state table from include/statemachine.h with actions that do nothing but hand out
+ * the next trigger, so what's measured is the table lookup, the budget check and the calls into the actions.
+ * A customer walks the whole flow every few steps and every so often one walks off, so the timeouts run too.
+ */
+
+#include <chrono>
+#include <string>
+
+#include <Arduino.h>
+
+#include "statemachine.h"
+
+static unsigned long s_ulNow = 0;
+static uint32_t s_uStep = 0;
+static volatile uint32_t s_uSink = 0;
+
+// Every state sits a few steps before moving on, like a station waiting on its customer
+#define STEPS_PER_STATE 4
+// One customer in this many leaves mid-flow and the state runs out of budget
+#define WALK_OFF_EVERY 50
+
+static uint32_t s_uCustomers = 0;
+static bool s_bWalkedOff = false;
+
+static int Next(int iState, int iTrigger)
+{
+  if( ++s_uStep % STEPS_PER_STATE )
+    return TRIGGER_NONE;
+
+  // Nobody coming back, let the clock run past the budget. Each of the waiting states gets its turn
+  if( !s_bWalkedOff && s_uCustomers % WALK_OFF_EVERY == WALK_OFF_EVERY - 1 && iState == 1 + (int)(s_uCustomers / WALK_OFF_EVERY % 3) )
+  {
+    s_bWalkedOff = true;
+    s_ulNow += 120000;
+    return TRIGGER_NONE;
+  }
+  return iTrigger;
+}
+
+static void OnEnter(int iFrom) { s_uSink += iFrom; }
+static void OnExit(int iTo) { s_uSink += iTo; }
+static void EnterIdle(int iFrom) { s_uSink += iFrom; s_uCustomers++; s_bWalkedOff = false; }
+
+static int UpdateIdle() { return Next(STATE_IDLE, TRIGGER_CARD_READ); }
+static int UpdateConfirmScan() { return Next(STATE_CONFIRM_SCAN, TRIGGER_SCAN_PRESSED); }
+static int UpdateScanning() { return Next(STATE_SCANNING, TRIGGER_SCAN_DONE); }
+static int UpdateConfirmResult() { return Next(STATE_CONFIRM_RESULT, TRIGGER_CARD_CONFIRM); }
+
+static const stateActions s_actions[STATE_COUNT] =
+{
+  { EnterIdle, UpdateIdle, OnExit },
+  { OnEnter, UpdateConfirmScan, OnExit },
+  { OnEnter, UpdateScanning, OnExit },
+  { OnEnter, UpdateConfirmResult, OnExit }
+};
+
+static void Usage(const char *name)
+{
+  printf("Usage: %s [--steps N]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t uSteps = 10000000;
+  for( int i = 1; i < argc; i++ )
+  {
+    std::string arg = argv[i];
+    if( arg == "--steps" && i + 1 < argc )
+      uSteps = strtoul(argv[++i], nullptr, 10);
+    else
+    {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+
+  CStateMachine machine(s_actions);
+  machine.Start(STATE_IDLE, s_ulNow);
+
+  auto start = std::chrono::steady_clock::now();
+  for( uint32_t i = 0; i < uSteps; i++ )
+  {
+    s_ulNow += 10;
+    machine.Step(s_ulNow);
+  }
+  double flStepNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / uSteps;
+  uint32_t uCustomers = s_uCustomers;
+
+  // Dispatch alone, one trigger that leads somewhere and one that doesn't, turn about
+  static const int s_iaCycle[] = { TRIGGER_CARD_READ, TRIGGER_SCAN_DONE, TRIGGER_SCAN_PRESSED, TRIGGER_CARD_READ,
+    TRIGGER_SCAN_DONE, TRIGGER_CANCEL, TRIGGER_CARD_CONFIRM, TRIGGER_SCAN_PRESSED };
+  CStateMachine dispatcher(s_actions);
+  dispatcher.Start(STATE_IDLE, 0);
+  start = std::chrono::steady_clock::now();
+  for( uint32_t i = 0; i < uSteps; i++ )
+    dispatcher.Dispatch(s_iaCycle[i % 8], i);
+  double flDispatchNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / uSteps;
+
+  printf("State table benchmark: %u steps, %zu bytes of table\n", (unsigned)uSteps, sizeof(g_stateTable) + sizeof(g_stateInfo));
+  printf("  step                 %.2f ns\n", flStepNs);
+  printf("  dispatch             %.2f ns\n", flDispatchNs);
+  printf("  customers            %u, %u transitions\n", (unsigned)uCustomers, (unsigned)machine.GetTransitions());
+  printf("  timeouts             %u confirm scan, %u scanning, %u confirm result\n",
+    (unsigned)machine.GetOverruns(STATE_CONFIRM_SCAN), (unsigned)machine.GetOverruns(STATE_SCANNING), (unsigned)machine.GetOverruns(STATE_CONFIRM_RESULT));
+
+  // Same numbers on one line, for scripts comparing runs
+  printf("{\"steps\":%u,\"stepNs\":%.2f,\"dispatchNs\":%.2f,\"transitions\":%u}\n",
+    (unsigned)uSteps, flStepNs, flDispatchNs, (unsigned)machine.GetTransitions());
+  return 0;
+}
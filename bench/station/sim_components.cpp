@@ -0,0 +1,665 @@
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <esp_now.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <rom/crc.h>
+
+#include "sim_components.h"
+#include "iothub.h"
+
+extern CIoTHub g_IoTHub;
+
+/* Scanner slave */
+
+void CSimScannerSlave::onReceive(const uint8_t *data, size_t len)
+{
+  // struct request { int requestCount; byte command; } __attribute__((packed))
+  if( len < 5 )
+    return;
+
+  Update();
+  if( IsRebooting() )
+    return; // Nobody's listening
+
+  m_command = data[4];
+  if( m_command >= SIM_CMD_FW_BEGIN && m_command <= SIM_CMD_FW_FINISH )
+  {
+    ReceiveFw(m_command, data + 5, len - 5);
+    return;
+  }
+
+  // The bootloader doesn't scan
+  if( m_bBootloader )
+    return;
+
+  if( m_command == SIM_CMD_START_SCAN && !m_bScanning )
+  {
+    std::uniform_real_distribution<float> jitter(1.0f - m_params.flJitter, 1.0f + m_params.flJitter);
+    m_bScanning = true;
+    m_ulScanStart = millis();
+    m_ulScanDone = m_ulScanStart + (unsigned long)(m_params.ulScanMs * jitter(m_rng));
+  }
+  else if( m_command == SIM_CMD_CANCEL_SCAN && m_bScanning )
+  {
+    m_bScanning = false;
+    m_flResult = -1;
+    m_iCancels++;
+  }
+}
+
+void CSimScannerSlave::ReceiveFw(uint8_t command, const uint8_t *data, size_t len)
+{
+  // Packed slaveFwBegin { size, crc, version } and slaveFwChunk { offset, uint16 length, crc } from slave.h
+  if( command == SIM_CMD_FW_BEGIN && len >= 12 )
+  {
+    uint32_t uSize, uCrc, uVersion;
+    memcpy(&uSize, data, 4);
+    memcpy(&uCrc, data + 4, 4);
+    memcpy(&uVersion, data + 8, 4);
+
+    // Same image as last time keeps what already arrived, a new one erases the update area first
+    if( uSize != m_uFwSize || uCrc != m_uFwCrc )
+    {
+      m_uFwSize = uSize;
+      m_uFwCrc = uCrc;
+      m_image.assign(uSize, 0xFF);
+      m_uFwNext = 0;
+      m_ulBusyUntil = millis() + (uSize + 4095) / 4096 * 20;
+    }
+    m_uFwVersion = uVersion;
+    m_bBootloader = true;
+    m_bScanning = false;
+    m_uFwStatus = SIM_FW_OK;
+  }
+  else if( !m_bBootloader )
+    m_uFwStatus = SIM_FW_NOT_READY;
+  else if( command == SIM_CMD_FW_CHUNK && len >= 10 )
+  {
+    uint32_t uOffset, uCrc;
+    uint16_t uLength;
+    memcpy(&uOffset, data, 4);
+    memcpy(&uLength, data + 4, 2);
+    memcpy(&uCrc, data + 6, 4);
+    if( len < 10u + uLength || uOffset != m_uFwNext || uOffset + uLength > m_uFwSize )
+      return; // Behind a bad chunk, dropped until the master goes back
+
+    uint8_t chunk[I2C_BUFFER_LENGTH];
+    memcpy(chunk, data + 10, uLength);
+    std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+    if( m_params.flFwCorrupt > 0 && uLength && chance(m_rng) < m_params.flFwCorrupt )
+      chunk[m_rng() % uLength] ^= 0x10;
+
+    if( crc32_le(0, chunk, uLength) != uCrc )
+    {
+      m_uFwStatus = SIM_FW_BAD_CHUNK;
+      m_iBadChunks++;
+      return;
+    }
+    memcpy(m_image.data() + uOffset, chunk, uLength);
+    m_uFwNext += uLength;
+    m_uFwStatus = SIM_FW_OK;
+  }
+  else if( command == SIM_CMD_FW_FINISH )
+  {
+    if( m_uFwNext == m_uFwSize && crc32_le(0, m_image.data(), m_image.size()) == m_uFwCrc )
+    {
+      m_uFwStatus = SIM_FW_OK;
+      m_ulBootAt = millis() + 50;
+      m_ulBootDone = m_ulBootAt + 800;
+    }
+    else
+    {
+      m_uFwStatus = SIM_FW_BAD_IMAGE;
+      m_uFwNext = 0;
+    }
+  }
+}
+
+size_t CSimScannerSlave::onRequest(uint8_t *data, size_t len)
+{
+  Update();
+  if( IsRebooting() )
+    return 0;
+
+  uint8_t value[5] = {};
+  size_t size = 1;
+  switch( m_command )
+  {
+    case SIM_CMD_IS_SCANNING:
+      value[0] = m_bScanning;
+    break;
+    case SIM_CMD_GET_RESULT:
+      memcpy(value, &m_flResult, sizeof(m_flResult));
+      size = sizeof(m_flResult);
+    break;
+    case SIM_CMD_GET_PROGRESS:
+      // The slave knows how far along it is but not how long this scan will take, it goes by the nominal time
+      value[0] = m_bScanning ? (uint8_t)std::min<unsigned long>(99, (millis() - m_ulScanStart) * 100 / m_params.ulScanMs) : 0;
+    break;
+    case SIM_CMD_GET_ETA:
+    {
+      unsigned long ulElapsed = millis() - m_ulScanStart;
+      uint32_t ulEta = m_bScanning && ulElapsed < m_params.ulScanMs ? m_params.ulScanMs - ulElapsed : 0;
+      memcpy(value, &ulEta, sizeof(ulEta));
+      size = sizeof(ulEta);
+    }
+    break;
+    case SIM_CMD_FW_STATUS:
+    {
+      uint8_t uStatus = (long)(millis() - m_ulBusyUntil) < 0 ? SIM_FW_BUSY : m_uFwStatus;
+      memcpy(value, &m_uFwNext, 4);
+      value[4] = uStatus;
+      size = 5;
+    }
+    break;
+    case SIM_CMD_GET_VERSION:
+      memcpy(value, &m_uVersion, sizeof(m_uVersion));
+      size = sizeof(m_uVersion);
+    break;
+  }
+
+  size_t n = len < size ? len : size;
+  memcpy(data, value, n);
+  return n;
+}
+
+bool CSimScannerSlave::IsRebooting()
+{
+  return m_ulBootAt && (long)(millis() - m_ulBootAt) >= 0;
+}
+
+void CSimScannerSlave::Update()
+{
+  if( m_ulBootAt && (long)(millis() - m_ulBootDone) >= 0 )
+  {
+    m_ulBootAt = 0;
+    m_bBootloader = false;
+    m_uVersion = m_uFwVersion;
+    m_uFwStatus = SIM_FW_NOT_READY;
+  }
+
+  if( !m_bScanning || (long)(millis() - m_ulScanDone) < 0 )
+    return;
+
+  std::uniform_real_distribution<float> result(0.0f, 1.0f);
+  m_bScanning = false;
+  m_flResult = result(m_rng);
+  m_iScans++;
+}
+
+/* Customers */
+
+unsigned long CSimCustomers::Jitter(unsigned long ulMs)
+{
+  std::uniform_real_distribution<float> jitter(1.0f - m_params.flJitter, 1.0f + m_params.flJitter);
+  return (unsigned long)(ulMs * jitter(m_rng));
+}
+
+void CSimCustomers::WriteCard()
+{
+  // Same layout CNFCHandler::WriteMenu() puts in block 4: 'o', 'p', user ID, menu length, menu items
+  uint8_t *block = m_card.getBlock(4);
+  memset(block, 0, 16);
+  block[0] = 'o';
+  block[1] = 'p';
+  block[2] = (uint8_t)m_iUserID;
+  block[3] = 3;
+  block[4] = 1;
+  block[5] = 56;
+  block[6] = 80;
+}
+
+void CSimCustomers::Tap(unsigned long ulNow)
+{
+  m_card.setPresent(true);
+  m_ulRemoveAt = ulNow + Jitter(m_params.ulHoldMs);
+}
+
+void CSimCustomers::Press(unsigned long ulNow)
+{
+  SimSetPin(SIM_SCAN_BUTTON, LOW);
+  m_ulReleaseAt = ulNow + SIM_PRESS_MS;
+}
+
+void CSimCustomers::Start(unsigned long ulNow)
+{
+  m_iStep = CUST_ARRIVING;
+  m_ulNextAction = ulNow;
+}
+
+void CSimCustomers::Step(unsigned long ulNow, int iStationState)
+{
+  if( m_card.isTagPresent() && (long)(ulNow - m_ulRemoveAt) >= 0 )
+    m_card.setPresent(false);
+  if( m_ulReleaseAt && (long)(ulNow - m_ulReleaseAt) >= 0 )
+  {
+    SimSetPin(SIM_SCAN_BUTTON, HIGH);
+    m_ulReleaseAt = 0;
+  }
+
+  bool bDue = (long)(ulNow - m_ulNextAction) >= 0;
+
+  switch( m_iStep )
+  {
+    case CUST_ARRIVING:
+    {
+      if( !bDue )
+        break;
+
+      // Latency counts from a customer's first tap, retries included
+      if( !m_bRetry )
+      {
+        std::uniform_real_distribution<float> chance(0.0f, 1.0f);
+        m_iUserID = m_iUserID % 250 + 1;
+        m_ulFirstTap = ulNow;
+        m_bWillCancel = chance(m_rng) < m_params.flCancel;
+      }
+      m_bRetry = false;
+
+      WriteCard();
+      Tap(ulNow);
+      m_iStep = CUST_FIRST_TAP;
+    }
+    break;
+    case CUST_FIRST_TAP:
+    {
+      if( m_card.isTagPresent() )
+        break;
+
+      // Station didn't take the card, try again once the screen says so
+      m_iStep = iStationState == STATE_CONFIRM_SCAN ? CUST_WAIT_CONFIRM_SCAN : CUST_ARRIVING;
+      m_bRetry = m_iStep == CUST_ARRIVING;
+      m_ulNextAction = ulNow + Jitter(m_params.ulReactMs);
+    }
+    break;
+    case CUST_WAIT_CONFIRM_SCAN:
+    {
+      if( !bDue )
+        break;
+
+      Press(ulNow);
+      m_iStep = CUST_WAIT_RESULT;
+      m_ulNextAction = ulNow + Jitter(m_params.ulReactMs);
+    }
+    break;
+    case CUST_WAIT_RESULT:
+    {
+      if( m_bWillCancel && iStationState == STATE_SCANNING && bDue )
+      {
+        // Changed their mind, press again and walk off
+        Press(ulNow);
+        m_iStep = CUST_CANCELLING;
+      }
+      else if( iStationState == STATE_CONFIRM_RESULT )
+      {
+        m_iStep = CUST_CONFIRM_TAP;
+        m_ulNextAction = ulNow + Jitter(m_params.ulReactMs);
+      }
+      else if( iStationState == STATE_CONFIRM_SCAN && bDue )
+      {
+        // Press got lost, press again
+        m_iStep = CUST_WAIT_CONFIRM_SCAN;
+      }
+    }
+    break;
+    case CUST_CONFIRM_TAP:
+    {
+      if( !bDue )
+        break;
+
+      Tap(ulNow);
+      m_iStep = CUST_WAIT_TELEMETRY;
+    }
+    break;
+    case CUST_WAIT_TELEMETRY:
+    break;
+    case CUST_CANCELLING:
+    {
+      // The next one steps up once the station is free again
+      if( iStationState != STATE_IDLE )
+        break;
+
+      m_iCancelled++;
+      m_iStep = CUST_ARRIVING;
+      m_ulNextAction = ulNow + m_params.ulSwapMs;
+    }
+    break;
+  }
+}
+
+void CSimCustomers::OnTelemetry(unsigned long ulNow)
+{
+  if( m_iStep != CUST_WAIT_TELEMETRY )
+    return;
+
+  m_latencies.push_back(ulNow - m_ulFirstTap);
+  m_iServed++;
+
+  // The telemetry can leave while the card is still on the reader, the next customer steps up after it's gone
+  unsigned long ulNext = ulNow + (m_params.ulArrivalGapMs ? Jitter(m_params.ulArrivalGapMs) : 0);
+  unsigned long ulSwapped = m_ulRemoveAt + m_params.ulSwapMs;
+  m_iStep = CUST_ARRIVING;
+  m_ulNextAction = (long)(ulSwapped - ulNext) > 0 ? ulSwapped : ulNext;
+}
+
+bool CSimCustomers::exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen)
+{
+  return m_card.exchange(cmd, cmdLen, resp, respLen);
+}
+
+/* Downstream stations */
+
+#define SIM_GATEWAY_MAGIC 0x4752
+#define SIM_GATEWAY_TELEMETRY 1
+#define SIM_GATEWAY_ACK 2
+#define SIM_GATEWAY_RETRY_MS 200
+#define SIM_GATEWAY_TAG_LEN 16
+
+struct simGatewayHeader {
+  uint16_t uMagic;
+  uint8_t uType;
+  uint8_t uIdLen;
+  uint32_t uBoot;
+  uint16_t uSeq;
+} __attribute__((packed));
+
+static void SimHmac(const uint8_t *key, size_t keyLen, const uint8_t *data, size_t len, uint8_t *out)
+{
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+  mbedtls_md_hmac_starts(&ctx, key, keyLen);
+  mbedtls_md_hmac_update(&ctx, data, len);
+  mbedtls_md_hmac_finish(&ctx, out);
+  mbedtls_md_free(&ctx);
+}
+
+CSimDownstream::CSimDownstream(std::mt19937 &rng, const simParams &params) : m_rng(rng), m_params(params)
+{
+  // Each station is provisioned with its key derived from the gateway's, like DPS does it
+  uint8_t groupKey[32];
+  size_t groupKeyLen = 0;
+  const char *keyBase64 = g_IoTHub.GetGatewayKey();
+  mbedtls_base64_decode(groupKey, sizeof(groupKey), &groupKeyLen, (const unsigned char *)keyBase64, strlen(keyBase64));
+
+  for( int i = 0; i < params.iDownstream; i++ )
+  {
+    station station = {};
+    station.id = "sim-station-" + std::to_string(i);
+    SimHmac(groupKey, groupKeyLen, (const uint8_t *)station.id.data(), station.id.size(), station.key);
+    uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, (uint8_t)(i + 1) };
+    memcpy(station.mac, mac, sizeof(mac));
+    station.ulInterval = i == 0 ? params.ulDownstreamMs / 8 : params.ulDownstreamMs;
+    station.uNextSeq = 1;
+    station.uBoot = 0x5EED0000 + i;
+    m_stations.push_back(station);
+  }
+}
+
+void CSimDownstream::Start(unsigned long ulNow)
+{
+  std::uniform_real_distribution<float> phase(0.0f, 1.0f);
+  for( auto &station : m_stations )
+    station.ulNextRating = ulNow + (unsigned long)(station.ulInterval * phase(m_rng));
+}
+
+void CSimDownstream::Step(unsigned long ulNow)
+{
+  std::uniform_real_distribution<float> jitter(1.0f - m_params.flJitter, 1.0f + m_params.flJitter);
+
+  for( auto &station : m_stations )
+  {
+    if( (long)(ulNow - station.ulNextRating) >= 0 )
+    {
+      station.pending.push_back({ station.uNextSeq++, ulNow });
+      station.iGenerated++;
+      station.ulNextRating = ulNow + (unsigned long)(station.ulInterval * jitter(m_rng));
+    }
+
+    // Like the firmware, only the oldest unacked one is in flight
+    if( station.pending.empty() || (long)(ulNow - station.ulNextSend) < 0 )
+      continue;
+
+    const pendingRating &rating = station.pending.front();
+    char szPayload[128];
+    int iPayloadLen = snprintf(szPayload, sizeof(szPayload), "{\"DeviceID\":\"%s\",\"seq\":%u}", station.id.c_str(), rating.uSeq);
+
+    uint8_t frame[250];
+    simGatewayHeader header = { SIM_GATEWAY_MAGIC, SIM_GATEWAY_TELEMETRY, (uint8_t)station.id.size(), station.uBoot, rating.uSeq };
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), station.id.data(), station.id.size());
+    memcpy(frame + sizeof(header) + station.id.size(), szPayload, iPayloadLen);
+    int iLen = (int)(sizeof(header) + station.id.size() + iPayloadLen);
+    uint8_t tag[32];
+    SimHmac(station.key, sizeof(station.key), frame, iLen, tag);
+    memcpy(frame + iLen, tag, SIM_GATEWAY_TAG_LEN);
+
+    if( station.ulNextSend )
+      m_iResends++;
+    station.ulNextSend = ulNow + SIM_GATEWAY_RETRY_MS;
+    SimEspNowReceive(station.mac, frame, iLen + SIM_GATEWAY_TAG_LEN);
+  }
+}
+
+void CSimDownstream::OnSend(const uint8_t *mac, const uint8_t *data, int len)
+{
+  simGatewayHeader header;
+  if( len < (int)sizeof(header) + SIM_GATEWAY_TAG_LEN )
+    return;
+  memcpy(&header, data, sizeof(header));
+  if( header.uMagic != SIM_GATEWAY_MAGIC || header.uType != SIM_GATEWAY_ACK )
+    return;
+
+  for( auto &station : m_stations )
+  {
+    if( memcmp(station.mac, mac, sizeof(station.mac)) != 0 )
+      continue;
+
+    uint8_t tag[32];
+    SimHmac(station.key, sizeof(station.key), data, len - SIM_GATEWAY_TAG_LEN, tag);
+    if( memcmp(tag, data + len - SIM_GATEWAY_TAG_LEN, SIM_GATEWAY_TAG_LEN) != 0 )
+      return; // Dropped like the station does, it sends again
+
+    if( !station.pending.empty() && header.uBoot == station.uBoot && station.pending.front().uSeq == header.uSeq )
+    {
+      station.published.push_back({ station.pending.front().uSeq, station.pending.front().ulCreated });
+      station.pending.erase(station.pending.begin());
+      station.ulNextSend = 0;
+    }
+    return;
+  }
+}
+
+bool CSimDownstream::OnPublish(const std::string &payload, unsigned long ulNow)
+{
+  for( auto &station : m_stations )
+  {
+    if( payload.find("\"" + station.id + "\"") == std::string::npos )
+      continue;
+
+    // Latency runs from the rating being made to the gateway publishing it
+    size_t pos = payload.find("\"seq\":");
+    uint16_t uSeq = pos != std::string::npos ? (uint16_t)atoi(payload.c_str() + pos + 6) : 0;
+    for( size_t i = 0; i < station.published.size(); i++ )
+    {
+      if( station.published[i].first == uSeq )
+      {
+        station.latencies.push_back(ulNow - station.published[i].second);
+        station.published.erase(station.published.begin() + i);
+        break;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+std::vector<unsigned long> CSimDownstream::GetLatencies(int iStation)
+{
+  return m_stations[iStation].latencies;
+}
+
+/* Broker */
+
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define MQTT_SUBSCRIBE 8
+#define MQTT_PINGREQ 12
+#define MQTT_DISCONNECT 14
+
+static bool ReadExact(int fd, uint8_t *buf, size_t len)
+{
+  while( len > 0 )
+  {
+    ssize_t n = recv(fd, buf, len, 0);
+    if( n <= 0 )
+      return false;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+uint16_t CSimBroker::Start()
+{
+  m_listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  if( m_listenFd < 0 )
+    return 0;
+
+  int iReuse = 1;
+  setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &iReuse, sizeof(iReuse));
+
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  socklen_t addrLen = sizeof(addr);
+  if( bind(m_listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+    || listen(m_listenFd, 1) != 0
+    || getsockname(m_listenFd, (struct sockaddr *)&addr, &addrLen) != 0 )
+  {
+    close(m_listenFd);
+    m_listenFd = -1;
+    return 0;
+  }
+
+  m_bRunning = true;
+  m_thread = std::thread(&CSimBroker::Run, this);
+  return ntohs(addr.sin_port);
+}
+
+void CSimBroker::Stop()
+{
+  if( !m_bRunning )
+    return;
+
+  m_bRunning = false;
+  m_thread.join();
+  close(m_listenFd);
+  m_listenFd = -1;
+}
+
+void CSimBroker::Run()
+{
+  while( m_bRunning )
+  {
+    struct pollfd pfd = { m_listenFd, POLLIN, 0 };
+    if( poll(&pfd, 1, 100) <= 0 )
+      continue;
+
+    int fd = accept(m_listenFd, nullptr, nullptr);
+    if( fd < 0 )
+      continue;
+
+    while( m_bRunning && HandleClient(fd) )
+      ;
+    close(fd);
+  }
+}
+
+// One packet, false once the client is gone
+bool CSimBroker::HandleClient(int fd)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if( poll(&pfd, 1, 100) <= 0 )
+    return true;
+
+  uint8_t header;
+  if( !ReadExact(fd, &header, 1) )
+    return false;
+
+  size_t remaining = 0;
+  int shift = 0;
+  uint8_t digit;
+  do
+  {
+    if( !ReadExact(fd, &digit, 1) )
+      return false;
+    remaining |= (size_t)(digit & 0x7F) << shift;
+    shift += 7;
+  } while( digit & 0x80 );
+
+  std::vector<uint8_t> body(remaining);
+  if( remaining && !ReadExact(fd, body.data(), remaining) )
+    return false;
+
+  switch( header >> 4 )
+  {
+    case MQTT_CONNECT:
+    {
+      const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+      send(fd, connack, sizeof(connack), MSG_NOSIGNAL);
+    }
+    break;
+    case MQTT_PUBLISH:
+    {
+      m_iPublishes++;
+
+      int qos = (header >> 1) & 0x03;
+      if( qos > 0 && remaining >= 2 )
+      {
+        size_t topicLen = (body[0] << 8) | body[1];
+        if( remaining >= topicLen + 4 )
+        {
+          const uint8_t puback[] = { 0x40, 0x02, body[2 + topicLen], body[3 + topicLen] };
+          send(fd, puback, sizeof(puback), MSG_NOSIGNAL);
+        }
+      }
+    }
+    break;
+    case MQTT_SUBSCRIBE:
+    {
+      if( remaining < 2 )
+        return false;
+
+      // Packet ID, then one granted QoS per topic filter
+      std::vector<uint8_t> suback = { 0x90, 0x02, body[0], body[1] };
+      size_t pos = 2;
+      while( pos + 2 <= remaining )
+      {
+        size_t len = (body[pos] << 8) | body[pos + 1];
+        pos += 2 + len + 1;
+        suback.push_back(0x00);
+      }
+      suback[1] = (uint8_t)(suback.size() - 2);
+      send(fd, suback.data(), suback.size(), MSG_NOSIGNAL);
+    }
+    break;
+    case MQTT_PINGREQ:
+    {
+      const uint8_t pingresp[] = { 0xD0, 0x00 };
+      send(fd, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+    }
+    break;
+    case MQTT_DISCONNECT:
+      return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Electroniccats_PN7150.h>
+
+#include "statemachine.h"
+
+// Mirrors the station's I2C protocol from include/slave.h, the states come from statemachine.h
+#define SIM_SLAVE_ADDR 0x10
+#define SIM_SCAN_BUTTON 21
+#define SIM_PRESS_MS 150 // How long a press holds the scan button down, well past the station's debounce
+
+enum {
+  SIM_CMD_IS_SCANNING = 2,
+  SIM_CMD_START_SCAN,
+  SIM_CMD_GET_RESULT,
+  SIM_CMD_GET_PROGRESS,
+  SIM_CMD_GET_ETA,
+  SIM_CMD_CANCEL_SCAN,
+  SIM_CMD_FW_BEGIN,
+  SIM_CMD_FW_CHUNK,
+  SIM_CMD_FW_STATUS,
+  SIM_CMD_FW_FINISH,
+  SIM_CMD_GET_VERSION
+};
+
+enum {
+  SIM_FW_OK = 0,
+  SIM_FW_BUSY,
+  SIM_FW_BAD_CHUNK,
+  SIM_FW_BAD_IMAGE,
+  SIM_FW_NOT_READY
+};
+
+struct simParams {
+  int iUsers = 100;
+  unsigned long ulScanMs = 5000;   // How long the camera slave takes per scan
+  unsigned long ulHoldMs = 700;    // How long a customer keeps the card on the reader
+  unsigned long ulReactMs = 800;   // From the prompt on screen to the customer acting on it
+  unsigned long ulArrivalGapMs = 0; // Between one customer leaving and the next one tapping, 0 is a full queue
+  unsigned long ulSwapMs = 1000;   // Least time between one card leaving the reader and the next one arriving
+  float flJitter = 0.1f;           // +- fraction applied to every duration above
+  unsigned long ulHangEveryMs = 0; // The camera slave resets mid-transfer and hangs Wire this often, 0 never
+  float flCancel = 0.0f;           // Fraction of customers who change their mind mid-scan and press the button
+  int iDownstream = 0;             // ESP-NOW stations the station under test is the gateway for, 0 runs it standalone
+  unsigned long ulDownstreamMs = 20000; // Between ratings of one downstream station, the first one is 8 times as busy
+  uint32_t uSlaveFwSize = 0;       // Bytes of a new camera slave image waiting in flash at boot, 0 for none
+  float flFwCorrupt = 0.0f;        // Fraction of image chunks that get to the slave's bootloader damaged
+  unsigned int uSeed = 1;
+};
+
+// The camera slave on Wire, answers the request/command framing of informSlave()/requestNum().
+// Has the bootloader side of src/slavefw.cpp too, version 1 until it gets a new image
+class CSimScannerSlave : public CSimI2CDevice
+{
+public:
+  CSimScannerSlave(std::mt19937 &rng, const simParams &params) : m_rng(rng), m_params(params) {}
+
+  void onReceive(const uint8_t *data, size_t len) override;
+  size_t onRequest(uint8_t *data, size_t len) override;
+
+  int GetScans() { return m_iScans; }
+  int GetCancels() { return m_iCancels; }
+  uint32_t GetVersion() { return m_uVersion; }
+  int GetBadChunks() { return m_iBadChunks; }
+
+private:
+  void Update();
+  bool IsRebooting();
+  void ReceiveFw(uint8_t command, const uint8_t *data, size_t len);
+
+  std::mt19937 &m_rng;
+  const simParams &m_params;
+
+  uint8_t m_command = 0;
+  bool m_bScanning = false;
+  unsigned long m_ulScanStart = 0;
+  unsigned long m_ulScanDone = 0;
+  float m_flResult = -1;
+  int m_iScans = 0;
+  int m_iCancels = 0;
+
+  uint32_t m_uVersion = 1;
+  bool m_bBootloader = false;
+  uint32_t m_uFwSize = 0;
+  uint32_t m_uFwCrc = 0;
+  uint32_t m_uFwVersion = 0;
+  std::vector<uint8_t> m_image;
+  uint32_t m_uFwNext = 0;
+  uint8_t m_uFwStatus = SIM_FW_NOT_READY;
+  unsigned long m_ulBusyUntil = 0;
+  unsigned long m_ulBootAt = 0;   // Reboots into the new image then, just long enough after the finish to answer its status
+  unsigned long m_ulBootDone = 0; // Doesn't answer until then
+  int m_iBadChunks = 0;
+};
+
+// Scripted customers, each one taps, starts a scan, confirms the result with a second tap and leaves.
+// A few press the button again mid-scan and leave instead
+class CSimCustomers : public CSimNFCModel
+{
+public:
+  CSimCustomers(std::mt19937 &rng, const simParams &params) : m_rng(rng), m_params(params) {}
+
+  void Start(unsigned long ulNow);
+  // Moves the customers along to ulNow, iStationState is the station's current state
+  void Step(unsigned long ulNow, int iStationState);
+  // A telemetry message left the station
+  void OnTelemetry(unsigned long ulNow);
+
+  bool isTagPresent() override { return m_card.isTagPresent(); }
+  bool exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen) override;
+
+  int GetServed() { return m_iServed; }
+  int GetCancelled() { return m_iCancelled; }
+  int GetUserID() { return m_iUserID; }
+  std::vector<unsigned long> &GetLatencies() { return m_latencies; }
+
+private:
+  enum {
+    CUST_ARRIVING,
+    CUST_FIRST_TAP,
+    CUST_WAIT_CONFIRM_SCAN,
+    CUST_WAIT_RESULT,
+    CUST_CONFIRM_TAP,
+    CUST_WAIT_TELEMETRY,
+    CUST_CANCELLING,
+  };
+
+  unsigned long Jitter(unsigned long ulMs);
+  void Tap(unsigned long ulNow);
+  void Press(unsigned long ulNow);
+  void WriteCard();
+
+  std::mt19937 &m_rng;
+  const simParams &m_params;
+  CSimMifareCard m_card;
+
+  int m_iStep = CUST_ARRIVING;
+  unsigned long m_ulNextAction = 0;
+  unsigned long m_ulRemoveAt = 0;
+  unsigned long m_ulReleaseAt = 0; // Of the scan button, 0 if it isn't down
+  unsigned long m_ulFirstTap = 0;
+  bool m_bRetry = false;
+  int m_iUserID = 0;
+  int m_iServed = 0;
+  int m_iCancelled = 0;
+  bool m_bWillCancel = false;
+  std::vector<unsigned long> m_latencies;
+};
+
+// Downstream stations talking ESP-NOW to the station under test as their gateway. Mirrors the frame
+// header and tag from include/gateway.h, resends every frame until it's acked like the real thing
+class CSimDownstream
+{
+public:
+  CSimDownstream(std::mt19937 &rng, const simParams &params);
+
+  void Start(unsigned long ulNow);
+  void Step(unsigned long ulNow);
+
+  // What the gateway sent out over ESP-NOW
+  void OnSend(const uint8_t *mac, const uint8_t *data, int len);
+  // A publish reached the broker side, true if it was one of ours
+  bool OnPublish(const std::string &payload, unsigned long ulNow);
+
+  int GetStations() { return (int)m_stations.size(); }
+  int GetGenerated(int iStation) { return m_stations[iStation].iGenerated; }
+  int GetForwarded(int iStation) { return (int)m_stations[iStation].latencies.size(); }
+  int GetResends() { return m_iResends; }
+  std::vector<unsigned long> GetLatencies(int iStation);
+
+private:
+  struct pendingRating {
+    uint16_t uSeq;
+    unsigned long ulCreated;
+  };
+
+  struct station {
+    std::string id;
+    uint8_t mac[6];
+    uint8_t key[32];
+    unsigned long ulInterval;
+    unsigned long ulNextRating;
+    unsigned long ulNextSend;
+    uint16_t uNextSeq;
+    uint32_t uBoot;
+    int iGenerated;
+    std::vector<pendingRating> pending;
+    std::vector<std::pair<uint16_t, unsigned long>> published; // Sequence and creation time, waiting for the broker
+    std::vector<unsigned long> latencies;
+  };
+
+  std::mt19937 &m_rng;
+  const simParams &m_params;
+  std::vector<station> m_stations;
+  int m_iResends = 0;
+};
+
+// Bare MQTT 3.1.1 broker on localhost, just enough for PubSubClient to connect, subscribe and publish
+class CSimBroker
+{
+public:
+  ~CSimBroker() { Stop(); }
+
+  // Returns the port it listens on, 0 on failure
+  uint16_t Start();
+  void Stop();
+
+  int GetPublishes() { return m_iPublishes; }
+
+private:
+  void Run();
+  bool HandleClient(int fd);
+
+  int m_listenFd = -1;
+  std::thread m_thread;
+  std::atomic<bool> m_bRunning{false};
+  std::atomic<int> m_iPublishes{0};
+};
@@ -0,0 +1,380 @@
+/*
+ * End-to-end station benchmark, pio run -e native_bench && .pio/build/native_bench/program [options]
+ *
+ * Runs the real setup()/loop() from src/main.cpp on the simulated clock against a scanner slave,
+ * scripted customers with cards, the fake OLED and a local MQTT broker, and reports how many
+ * people one station serves per hour and how long it takes from the first tap to the rating
+ * leaving for the cloud.
+ */
+
+#include <algorithm>
+#include <string>
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <WiFiClient.h>
+#include <Preferences.h>
+#include <esp_now.h>
+#include <esp_partition.h>
+#include <rom/crc.h>
+
+#include "sim_components.h"
+#include "power.h"
+#include "trace.h"
+#include "i2cbus.h"
+#include "gateway.h"
+#include "statemachine.h"
+#include "slavefw.h"
+#include "capture.h"
+
+void setup();
+void loop();
+
+// The station's state machine, see src/main.cpp
+extern CStateMachine g_Flow;
+
+static simParams s_params;
+static std::mt19937 s_rng;
+static CSimCustomers *s_pCustomers = nullptr;
+static CSimDownstream *s_pDownstream = nullptr;
+static unsigned long s_ulNextHang = 0;
+static bool s_bUpdatingSlave = false;
+
+static void OnDelay(uint64_t ulFromUs, uint64_t ulToUs)
+{
+  (void)ulFromUs;
+  if( !s_pCustomers && !s_bUpdatingSlave )
+    return;
+
+  unsigned long ulNow = (unsigned long)(ulToUs / 1000);
+  if( s_pCustomers )
+    s_pCustomers->Step(ulNow, g_Flow.GetState());
+  if( s_pDownstream )
+    s_pDownstream->Step(ulNow);
+
+  if( s_params.ulHangEveryMs && (long)(ulNow - s_ulNextHang) >= 0 )
+  {
+    Wire.SimHang();
+    s_ulNextHang = ulNow + s_params.ulHangEveryMs;
+  }
+}
+
+// Telemetry counts as delivered once its PUBLISH leaves the station
+static void OnNetWrite(const uint8_t *data, size_t len)
+{
+  if( !s_pCustomers || len < 2 || (data[0] & 0xF0) != 0x30 )
+    return;
+
+  size_t pos = 1;
+  while( pos < len && (data[pos] & 0x80) )
+    pos++;
+  pos++;
+
+  if( pos + 2 > len )
+    return;
+  size_t topicLen = (data[pos] << 8) | data[pos + 1];
+  pos += 2;
+  if( pos + topicLen > len )
+    return;
+
+  std::string topic((const char *)data + pos, topicLen);
+  std::string payload((const char *)data + pos + topicLen, len - pos - topicLen);
+  if( topic.find("/messages/events/") == std::string::npos )
+    return;
+  if( s_pDownstream && s_pDownstream->OnPublish(payload, millis()) )
+    return;
+  if( payload.find("\"UserID\"") != std::string::npos )
+    s_pCustomers->OnTelemetry(millis());
+}
+
+static void OnEspNowSend(const uint8_t *mac, const uint8_t *data, int len)
+{
+  if( s_pDownstream )
+    s_pDownstream->OnSend(mac, data, len);
+}
+
+class CFilePrint : public Print
+{
+public:
+  CFilePrint(FILE *file) : m_file(file) {}
+
+  size_t write(uint8_t c) override { return fwrite(&c, 1, 1, m_file); }
+  size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, m_file); }
+  using Print::write;
+
+private:
+  FILE *m_file;
+};
+
+// What the C2D side would have left in the slavefw partition, a random image of uSize bytes
+static bool StoreSlaveImage(uint32_t uSize)
+{
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SLAVEFW_SUBTYPE, SLAVEFW_PARTITION);
+  if( !partition || SLAVEFW_DATA_OFFSET + uSize > partition->size )
+    return false;
+
+  std::vector<uint8_t> image(uSize);
+  for( uint8_t &b : image )
+    b = (uint8_t)s_rng();
+
+  slaveFwHeader header = { SLAVEFW_MAGIC, uSize, crc32_le(0, image.data(), uSize), 2 };
+  esp_partition_erase_range(partition, 0, (SLAVEFW_DATA_OFFSET + uSize + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE);
+  esp_partition_write(partition, SLAVEFW_DATA_OFFSET, image.data(), uSize);
+  esp_partition_write(partition, 0, &header, sizeof(header));
+  return true;
+}
+
+// What esptool read_flash would get off the capture partition, for bench/replay/replay.cpp
+static bool WriteCapture(const char *fileName)
+{
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CAPTURE_SUBTYPE, CAPTURE_PARTITION);
+  FILE *file = partition ? fopen(fileName, "wb") : nullptr;
+  if( !file )
+    return false;
+
+  std::vector<uint8_t> data(partition->size);
+  esp_partition_read(partition, 0, data.data(), data.size());
+  bool bWritten = fwrite(data.data(), 1, data.size(), file) == data.size();
+  fclose(file);
+  return bWritten;
+}
+
+static unsigned long Percentile(const std::vector<unsigned long> &sorted, int p)
+{
+  if( sorted.empty() )
+    return 0;
+
+  // Nearest rank
+  size_t rank = (sorted.size() * p + 99) / 100;
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static void Usage(const char *name)
+{
+  printf("Usage: %s [--users N] [--scan-ms MS] [--hold-ms MS] [--react-ms MS] [--gap-ms MS] [--swap-ms MS] [--jitter F] [--hang-ms MS] [--cancel F] [--downstream N] [--downstream-ms MS] [--slave-fw BYTES] [--fw-corrupt F] [--seed N] [--trace FILE] [--capture FILE] [--verbose]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  bool bVerbose = false;
+  const char *traceFile = nullptr;
+  const char *captureFile = nullptr;
+  for( int i = 1; i < argc; i++ )
+  {
+    std::string arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+    if( arg == "--verbose" )
+      bVerbose = true;
+    else if( arg == "--users" && value )
+      s_params.iUsers = atoi(argv[++i]);
+    else if( arg == "--scan-ms" && value )
+      s_params.ulScanMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--hold-ms" && value )
+      s_params.ulHoldMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--react-ms" && value )
+      s_params.ulReactMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--gap-ms" && value )
+      s_params.ulArrivalGapMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--swap-ms" && value )
+      s_params.ulSwapMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--jitter" && value )
+      s_params.flJitter = atof(argv[++i]);
+    else if( arg == "--hang-ms" && value )
+      s_params.ulHangEveryMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--cancel" && value )
+      s_params.flCancel = atof(argv[++i]);
+    else if( arg == "--downstream" && value )
+      s_params.iDownstream = atoi(argv[++i]);
+    else if( arg == "--downstream-ms" && value )
+      s_params.ulDownstreamMs = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--slave-fw" && value )
+      s_params.uSlaveFwSize = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--fw-corrupt" && value )
+      s_params.flFwCorrupt = atof(argv[++i]);
+    else if( arg == "--seed" && value )
+      s_params.uSeed = strtoul(argv[++i], nullptr, 10);
+    else if( arg == "--trace" && value )
+      traceFile = argv[++i];
+    else if( arg == "--capture" && value )
+      captureFile = argv[++i];
+    else
+    {
+      Usage(argv[0]);
+      return 2;
+    }
+  }
+
+  s_rng.seed(s_params.uSeed);
+
+  CSimBroker broker;
+  uint16_t port = broker.Start();
+  if( !port )
+  {
+    fprintf(stderr, "Failed starting the local MQTT broker\n");
+    return 1;
+  }
+  setenv("NATIVE_MQTT_HOST", "127.0.0.1", 1);
+  setenv("NATIVE_MQTT_PORT", std::to_string(port).c_str(), 1);
+
+  CSimScannerSlave slave(s_rng, s_params);
+  CSimCustomers customers(s_rng, s_params);
+  Wire.attachDevice(SIM_SLAVE_ADDR, &slave);
+  Electroniccats_PN7150::setSimModel(&customers);
+
+  // The station under test becomes their gateway, the config is read from NVS in setup()
+  CSimDownstream downstream(s_rng, s_params);
+  if( s_params.iDownstream )
+  {
+    Preferences prefs;
+    prefs.begin("station");
+    prefs.putInt("gatewayMode", GATEWAY_MODE_GATEWAY);
+    prefs.end();
+    SimSetEspNowSendHook(OnEspNowSend);
+  }
+
+  // Same as turning it on from the twin, the station starts capturing at the end of setup()
+  if( captureFile )
+  {
+    Preferences prefs;
+    prefs.begin("station");
+    prefs.putInt("capture", 1);
+    prefs.end();
+  }
+
+  if( s_params.uSlaveFwSize && !StoreSlaveImage(s_params.uSlaveFwSize) )
+  {
+    fprintf(stderr, "A camera slave image of %u bytes doesn't fit the %s partition\n", (unsigned)s_params.uSlaveFwSize, SLAVEFW_PARTITION);
+    return 1;
+  }
+
+  Serial.SimSetEnabled(bVerbose);
+  SimClockEnable(true);
+  SimSetDelayHook(OnDelay);
+  SimSetNetWriteHook(OnNetWrite);
+
+  setup();
+
+  // The image goes out before the first customer, the station can't scan meanwhile
+  unsigned long ulFwMs = 0;
+  if( s_params.uSlaveFwSize )
+  {
+    unsigned long ulFwStart = millis();
+    s_bUpdatingSlave = true;
+    s_ulNextHang = ulFwStart + s_params.ulHangEveryMs;
+    while( getSlaveFwStats().iState != SLAVEFW_DONE && getSlaveFwStats().iState != SLAVEFW_STOPPED && millis() - ulFwStart < 600000 )
+      loop();
+    s_bUpdatingSlave = false;
+    ulFwMs = millis() - ulFwStart;
+  }
+
+  // Boot isn't part of the numbers
+  Wire.resetBusTime();
+  Wire1.resetBusTime();
+  unsigned long ulStart = millis();
+  s_pCustomers = &customers;
+  customers.Start(ulStart);
+  if( s_params.iDownstream )
+  {
+    s_pDownstream = &downstream;
+    downstream.Start(ulStart);
+  }
+  s_ulNextHang = ulStart + s_params.ulHangEveryMs;
+
+  // Nobody should need more than a minute on top of the scan, past that the station is stuck
+  unsigned long ulDeadline = ulStart + (unsigned long)s_params.iUsers * (s_params.ulScanMs + s_params.ulArrivalGapMs + 60000);
+  while( customers.GetServed() + customers.GetCancelled() < s_params.iUsers && (long)(millis() - ulDeadline) < 0 )
+  {
+    loop();
+    customers.Step(millis(), g_Flow.GetState());
+    if( s_pDownstream )
+      s_pDownstream->Step(millis());
+  }
+
+  unsigned long ulElapsed = millis() - ulStart;
+  s_pCustomers = nullptr;
+  s_pDownstream = nullptr;
+  Serial.SimSetEnabled(true);
+
+  std::vector<unsigned long> latencies = customers.GetLatencies();
+  std::sort(latencies.begin(), latencies.end());
+
+  int iServed = customers.GetServed();
+  bool bStuck = iServed + customers.GetCancelled() < s_params.iUsers;
+  double flHours = ulElapsed / 3600000.0;
+  double flUsersPerHour = flHours > 0 ? iServed / flHours : 0;
+  double flWireUtil = ulElapsed ? Wire.getBusTimeUs() / (ulElapsed * 10.0) : 0;
+  double flWire1Util = ulElapsed ? Wire1.getBusTimeUs() / (ulElapsed * 10.0) : 0;
+
+  printf("Station benchmark: %d users, scan %lu ms, hold %lu ms, react %lu ms, gap %lu ms, swap %lu ms, jitter %.2f, seed %u\n",
+    s_params.iUsers, s_params.ulScanMs, s_params.ulHoldMs, s_params.ulReactMs, s_params.ulArrivalGapMs, s_params.ulSwapMs, s_params.flJitter, s_params.uSeed);
+  printf("  served               %d in %.1f s simulated%s\n", iServed, ulElapsed / 1000.0, bStuck ? " (STUCK)" : "");
+  printf("  users/hour           %.1f\n", flUsersPerHour);
+  printf("  tap->telemetry       p50 %lu ms, p99 %lu ms\n", Percentile(latencies, 50), Percentile(latencies, 99));
+  printf("  camera bus (Wire)    %.2f %% busy, %llu transactions\n", flWireUtil, (unsigned long long)Wire.getTransactions());
+  printf("  nfc/oled bus (Wire1) %.2f %% busy, %llu transactions\n", flWire1Util, (unsigned long long)Wire1.getTransactions());
+  printf("  scans %d, cancelled %d (slave saw %d), broker publishes %d\n", slave.GetScans(), customers.GetCancelled(), slave.GetCancels(), broker.GetPublishes());
+  printf("  state timeouts       %u confirm scan, %u scanning, %u confirm result, %u transitions\n",
+    (unsigned)g_Flow.GetOverruns(STATE_CONFIRM_SCAN), (unsigned)g_Flow.GetOverruns(STATE_SCANNING),
+    (unsigned)g_Flow.GetOverruns(STATE_CONFIRM_RESULT), (unsigned)g_Flow.GetTransitions());
+  printf("  camera bus health    %u errors, %u resets\n", (unsigned)g_CamBus.GetErrors(), (unsigned)g_CamBus.GetRecoveries());
+  printf("  nfc/oled bus health  %u errors, %u resets\n", (unsigned)g_NfcBus.GetErrors(), (unsigned)g_NfcBus.GetRecoveries());
+  printf("  light sleeps         %d, last wake->ready %lu ms, est. average %.1f mA\n",
+    g_PowerStats.iLightSleeps, g_PowerStats.ulLastWakeToReadyMs, g_PowerStats.GetAverageCurrent());
+
+  if( s_params.uSlaveFwSize )
+  {
+    const slaveFwStats &stats = getSlaveFwStats();
+    printf("  slave firmware       %s v%u, %u bytes in %lu ms (%.0f B/s sustained), station down %lu ms\n",
+      stats.iState == SLAVEFW_DONE ? "now runs" : "FAILED on", (unsigned)slave.GetVersion(), (unsigned)stats.uSize,
+      stats.ulTransferMs, stats.flBytesPerSec, ulFwMs);
+    printf("                       resumed at %u, %u bytes sent, %u chunks sent again, %d bad on arrival\n",
+      (unsigned)stats.uResumedAt, (unsigned)stats.uBytesSent, (unsigned)stats.uChunksResent, slave.GetBadChunks());
+  }
+
+  if( s_params.iDownstream )
+  {
+    const gatewayStats &stats = getGatewayStats();
+    printf("  gateway              %u received, %u forwarded, %u dropped, %u duplicates, %d resends\n",
+      (unsigned)stats.uReceived, (unsigned)stats.uForwarded, (unsigned)stats.uDropped, (unsigned)stats.uDuplicates, downstream.GetResends());
+    for( int i = 0; i < downstream.GetStations(); i++ )
+    {
+      std::vector<unsigned long> stationLatencies = downstream.GetLatencies(i);
+      std::sort(stationLatencies.begin(), stationLatencies.end());
+      printf("  sim-station-%-8d %d/%d forwarded, rating->publish p50 %lu ms, p99 %lu ms\n", i,
+        downstream.GetForwarded(i), downstream.GetGenerated(i), Percentile(stationLatencies, 50), Percentile(stationLatencies, 99));
+    }
+  }
+
+  // Same numbers on one line, for scripts comparing runs
+  printf("{\"users\":%d,\"served\":%d,\"simMs\":%lu,\"usersPerHour\":%.1f,\"p50Ms\":%lu,\"p99Ms\":%lu,\"wireUtil\":%.3f,\"wire1Util\":%.3f}\n",
+    s_params.iUsers, iServed, ulElapsed, flUsersPerHour, Percentile(latencies, 50), Percentile(latencies, 99), flWireUtil, flWire1Util);
+
+  // Open in https://ui.perfetto.dev or chrome://tracing
+  if( traceFile )
+  {
+    FILE *file = fopen(traceFile, "w");
+    if( file )
+    {
+      CFilePrint out(file);
+      traceDump(out);
+      fclose(file);
+      printf("  trace written to %s\n", traceFile);
+    }
+    else
+      fprintf(stderr, "Failed opening %s\n", traceFile);
+  }
+
+  if( captureFile )
+  {
+    // Whatever the last loop() left in RAM
+    updateCapture();
+    if( WriteCapture(captureFile) )
+      printf("  capture written to %s, %d records dropped%s\n", captureFile, captureGetDropped(), g_bCapturing ? "" : ", partition filled up");
+    else
+      fprintf(stderr, "Failed writing %s\n", captureFile);
+  }
+
+  broker.Stop();
+  return bStuck ? 1 : 0;
+}
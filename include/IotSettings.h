@@ -16,4 +16,9 @@ char *deviceId = "LabDevice1";  // Device ID as specified in the list of devices
 //[Azure IoT host name].azure-devices.net
 // IOT hub->Overview ( prva stranica )->Hostname
 char *iotHubHost = "HUB-RUS-KAY-21.azure-devices.net";
+
+/* ESP-NOW gateway, only used with gatewayMode set */
+// Gateway: the group key, 32 random bytes in base64 (openssl rand -base64 32)
+// Downstream station: its own key, az iot dps enrollment-group compute-device-key --key <group key> --registration-id <deviceId>
+char *gatewayKey = "q0mXbE1p8cJ3Gf7oT2vYzN6wR4sK9hLdA5uPeIjVxCg=";
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "config.h"
+
+// Capture of the station's I/O for replaying it on the host, see bench/replay/replay.cpp.
+// Every camera slave transaction, PN7150 tag command and IRQ change, card arrival/removal, button press and
+// MQTT publish goes into the capture partition with its time. Turned on by the capture config
+// value, starts at the next boot and runs until the partition is full. Read it out with
+//   esptool.py read_flash 0x310000 0x80000 capture.bin
+#define CAPTURE_PARTITION "capture"
+#define CAPTURE_SUBTYPE 0x41
+#define CAPTURE_MAGIC 0x50414343 // "CCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER 4096 // RAM the records wait in until loop() writes them to flash
+
+enum {
+  CAPTURE_START = 1,   // captureStart
+  CAPTURE_CLOCK,       // uint32_t millis(), when the gap since the last record doesn't fit uDeltaMs
+  CAPTURE_I2C_WRITE,   // To the camera slave, uArg is the I2C_* result, the bytes that went out
+  CAPTURE_I2C_READ,    // uArg is the I2C_* result, the buffer after the read
+  CAPTURE_NFC_CMD,     // readerTagCmd() command
+  CAPTURE_NFC_RESP,    // Its answer, uArg is the status it returned
+  CAPTURE_NFC_DETECT,  // CheckCard(), uArg is whether there was a card
+  CAPTURE_NFC_REMOVED, // WaitForRemoval() returned
+  CAPTURE_NFC_IRQ,     // loop() saw the PN7150's IRQ line go the other way, uArg is the new level
+  CAPTURE_BUTTON,      // Debounced scan button press
+  CAPTURE_PUBLISH,     // uArg is whether it went out, topic with its terminator then the payload
+  CAPTURE_END = 0xFF   // Erased flash, nothing after it
+};
+
+typedef struct
+{
+  uint8_t uType;
+  uint8_t uArg;
+  uint16_t uLength;  // Of what follows
+  uint16_t uDeltaMs; // Since the record before
+} __attribute__((packed)) captureRecord;
+
+// First record, the replay starts the firmware with the same config
+typedef struct
+{
+  uint32_t uMagic;
+  uint16_t uVersion;
+  uint16_t uConfigSize; // sizeof(stationConfig), a replay built from different sources can't use it
+  uint32_t ulMillis;
+  stationConfig config;
+} __attribute__((packed)) captureStart;
+
+// Checked before every capture call, so a station that isn't capturing only pays for the test
+extern bool g_bCapturing;
+
+#define CAPTURE(...) do { if( g_bCapturing ) captureWrite(__VA_ARGS__); } while( 0 )
+
+// End of setup(), starts a capture if the config says so
+void setupCapture();
+
+// Call from loop(), moves what's waiting in RAM to flash
+void updateCapture();
+
+// One record from two pieces, second one optional. Only from the loop task, there's no locking
+void captureWrite(uint8_t uType, uint8_t uArg, const void *data, size_t length, const void *data2 = nullptr, size_t length2 = 0);
+
+int captureGetDropped();
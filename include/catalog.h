@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Menu items by ID, what the card only has numbers for. Lives in the catalog partition and is read
+// through the flash cache, nothing of it is copied into RAM. The partition has two halves that take
+// turns: a delta from the cloud merges the live half with its changes into the other one, and that
+// one only counts once its header is written, so a reset halfway leaves the old catalog in place.
+// At boot the intact half with the higher version wins
+#define CATALOG_PARTITION "catalog"
+#define CATALOG_SUBTYPE 0x42
+#define CATALOG_MAGIC 0x474C5443   // "CTLG"
+#define CATALOG_SLOT_SIZE 0x10000  // One MMU page, a half maps in one piece
+#define CATALOG_NAME_LEN 24        // With the terminator, the OLED has room for the first 14 next to the price
+#define CATALOG_MAX_DELTA 64       // Items set plus removed in one delta at most, catalogGetMaxDelta() is what actually fits
+#define CATALOG_DELTA_DOC 4096     // bytes of JSON document for a delta, C2D or the twin's
+#define CATALOG_ITEM_JSON 48       // bytes of the longest set item on the wire, [65535,"<23 chars>",99999999,255],
+#define CATALOG_ITEM_DOC 104       // bytes of document per set item, JSON_ARRAY_SIZE(4), its slot in "set" and the name
+#define CATALOG_C2D_OVERHEAD 384   // bytes of the C2D topic with the hub's system properties, and the delta's own keys
+
+// At the start of a half, the items follow it sorted by ID. uMagic goes in last
+struct catalogHeader {
+  uint32_t uMagic;
+  uint32_t uVersion;  // The cloud's, every delta says which version it goes from and to
+  uint32_t uCount;
+  uint32_t uCrc;      // Of the items
+  uint8_t reserved[16];
+};
+
+struct catalogItem {
+  uint16_t uId;
+  uint8_t uCategory;
+  uint8_t uReserved;
+  uint32_t uPrice;    // Cents
+  char szName[CATALOG_NAME_LEN];
+};
+
+// Maps the newest intact half, call once at boot
+void setupCatalog();
+
+// Binary search over the items in flash, nullptr if the catalog doesn't have it
+const catalogItem *catalogFind(int iId);
+
+// 0 with no catalog yet, it's reported in the twin so the cloud knows which delta to send
+uint32_t catalogGetVersion();
+int catalogGetCount();
+
+// How many items one delta can set or remove. PubSubClient drops anything over its buffer without a word,
+// so it's reported in the twin and the cloud has to split bigger changes into several versions in a row
+int catalogGetMaxDelta();
+
+// {"from": 41, "to": 42, "set": [[id, "name", cents, category], ...], "remove": [id, ...]}, only applies to
+// the version it's from. True if the catalog moved to a new version.
+// From 0 replaces the whole catalog, whatever version the station is on, as long as it's going up. So a station
+// that missed a delta gets back in step without the cloud keeping every version in between. A catalog that
+// doesn't fit in one comes in "parts", each with "part": 0.. and "parts": N, and items sorted by ID across them.
+// Only the last part switches over to it
+bool catalogApplyDelta(JsonObjectConst delta);
+
+// Same, as the JSON of a C2D message
+bool catalogReceiveDelta(const uint8_t *payload, size_t length);
+
+// Same, out of a twin message. Only the catalog is kept out of it, in a document of its own, so a delta can't
+// take the station's settings down with it. bFull for a GET, where it's under "desired"
+bool catalogReceiveTwin(const uint8_t *payload, size_t length, bool bFull);
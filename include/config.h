@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+/* Defaults, used until NVS or the device twin tell us otherwise */
+#define DEFAULT_REQUEST_DELAY 0
+#define DEFAULT_DISPLAY_DELAY 1000
+#define DEFAULT_I2C_FREQ 100000
+#define DEFAULT_TOKEN_DURATION 60     // minutes
+#define DEFAULT_MQTT_BUFFER_SIZE 1024 // bytes, 256 (PubSubClient default) is too small for Azure. Applied on the next boot
+#define DEFAULT_MQTT_KEEPALIVE 30     // seconds, also drives the TCP keepalive of the TLS socket
+#define DEFAULT_SLEEP_DELAY 60        // seconds idle before sleeping, 0 never sleeps
+#define DEFAULT_SLEEP_MODE SLEEP_MODE_LIGHT
+#define DEFAULT_DIAG_INTERVAL 300     // seconds between diagnostics messages, 0 turns them off
+#define DEFAULT_SUMMARY_INTERVAL 15   // minutes between per menu item rating summaries, 0 turns them off
+#define DEFAULT_RAW_UPLOAD 1          // Also send every rating on its own, 0 leaves only the summaries
+#define DEFAULT_GATEWAY_MODE 0        // GATEWAY_MODE_* from gateway.h, applied on the next boot
+#define DEFAULT_CAPTURE 0             // 1 records the station's I/O for a replay (capture.h), applied on the next boot
+#define DEFAULT_TLS_PINNED_ROOTS 1    // 1 trusts only the roots from tlsroots.h, 0 the whole Azure CA bundle. Applied on the next boot
+
+#define SLEEP_MODE_LIGHT 1 // Keeps RAM and the MQTT session, wakes on the NFC IRQ or the scan button
+#define SLEEP_MODE_DEEP 2  // Reboots on wake and reconnects, wakes on the NFC IRQ only
+
+#define NUM_RATING_THRESHOLDS 4
+
+// Everything in here can be changed at runtime through the desired properties of the device twin,
+// gets reported back through the reported properties and is kept in NVS between reboots
+struct stationConfig {
+    int iRequestDelay;
+    int iDisplayDelay;
+    int iI2CFreq;
+    int iTokenDuration;
+    int iMqttBufferSize;
+    int iMqttKeepAlive;
+    int iSleepDelay;
+    int iSleepMode;
+    int iDiagInterval;
+    int iSummaryInterval;
+    int iRawUpload;
+    int iGatewayMode;
+    int iCapture;
+    int iTlsPinnedRoots;
+    // Scan percentage needed for each rating, from best ( :)) ) to worst ( :( ), below the last one is :((
+    float flaRatingThresholds[NUM_RATING_THRESHOLDS];
+    // $version of the last desired properties we applied
+    int iTwinVersion;
+
+    void Defaults();
+
+    // NVS
+    void Load();
+    void Save();
+
+    // Device twin, returns true if anything changed
+    bool ApplyDesired(JsonObjectConst desired);
+    size_t WriteReported(char *buffer, size_t size);
+
+    int GetRating(float flPercentage);
+
+    void Print();
+};
+
+extern stationConfig g_Config;
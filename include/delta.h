@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Binary delta of a new firmware image against the one running, made by tools/mkdelta.py.
+// A deltaHeader, then ops until the target is complete. Numbers after an op are LEB128 varints
+#define DELTA_MAGIC 0x544C4453 // "SDLT"
+#define DELTA_WINDOW 4096      // Bytes of the new image a back-reference can reach, a power of two
+#define DELTA_HASH_LEN 32      // SHA-256
+
+enum {
+  DELTA_OP_COPY = 1, // offset, length: bytes from the running image
+  DELTA_OP_LITERAL,  // length, then that many bytes
+  DELTA_OP_BACKREF   // distance, length: bytes already written, may overlap what it writes
+};
+
+typedef struct
+{
+  uint32_t uMagic;
+  uint32_t uBaseSize;   // Bytes of the running image the delta was made against
+  uint32_t uTargetSize;
+  uint8_t baseHash[DELTA_HASH_LEN];
+  uint8_t targetHash[DELTA_HASH_LEN];
+} __attribute__((packed)) deltaHeader;
+
+enum {
+  DELTA_OK = 0,     // Wants more input
+  DELTA_DONE,       // The whole target is out, anything after it is ignored
+  DELTA_ERR_HEADER, // Not a delta, or onHeader turned it down
+  DELTA_ERR_OP,     // Unknown op or a varint that doesn't end
+  DELTA_ERR_RANGE,  // Reaches past the base, the window or the target
+  DELTA_ERR_IO      // readBase or write failed
+};
+
+// Where the decoder's bytes come from and go to
+struct deltaSink {
+  bool (*onHeader)(const deltaHeader &header); // Before any op runs, false stops the decoder
+  bool (*readBase)(uint32_t uOffset, uint8_t *data, size_t length);
+  bool (*write)(const uint8_t *data, size_t length);
+};
+
+// Streaming, takes the delta in whatever pieces the download hands it and needs no more memory than the window
+class CDeltaDecoder
+{
+public:
+  CDeltaDecoder(const deltaSink &sink) : m_sink(sink) {}
+
+  void Reset();
+  // Returns DELTA_OK while it wants more, DELTA_DONE once the target is complete, or a DELTA_ERR_*. Errors stick until Reset()
+  int Feed(const uint8_t *data, size_t length);
+
+  const deltaHeader &GetHeader() { return m_header; }
+  uint32_t GetWritten() { return m_uWritten; }
+
+private:
+  enum {
+    STEP_HEADER,
+    STEP_OP,
+    STEP_ARG1,
+    STEP_ARG2,
+    STEP_LITERAL
+  };
+
+  int RunOp();
+  int Emit(const uint8_t *data, size_t length);
+  int ReadVarint(uint8_t b, uint32_t &uValue);
+
+  const deltaSink &m_sink;
+  deltaHeader m_header = {};
+  int m_iStep = STEP_HEADER;
+  int m_iResult = DELTA_OK;
+  size_t m_uHeaderRead = 0;
+
+  uint8_t m_uOp = 0;
+  uint32_t m_uArg1 = 0;
+  uint32_t m_uArg2 = 0;
+  int m_iVarintShift = 0;
+  uint32_t m_uVarint = 0;
+
+  uint32_t m_uWritten = 0;
+  uint8_t m_window[DELTA_WINDOW];
+  uint8_t m_buffer[256];
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#define DIAG_RING_LEN 16         // Samples kept in RTC memory
+#define DIAG_SAMPLE_INTERVAL 60  // s between samples, so the ring covers the last quarter of an hour
+#define DIAG_MAX_TASKS 4
+#define DIAG_I2C_BUSES 2
+
+struct diagSample {
+  uint32_t ulUptimeS;
+  uint32_t uFreeHeap;
+  uint32_t uLargestBlock; // Largest single allocation that would still succeed
+  uint32_t uMinFreeHeap;  // Lowest the free heap has ever been since boot
+  uint16_t uaStackFree[DIAG_MAX_TASKS]; // Least stack each registered task has had left, bytes
+  uint16_t uMqttPeak;     // Biggest packet PubSubClient's buffer had to take
+  uint16_t uMqttBuffer;
+  int8_t iRssi;
+  uint16_t uConnects;
+  uint16_t uFailures;
+  uint16_t uaI2CUtil[DIAG_I2C_BUSES]; // Per mille busy since the last sample, camera bus then NFC bus
+  uint16_t uaI2CErrors[DIAG_I2C_BUSES];
+  uint16_t uaI2CRecoveries[DIAG_I2C_BUSES];
+};
+
+// Keep an eye on a task's stack, the loop task is registered by setupDiagnostics()
+void registerDiagTask(const char *name, TaskHandle_t hTask);
+
+// Picks up the samples from before a soft reset, call early in setup()
+void setupDiagnostics();
+
+// Samples every DIAG_SAMPLE_INTERVAL, publishes every g_Config.iDiagInterval, call from loop()
+void updateDiagnostics();
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#define EVENT_QUEUE_LEN 16     // Has to be a power of two
+#define BUTTON_DEBOUNCE_MS 50  // The line has to be quiet this long before an edge counts, and low this long after it for a press
+
+enum {
+  EVENT_NONE = 0,
+  EVENT_BUTTON_EDGE,  // Raw edge on the scan button, getEvent() turns these into presses
+  EVENT_BUTTON_PRESS, // Debounced
+  EVENT_NFC_IRQ       // The PN7150 has something for us, usually a card in front of it
+};
+
+struct inputEvent {
+  uint8_t type;
+  uint8_t level;     // Pin level right after the edge
+  uint32_t ulTimeUs; // micros() in the ISR
+};
+
+// Lock-free single-producer/single-consumer ring. The producers are the GPIO ISRs, those all
+// run from the one GPIO interrupt handler on one core so they can't race each other,
+// the consumer is loop()
+class CEventQueue
+{
+public:
+  // ISR side, returns false and counts it as dropped if the ring is full
+  bool Push(const inputEvent &event);
+  bool Pop(inputEvent &event);
+
+  int GetDropped() { return m_uDropped.load(std::memory_order_relaxed); }
+
+private:
+  inputEvent m_events[EVENT_QUEUE_LEN];
+  std::atomic<uint32_t> m_uHead{0}; // Next to pop, only the consumer writes it
+  std::atomic<uint32_t> m_uTail{0}; // Next to push, only the producer writes it
+  std::atomic<uint32_t> m_uDropped{0};
+};
+
+extern CEventQueue g_Events;
+
+// Attaches the ISRs and remembers the calling task as the one to wake up
+void setupEvents(int iButtonPin, int iNfcIrqPin);
+// Waking up from light sleep on a pin's level takes over its interrupt, this puts ours back
+void attachEventInterrupts();
+
+// Next debounced event, waits up to ulTimeoutMs for one to come in. False if nothing did
+bool getEvent(inputEvent &event, unsigned long ulTimeoutMs = 0);
+
+// Cuts a getEvent() wait short without an event, for other tasks that have work for loop(). Not for ISRs
+void wakeEventLoop();
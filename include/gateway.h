@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "iothub.h"
+
+#define GATEWAY_MODE_OFF 0        // Talks to the hub itself
+#define GATEWAY_MODE_GATEWAY 1    // Also forwards the ratings of downstream stations, one hub connection for all
+#define GATEWAY_MODE_DOWNSTREAM 2 // Hands its ratings to the gateway over ESP-NOW, no hub connection of its own
+
+#define GATEWAY_MAX_STATIONS 8     // Downstream stations one gateway keeps queues for
+#define GATEWAY_STATION_QUEUE 4    // Messages per station, a busy station drops its own oldest, not anyone else's
+#define GATEWAY_RX_QUEUE 8         // Frames between the Wi-Fi task and loop()
+#define GATEWAY_MAX_ID_LEN 48
+#define GATEWAY_RETRY_INTERVAL 200 // ms a downstream station waits for the gateway's ack before sending again
+
+#define GATEWAY_MAGIC 0x4752 // "RG"
+#define GATEWAY_KEY_LEN 32   // HMAC-SHA256 keys, what the base64 gatewayKey in IotSettings.h decodes to
+#define GATEWAY_TAG_LEN 16   // Truncated HMAC at the end of every frame
+
+enum {
+  GATEWAY_FRAME_TELEMETRY = 1,
+  GATEWAY_FRAME_ACK
+};
+
+// Followed by uIdLen bytes of station ID, the payload (the telemetry JSON, nothing for an ack) and the
+// tag, the first GATEWAY_TAG_LEN bytes of HMAC-SHA256 over all of it before the tag. A station's key is
+// HMAC-SHA256(gateway key, station ID), the way DPS derives enrollment group device keys, so the gateway
+// holds one key for all and a station only its own. Frames that fail the tag are dropped
+struct gatewayHeader {
+  uint16_t uMagic;
+  uint8_t uType;
+  uint8_t uIdLen;
+  uint32_t uBoot; // Picked at random on every boot, the sequence starts over with it
+  uint16_t uSeq;
+} __attribute__((packed));
+
+// Starts ESP-NOW for g_Config.iGatewayMode, after setupWiFi() since it rides on the same radio and channel
+void setupGateway();
+
+// Around a light sleep, ESP-NOW has to go before Wi-Fi is stopped and come back after it's started again
+void suspendGateway();
+void resumeGateway();
+
+// Call from loop(). A gateway moves received frames into the station queues and publishes one
+// message per call, taking the stations in turn. A downstream station (re)sends its oldest unacked message
+void updateGateway();
+
+#define GATEWAY_SEND_QUEUED 0
+#define GATEWAY_SEND_DROPPED 1 // Queued, but the queue was full and the oldest message had to go
+#define GATEWAY_SEND_TOO_BIG 2 // Doesn't fit in an ESP-NOW frame with our ID, not queued
+
+// Downstream stations, queues a rating for the gateway instead of g_IoTHub.queueTelemetryData(). GATEWAY_SEND_*
+int gatewaySendTelemetry(const char *telemetryData);
+
+// Anything that receives a rating from a downstream station (ESP-NOW here, a UART link would do the same)
+// hands it over with this, after checking it's from who it says. One producer task, not an ISR. mac is where
+// the ack goes, nullptr for none. uBoot is the station's per boot nonce, duplicates are told apart by it and uSeq
+bool gatewaySubmit(const char *stationId, uint32_t uBoot, uint16_t uSeq, const uint8_t *payload, size_t length, const uint8_t *mac);
+
+// What this boot runs as, a twin change to gatewayMode only takes effect after a restart
+int getGatewayMode();
+
+// Downstream: messages the gateway hasn't acked yet. Gateway: messages waiting in the station queues
+int getGatewayPending();
+
+struct gatewayStats {
+  int iStations;
+  uint32_t uReceived;
+  uint32_t uForwarded;
+  uint32_t uDropped;    // Station queue full, the oldest went
+  uint32_t uRejected;   // Bad frame or tag, no room for another station or the rx queue was full
+  uint32_t uDuplicates; // Resends of something we already had, the ack got lost
+};
+
+const gatewayStats &getGatewayStats();
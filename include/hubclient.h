@@ -0,0 +1,79 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+// The TLS session of the last full handshake, offered again on the next connect so the hub can skip the
+// certificate chain and the key exchange. Kept in RTC memory too, so it survives deep sleep and soft resets.
+// A session that doesn't fit there (a kept peer certificate makes it ~2 KB) is only kept until the next reset
+#define TLS_SESSION_RTC_SIZE 2048
+
+// What connectStep() got to
+enum
+{
+  HUB_CONNECT_FAILED = 0,
+  HUB_CONNECT_DONE,
+  HUB_CONNECT_PENDING
+};
+
+// WiFiClientSecure sets up and handshakes a fresh mbedTLS context in one call, with no way to hand it a
+// session. This is the same thing over mbedTLS directly: TCP through WiFiClient, TLS on top of it
+class CHubClient : public Client
+{
+public:
+  CHubClient();
+  ~CHubClient();
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  size_t write(uint8_t data) override { return write(&data, 1); }
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+  // One or the other, the bundle is ESP-IDF's format as for WiFiClientSecure::setCACertBundle()
+  void setCACert(const char *rootCA);
+  void setCACertBundle(const uint8_t *bundle);
+  void setHandshakeTimeout(unsigned long ulSeconds) { m_ulHandshakeTimeout = ulSeconds * 1000; }
+  // TCP keepalive probes on the socket, once it's connected
+  bool setKeepAlive(int iIdleSec);
+
+  // connect() a step at a time, so loop() doesn't wait out the hub's round trips. connectStart() opens the
+  // socket and sets TLS up, then every connectStep() takes the handshake one message further
+  bool connectStart(const char *host, uint16_t port);
+  int connectStep();
+  bool isConnecting() { return m_bHandshaking; }
+  // From connectStart() to the end of the handshake, TCP connect included
+  unsigned long GetHandshakeMs() { return m_ulHandshakeMs; }
+
+  // The last handshake picked up the cached session
+  bool WasResumed() { return m_bResumed; }
+
+private:
+  bool Setup(const char *host);
+  void CacheSession();
+
+  WiFiClient m_tcp;
+  mbedtls_ssl_context m_ssl;
+  mbedtls_ssl_config m_conf;
+  mbedtls_x509_crt m_ca;
+  const char *m_szCACert = nullptr;
+  const uint8_t *m_bundle = nullptr;
+  unsigned long m_ulHandshakeTimeout = 120000;
+  unsigned long m_ulHandshakeStart = 0;
+  unsigned long m_ulHandshakeMs = 0;
+  bool m_bConnected = false;
+  bool m_bHandshaking = false;
+  bool m_bOffered = false;
+  bool m_bResumed = false;
+  int m_iPeeked = -1;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+
+#define I2C_BUS_TIMEOUT 20          // ms, the driver gives up on a transaction after this and the bus gets reset
+#define I2C_MAX_DEVICES 4           // Per bus, the rest aren't tracked separately
+#define I2C_QUARANTINE_AFTER 5      // Failures in a row before a device is left alone for a while
+#define I2C_QUARANTINE_MS 1000      // First quarantine, doubles every time the device still fails afterwards
+#define I2C_QUARANTINE_MAX_MS 30000
+#define I2C_IDLE_CHECK_INTERVAL 1000 // ms between looks at SDA, low twice in a row while idle means a stuck slave
+
+// Same codes Wire.endTransmission() returns, plus ours
+enum {
+  I2C_OK = 0,
+  I2C_ERR_TOO_LONG,
+  I2C_ERR_NACK_ADDR,
+  I2C_ERR_NACK_DATA,
+  I2C_ERR_OTHER,
+  I2C_ERR_TIMEOUT,
+  I2C_ERR_SHORT_READ,  // requestFrom() got fewer bytes than asked for
+  I2C_ERR_QUARANTINED, // Not tried, the device has been failing
+  I2C_ERR_NO_ANSWER,   // A driver's exchange failed without saying why, for the PN7150 mostly the card that went
+};
+
+struct i2cDeviceStats {
+  uint16_t uAddress;
+  uint32_t uTransactions;
+  uint32_t uErrors;
+  uint32_t uNacks;
+  uint32_t uTimeouts;
+  int iFailsInRow;
+  unsigned long ulQuarantineMs;
+  unsigned long ulQuarantinedUntil;
+};
+
+// Goes between the firmware and a TwoWire, checks every result, resets a hung bus and keeps
+// a device that keeps failing from holding up everything else on it
+class CI2CBus
+{
+public:
+  CI2CBus(TwoWire &wire, const char *name) : m_wire(wire), m_name(name) {}
+
+  bool begin(int iSda, int iScl, uint32_t uFrequency);
+  void setClock(uint32_t uFrequency);
+
+  // Return I2C_OK or one of the I2C_ERR_* codes
+  int write(uint16_t address, const uint8_t *data, size_t length);
+  int read(uint16_t address, uint8_t *data, size_t length);
+
+  // For libraries that talk to the TwoWire themselves (PN7150, SSD1306), with the result of what they did.
+  // Their time counts towards the utilisation and a timeout resets the bus, same as our own transactions
+  int account(uint16_t address, int iResult, uint32_t ulStartUs);
+
+  // Clocks a stuck slave free and restarts the peripheral, true if SDA came back up
+  bool recover();
+  // Call from loop(), catches a stuck bus nobody has tried to use yet
+  void update();
+
+  const char *GetName() { return m_name; }
+  // Percent of the time since the last ResetWindow() spent in transactions
+  float GetUtilisation();
+  void ResetWindow();
+  uint32_t GetErrors() { return m_uErrors; }
+  uint32_t GetRecoveries() { return m_uRecoveries; }
+  int GetDeviceCount() { return m_iDevices; }
+  const i2cDeviceStats &GetDevice(int i) { return m_devices[i]; }
+
+private:
+  i2cDeviceStats *FindDevice(uint16_t address);
+  bool IsQuarantined(i2cDeviceStats *device);
+  int Finish(i2cDeviceStats *device, int iResult, uint32_t ulStartUs);
+
+  TwoWire &m_wire;
+  const char *m_name;
+  int m_iSda = -1;
+  int m_iScl = -1;
+  uint32_t m_uFrequency = 100000;
+
+  i2cDeviceStats m_devices[I2C_MAX_DEVICES] = {};
+  int m_iDevices = 0;
+  uint32_t m_uErrors = 0;
+  uint32_t m_uRecoveries = 0;
+
+  uint64_t m_ullBusyUs = 0;
+  unsigned long m_ulWindowStart = 0;
+
+  unsigned long m_ulNextIdleCheck = 0;
+  bool m_bSdaWasLow = false;
+};
+
+extern CI2CBus g_CamBus; // Wire, the camera slave
+extern CI2CBus g_NfcBus; // Wire1, the PN7150 and the OLED
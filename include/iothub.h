@@ -3,8 +3,8 @@
 #include <az_iot_hub_client.h>
 #include <az_span.h>
 #include <az_core.h>
-#include "WiFiClientSecure.h"
 #include "PubSubClient.h"
+#include "hubclient.h"
 #include <ctime>
 
 class AzIoTSasToken
@@ -30,6 +30,34 @@ private:
 
 #ifndef hehehoho
 
+#define TELEMETRY_QUEUE_LEN 8
+#define TELEMETRY_MAX_LEN 256
+
+struct connectionStats {
+  int iConnects;
+  int iFailures;
+  // TCP + TLS handshake, the MQTT CONNECT is timed separately
+  unsigned long ulLastHandshakeMs;
+  unsigned long ulMinHandshakeMs;
+  unsigned long ulMaxHandshakeMs;
+  unsigned long ulTotalHandshakeMs;
+  // Of those, the ones that picked up the cached TLS session
+  int iResumed;
+  unsigned long ulTotalResumedMs;
+  bool bLastResumed;
+  // Heap the handshake took at its worst, an upper bound unless it was the lowest the heap has been since boot
+  uint32_t uLastHandshakePeak;
+  uint32_t uMaxHandshakePeak;
+  bool bHandshakePeakExact;
+  // What the TLS session keeps once it's up
+  uint32_t uLastHandshakeHeld;
+  unsigned long ulLastMqttConnectMs;
+  // From losing the connection to being subscribed again
+  unsigned long ulLastOutageMs;
+
+  void Print();
+};
+
 class CIoTHub
 {
 public:
@@ -40,9 +68,18 @@ public:
 
   bool connectMQTT();
 
-  void mqttReconnect();
+  // HUB_CONNECT_PENDING while the TLS handshake is still going, it's taken a step further on every call
+  int mqttReconnect();
+
+  void sendTelemetryData(const char *telemetryData);
 
-  void sendTelemetryData(String telemetryData);
+  // Sent from loop() in the background, so the station can take the next customer right away.
+  // Returns false if the queue was full and the oldest message had to be dropped
+  bool queueTelemetryData(const char *telemetryData);
+  int GetQueuedCount() { return telemetryQueueCount; }
+  // Running totals, compare against the last seen values to find out how the queued sends went
+  int GetSentCount() { return iTelemetrySent; }
+  int GetDroppedCount() { return iTelemetryDropped; }
 
   void sendTestMessageToIoTHub();
   
@@ -51,13 +88,40 @@ public:
   void loop();
 
   char *GetDeviceID();
+  // Base64, see IotSettings.h
+  char *GetGatewayKey();
+
+  bool IsConnected() { return mqttClient.connected(); }
+
+  // Low rate health data, goes out right away on its own topic or not at all
+  bool publishDiagnostics(const char *data, size_t length);
+  // Biggest packet we've had to fit into PubSubClient's buffer so far
+  size_t GetPublishPeak() { return uPublishPeak; }
+  // Per menu item rating aggregates, type=summary so routing can send them to the dashboards
+  bool publishSummary(const char *data, size_t length);
+  // Gateway mode, a downstream station's telemetry with a stationId property. Goes out right away or not at all
+  bool publishForStation(const char *stationId, const char *data, size_t length);
+  int GetBufferSize() { return mqttClient.getBufferSize(); }
+  // Clean MQTT disconnect, before sleeping so the hub doesn't wait out the keepalive
+  void disconnect();
+
+  const connectionStats &GetStats() { return stats; }
+
+  void requestTwin();
+  void handleTwinMessage(char *topic, byte *payload, unsigned int length);
+  void reportTwin();
+  // True if it was one of ours, anything else is just logged
+  bool handleC2DMessage(char *topic, byte *payload, unsigned int length);
+  bool handleMethodMessage(char *topic, byte *payload, unsigned int length);
 
 private:
-  int tokenDuration = 60;
 
   /* MQTT data for IoT Hub connection */
   int mqttPort = AZ_IOT_DEFAULT_MQTT_CONNECT_PORT;	// Secure MQTT port
   const char* mqttC2DTopic = AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC;	// Topic where we can receive cloud to device messages
+  const char* mqttTwinResponseTopic = AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_SUBSCRIBE_TOPIC; // Responses to our twin GET/PATCH requests
+  const char* mqttTwinPatchTopic = AZ_IOT_HUB_CLIENT_TWIN_PATCH_SUBSCRIBE_TOPIC; // Desired property changes pushed by the hub
+  const char* mqttMethodsTopic = AZ_IOT_HUB_CLIENT_METHODS_SUBSCRIBE_TOPIC; // Direct methods
 
   // These three are just buffers - actual clientID/username/password is generated
   // using the SDK functions in initIoTHub()
@@ -65,21 +129,84 @@ private:
   char mqttUsername[128];
   char mqttPasswordBuffer[200];
   char publishTopic[200];
+  char diagTopic[200];
+  char summaryTopic[200];
+  char stationTopic[256];
+  char twinTopic[128];
+
+  // Twin changes come in through the MQTT callback, where the PubSubClient buffer is still in use,
+  // so anything that needs to publish is done on the next loop()
+  bool bTwinReportPending = false;
+  int iTwinRequestId = 0;
+  unsigned long ulTwinRequestedAt = 0; // millis() of the GET that hasn't been answered yet, 0 if none
+
+  // Same for direct method responses, the request ID is all that's kept of the request
+  bool bMethodResponsePending = false;
+  char methodRequestId[40];
+  int iMethodStatus = 0;
+  void sendMethodResponse();
+
+  // Reconnects are attempted from loop() with a backoff instead of blocking,
+  // the first one right away since most drops are just a short Wi-Fi blip
+  unsigned long ulNextReconnect = 0;
+  unsigned long ulReconnectBackoff = 0;
+  unsigned long ulDisconnectedAt = 0;
+  // Heap as the handshake in progress found it
+  uint32_t uHandshakeFreeBefore = 0;
+  uint32_t uHandshakeMinBefore = 0;
+  connectionStats stats = {};
+
+  void flushTelemetryQueue();
+
+  bool publish(const char *topic, const uint8_t *payload, size_t length);
+  size_t uPublishPeak = 0;
+
+  char telemetryQueue[TELEMETRY_QUEUE_LEN][TELEMETRY_MAX_LEN];
+  int telemetryQueueHead = 0;
+  int telemetryQueueCount = 0;
+  int iTelemetrySent = 0;
+  int iTelemetryDropped = 0;
 
 /* Auth token requirements */
 
   uint8_t sasSignatureBuffer[256];  // Make sure it's of correct size, it will just freeze otherwise :/
 
+  // Everything below points into the members above, so the declaration order matters
   az_iot_hub_client client;
-  AzIoTSasToken *sasToken;
+  AzIoTSasToken sasToken;
   /* WiFi things */
-  WiFiClientSecure wifiClient;
-  PubSubClient *mqttClient;
+  CHubClient wifiClient;
+  PubSubClient mqttClient;
 };
 
+// millis() at which each part of the station came up, 0 if it hasn't yet
+struct bootTimings {
+  unsigned long ulSlaveReady;
+  unsigned long ulNfcReady;
+  unsigned long ulDisplayReady;
+  unsigned long ulWiFiConnected;
+  unsigned long ulTimeValid;
+  unsigned long ulHubConnected;
+  // Connected straight to the cached channel/BSSID, without a scan
+  bool bFastConnect;
+  // The clock was already good at boot (soft reset, deep sleep), didn't have to wait for SNTP
+  bool bTimeFromRtc;
+
+  void Print();
+};
+
+extern bootTimings g_BootTimings;
+
+// Starts connecting in the background, the last AP's channel and BSSID are cached so it can skip the scan
 extern void setupWiFi();
+// Call from loop(), falls back to a full scan if the cached AP doesn't answer and keeps retrying
+extern void updateWiFi();
+// Around a light sleep, the association doesn't survive it. Resuming connects to the cached AP again
+extern void suspendWiFi();
+extern void resumeWiFi();
 
-// Use pool pool.ntp.org to get the current time
-// Define a date on 1.1.2023. and wait until the current time has the same year (by default it's 1.1.1970.)
+// Use pool pool.ntp.org to get the current time, doesn't wait for it
 extern void initializeTime();
+// The clock is good enough for SAS tokens, i.e. past 1.1.2023. and past the last time we had a good clock
+extern bool isTimeValid();
 #endif
\ No newline at end of file
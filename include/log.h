@@ -0,0 +1,61 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Anything above this level or outside these modules isn't even compiled in, override with build_flags
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+#ifndef LOG_MODULES
+#define LOG_MODULES 0xFFFFFFFF // Bit per LOG_MOD_*
+#endif
+
+enum {
+  LOG_MOD_MAIN = 0,
+  LOG_MOD_NFC,
+  LOG_MOD_HUB,
+  LOG_MOD_NET,
+  LOG_MOD_CFG,
+  LOG_MOD_POWER,
+  LOG_MOD_DIAG,
+  LOG_MOD_MEM,
+  LOG_MOD_LOG,
+  LOG_MOD_I2C,
+  LOG_MOD_OTA,
+  LOG_MOD_MENU,
+  LOG_MOD_COUNT
+};
+
+#define LOG_RING_LEN 32     // Lines waiting for the log task
+#define LOG_LINE_LEN 160    // Longer ones get cut
+#define LOG_DRAIN_INTERVAL 20 // ms
+
+#define LOG_ENABLED(level, module) ((level) <= LOG_MIN_LEVEL && ((LOG_MODULES >> (module)) & 1))
+
+// The condition is a constant, so a filtered out line and its arguments go away entirely
+#define LOG(level, module, ...) do { if( LOG_ENABLED(level, module) ) logWrite(level, module, __VA_ARGS__); } while( 0 )
+#define LOGE(module, ...) LOG(LOG_LEVEL_ERROR, module, __VA_ARGS__)
+#define LOGW(module, ...) LOG(LOG_LEVEL_WARN, module, __VA_ARGS__)
+#define LOGI(module, ...) LOG(LOG_LEVEL_INFO, module, __VA_ARGS__)
+#define LOGD(module, ...) LOG(LOG_LEVEL_DEBUG, module, __VA_ARGS__)
+
+// Formats straight into the ring and returns, the line is written out later by a low
+// priority task. Safe from any task, not from an ISR. A full ring drops the line and counts it
+void logWrite(int iLevel, int iModule, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// Starts the task that drains the ring to Serial, lines logged before this wait in the ring
+void setupLog();
+
+// Waits (briefly) for the log task to get everything out, before sleeping or restarting
+void logFlush();
+
+// Keeps the log task off Serial while something else needs it to itself, lines wait in the ring meanwhile
+void logHold(bool bHold);
+
+int logGetDropped();
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Everything long-lived is static, sized at compile time and in place once setup() is done,
+// so a C++ heap allocation after that is either a leak in the making or fragmentation.
+// Only operator new is watched, the C libraries underneath (lwIP, mbedTLS, NVS) malloc from
+// their own bounded pools and are left alone. On the host (env:native) the shims' own
+// std::strings get counted as well, and env:native_micro counts malloc, calloc and realloc too
+struct heapGuardStats {
+  int iAllocations;
+  size_t uBytes;
+  // The latest one, to go and find it with addr2line
+  size_t uLastSize;
+  void *pLastCaller;
+};
+
+// Call as the last thing in setup()
+void armHeapGuard();
+
+// Reports allocations that happened since the last call on Serial, call from loop()
+void checkHeapGuard();
+
+heapGuardStats getHeapGuardStats();
@@ -1,12 +1,14 @@
 #pragma once
 
-class Electroniccats_PN7150;
-class TwoWire;
+#include "Electroniccats_PN7150.h"
+
+#define MENU_MAX_ITEMS 12
+#define NFC_I2C_FREQ 100000
 
 struct menu {
     int iUserID;
     int iMenuLen;
-    int iaMenu[12];
+    int iaMenu[MENU_MAX_ITEMS];
 
     void Print()
     {
@@ -20,7 +22,7 @@ struct menu {
     {
         iUserID = 0;
         iMenuLen = 0;
-        memset(iaMenu, 0, sizeof(int) * 12);
+        memset(iaMenu, 0, sizeof(iaMenu));
     }
 };
 
@@ -29,14 +31,19 @@ public:
     void setup( TwoWire *wire, int SDA_Pin, int SCL_Pin, int IRQ_Pin, int VEN_Pin );
     void loop();
 
-    Electroniccats_PN7150 GetNFC() { return *m_NFC; }
+    Electroniccats_PN7150 &GetNFC() { return *m_NFC; }
 
     bool CheckCard(bool bWait = false);
     void WaitForRemoval();
     void Reset();
-    int WriteMenu(menu newMenu);
+    int WriteMenu(const menu &newMenu);
     int ReadMenu(menu &out);
 private:
+    // readerTagCmd() that also goes into the capture
+    bool TagCmd(unsigned char *cmd, unsigned char cmdSize, unsigned char *resp, unsigned char *respSize);
+
     TwoWire *m_Wire;
-    Electroniccats_PN7150 *m_NFC;
+    // The driver wants its pins in the constructor, so it's constructed in setup(), but into storage we already own
+    alignas(Electroniccats_PN7150) uint8_t m_NFCStorage[sizeof(Electroniccats_PN7150)];
+    Electroniccats_PN7150 *m_NFC = nullptr;
 };
\ No newline at end of file
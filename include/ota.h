@@ -0,0 +1,47 @@
+#pragma once
+
+#include <Arduino.h>
+
+// The master's own firmware over the air. The firmwareUpdate direct method gives a URL, the download
+// is either a full image or a delta against the running one (delta.h), and goes into the other app
+// partition as it arrives. It's only booted once its SHA-256 matches, and only between customers
+#define OTA_METHOD "firmwareUpdate"
+#define OTA_URL_LEN 160
+#define OTA_SLICE 100         // ms of downloading per loop(), the station keeps serving meanwhile
+#define OTA_BASE_SLICE 20     // ms per loop() of hashing the running image a delta is against
+#define OTA_READ_TIMEOUT 15000 // ms without a byte before the download is given up
+#define OTA_IMAGE_MAGIC 0xE9  // First byte of a full ESP32 app image
+
+enum {
+  OTA_NONE = 0,
+  OTA_DOWNLOADING,
+  OTA_READY,   // Verified and waiting for the station to be idle to switch
+  OTA_FAILED
+};
+
+struct otaStats {
+  int iState;
+  bool bDelta;
+  uint32_t uDownloaded;   // Bytes that came over the network
+  uint32_t uWritten;      // Bytes of the new image in flash
+  uint32_t uTargetSize;   // 0 until known, a full image only has it if the server sent a length
+  unsigned long ulStartMs;
+  unsigned long ulDurationMs;
+
+  int GetProgress() { return uTargetSize ? (int)((uint64_t)uWritten * 100 / uTargetSize) : 0; }
+};
+
+// 1 also takes plain http:// URLs, for trying it out against a local server. Never in a release build
+#ifndef OTA_ALLOW_HTTP
+#define OTA_ALLOW_HTTP 0
+#endif
+
+// The direct method's payload, {"url": "https://...", "sha256": "<hex>"}, sha256 of the new image whether the
+// download is a delta or a full one. Returns the status for the method response, the download starts on the next loop()
+int otaRequest(const char *json, size_t length);
+
+// Call from loop(), moves the download along by OTA_SLICE and reboots into the new image once
+// bStationIdle. True while it's downloading, so loop() doesn't wait on input meanwhile
+bool updateOta(bool bStationIdle);
+
+otaStats &getOtaStats();
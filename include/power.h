@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Typical draw of the whole station (ESP32, PN7150 polling for cards, OLED) in each mode, only used
+// to estimate the average current from how long we spent in each. Measure your board and adjust
+#define CURRENT_ACTIVE_MA 115.0f
+#define CURRENT_LIGHT_SLEEP_MA 3.0f
+#define CURRENT_DEEP_SLEEP_MA 1.5f
+
+// Deep sleep also wakes up on its own after this long, in case the reader never raises its IRQ again.
+// It goes back to sleep once it's been idle for g_Config.iSleepDelay, having checked in with the hub
+#define DEEP_SLEEP_TIMER_WAKE 3600 // s
+
+// Kept in RTC memory, so deep sleep cycles add up too
+struct powerStats {
+  uint64_t ullActiveMs;
+  uint64_t ullLightSleepMs;
+  uint64_t ullDeepSleepMs;
+  int iLightSleeps;
+  int iDeepSleeps;
+  // From waking up until the station could take a card again
+  unsigned long ulLastWakeToReadyMs;
+  // From waking up until MQTT was back
+  unsigned long ulLastWakeToHubMs;
+  int iLastWakeCause;
+
+  float GetAverageCurrent();
+  void Print();
+};
+
+extern powerStats g_PowerStats;
+
+// Picks up after a deep sleep wake, call first thing in setup(), before the NFC driver takes the VEN pin
+void setupPower(int iNfcIrqPin, int iNfcVenPin, int iButtonPin);
+
+// Call at the end of setup() and every loop(), bIdle is whether the station could sleep right now.
+// Returns true once it's been idle long enough, see g_Config.iSleepDelay
+bool updatePower(bool bIdle);
+
+// Light sleep returns after waking up, with Wi-Fi connecting again and the hub following from loop().
+// Deep sleep doesn't return at all. The reader has to be in discovery, a card only raises its IRQ then.
+// The scan button's interrupt has to be attached again afterwards
+void enterSleep();
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "nfc.h"
+
+#define RATING_TABLE_BITS 6
+#define RATING_TABLE_SIZE (1 << RATING_TABLE_BITS) // Menu items tracked per summary window, the card only has room for byte IDs anyway
+#define RATING_BUCKETS 10                          // Histogram of the scan percentage, 0.1 wide each
+#define RATING_ITEMS_PER_MESSAGE 5                 // Keeps a summary message inside the default MQTT buffer
+
+// Running aggregate of one menu item's ratings since the last summary went out
+struct ratingStats {
+  int iItem;
+  uint32_t uCount; // 0 marks an empty slot
+  float flMean;
+  float flM2;      // Sum of squared differences from the mean, Welford's
+  uint16_t uaHistogram[RATING_BUCKETS];
+
+  float GetVariance() { return uCount > 1 ? flM2 / (uCount - 1) : 0.0f; }
+};
+
+// Adds one scan to every item on the customer's menu
+void recordRating(const menu &menu, float flPercentage);
+
+// Publishes the summary every g_Config.iSummaryInterval minutes and starts a new window once it's out, call from loop()
+void updateRatings();
+
+// Total ratings in the current window
+uint32_t getRatingCount();
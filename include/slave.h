@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "capture.h"
+#include "config.h"
+#include "i2cbus.h"
+#include "trace.h"
+
+// The camera slave on Wire and the request/command framing it understands
+#define I2C_DEV_ADDR 0x10
+
+enum {
+  CMD_IS_SCANNING = 2,
+  CMD_START_SCAN,
+  CMD_GET_RESULT,
+  CMD_GET_PROGRESS, // uint8_t percent done, SCAN_PROGRESS_UNKNOWN if the slave can't tell
+  CMD_GET_ETA,      // uint32_t ms the slave thinks it still needs, SCAN_ETA_UNKNOWN if it can't tell
+  CMD_CANCEL_SCAN,  // Drops the running scan, the result stays -1
+  CMD_FW_BEGIN,     // slaveFwBegin follows the request, the slave goes into its bootloader
+  CMD_FW_CHUNK,     // slaveFwChunk and its data follow the request
+  CMD_FW_STATUS,    // slaveFwStatus
+  CMD_FW_FINISH,    // Slave checks the whole image against the CRC from CMD_FW_BEGIN and boots it if it matches
+  CMD_GET_VERSION   // uint32_t version of the firmware the slave runs
+};
+
+#define SCAN_PROGRESS_UNKNOWN 0xFF
+#define SCAN_ETA_UNKNOWN 0xFFFFFFFF
+
+typedef struct
+{
+  int requestCount;
+  byte command;
+} __attribute__((packed)) request;
+
+typedef struct
+{
+  uint32_t uSize;
+  uint32_t uCrc;     // CRC-32 of the whole image, same as the ESP ROM's crc32_le()
+  uint32_t uVersion;
+} __attribute__((packed)) slaveFwBegin;
+
+typedef struct
+{
+  uint32_t uOffset;
+  uint16_t uLength;
+  uint32_t uCrc;     // Of just this chunk's data
+} __attribute__((packed)) slaveFwChunk;
+
+enum {
+  FW_STATUS_OK = 0,
+  FW_STATUS_BUSY,      // Still writing to flash or checking the image, ask again
+  FW_STATUS_BAD_CHUNK, // A chunk failed its CRC, everything from uNextOffset on has to be sent again
+  FW_STATUS_BAD_IMAGE, // The finished image doesn't match the CRC it was announced with
+  FW_STATUS_NOT_READY  // No CMD_FW_BEGIN yet
+};
+
+typedef struct
+{
+  uint32_t uNextOffset; // Everything before this arrived intact, it's where a transfer picks up after an interruption
+  uint8_t uStatus;
+} __attribute__((packed)) slaveFwStatus;
+
+// Every request to the slave has a new number
+extern int g_iRequestCount;
+
+void informSlave(int requestNumber, byte cmd);
+void requestString(int requestNumber, byte registerNumber, char *response, int length); //string
+void I2cTransmit(int requestNumber, byte registerNumber);
+// A request with a payload behind it, all in one write. Returns one of the I2C_* codes
+int I2cTransmitData(int requestNumber, byte cmd, const void *data, size_t length);
+
+template <class T>
+void I2cRead(T *response, int length)
+{
+  TRACE_SCOPE("i2c read");
+  int iResult = g_CamBus.read(I2C_DEV_ADDR, (uint8_t *)response, length); //read register, left as it was if that failed
+  CAPTURE(CAPTURE_I2C_READ, iResult, response, length);
+}
+
+template <class T>
+void requestNum(int requestNumber, byte cmd, T *response)
+{
+  informSlave(requestNumber, cmd);
+  //again - after ESP32 buffer prefill
+  delay(g_Config.iRequestDelay);
+  I2cRead<T>(response, sizeof(T)); //read register
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Camera slave firmware update. The image waits in the slavefw partition, written there in pieces
+// over C2D or straight with esptool, and goes over Wire to the slave's bootloader once the station is idle
+#define SLAVEFW_PARTITION "slavefw"
+#define SLAVEFW_SUBTYPE 0x40
+#define SLAVEFW_MAGIC 0x57464C53 // "SLFW"
+#define SLAVEFW_DATA_OFFSET 0x1000 // The header has the first sector to itself, it's written last
+
+#define SLAVEFW_CHUNK 112       // Image bytes per I2C write, with the request and chunk headers that's just under the 128 byte Wire buffer
+#define SLAVEFW_WINDOW 16       // Chunks sent back to back before asking the slave how far it got
+#define SLAVEFW_SLICE 250       // ms of windows per loop(), the screen flush in between costs as much as a few chunks
+#define SLAVEFW_STATUS_WAIT 3000 // ms the slave may answer busy, erasing its update area after a begin takes the longest. Asked once per loop()
+#define SLAVEFW_REBOOT_WAIT 5000 // ms for the slave to come back up on the new image
+#define SLAVEFW_RETRY_DELAY 60000 // ms before a failed update is tried again, it picks up where it stopped
+#define SLAVEFW_RESUME_DELAY 1000 // Same once the slave is in its bootloader, the station is down until it's done
+#define SLAVEFW_RETRY_MAX_DELAY 1800000 // ms, both delays double with every failure in a row up to this
+#define SLAVEFW_MAX_ATTEMPTS 8    // Failures in a row before it gives up until a new image or slaveFwRetry in the twin
+
+// At the start of the partition. uMagic goes in last, a half written image never looks ready
+struct slaveFwHeader {
+  uint32_t uMagic;
+  uint32_t uSize;
+  uint32_t uCrc;
+  uint32_t uVersion;
+};
+
+enum {
+  SLAVEFW_NONE = 0,  // No image waiting
+  SLAVEFW_PENDING,   // Waiting for the station to be idle
+  SLAVEFW_TRANSFER,  // The slave is in its bootloader, the station is out of service
+  SLAVEFW_DONE,      // The slave runs the image
+  SLAVEFW_FAILED,    // Tried again after SLAVEFW_RETRY_DELAY, longer each time
+  SLAVEFW_STOPPED    // Failed SLAVEFW_MAX_ATTEMPTS times, waits for a new image or slaveFwRetry
+};
+
+struct slaveFwStats {
+  int iState;
+  uint32_t uVersion;
+  uint32_t uSize;
+  uint32_t uNextOffset;  // What the slave has so far
+  uint32_t uResumedAt;   // Where the slave said the last transfer picked up
+  uint32_t uBytesSent;   // Resends included
+  uint32_t uChunksResent;
+  unsigned long ulTransferMs;
+  int iAttempts;         // Failed ones in a row
+  float flBytesPerSec;   // Image bytes the slave took per second of transfer, the number that decides how long a station is down
+
+  int GetProgress() { return uSize ? (int)((uint64_t)uNextOffset * 100 / uSize) : 0; }
+};
+
+// Looks for an image in the partition, call once at boot after the camera bus is up
+void setupSlaveFw();
+
+// Call from loop(). Starts the update when bStationIdle and moves it along SLAVEFW_SLICE per call.
+// True while the slave is in its bootloader, the station can't scan then and shouldn't try
+bool updateSlaveFw(bool bStationIdle);
+
+// C2D pieces of a new image, in order. Begin's JSON has size, crc and version
+void slaveFwReceiveBegin(const char *json, size_t length);
+void slaveFwReceiveChunk(uint32_t uOffset, const uint8_t *data, size_t length);
+void slaveFwReceiveEnd();
+
+// Desired twin properties. A change of slaveFwRetry has a station that gave up try again
+void slaveFwApplyDesired(JsonObjectConst desired);
+
+slaveFwStats &getSlaveFwStats();
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Arduino.h>
+
+// The station's flow, one customer at a time
+enum {
+  STATE_NONE = -1,
+  STATE_IDLE = 0,
+  STATE_CONFIRM_SCAN,
+  STATE_SCANNING,
+  STATE_CONFIRM_RESULT,
+  STATE_COUNT
+};
+
+// What makes the station move on, raised by the state's update action
+enum {
+  TRIGGER_NONE = -1,
+  TRIGGER_CARD_READ = 0, // A customer's menu came off their card
+  TRIGGER_SCAN_PRESSED,
+  TRIGGER_CANCEL,        // The customer called it off, with the card or, once the scan is running, the button
+  TRIGGER_SCAN_DONE,
+  TRIGGER_CARD_CONFIRM,
+  TRIGGER_TIMEOUT,       // Raised by the machine itself once the state has used up its budget
+  TRIGGER_COUNT
+};
+
+#define STATE_NO_BUDGET 0
+
+struct stateInfo {
+  const char *szName;
+  unsigned long ulBudgetMs; // Longest the station stays in the state before TRIGGER_TIMEOUT, STATE_NO_BUDGET for no limit
+};
+
+constexpr stateInfo g_stateInfo[STATE_COUNT] =
+{
+  { "idle",           STATE_NO_BUDGET },
+  { "confirm scan",   60000 }, // Customer walked off without pressing
+  { "scanning",       30000 }, // Slave never reported, a scan takes a few seconds
+  { "confirm result", 60000 }  // Customer walked off without confirming, the rating is dropped
+};
+
+// Where each trigger leads from each state, STATE_NONE means the trigger is ignored there
+constexpr int8_t g_stateTable[STATE_COUNT][TRIGGER_COUNT] =
+{
+  //                     CARD_READ           SCAN_PRESSED    CANCEL       SCAN_DONE             CARD_CONFIRM  TIMEOUT
+  /* idle */           { STATE_CONFIRM_SCAN, STATE_NONE,     STATE_NONE,  STATE_NONE,           STATE_NONE,   STATE_NONE },
+  /* confirm scan */   { STATE_NONE,         STATE_SCANNING, STATE_IDLE,  STATE_NONE,           STATE_NONE,   STATE_IDLE },
+  /* scanning */       { STATE_NONE,         STATE_NONE,     STATE_IDLE,  STATE_CONFIRM_RESULT, STATE_NONE,   STATE_CONFIRM_SCAN },
+  /* confirm result */ { STATE_NONE,         STATE_NONE,     STATE_NONE,  STATE_NONE,           STATE_IDLE,   STATE_IDLE }
+};
+
+// A state with a budget has to have somewhere to go when it runs out, and the table can only lead to real states
+constexpr bool IsValidStateTable(int iState = 0, int iTrigger = 0)
+{
+  return iState == STATE_COUNT ? true
+    : iTrigger == TRIGGER_COUNT ? (g_stateInfo[iState].ulBudgetMs == STATE_NO_BUDGET || g_stateTable[iState][TRIGGER_TIMEOUT] != STATE_NONE)
+        && IsValidStateTable(iState + 1, 0)
+    : g_stateTable[iState][iTrigger] >= STATE_NONE && g_stateTable[iState][iTrigger] < STATE_COUNT && IsValidStateTable(iState, iTrigger + 1);
+}
+static_assert(IsValidStateTable(), "Broken station state table");
+
+// Entry, update and exit of one state, any of them can be nullptr
+struct stateActions {
+  void (*onEnter)(int iFrom);
+  int (*onUpdate)(); // Every loop() while in the state, returns the trigger it saw or TRIGGER_NONE
+  void (*onExit)(int iTo);
+};
+
+// Runs the table above. Knows nothing about the screen, NFC or the slave, that's all in the actions,
+// so it runs the same with no-op actions on the host
+class CStateMachine
+{
+public:
+  // actions has STATE_COUNT entries. onTransition, if there is one, runs after the exit and before the entry action
+  CStateMachine(const stateActions *actions, void (*onTransition)(int iFrom, int iTo, int iTrigger) = nullptr)
+    : m_actions(actions), m_onTransition(onTransition) {}
+
+  // Enters iState without an exit or transition, m_actions[iState].onEnter gets STATE_NONE
+  void Start(int iState, unsigned long ulNow);
+
+  // Looks the trigger up for the current state, runs exit/entry if it leads somewhere. True if the state changed
+  bool Dispatch(int iTrigger, unsigned long ulNow);
+
+  // Runs the current state's update action and dispatches its trigger, then checks the budget. True if the state changed
+  bool Step(unsigned long ulNow);
+
+  int GetState() { return m_iState; }
+  const char *GetStateName() { return m_iState == STATE_NONE ? "none" : g_stateInfo[m_iState].szName; }
+  unsigned long GetTimeInState(unsigned long ulNow) { return ulNow - m_ulEntered; }
+  uint32_t GetOverruns(int iState) { return m_uaOverruns[iState]; }
+  uint32_t GetTransitions() { return m_uTransitions; }
+
+private:
+  const stateActions *m_actions;
+  void (*m_onTransition)(int iFrom, int iTo, int iTrigger);
+
+  int m_iState = STATE_NONE;
+  unsigned long m_ulEntered = 0;
+  uint32_t m_uaOverruns[STATE_COUNT] = {};
+  uint32_t m_uTransitions = 0;
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <Arduino.h>
+
+// setCACert() with the SDK's whole ca_pem has CHubClient parse every certificate in it again on each
+// connect, and all of them sit on the heap for the handshake. tools/mktlsroots.py takes the pinned roots
+// out of ca_pem at build time instead and makes an ESP-IDF certificate bundle of them for setCACertBundle():
+// per root just its subject and public key, sorted by subject, and only the key of the root the hub
+// chains up to gets parsed. It's const, so it stays in flash. The roots are picked by common name
+// (PINNED_ROOTS in the script), nothing is trusted that isn't in the SDK's own bundle already
+
+// The bundle, nullptr if none of the pinned roots were in ca_pem. piRoots gets how many made it in
+const uint8_t *tlsGetPinnedBundle(int *piRoots);
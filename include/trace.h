@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Trace events for Perfetto/chrome://tracing, compiled out entirely with -DTRACE_ENABLED=0
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Newest events overwrite the oldest. A customer interaction is a couple of thousand events,
+// the host has room to keep a whole benchmark run
+#ifndef TRACE_RING_LEN
+#ifdef NATIVE_BUILD
+#define TRACE_RING_LEN 131072
+#else
+#define TRACE_RING_LEN 1024
+#endif
+#endif
+
+// Rows in the trace viewer
+enum {
+  TRACE_TRACK_LOOP = 1, // Whatever loop() is doing right now
+  TRACE_TRACK_STATE,    // Which state the station is in, spans overlap the work on the loop track
+};
+
+#if TRACE_ENABLED
+
+// Names must be string literals, only the pointer is kept.
+// Only the loop task records, there's no locking
+void traceBegin(const char *name, uint8_t track = TRACE_TRACK_LOOP);
+void traceEnd(const char *name, uint8_t track = TRACE_TRACK_LOOP);
+void traceInstant(const char *name, uint8_t track = TRACE_TRACK_LOOP);
+void traceCounter(const char *name, int32_t value);
+// One event with a duration instead of a begin/end pair, for spans that start and end in the same place
+void traceComplete(const char *name, uint32_t ulStartUs, uint8_t track = TRACE_TRACK_LOOP);
+
+// Writes everything in the ring as Chrome trace JSON
+void traceDump(Print &out);
+// Call from loop(), sending 't' over Serial dumps the trace there
+void updateTrace();
+
+class CTraceScope
+{
+public:
+  CTraceScope(const char *name) : m_name(name), m_ulStartUs(micros()) {}
+  ~CTraceScope() { traceComplete(m_name, m_ulStartUs); }
+
+private:
+  const char *m_name;
+  uint32_t m_ulStartUs;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) CTraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_BEGIN(...) traceBegin(__VA_ARGS__)
+#define TRACE_END(...) traceEnd(__VA_ARGS__)
+#define TRACE_INSTANT(...) traceInstant(__VA_ARGS__)
+#define TRACE_COUNTER(name, value) traceCounter(name, value)
+
+#else
+
+inline void traceDump(Print &out) { (void)out; }
+inline void updateTrace() {}
+
+#define TRACE_SCOPE(name) do {} while( 0 )
+#define TRACE_BEGIN(...) do {} while( 0 )
+#define TRACE_END(...) do {} while( 0 )
+#define TRACE_INSTANT(...) do {} while( 0 )
+#define TRACE_COUNTER(name, value) do {} while( 0 )
+
+#endif
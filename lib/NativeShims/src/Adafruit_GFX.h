@@ -0,0 +1,6 @@
+#pragma once
+
+#include "Arduino.h"
+
+#define BLACK 0
+#define WHITE 1
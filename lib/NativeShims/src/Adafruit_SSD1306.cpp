@@ -0,0 +1,46 @@
+#include "Adafruit_SSD1306.h"
+
+// The real driver pushes the frame in Wire-buffer sized pieces, each with a control byte in front
+#define SSD1306_CHUNK 31
+#define SSD1306_SETUP_COMMANDS 6
+
+Adafruit_SSD1306::Adafruit_SSD1306(uint8_t w, uint8_t h, TwoWire *twi, int8_t rst_pin)
+  : m_wire(twi), m_width(w), m_height(h)
+{
+  (void)rst_pin;
+}
+
+bool Adafruit_SSD1306::begin(uint8_t switchvcc, uint8_t i2caddr, bool reset, bool periphBegin)
+{
+  (void)switchvcc; (void)reset; (void)periphBegin;
+  m_wire->attachDevice(i2caddr, this);
+  return true;
+}
+
+void Adafruit_SSD1306::display()
+{
+  m_wire->accountTransfer(SSD1306_SETUP_COMMANDS + 1);
+
+  size_t bytes = (size_t)m_width * m_height / 8;
+  while( bytes > 0 )
+  {
+    size_t chunk = bytes < SSD1306_CHUNK ? bytes : SSD1306_CHUNK;
+    m_wire->accountTransfer(chunk + 1);
+    bytes -= chunk;
+  }
+
+  m_shown = m_text;
+  m_frames++;
+}
+
+void Adafruit_SSD1306::clearDisplay()
+{
+  m_text.clear();
+}
+
+size_t Adafruit_SSD1306::write(uint8_t c)
+{
+  if( c != '\r' )
+    m_text += (char)c;
+  return 1;
+}
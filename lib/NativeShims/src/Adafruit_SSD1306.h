@@ -0,0 +1,51 @@
+#pragma once
+
+#include "Adafruit_GFX.h"
+#include "Wire.h"
+
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_DISPLAYOFF 0xAE
+#define SSD1306_DISPLAYON 0xAF
+#define SSD1306_BLACK BLACK
+#define SSD1306_WHITE WHITE
+
+// Keeps the text that would be drawn instead of pixels, and charges every
+// display() to the bus like the real driver's frame upload would. begin() puts it on
+// the bus, so whatever else is sent to its address gets acked
+class Adafruit_SSD1306 : public Print, public CSimI2CDevice
+{
+public:
+  Adafruit_SSD1306(uint8_t w, uint8_t h, TwoWire *twi, int8_t rst_pin = -1);
+
+  bool begin(uint8_t switchvcc = SSD1306_SWITCHCAPVCC, uint8_t i2caddr = 0, bool reset = true, bool periphBegin = true);
+  void display();
+  void clearDisplay();
+
+  void setTextColor(uint16_t c) { (void)c; }
+  void setTextSize(uint8_t s) { (void)s; }
+  void setCursor(int16_t x, int16_t y) { (void)x; (void)y; }
+  void drawRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) { (void)x; (void)y; (void)w; (void)h; (void)color; }
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) { (void)x; (void)y; (void)w; (void)h; (void)color; }
+  void dim(bool dim) { (void)dim; }
+  void ssd1306_command(uint8_t c) { (void)c; m_wire->accountTransfer(2); }
+
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  void onReceive(const uint8_t *data, size_t len) override { (void)data; (void)len; }
+  size_t onRequest(uint8_t *data, size_t len) override { (void)data; (void)len; return 0; }
+
+  /* Simulation side */
+  // What the last display() put on the screen
+  const char *getShownText() { return m_shown.c_str(); }
+  uint32_t getFrameCount() { return m_frames; }
+
+private:
+  TwoWire *m_wire;
+  uint8_t m_width;
+  uint8_t m_height;
+
+  std::string m_text;
+  std::string m_shown;
+  uint32_t m_frames = 0;
+};
@@ -0,0 +1,193 @@
+#include <chrono>
+#include <thread>
+
+#include "Arduino.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+
+#define NUM_PINS 40
+
+static bool s_bSimClock = false;
+static uint64_t s_ulSimMicros = 0;
+static void (*s_pDelayHook)(uint64_t, uint64_t) = nullptr;
+
+static int s_iaPinLevel[NUM_PINS];
+static int s_iaPinMode[NUM_PINS];
+static void (*s_paHandlers[NUM_PINS])(void);
+static int s_iaHandlerMode[NUM_PINS];
+static int (*s_paPinSources[NUM_PINS])(void);
+
+static uint64_t WallMicros()
+{
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint64_t NowMicros()
+{
+  return s_bSimClock ? s_ulSimMicros : WallMicros();
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(NowMicros() / 1000);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)NowMicros();
+}
+
+static void FireHandler(uint8_t pin, int old)
+{
+  if( !s_paHandlers[pin] || old == s_iaPinLevel[pin] )
+    return;
+
+  bool bRising = s_iaPinLevel[pin] == HIGH;
+  int mode = s_iaHandlerMode[pin];
+  if( mode == CHANGE || (mode == RISING && bRising) || (mode == FALLING && !bRising) )
+    s_paHandlers[pin]();
+}
+
+// Pins driven by a simulated part only change while time passes, that's when their interrupts fire
+static void PollPinSources()
+{
+  for( uint8_t pin = 0; pin < NUM_PINS; pin++ )
+  {
+    if( !s_paPinSources[pin] )
+      continue;
+
+    int old = s_iaPinLevel[pin];
+    s_iaPinLevel[pin] = s_paPinSources[pin]() ? HIGH : LOW;
+    FireHandler(pin, old);
+  }
+}
+
+static void SleepMicros(uint64_t us)
+{
+  uint64_t from = NowMicros();
+
+  if( s_bSimClock )
+    s_ulSimMicros += us;
+  else
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+
+  if( s_pDelayHook )
+    s_pDelayHook(from, NowMicros());
+
+  PollPinSources();
+}
+
+void delay(uint32_t ms)
+{
+  SleepMicros((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+  SleepMicros(us);
+}
+
+void yield()
+{
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if( pin >= NUM_PINS )
+    return;
+
+  s_iaPinMode[pin] = mode;
+  if( mode == INPUT_PULLUP )
+    s_iaPinLevel[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  if( pin < NUM_PINS )
+    s_iaPinLevel[pin] = val ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  if( pin >= NUM_PINS )
+    return LOW;
+  return s_paPinSources[pin] ? (s_paPinSources[pin]() ? HIGH : LOW) : s_iaPinLevel[pin];
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode)
+{
+  if( pin >= NUM_PINS )
+    return;
+
+  s_paHandlers[pin] = handler;
+  s_iaHandlerMode[pin] = mode;
+}
+
+void detachInterrupt(uint8_t pin)
+{
+  if( pin < NUM_PINS )
+    s_paHandlers[pin] = nullptr;
+}
+
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char *server1, const char *server2, const char *server3)
+{
+  // The host clock is already synced
+  (void)gmtOffset_sec; (void)daylightOffset_sec; (void)server1; (void)server2; (void)server3;
+}
+
+void EspClass::restart()
+{
+  Serial.println("ESP.restart() called, exiting");
+  Serial.flush();
+  exit(1);
+}
+
+void SimClockEnable(bool bEnable)
+{
+  if( bEnable && !s_bSimClock )
+    s_ulSimMicros = WallMicros();
+  s_bSimClock = bEnable;
+}
+
+void SimClockAdvance(uint64_t ulMicros)
+{
+  if( s_bSimClock )
+    s_ulSimMicros += ulMicros;
+}
+
+void SimSetPin(uint8_t pin, int level)
+{
+  if( pin >= NUM_PINS )
+    return;
+
+  int old = s_iaPinLevel[pin];
+  s_iaPinLevel[pin] = level ? HIGH : LOW;
+  FireHandler(pin, old);
+}
+
+void SimSetPinSource(uint8_t pin, int (*source)(void))
+{
+  if( pin < NUM_PINS )
+    s_paPinSources[pin] = source;
+}
+
+void SimSetDelayHook(void (*hook)(uint64_t ulFromUs, uint64_t ulToUs))
+{
+  s_pDelayHook = hook;
+}
+
+// The core normally owns main(), a simulation that wants its own defines NATIVE_CUSTOM_MAIN.
+// pio test builds src with each test, which brings its own too
+#if !defined(NATIVE_CUSTOM_MAIN) && !defined(PIO_UNIT_TESTING)
+void setup();
+void loop();
+
+int main()
+{
+  setup();
+  for( ;; )
+    loop();
+}
+#endif
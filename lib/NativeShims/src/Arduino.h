@@ -0,0 +1,75 @@
+#pragma once
+
+// Host stand-in for the Arduino-ESP32 core, only what the station firmware actually uses
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "HardwareSerial.h"
+#include "Esp.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_byte_near(addr) pgm_read_byte(addr)
+#define F(str) (str)
+
+#define LOW 0x0
+#define HIGH 0x1
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+#define OUTPUT_OPEN_DRAIN 0x12
+
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t pin);
+
+// esp32-hal-time
+void configTime(long gmtOffset_sec, int daylightOffset_sec, const char *server1, const char *server2 = nullptr, const char *server3 = nullptr);
+
+/* Simulation controls, these don't exist on the device */
+
+// Run millis()/delay() off a simulated clock, delay() then just moves it forward instead of sleeping
+void SimClockEnable(bool bEnable);
+void SimClockAdvance(uint64_t ulMicros);
+
+// Drive an input pin, fires the attached interrupt on the matching edge
+void SimSetPin(uint8_t pin, int level);
+
+// Have digitalRead() of a pin ask a simulated part for its level, e.g. an IRQ line
+void SimSetPinSource(uint8_t pin, int (*source)(void));
+
+// Called whenever the firmware sleeps, lets a simulation run its components in the meantime
+void SimSetDelayHook(void (*hook)(uint64_t ulFromUs, uint64_t ulToUs));
@@ -0,0 +1,138 @@
+#include "Electroniccats_PN7150.h"
+
+// How often the shim looks at the model while waiting, the real chip notifies over IRQ
+#define SIM_NFC_POLL_MS 10
+// NCI header + tag command framing around every readerTagCmd payload
+#define SIM_NCI_OVERHEAD 3
+
+CSimNFCModel *Electroniccats_PN7150::s_model = nullptr;
+
+CSimMifareCard::CSimMifareCard()
+{
+  memset(m_blocks, 0, sizeof(m_blocks));
+}
+
+bool CSimMifareCard::exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen)
+{
+  if( !m_bPresent || cmdLen < 1 )
+    return false;
+
+  // Second half of a write, the 16 data bytes after the 0xA0 command
+  if( m_pendingWrite >= 0 && cmd[0] == 0x10 && cmdLen == 17 )
+  {
+    memcpy(m_blocks[m_pendingWrite], cmd + 1, 16);
+    m_pendingWrite = -1;
+    resp[0] = 0x10; resp[1] = 0x00;
+    *respLen = 2;
+    return true;
+  }
+
+  // Sector authentication, any key goes
+  if( cmd[0] == 0x40 )
+  {
+    m_bAuthenticated = true;
+    resp[0] = 0x40; resp[1] = 0x00;
+    *respLen = 2;
+    return true;
+  }
+
+  if( cmd[0] == 0x10 && cmdLen >= 3 && m_bAuthenticated )
+  {
+    int block = cmd[2] & 0x3F;
+
+    // Read
+    if( cmd[1] == 0x30 )
+    {
+      resp[0] = 0x10;
+      memcpy(resp + 1, m_blocks[block], 16);
+      resp[17] = 0x00;
+      *respLen = 18;
+      return true;
+    }
+
+    // Write, data comes in the next command
+    if( cmd[1] == 0xA0 )
+    {
+      m_pendingWrite = block;
+      resp[0] = 0x10; resp[1] = 0x00;
+      *respLen = 2;
+      return true;
+    }
+  }
+
+  resp[0] = cmd[0]; resp[1] = 0x03;
+  *respLen = 2;
+  return true;
+}
+
+// The controller raises IRQ once discovery finds a card
+static int IrqLevel()
+{
+  return Electroniccats_PN7150::isSimTagPresent() ? HIGH : LOW;
+}
+
+Electroniccats_PN7150::Electroniccats_PN7150(uint8_t IRQpin, uint8_t VENpin, uint8_t I2Caddress, TwoWire *wire)
+  : m_wire(wire), m_address(I2Caddress)
+{
+  (void)VENpin;
+  SimSetPinSource(IRQpin, IrqLevel);
+}
+
+uint8_t Electroniccats_PN7150::connectNCI()
+{
+  return NFC_SUCCESS;
+}
+
+bool Electroniccats_PN7150::configureSettings()
+{
+  return NFC_SUCCESS;
+}
+
+uint8_t Electroniccats_PN7150::configMode()
+{
+  return NFC_SUCCESS;
+}
+
+bool Electroniccats_PN7150::startDiscovery()
+{
+  return NFC_SUCCESS;
+}
+
+bool Electroniccats_PN7150::isTagDetected(uint16_t tout)
+{
+  unsigned long ulStart = millis();
+  for( ;; )
+  {
+    if( s_model && s_model->isTagPresent() )
+      return true;
+
+    if( millis() - ulStart >= tout )
+      return false;
+
+    delay(SIM_NFC_POLL_MS);
+  }
+}
+
+void Electroniccats_PN7150::waitForTagRemoval()
+{
+  while( s_model && s_model->isTagPresent() )
+    delay(SIM_NFC_POLL_MS);
+}
+
+bool Electroniccats_PN7150::readerTagCmd(unsigned char *pCommand, unsigned char CommandSize, unsigned char *pAnswer, unsigned char *pAnswerSize)
+{
+  m_wire->accountTransfer(CommandSize + SIM_NCI_OVERHEAD);
+
+  if( !s_model || !s_model->exchange(pCommand, CommandSize, pAnswer, pAnswerSize) )
+  {
+    *pAnswerSize = 0;
+    return NFC_ERROR;
+  }
+
+  m_wire->accountTransfer(*pAnswerSize + SIM_NCI_OVERHEAD);
+  return NFC_SUCCESS;
+}
+
+void Electroniccats_PN7150::reset()
+{
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Arduino.h"
+#include "Wire.h"
+
+#define NFC_SUCCESS 0
+#define NFC_ERROR 1
+
+// What's in front of the reader, the shim only forwards to it
+class CSimNFCModel
+{
+public:
+  virtual ~CSimNFCModel() {}
+
+  virtual bool isTagPresent() = 0;
+  // One readerTagCmd() round trip, returns false if the card didn't answer
+  virtual bool exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen) = 0;
+};
+
+// A MIFARE Classic 1K that answers the auth/read/write commands the station uses
+class CSimMifareCard : public CSimNFCModel
+{
+public:
+  CSimMifareCard();
+
+  void setPresent(bool bPresent) { m_bPresent = bPresent; }
+  uint8_t *getBlock(int block) { return m_blocks[block]; }
+
+  bool isTagPresent() override { return m_bPresent; }
+  bool exchange(const uint8_t *cmd, uint8_t cmdLen, uint8_t *resp, uint8_t *respLen) override;
+
+private:
+  bool m_bPresent = false;
+  bool m_bAuthenticated = false;
+  int m_pendingWrite = -1;
+  uint8_t m_blocks[64][16];
+};
+
+class RemoteDevice
+{
+public:
+  int getProtocol() { return 0x80; } // PROT_MIFARE
+  int getModeTech() { return 0x00; } // MODE_POLL | TECH_PASSIVE_NFCA
+  int getInterface() { return 0x80; } // INTF_TAGCMD
+};
+
+class Electroniccats_PN7150
+{
+public:
+  Electroniccats_PN7150(uint8_t IRQpin, uint8_t VENpin, uint8_t I2Caddress, TwoWire *wire = &Wire);
+
+  uint8_t connectNCI();
+  bool configureSettings();
+  uint8_t configMode();
+  bool startDiscovery();
+  bool isTagDetected(uint16_t tout = 500);
+  void waitForTagRemoval();
+  bool readerTagCmd(unsigned char *pCommand, unsigned char CommandSize, unsigned char *pAnswer, unsigned char *pAnswerSize);
+  void reset();
+
+  RemoteDevice remoteDevice;
+
+  /* Simulation side */
+  static void setSimModel(CSimNFCModel *model) { s_model = model; }
+  static bool isSimTagPresent() { return s_model && s_model->isTagPresent(); }
+
+private:
+  static CSimNFCModel *s_model;
+
+  TwoWire *m_wire;
+  uint8_t m_address;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+class EspClass
+{
+public:
+  // The station gives up and restarts when it can't get online, on the host that just ends the run
+  void restart();
+
+  uint32_t getFreeHeap() { return 0; }
+  uint32_t getMinFreeHeap() { return 0; }
+  uint32_t getMaxAllocHeap() { return 0; }
+  uint32_t getHeapSize() { return 0; }
+  uint32_t getCpuFreqMHz() { return 240; }
+};
+
+extern EspClass ESP;
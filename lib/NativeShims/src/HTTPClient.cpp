@@ -0,0 +1,82 @@
+#include <poll.h>
+
+#include "HTTPClient.h"
+
+bool HTTPClient::begin(const String &url)
+{
+  std::string s = url.c_str();
+  const std::string scheme = "http://";
+  if( s.compare(0, scheme.size(), scheme) != 0 )
+    return false;
+
+  s = s.substr(scheme.size());
+  size_t slash = s.find('/');
+  std::string hostPort = s.substr(0, slash);
+  m_path = slash == std::string::npos ? "/" : s.substr(slash);
+
+  size_t colon = hostPort.find(':');
+  m_host = hostPort.substr(0, colon);
+  m_port = colon == std::string::npos ? 80 : (uint16_t)atoi(hostPort.c_str() + colon + 1);
+  m_size = -1;
+  return !m_host.empty();
+}
+
+void HTTPClient::end()
+{
+  m_client.stop();
+}
+
+bool HTTPClient::ReadLine(std::string &line)
+{
+  line.clear();
+  for( ;; )
+  {
+    struct pollfd pfd = { m_client.fd(), POLLIN, 0 };
+    if( m_client.fd() < 0 || poll(&pfd, 1, m_timeout) <= 0 )
+      return false;
+
+    int c = m_client.read();
+    if( c < 0 )
+      return false;
+    if( c == '\n' )
+      break;
+    if( c != '\r' )
+      line += (char)c;
+  }
+  return true;
+}
+
+int HTTPClient::GET()
+{
+  if( !m_client.connect(m_host.c_str(), m_port) )
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+
+  std::string request = "GET " + m_path + " HTTP/1.0\r\nHost: " + m_host + "\r\nConnection: close\r\n\r\n";
+  if( m_client.write((const uint8_t *)request.data(), request.size()) != request.size() )
+    return HTTPC_ERROR_NOT_CONNECTED;
+
+  // HTTP/1.x 200 OK
+  std::string line;
+  if( !ReadLine(line) || line.size() < 12 )
+    return HTTPC_ERROR_READ_TIMEOUT;
+  int code = atoi(line.c_str() + 9);
+
+  while( ReadLine(line) && !line.empty() )
+  {
+    const std::string header = "content-length:";
+    if( line.size() > header.size() && strncasecmp(line.c_str(), header.c_str(), header.size()) == 0 )
+      m_size = atoi(line.c_str() + header.size());
+  }
+  return code;
+}
+
+String HTTPClient::errorToString(int error)
+{
+  switch( error )
+  {
+    case HTTPC_ERROR_CONNECTION_REFUSED: return "connection refused";
+    case HTTPC_ERROR_NOT_CONNECTED: return "not connected";
+    case HTTPC_ERROR_READ_TIMEOUT: return "read Timeout";
+    default: return String();
+  }
+}
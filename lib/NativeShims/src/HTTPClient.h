@@ -0,0 +1,42 @@
+#pragma once
+
+#include "WString.h"
+#include "WiFiClient.h"
+
+#define HTTP_CODE_OK 200
+
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+
+// Plain http:// GET over a WiFiClient, just what a firmware download reads through getStreamPtr().
+// Always HTTP/1.0, so the body is never chunked
+class HTTPClient
+{
+public:
+  ~HTTPClient() { end(); }
+
+  bool begin(const String &url);
+  // No TLS on the host, an https:// URL never connects
+  bool begin(const String &url, const char *CAcert) { (void)url; (void)CAcert; return false; }
+  void end();
+  void setTimeout(uint16_t timeout) { m_timeout = timeout; }
+  void setConnectTimeout(int32_t timeout) { (void)timeout; }
+  void useHTTP10(bool usehttp10 = true) { (void)usehttp10; }
+
+  int GET();
+  int getSize() { return m_size; }
+  WiFiClient *getStreamPtr() { return m_client.connected() ? &m_client : nullptr; }
+
+  static String errorToString(int error);
+
+private:
+  bool ReadLine(std::string &line);
+
+  WiFiClient m_client;
+  std::string m_host;
+  std::string m_path;
+  uint16_t m_port = 80;
+  uint16_t m_timeout = 5000;
+  int m_size = -1;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Stream.h"
+
+// Serial goes straight to stdout, there's no input on the host
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long baud) { (void)baud; }
+  void end() {}
+
+  size_t write(uint8_t c) override { return m_bEnabled ? fwrite(&c, 1, 1, stdout) : 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { return m_bEnabled ? fwrite(buffer, 1, size, stdout) : size; }
+  using Print::write;
+
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void flush() override { fflush(stdout); }
+
+  operator bool() const { return true; }
+
+  /* Simulation side */
+  // Keeps the firmware's chatter out of a benchmark report
+  void SimSetEnabled(bool bEnabled) { m_bEnabled = bEnabled; }
+
+private:
+  bool m_bEnabled = true;
+};
+
+extern HardwareSerial Serial;
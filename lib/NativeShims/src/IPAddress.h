@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress
+{
+public:
+  IPAddress() { memset(m_bytes, 0, sizeof(m_bytes)); }
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { m_bytes[0] = a; m_bytes[1] = b; m_bytes[2] = c; m_bytes[3] = d; }
+  IPAddress(const uint8_t *address) { memcpy(m_bytes, address, sizeof(m_bytes)); }
+
+  uint8_t operator[](int index) const { return m_bytes[index]; }
+  uint8_t &operator[](int index) { return m_bytes[index]; }
+
+private:
+  uint8_t m_bytes[4];
+};
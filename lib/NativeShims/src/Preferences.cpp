@@ -0,0 +1,102 @@
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Preferences.h"
+
+typedef std::map<std::string, std::vector<uint8_t>> nvsNamespace;
+
+static std::map<std::string, nvsNamespace> &Store()
+{
+  static std::map<std::string, nvsNamespace> s_store;
+  return s_store;
+}
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partition_label)
+{
+  (void)partition_label;
+
+  // Same as NVS, a read-only open of a namespace that was never written fails
+  if( readOnly && Store().find(name) == Store().end() )
+    return false;
+
+  m_namespace = name;
+  m_bReadOnly = readOnly;
+  m_bStarted = true;
+  Store()[m_namespace];
+  return true;
+}
+
+void Preferences::end()
+{
+  m_bStarted = false;
+}
+
+bool Preferences::clear()
+{
+  if( !m_bStarted || m_bReadOnly )
+    return false;
+  Store()[m_namespace].clear();
+  return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+  if( !m_bStarted || m_bReadOnly )
+    return false;
+  return Store()[m_namespace].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key)
+{
+  return m_bStarted && Store()[m_namespace].count(key) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len)
+{
+  if( !m_bStarted || m_bReadOnly )
+    return 0;
+
+  const uint8_t *bytes = (const uint8_t *)value;
+  Store()[m_namespace][key].assign(bytes, bytes + len);
+  return len;
+}
+
+size_t Preferences::putInt(const char *key, int32_t value)
+{
+  return putBytes(key, &value, sizeof(value));
+}
+
+size_t Preferences::putUInt(const char *key, uint32_t value)
+{
+  return putBytes(key, &value, sizeof(value));
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+  if( !isKey(key) )
+    return 0;
+  return Store()[m_namespace][key].size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen)
+{
+  size_t len = getBytesLength(key);
+  if( len == 0 || len > maxLen )
+    return 0;
+
+  memcpy(buf, Store()[m_namespace][key].data(), len);
+  return len;
+}
+
+int32_t Preferences::getInt(const char *key, int32_t defaultValue)
+{
+  int32_t value;
+  return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+}
+
+uint32_t Preferences::getUInt(const char *key, uint32_t defaultValue)
+{
+  uint32_t value;
+  return getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : defaultValue;
+}
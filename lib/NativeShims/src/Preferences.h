@@ -0,0 +1,27 @@
+#pragma once
+
+#include "Arduino.h"
+
+// NVS on the host is just a map in RAM, it lives as long as the process
+class Preferences
+{
+public:
+  bool begin(const char *name, bool readOnly = false, const char *partition_label = nullptr);
+  void end();
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+
+  size_t putInt(const char *key, int32_t value);
+  size_t putUInt(const char *key, uint32_t value);
+  size_t putBytes(const char *key, const void *value, size_t len);
+  int32_t getInt(const char *key, int32_t defaultValue = 0);
+  uint32_t getUInt(const char *key, uint32_t defaultValue = 0);
+  size_t getBytesLength(const char *key);
+  size_t getBytes(const char *key, void *buf, size_t maxLen);
+
+private:
+  std::string m_namespace;
+  bool m_bReadOnly = false;
+  bool m_bStarted = false;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+
+class Print
+{
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while( size-- )
+      n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+  __attribute__((format(printf, 2, 3)))
+  size_t printf(const char *format, ...)
+  {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if( len < 0 )
+      return 0;
+    return write((const uint8_t *)buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+  }
+
+  size_t print(const char *str) { return write(str); }
+  size_t print(const String &str) { return write(str.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value, int base = DEC) { return printf(base == HEX ? "%x" : "%d", value); }
+  size_t print(unsigned int value, int base = DEC) { return printf(base == HEX ? "%x" : "%u", value); }
+  size_t print(long value, int base = DEC) { return printf(base == HEX ? "%lx" : "%ld", value); }
+  size_t print(unsigned long value, int base = DEC) { return printf(base == HEX ? "%lx" : "%lu", value); }
+  size_t print(double value, int digits = 2) { return printf("%.*f", digits, value); }
+
+  size_t println() { return write("\r\n"); }
+  template <class T>
+  size_t println(const T &value) { size_t n = print(value); return n + println(); }
+  template <class T>
+  size_t println(const T &value, int format) { size_t n = print(value, format); return n + println(); }
+
+  virtual void flush() {}
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Print.h"
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+
+  void setTimeout(unsigned long timeout) { m_timeout = timeout; }
+
+  size_t readBytes(char *buffer, size_t length)
+  {
+    size_t count = 0;
+    while( count < length )
+    {
+      int c = read();
+      if( c < 0 )
+        break;
+      *buffer++ = (char)c;
+      count++;
+    }
+    return count;
+  }
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+
+protected:
+  unsigned long m_timeout = 1000;
+};
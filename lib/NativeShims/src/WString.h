@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+
+// Arduino String on top of std::string, ArduinoJson needs c_str()/length()/concat()
+class String
+{
+public:
+  String() {}
+  String(const char *cstr) : m_str(cstr ? cstr : "") {}
+  String(const std::string &str) : m_str(str) {}
+  String(char c) : m_str(1, c) {}
+  String(int value) : m_str(std::to_string(value)) {}
+  String(unsigned int value) : m_str(std::to_string(value)) {}
+  String(long value) : m_str(std::to_string(value)) {}
+  String(unsigned long value) : m_str(std::to_string(value)) {}
+  String(float value, unsigned int decimals = 2) { fromDouble(value, decimals); }
+  String(double value, unsigned int decimals = 2) { fromDouble(value, decimals); }
+
+  const char *c_str() const { return m_str.c_str(); }
+  unsigned int length() const { return m_str.length(); }
+  bool isEmpty() const { return m_str.empty(); }
+
+  bool concat(const char *cstr) { if( cstr ) m_str += cstr; return true; }
+  bool concat(const char *cstr, unsigned int len) { m_str.append(cstr, len); return true; }
+  bool concat(const String &str) { m_str += str.m_str; return true; }
+  bool concat(char c) { m_str += c; return true; }
+
+  String &operator+=(const String &rhs) { concat(rhs); return *this; }
+  String &operator+=(const char *rhs) { concat(rhs); return *this; }
+  String &operator+=(char rhs) { concat(rhs); return *this; }
+
+  bool operator==(const String &rhs) const { return m_str == rhs.m_str; }
+  bool operator==(const char *rhs) const { return m_str == (rhs ? rhs : ""); }
+  bool operator!=(const String &rhs) const { return !(*this == rhs); }
+
+  char operator[](unsigned int index) const { return index < m_str.size() ? m_str[index] : 0; }
+  char charAt(unsigned int index) const { return (*this)[index]; }
+
+  bool startsWith(const String &prefix) const { return m_str.compare(0, prefix.m_str.size(), prefix.m_str) == 0; }
+  int indexOf(char c) const { size_t pos = m_str.find(c); return pos == std::string::npos ? -1 : (int)pos; }
+  String substring(unsigned int from, unsigned int to = (unsigned int)-1) const
+  {
+    if( from > m_str.size() )
+      return String();
+    return String(m_str.substr(from, to == (unsigned int)-1 ? std::string::npos : to - from));
+  }
+
+  long toInt() const { return atol(m_str.c_str()); }
+  float toFloat() const { return (float)atof(m_str.c_str()); }
+
+private:
+  void fromDouble(double value, unsigned int decimals)
+  {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    m_str = buf;
+  }
+
+  std::string m_str;
+};
+
+// ArduinoJson looks this one up too
+class StringSumHelper : public String
+{
+public:
+  StringSumHelper(const String &s) : String(s) {}
+  StringSumHelper(const char *p) : String(p) {}
+};
+
+inline StringSumHelper operator+(const StringSumHelper &lhs, const String &rhs)
+{
+  StringSumHelper res(lhs);
+  res.concat(rhs);
+  return res;
+}
+
+inline StringSumHelper operator+(const StringSumHelper &lhs, const char *rhs)
+{
+  StringSumHelper res(lhs);
+  res.concat(rhs);
+  return res;
+}
@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "WiFiClientSecure.h"
+
+WiFiClass WiFi;
+
+static void (*s_pNetWriteHook)(const uint8_t *, size_t) = nullptr;
+
+void SimSetNetWriteHook(void (*hook)(const uint8_t *data, size_t len))
+{
+  s_pNetWriteHook = hook;
+}
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *passphrase, int32_t channel, const uint8_t *bssid, bool connect)
+{
+  (void)ssid; (void)passphrase; (void)connect;
+  if( channel )
+    m_channel = channel;
+  if( bssid )
+    memcpy(m_bssid, bssid, sizeof(m_bssid));
+
+  m_status = WL_CONNECTED;
+  return m_status;
+}
+
+bool WiFiClass::disconnect(bool wifioff, bool eraseap)
+{
+  (void)wifioff; (void)eraseap;
+  m_status = WL_DISCONNECTED;
+  return true;
+}
+
+bool WiFiClass::reconnect()
+{
+  m_status = WL_CONNECTED;
+  return true;
+}
+
+static const char *MqttHost(const char *host)
+{
+  const char *env = getenv("NATIVE_MQTT_HOST");
+  (void)host;
+  return env ? env : "127.0.0.1";
+}
+
+static uint16_t MqttPort(uint16_t port)
+{
+  const char *env = getenv("NATIVE_MQTT_PORT");
+  (void)port;
+  return env ? (uint16_t)atoi(env) : 1883;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  char host[16];
+  snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return connect(host, port);
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  stop();
+
+  // No TLS on the host, whatever dials the hub's secure MQTT port gets the plain text broker instead
+  if( port == 8883 )
+  {
+    host = MqttHost(host);
+    port = MqttPort(port);
+  }
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *result = nullptr;
+  if( getaddrinfo(host, service, &hints, &result) != 0 )
+    return 0;
+
+  for( struct addrinfo *ai = result; ai; ai = ai->ai_next )
+  {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if( fd < 0 )
+      continue;
+
+    if( ::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+    {
+      int iNoDelay = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+      m_socket = fd;
+      break;
+    }
+    close(fd);
+  }
+
+  freeaddrinfo(result);
+  return m_socket >= 0;
+}
+
+size_t WiFiClient::write(const uint8_t *buf, size_t size)
+{
+  if( m_socket < 0 )
+    return 0;
+
+  if( s_pNetWriteHook )
+    s_pNetWriteHook(buf, size);
+
+  size_t sent = 0;
+  while( sent < size )
+  {
+    ssize_t n = send(m_socket, buf + sent, size - sent, MSG_NOSIGNAL);
+    if( n <= 0 )
+    {
+      stop();
+      break;
+    }
+    sent += n;
+  }
+  return sent;
+}
+
+int WiFiClient::available()
+{
+  if( m_socket < 0 )
+    return 0;
+
+  int count = 0;
+  if( ioctl(m_socket, FIONREAD, &count) < 0 )
+    return 0;
+  return count + (m_peeked >= 0 ? 1 : 0);
+}
+
+int WiFiClient::read()
+{
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t *buf, size_t size)
+{
+  if( size == 0 )
+    return 0;
+
+  size_t got = 0;
+  if( m_peeked >= 0 )
+  {
+    buf[got++] = (uint8_t)m_peeked;
+    m_peeked = -1;
+  }
+
+  if( m_socket < 0 || got == size )
+    return got ? (int)got : -1;
+
+  ssize_t n = recv(m_socket, buf + got, size - got, MSG_DONTWAIT);
+  if( n == 0 )
+    stop();
+  else if( n > 0 )
+    got += n;
+
+  return got ? (int)got : -1;
+}
+
+int WiFiClient::peek()
+{
+  if( m_peeked < 0 )
+  {
+    uint8_t c;
+    if( m_socket >= 0 && recv(m_socket, &c, 1, MSG_DONTWAIT) == 1 )
+      m_peeked = c;
+  }
+  return m_peeked;
+}
+
+void WiFiClient::stop()
+{
+  if( m_socket >= 0 )
+    close(m_socket);
+  m_socket = -1;
+  m_peeked = -1;
+}
+
+uint8_t WiFiClient::connected()
+{
+  if( m_socket < 0 )
+    return 0;
+
+  // Peer closed if the socket is readable but has nothing in it
+  struct pollfd pfd = { m_socket, POLLIN, 0 };
+  if( poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) )
+  {
+    stop();
+    return 0;
+  }
+  if( pfd.revents & POLLIN )
+  {
+    uint8_t c;
+    ssize_t n = recv(m_socket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if( n == 0 )
+    {
+      stop();
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int WiFiClient::setSocketOption(int level, int option, const void *value, size_t len)
+{
+  return setsockopt(m_socket, level, option, value, len);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port)
+{
+  (void)ip;
+  return connect((const char *)nullptr, port);
+}
+
+int WiFiClientSecure::connect(const char *host, uint16_t port)
+{
+  int result = WiFiClient::connect(MqttHost(host), MqttPort(port));
+  m_context.socket = m_socket;
+  return result;
+}
+
+void WiFiClientSecure::stop()
+{
+  WiFiClient::stop();
+  m_context.socket = -1;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum {
+  WIFI_OFF = 0,
+  WIFI_STA = 1
+} wifi_mode_t;
+
+// The host is always online, a simulation can take the station off the air with SimSetStatus()
+class WiFiClass
+{
+public:
+  bool mode(wifi_mode_t mode) { (void)mode; return true; }
+  void persistent(bool persistent) { (void)persistent; }
+  wl_status_t begin(const char *ssid, const char *passphrase = nullptr, int32_t channel = 0, const uint8_t *bssid = nullptr, bool connect = true);
+  bool disconnect(bool wifioff = false, bool eraseap = false);
+  bool reconnect();
+  bool setAutoReconnect(bool autoReconnect) { (void)autoReconnect; return true; }
+
+  wl_status_t status() { return m_status; }
+  int8_t RSSI() { return m_status == WL_CONNECTED ? -55 : 0; }
+  int32_t channel() { return m_channel; }
+  uint8_t *BSSID() { return m_bssid; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+
+  /* Simulation side */
+  void SimSetStatus(wl_status_t status) { m_status = status; }
+
+private:
+  wl_status_t m_status = WL_DISCONNECTED;
+  int32_t m_channel = 1;
+  uint8_t m_bssid[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+};
+
+extern WiFiClass WiFi;
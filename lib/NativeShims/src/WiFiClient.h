@@ -0,0 +1,37 @@
+#pragma once
+
+#include "Client.h"
+#include "WiFi.h"
+
+// Sees every byte the firmware sends, lets a simulation timestamp publishes on the simulated clock
+void SimSetNetWriteHook(void (*hook)(const uint8_t *data, size_t len));
+
+// Plain POSIX TCP socket
+class WiFiClient : public Client
+{
+public:
+  WiFiClient() {}
+  ~WiFiClient() { stop(); }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  int connect(const char *host, uint16_t port, int32_t timeout_ms) { (void)timeout_ms; return connect(host, port); }
+  size_t write(uint8_t data) override { return write(&data, 1); }
+  size_t write(const uint8_t *buf, size_t size) override;
+  using Print::write;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+  int fd() const { return m_socket; }
+  int setSocketOption(int level, int option, const void *value, size_t len);
+
+protected:
+  int m_socket = -1;
+  int m_peeked = -1;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "WiFiClient.h"
+
+// Mirrors the bit of ssl_client.h the firmware touches
+struct sslclient_context {
+  int socket;
+};
+
+// No TLS on the host, this talks plain TCP to a local broker so the MQTT side can run for real.
+// NATIVE_MQTT_HOST / NATIVE_MQTT_PORT in the environment redirect the hub's address, defaults are localhost:1883
+class WiFiClientSecure : public WiFiClient
+{
+public:
+  WiFiClientSecure() { sslclient = &m_context; m_context.socket = -1; }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  void stop() override;
+
+  void setCACert(const char *rootCA) { (void)rootCA; }
+  void setCACertBundle(const uint8_t *bundle) { (void)bundle; }
+  void setInsecure() {}
+  void setHandshakeTimeout(unsigned long handshake_timeout) { (void)handshake_timeout; }
+
+protected:
+  sslclient_context *sslclient;
+
+private:
+  sslclient_context m_context;
+};
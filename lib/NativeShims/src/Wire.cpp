@@ -0,0 +1,173 @@
+#include "Wire.h"
+
+TwoWire Wire(0);
+TwoWire Wire1(1);
+
+static int WireSda() { return Wire.SimIsHung() ? LOW : HIGH; }
+static int Wire1Sda() { return Wire1.SimIsHung() ? LOW : HIGH; }
+
+TwoWire::TwoWire(uint8_t busNum)
+  : m_busNum(busNum)
+{
+}
+
+bool TwoWire::begin(int sda, int scl, uint32_t frequency)
+{
+  (void)scl;
+  if( sda >= 0 )
+    SimSetPinSource(sda, m_busNum == 0 ? WireSda : Wire1Sda);
+  if( frequency )
+    m_frequency = frequency;
+  return true;
+}
+
+bool TwoWire::end()
+{
+  // Good enough for the sim, on real hardware it takes the clocks CI2CBus::recover() sends
+  m_bHung = false;
+  return true;
+}
+
+bool TwoWire::setClock(uint32_t frequency)
+{
+  m_frequency = frequency;
+  return true;
+}
+
+void TwoWire::beginTransmission(uint16_t address)
+{
+  m_txAddress = address;
+  m_txLength = 0;
+  m_bTransmitting = true;
+}
+
+uint8_t TwoWire::endTransmission(bool sendStop)
+{
+  (void)sendStop;
+  m_bTransmitting = false;
+  if( m_bHung )
+  {
+    SimClockAdvance(m_timeOutMs * 1000ULL);
+    return 5;
+  }
+  accountTransfer(m_txLength);
+
+  // Same codes as the real driver: 2 is an address NACK
+  CSimI2CDevice *device = findDevice(m_txAddress);
+  if( !device )
+    return 2;
+
+  device->onReceive(m_txBuffer, m_txLength);
+  return 0;
+}
+
+size_t TwoWire::requestFrom(uint16_t address, size_t size, bool sendStop)
+{
+  (void)sendStop;
+  m_rxIndex = 0;
+  m_rxLength = 0;
+
+  if( size > I2C_BUFFER_LENGTH )
+    size = I2C_BUFFER_LENGTH;
+
+  if( m_bHung )
+  {
+    SimClockAdvance(m_timeOutMs * 1000ULL);
+    return 0;
+  }
+
+  CSimI2CDevice *device = findDevice(address);
+  if( !device )
+  {
+    accountTransfer(0);
+    return 0;
+  }
+
+  m_rxLength = device->onRequest(m_rxBuffer, size);
+  if( m_rxLength > size )
+    m_rxLength = size;
+
+  accountTransfer(m_rxLength);
+  return m_rxLength;
+}
+
+size_t TwoWire::write(uint8_t data)
+{
+  if( !m_bTransmitting || m_txLength >= I2C_BUFFER_LENGTH )
+    return 0;
+
+  m_txBuffer[m_txLength++] = data;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t *data, size_t quantity)
+{
+  size_t n = 0;
+  while( n < quantity && write(data[n]) )
+    n++;
+  return n;
+}
+
+int TwoWire::available()
+{
+  return (int)(m_rxLength - m_rxIndex);
+}
+
+int TwoWire::read()
+{
+  return m_rxIndex < m_rxLength ? m_rxBuffer[m_rxIndex++] : -1;
+}
+
+int TwoWire::peek()
+{
+  return m_rxIndex < m_rxLength ? m_rxBuffer[m_rxIndex] : -1;
+}
+
+void TwoWire::flush()
+{
+  m_rxIndex = m_rxLength = 0;
+  m_txLength = 0;
+}
+
+void TwoWire::attachDevice(uint16_t address, CSimI2CDevice *device)
+{
+  for( int i = 0; i < MAX_DEVICES; i++ )
+  {
+    if( !m_devices[i] || m_deviceAddress[i] == address )
+    {
+      m_deviceAddress[i] = address;
+      m_devices[i] = device;
+      return;
+    }
+  }
+}
+
+void TwoWire::detachDevice(uint16_t address)
+{
+  for( int i = 0; i < MAX_DEVICES; i++ )
+  {
+    if( m_devices[i] && m_deviceAddress[i] == address )
+      m_devices[i] = nullptr;
+  }
+}
+
+CSimI2CDevice *TwoWire::findDevice(uint16_t address)
+{
+  for( int i = 0; i < MAX_DEVICES; i++ )
+  {
+    if( m_devices[i] && m_deviceAddress[i] == address )
+      return m_devices[i];
+  }
+  return nullptr;
+}
+
+void TwoWire::accountTransfer(size_t len)
+{
+  // 9 clocks per byte (8 data + ACK) for the address and the data, plus roughly 2 for start/stop
+  uint64_t ulClocks = (len + 1) * 9 + 2;
+  uint64_t ulTimeUs = ulClocks * 1000000 / m_frequency;
+
+  m_ulBusTimeUs += ulTimeUs;
+  m_ulTransactions++;
+  SimClockAdvance(ulTimeUs);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Arduino.h"
+
+#define I2C_BUFFER_LENGTH 128
+
+// Something living on a simulated bus, the camera slave, the PN7150, the OLED...
+class CSimI2CDevice
+{
+public:
+  virtual ~CSimI2CDevice() {}
+
+  // Master wrote a whole transaction
+  virtual void onReceive(const uint8_t *data, size_t len) = 0;
+  // Master wants len bytes, returns how many the device actually has
+  virtual size_t onRequest(uint8_t *data, size_t len) = 0;
+};
+
+class TwoWire : public Stream
+{
+public:
+  TwoWire(uint8_t busNum);
+
+  bool begin(int sda = -1, int scl = -1, uint32_t frequency = 0);
+  bool end();
+  bool setClock(uint32_t frequency);
+  uint32_t getClock() { return m_frequency; }
+  void setTimeOut(uint16_t timeOutMillis) { m_timeOutMs = timeOutMillis; }
+
+  void beginTransmission(uint16_t address);
+  uint8_t endTransmission(bool sendStop = true);
+  size_t requestFrom(uint16_t address, size_t size, bool sendStop = true);
+
+  size_t write(uint8_t data) override;
+  size_t write(const uint8_t *data, size_t quantity) override;
+  using Print::write;
+
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+
+  /* Simulation side */
+  void attachDevice(uint16_t address, CSimI2CDevice *device);
+  void detachDevice(uint16_t address);
+
+  // Time the transfer of len bytes (plus address byte and start/stop) keeps the bus busy, and also charges it to the clock
+  void accountTransfer(size_t len);
+  uint64_t getBusTimeUs() { return m_ulBusTimeUs; }
+  uint64_t getTransactions() { return m_ulTransactions; }
+  void resetBusTime() { m_ulBusTimeUs = 0; m_ulTransactions = 0; }
+
+  // A slave reset mid-transfer and is holding SDA low: every transaction times out and SDA reads
+  // low until the master restarts the peripheral
+  void SimHang() { m_bHung = true; }
+  bool SimIsHung() { return m_bHung; }
+
+private:
+  CSimI2CDevice *findDevice(uint16_t address);
+
+  uint8_t m_busNum;
+  uint32_t m_frequency = 100000;
+  uint16_t m_timeOutMs = 50;
+  bool m_bHung = false;
+
+  uint16_t m_txAddress = 0;
+  uint8_t m_txBuffer[I2C_BUFFER_LENGTH];
+  size_t m_txLength = 0;
+  bool m_bTransmitting = false;
+
+  uint8_t m_rxBuffer[I2C_BUFFER_LENGTH];
+  size_t m_rxLength = 0;
+  size_t m_rxIndex = 0;
+
+  static const int MAX_DEVICES = 8;
+  uint16_t m_deviceAddress[MAX_DEVICES];
+  CSimI2CDevice *m_devices[MAX_DEVICES] = {};
+
+  uint64_t m_ulBusTimeUs = 0;
+  uint64_t m_ulTransactions = 0;
+};
+
+extern TwoWire Wire;
+extern TwoWire Wire1;
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+#ifndef ESP_OK
+#define ESP_OK 0
+#define ESP_FAIL -1
+#endif
+
+typedef int gpio_num_t;
+
+typedef enum {
+  GPIO_INTR_DISABLE = 0,
+  GPIO_INTR_POSEDGE,
+  GPIO_INTR_NEGEDGE,
+  GPIO_INTR_ANYEDGE,
+  GPIO_INTR_LOW_LEVEL,
+  GPIO_INTR_HIGH_LEVEL
+} gpio_int_type_t;
+
+// Only the light sleep wakeup part, the rest goes through the Arduino pin functions
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type);
+esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num);
+
+// Nothing powers down on the host, holding a pin through deep sleep is a no-op
+inline esp_err_t gpio_hold_en(gpio_num_t gpio_num) { (void)gpio_num; return ESP_OK; }
+inline esp_err_t gpio_hold_dis(gpio_num_t gpio_num) { (void)gpio_num; return ESP_OK; }
+inline void gpio_deep_sleep_hold_en() {}
+inline void gpio_deep_sleep_hold_dis() {}
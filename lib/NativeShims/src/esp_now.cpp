@@ -0,0 +1,82 @@
+#include <string.h>
+#include <vector>
+#include <array>
+
+#include "esp_now.h"
+
+static bool s_bInit = false;
+static esp_now_recv_cb_t s_pRecvCb = nullptr;
+static void (*s_pSendHook)(const uint8_t *mac, const uint8_t *data, int len) = nullptr;
+static std::vector<std::array<uint8_t, ESP_NOW_ETH_ALEN>> s_peers;
+
+esp_err_t esp_now_init()
+{
+  s_bInit = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_deinit()
+{
+  s_bInit = false;
+  s_pRecvCb = nullptr;
+  s_peers.clear();
+  return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb)
+{
+  if( !s_bInit )
+    return ESP_ERR_ESPNOW_NOT_INIT;
+  s_pRecvCb = cb;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+  if( !s_bInit )
+    return ESP_ERR_ESPNOW_NOT_INIT;
+  if( !peer )
+    return ESP_ERR_ESPNOW_ARG;
+
+  if( !esp_now_is_peer_exist(peer->peer_addr) )
+  {
+    std::array<uint8_t, ESP_NOW_ETH_ALEN> addr;
+    memcpy(addr.data(), peer->peer_addr, ESP_NOW_ETH_ALEN);
+    s_peers.push_back(addr);
+  }
+  return ESP_OK;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr)
+{
+  for( auto &addr : s_peers )
+  {
+    if( memcmp(addr.data(), peer_addr, ESP_NOW_ETH_ALEN) == 0 )
+      return true;
+  }
+  return false;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len)
+{
+  // Like the driver, a peer has to be added before sending to it
+  if( !s_bInit )
+    return ESP_ERR_ESPNOW_NOT_INIT;
+  if( !peer_addr || !esp_now_is_peer_exist(peer_addr) || len > ESP_NOW_MAX_DATA_LEN )
+    return ESP_ERR_ESPNOW_ARG;
+
+  if( s_pSendHook )
+    s_pSendHook(peer_addr, data, (int)len);
+  return ESP_OK;
+}
+
+void SimEspNowReceive(const uint8_t *mac, const uint8_t *data, int len)
+{
+  if( s_bInit && s_pRecvCb )
+    s_pRecvCb(mac, data, len);
+}
+
+void SimSetEspNowSendHook(void (*hook)(const uint8_t *mac, const uint8_t *data, int len))
+{
+  s_pSendHook = hook;
+}
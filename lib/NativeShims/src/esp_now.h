@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "driver/gpio.h"
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+#define ESP_NOW_MAX_DATA_LEN 250
+
+#define ESP_ERR_ESPNOW_NOT_INIT 0x3066
+#define ESP_ERR_ESPNOW_ARG 0x3067
+
+typedef enum {
+  WIFI_IF_STA = 0,
+  WIFI_IF_AP
+} wifi_interface_t;
+
+typedef struct {
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[ESP_NOW_KEY_LEN];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void *priv;
+} esp_now_peer_info_t;
+
+typedef void (*esp_now_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+
+esp_err_t esp_now_init();
+esp_err_t esp_now_deinit();
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer);
+bool esp_now_is_peer_exist(const uint8_t *peer_addr);
+// Nothing goes over the air on the host, the send hook gets the frame instead
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len);
+
+/* Simulation side */
+// A frame arrived from mac, runs the receive callback right away
+void SimEspNowReceive(const uint8_t *mac, const uint8_t *data, int len);
+void SimSetEspNowSendHook(void (*hook)(const uint8_t *mac, const uint8_t *data, int len));
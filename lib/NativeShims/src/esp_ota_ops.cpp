@@ -0,0 +1,95 @@
+#include "esp_ota_ops.h"
+
+#define ESP_IMAGE_MAGIC 0xE9
+
+static const esp_partition_t *s_pBoot = nullptr;
+
+// One update at a time, like the firmware does it
+static const esp_partition_t *s_pUpdate = nullptr;
+static size_t s_written = 0;
+static size_t s_erased = 0;
+static esp_ota_handle_t s_handle = 0;
+
+const esp_partition_t *esp_ota_get_running_partition()
+{
+  return esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, nullptr);
+}
+
+const esp_partition_t *esp_ota_get_boot_partition()
+{
+  return s_pBoot ? s_pBoot : esp_ota_get_running_partition();
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+  const esp_partition_t *from = start_from ? start_from : esp_ota_get_running_partition();
+  return esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+    from->subtype == ESP_PARTITION_SUBTYPE_APP_OTA_0 ? ESP_PARTITION_SUBTYPE_APP_OTA_1 : ESP_PARTITION_SUBTYPE_APP_OTA_0, nullptr);
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle)
+{
+  if( !partition || !out_handle || partition == esp_ota_get_running_partition() )
+    return ESP_ERR_INVALID_ARG;
+
+  s_pUpdate = partition;
+  s_written = 0;
+  s_erased = 0;
+  if( image_size != OTA_WITH_SEQUENTIAL_WRITES )
+  {
+    size_t size = image_size == OTA_SIZE_UNKNOWN ? partition->size : image_size;
+    if( size > partition->size )
+      return ESP_ERR_INVALID_SIZE;
+    s_erased = (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    esp_partition_erase_range(partition, 0, s_erased);
+  }
+
+  *out_handle = ++s_handle;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+  if( handle != s_handle || !s_pUpdate )
+    return ESP_ERR_INVALID_ARG;
+  if( size > s_pUpdate->size - s_written )
+    return ESP_ERR_INVALID_SIZE;
+
+  while( s_erased < s_written + size )
+  {
+    esp_partition_erase_range(s_pUpdate, s_erased, SPI_FLASH_SEC_SIZE);
+    s_erased += SPI_FLASH_SEC_SIZE;
+  }
+
+  esp_err_t err = esp_partition_write(s_pUpdate, s_written, data, size);
+  if( err == ESP_OK )
+    s_written += size;
+  return err;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+  if( handle != s_handle || !s_pUpdate )
+    return ESP_ERR_INVALID_ARG;
+
+  uint8_t magic = 0;
+  esp_partition_read(s_pUpdate, 0, &magic, 1);
+  s_pUpdate = nullptr;
+  return s_written && magic == ESP_IMAGE_MAGIC ? ESP_OK : ESP_ERR_OTA_VALIDATE_FAILED;
+}
+
+esp_err_t esp_ota_abort(esp_ota_handle_t handle)
+{
+  if( handle != s_handle )
+    return ESP_ERR_INVALID_ARG;
+  s_pUpdate = nullptr;
+  return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+  if( !partition || partition->type != ESP_PARTITION_TYPE_APP )
+    return ESP_ERR_INVALID_ARG;
+  s_pBoot = partition;
+  return ESP_OK;
+}
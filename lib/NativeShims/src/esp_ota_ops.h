@@ -0,0 +1,22 @@
+#pragma once
+
+#include "esp_partition.h"
+
+#define ESP_ERR_OTA_VALIDATE_FAILED 0x1503
+
+#define OTA_SIZE_UNKNOWN 0xffffffff
+#define OTA_WITH_SEQUENTIAL_WRITES 0xfffffffe
+
+typedef uint32_t esp_ota_handle_t;
+
+// app0 runs on the host until esp_ota_set_boot_partition() says otherwise, there's no reboot to switch.
+// esp_ota_end() only checks the image magic, the real one verifies the whole image
+const esp_partition_t *esp_ota_get_running_partition();
+const esp_partition_t *esp_ota_get_boot_partition();
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from);
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *out_handle);
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size);
+esp_err_t esp_ota_end(esp_ota_handle_t handle);
+esp_err_t esp_ota_abort(esp_ota_handle_t handle);
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition);
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <vector>
+
+#include "esp_partition.h"
+
+struct simPartition {
+  esp_partition_t info;
+  std::vector<uint8_t> data;
+};
+
+// Keep in step with partitions.csv
+static simPartition s_partitions[] = {
+  { { nullptr, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x5000, "nvs", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_OTA, 0xe000, 0x2000, "otadata", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, 0x10000, 0x140000, "app0", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, 0x150000, 0x140000, "app1", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x40, 0x290000, 0x80000, "slavefw", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x41, 0x310000, 0x80000, "capture", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)0x42, 0x390000, 0x20000, "catalog", false }, {} },
+  { { nullptr, ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_COREDUMP, 0x3F0000, 0x10000, "coredump", false }, {} },
+};
+
+static simPartition *Find(const esp_partition_t *partition)
+{
+  for( auto &sim : s_partitions )
+  {
+    if( &sim.info == partition )
+    {
+      // Erased flash is all ones
+      if( sim.data.empty() )
+        sim.data.assign(sim.info.size, 0xFF);
+      return &sim;
+    }
+  }
+  return nullptr;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+  for( auto &sim : s_partitions )
+  {
+    if( type != ESP_PARTITION_TYPE_ANY && sim.info.type != type )
+      continue;
+    if( subtype != ESP_PARTITION_SUBTYPE_ANY && sim.info.subtype != subtype )
+      continue;
+    if( label && strcmp(label, sim.info.label) != 0 )
+      continue;
+    return &sim.info;
+  }
+  return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+  simPartition *sim = Find(partition);
+  if( !sim || !dst )
+    return ESP_ERR_INVALID_ARG;
+  if( src_offset > sim->info.size || size > sim->info.size - src_offset )
+    return ESP_ERR_INVALID_SIZE;
+
+  memcpy(dst, sim->data.data() + src_offset, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+  simPartition *sim = Find(partition);
+  if( !sim || !src )
+    return ESP_ERR_INVALID_ARG;
+  if( dst_offset > sim->info.size || size > sim->info.size - dst_offset )
+    return ESP_ERR_INVALID_SIZE;
+
+  const uint8_t *bytes = (const uint8_t *)src;
+  for( size_t i = 0; i < size; i++ )
+    sim->data[dst_offset + i] &= bytes[i];
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+  simPartition *sim = Find(partition);
+  if( !sim )
+    return ESP_ERR_INVALID_ARG;
+  if( offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE || offset > sim->info.size || size > sim->info.size - offset )
+    return ESP_ERR_INVALID_SIZE;
+
+  memset(sim->data.data() + offset, 0xFF, size);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory,
+  const void **out_ptr, spi_flash_mmap_handle_t *out_handle)
+{
+  (void)memory;
+  simPartition *sim = Find(partition);
+  if( !sim || !out_ptr || !out_handle )
+    return ESP_ERR_INVALID_ARG;
+  if( offset > sim->info.size || size > sim->info.size - offset )
+    return ESP_ERR_INVALID_SIZE;
+
+  *out_ptr = sim->data.data() + offset;
+  *out_handle = 0;
+  return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+  (void)handle;
+}
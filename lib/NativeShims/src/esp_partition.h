@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver/gpio.h"
+
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+  ESP_PARTITION_TYPE_ANY = 0xff
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+  ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+  ESP_PARTITION_SUBTYPE_APP_OTA_1 = 0x11,
+  ESP_PARTITION_SUBTYPE_DATA_OTA = 0x00,
+  ESP_PARTITION_SUBTYPE_DATA_NVS = 0x02,
+  ESP_PARTITION_SUBTYPE_DATA_COREDUMP = 0x03,
+  ESP_PARTITION_SUBTYPE_ANY = 0xff
+} esp_partition_subtype_t;
+
+typedef enum {
+  ESP_PARTITION_MMAP_DATA,
+  ESP_PARTITION_MMAP_INST
+} esp_partition_mmap_memory_t;
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef struct {
+  void *flash_chip;
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+  bool encrypted;
+} esp_partition_t;
+
+// The host has the same partitions as partitions.csv, in memory and erased at start.
+// Writes only clear bits like NOR flash does, so a missing erase shows up as corrupt data
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size);
+// offset and size have to be multiples of SPI_FLASH_SEC_SIZE
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size);
+// Straight into the partition's memory, so like through the flash cache it sees later writes and erases
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size, esp_partition_mmap_memory_t memory,
+  const void **out_ptr, spi_flash_mmap_handle_t *out_handle);
+void spi_flash_munmap(spi_flash_mmap_handle_t handle);
@@ -0,0 +1,106 @@
+#include "Arduino.h"
+#include "esp_sleep.h"
+
+#define NUM_PINS 40
+#define SLEEP_TICK 10 // ms, how often the simulated wakeup sources get checked
+
+static gpio_int_type_t s_iaWakeType[NUM_PINS];
+static bool s_bGpioWakeup = false;
+static uint64_t s_ulTimerWakeupUs = 0;
+static esp_sleep_wakeup_cause_t s_wakeupCause = ESP_SLEEP_WAKEUP_UNDEFINED;
+
+esp_err_t gpio_wakeup_enable(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+  if( gpio_num < 0 || gpio_num >= NUM_PINS || (intr_type != GPIO_INTR_LOW_LEVEL && intr_type != GPIO_INTR_HIGH_LEVEL) )
+    return ESP_FAIL;
+
+  s_iaWakeType[gpio_num] = intr_type;
+  return ESP_OK;
+}
+
+esp_err_t gpio_wakeup_disable(gpio_num_t gpio_num)
+{
+  if( gpio_num < 0 || gpio_num >= NUM_PINS )
+    return ESP_FAIL;
+
+  s_iaWakeType[gpio_num] = GPIO_INTR_DISABLE;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us)
+{
+  s_ulTimerWakeupUs = time_in_us;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_gpio_wakeup()
+{
+  s_bGpioWakeup = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level)
+{
+  (void)gpio_num; (void)level;
+  return ESP_OK;
+}
+
+esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source)
+{
+  if( source == ESP_SLEEP_WAKEUP_ALL || source == ESP_SLEEP_WAKEUP_TIMER )
+    s_ulTimerWakeupUs = 0;
+  if( source == ESP_SLEEP_WAKEUP_ALL || source == ESP_SLEEP_WAKEUP_GPIO )
+    s_bGpioWakeup = false;
+  return ESP_OK;
+}
+
+static bool GpioWakeup()
+{
+  if( !s_bGpioWakeup )
+    return false;
+
+  for( int pin = 0; pin < NUM_PINS; pin++ )
+  {
+    if( (s_iaWakeType[pin] == GPIO_INTR_HIGH_LEVEL && digitalRead(pin) == HIGH)
+      || (s_iaWakeType[pin] == GPIO_INTR_LOW_LEVEL && digitalRead(pin) == LOW) )
+      return true;
+  }
+  return false;
+}
+
+esp_err_t esp_light_sleep_start()
+{
+  unsigned long ulStart = millis();
+  for( ;; )
+  {
+    if( GpioWakeup() )
+    {
+      s_wakeupCause = ESP_SLEEP_WAKEUP_GPIO;
+      return ESP_OK;
+    }
+
+    if( s_ulTimerWakeupUs && (uint64_t)(millis() - ulStart) * 1000 >= s_ulTimerWakeupUs )
+    {
+      s_wakeupCause = ESP_SLEEP_WAKEUP_TIMER;
+      return ESP_OK;
+    }
+
+    // Nothing could ever wake us up
+    if( !s_bGpioWakeup && !s_ulTimerWakeupUs )
+      return ESP_FAIL;
+
+    delay(SLEEP_TICK);
+  }
+}
+
+void esp_deep_sleep_start()
+{
+  Serial.println("esp_deep_sleep_start() called, exiting");
+  Serial.flush();
+  exit(0);
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+  return s_wakeupCause;
+}
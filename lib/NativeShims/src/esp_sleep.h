@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "driver/gpio.h"
+
+typedef enum {
+  ESP_SLEEP_WAKEUP_UNDEFINED = 0,
+  ESP_SLEEP_WAKEUP_ALL,
+  ESP_SLEEP_WAKEUP_EXT0,
+  ESP_SLEEP_WAKEUP_EXT1,
+  ESP_SLEEP_WAKEUP_TIMER,
+  ESP_SLEEP_WAKEUP_TOUCHPAD,
+  ESP_SLEEP_WAKEUP_ULP,
+  ESP_SLEEP_WAKEUP_GPIO
+} esp_sleep_source_t;
+
+typedef esp_sleep_source_t esp_sleep_wakeup_cause_t;
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time_in_us);
+esp_err_t esp_sleep_enable_gpio_wakeup();
+esp_err_t esp_sleep_enable_ext0_wakeup(gpio_num_t gpio_num, int level);
+esp_err_t esp_sleep_disable_wakeup_source(esp_sleep_source_t source);
+
+// Light sleep runs the simulated clock forward until a wakeup source fires
+esp_err_t esp_light_sleep_start();
+// There's no waking up from this on the host, it ends the run like ESP.restart()
+void esp_deep_sleep_start();
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  ESP_RST_UNKNOWN,
+  ESP_RST_POWERON,
+  ESP_RST_EXT,
+  ESP_RST_SW,
+  ESP_RST_PANIC,
+  ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT,
+  ESP_RST_WDT,
+  ESP_RST_DEEPSLEEP,
+  ESP_RST_BROWNOUT,
+  ESP_RST_SDIO
+} esp_reset_reason_t;
+
+// Every run on the host is a fresh power on
+inline esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+
+// xorshift32, the same numbers on every run so the bench stays repeatable
+inline uint32_t esp_random()
+{
+  static uint32_t s_uState = 0x2545F491;
+  s_uState ^= s_uState << 13;
+  s_uState ^= s_uState >> 17;
+  s_uState ^= s_uState << 5;
+  return s_uState;
+}
+
+inline void esp_fill_random(void *buf, size_t len)
+{
+  uint8_t *bytes = (uint8_t *)buf;
+  for( size_t i = 0; i < len; i++ )
+    bytes[i] = (uint8_t)esp_random();
+}
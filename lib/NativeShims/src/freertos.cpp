@@ -0,0 +1,67 @@
+#include <chrono>
+#include <thread>
+
+#include "Arduino.h"
+#include "freertos/task.h"
+
+static int s_iLoopTask;
+static const std::thread::id s_mainThread = std::this_thread::get_id();
+static uint32_t s_uNotifyCount = 0;
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  return &s_iLoopTask;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+  UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, BaseType_t xCoreID)
+{
+  (void)pcName; (void)usStackDepth; (void)uxPriority; (void)xCoreID;
+
+  std::thread *thread = new std::thread(pvTaskCode, pvParameters);
+  thread->detach();
+  if( pvCreatedTask )
+    *pvCreatedTask = thread;
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+  if( std::this_thread::get_id() == s_mainThread )
+    delay(xTicksToDelay);
+  else
+    std::this_thread::sleep_for(std::chrono::milliseconds(xTicksToDelay));
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t xTask)
+{
+  (void)xTask;
+  return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+  (void)xTaskToNotify;
+  s_uNotifyCount++;
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t *pxHigherPriorityTaskWoken)
+{
+  (void)xTaskToNotify;
+  s_uNotifyCount++;
+  if( pxHigherPriorityTaskWoken )
+    *pxHigherPriorityTaskWoken = pdFALSE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+  unsigned long ulStart = millis();
+  while( s_uNotifyCount == 0 && millis() - ulStart < xTicksToWait )
+    delay(1);
+
+  uint32_t uCount = s_uNotifyCount;
+  if( uCount )
+    s_uNotifyCount = xClearCountOnExit ? 0 : uCount - 1;
+  return uCount;
+}
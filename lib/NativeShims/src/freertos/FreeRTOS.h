@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// The host runs the firmware on a single thread, a tick is a millisecond like on the device
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define portMAX_DELAY (TickType_t)0xFFFFFFFF
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define portYIELD_FROM_ISR(...)
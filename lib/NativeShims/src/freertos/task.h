@@ -0,0 +1,23 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define tskIDLE_PRIORITY 0
+
+// Tasks other than loop() get a real thread, their vTaskDelay() sleeps for real instead of moving the simulated clock
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char *pcName, uint32_t usStackDepth, void *pvParameters,
+  UBaseType_t uxPriority, TaskHandle_t *pvCreatedTask, BaseType_t xCoreID);
+void vTaskDelay(TickType_t xTicksToDelay);
+
+TaskHandle_t xTaskGetCurrentTaskHandle();
+// There's no fixed stack to run out of on the host
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t xTask);
+
+// Only the loop task exists, so there's only one notification count. Waiting
+// moves the simulated clock along, which is when the simulated ISRs fire
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify);
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t *pxHigherPriorityTaskWoken);
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait);
@@ -0,0 +1,519 @@
+#include <string.h>
+
+#include "mbedtls/ssl.h"
+
+// env:native_micro links the host's mbedTLS for these, only the TLS stand-in below is left
+#ifndef NATIVE_HOST_MBEDTLS
+
+#include "mbedtls/base64.h"
+#include "mbedtls/md.h"
+#include "mbedtls/sha256.h"
+
+/* SHA-256, FIPS 180-4 */
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_process(mbedtls_sha256_context *ctx, const unsigned char data[64])
+{
+  uint32_t W[64];
+  for( int i = 0; i < 16; i++ )
+    W[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) | ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+  for( int i = 16; i < 64; i++ )
+  {
+    uint32_t s0 = ROTR(W[i - 15], 7) ^ ROTR(W[i - 15], 18) ^ (W[i - 15] >> 3);
+    uint32_t s1 = ROTR(W[i - 2], 17) ^ ROTR(W[i - 2], 19) ^ (W[i - 2] >> 10);
+    W[i] = W[i - 16] + s0 + W[i - 7] + s1;
+  }
+
+  uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+  uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+
+  for( int i = 0; i < 64; i++ )
+  {
+    uint32_t S1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + S1 + ch + K[i] + W[i];
+    uint32_t S0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t t2 = S0 + maj;
+
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+  ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+  static const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  if( is224 )
+    return -1;
+
+  ctx->total[0] = ctx->total[1] = 0;
+  memcpy(ctx->state, init, sizeof(init));
+  return 0;
+}
+
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+  size_t fill = ctx->total[0] & 0x3F;
+
+  ctx->total[0] += (uint32_t)ilen;
+  if( ctx->total[0] < (uint32_t)ilen )
+    ctx->total[1]++;
+
+  while( ilen > 0 )
+  {
+    size_t n = 64 - fill < ilen ? 64 - fill : ilen;
+    memcpy(ctx->buffer + fill, input, n);
+    fill += n;
+    input += n;
+    ilen -= n;
+
+    if( fill == 64 )
+    {
+      sha256_process(ctx, ctx->buffer);
+      fill = 0;
+    }
+  }
+  return 0;
+}
+
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+  uint64_t bits = ((uint64_t)ctx->total[1] << 32 | ctx->total[0]) * 8;
+
+  unsigned char pad = 0x80;
+  mbedtls_sha256_update(ctx, &pad, 1);
+  pad = 0;
+  while( (ctx->total[0] & 0x3F) != 56 )
+    mbedtls_sha256_update(ctx, &pad, 1);
+
+  unsigned char len[8];
+  for( int i = 0; i < 8; i++ )
+    len[i] = (unsigned char)(bits >> (56 - i * 8));
+  mbedtls_sha256_update(ctx, len, 8);
+
+  for( int i = 0; i < 8; i++ )
+  {
+    output[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+    output[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+    output[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+    output[i * 4 + 3] = (unsigned char)(ctx->state[i]);
+  }
+  return 0;
+}
+
+int mbedtls_sha256(const unsigned char *input, size_t ilen, unsigned char output[32], int is224)
+{
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  int ret = mbedtls_sha256_starts(&ctx, is224);
+  if( ret == 0 )
+  {
+    mbedtls_sha256_update(&ctx, input, ilen);
+    mbedtls_sha256_finish(&ctx, output);
+  }
+  mbedtls_sha256_free(&ctx);
+  return ret;
+}
+
+/* Message digest / HMAC, SHA-256 only */
+
+static const mbedtls_md_info_t s_sha256Info = { MBEDTLS_MD_SHA256, 32 };
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t md_type)
+{
+  return md_type == MBEDTLS_MD_SHA256 ? &s_sha256Info : NULL;
+}
+
+unsigned char mbedtls_md_get_size(const mbedtls_md_info_t *md_info)
+{
+  return md_info ? md_info->size : 0;
+}
+
+void mbedtls_md_init(mbedtls_md_context_t *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_md_free(mbedtls_md_context_t *ctx)
+{
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_md_setup(mbedtls_md_context_t *ctx, const mbedtls_md_info_t *md_info, int hmac)
+{
+  if( !md_info )
+    return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+
+  ctx->md_info = md_info;
+  ctx->hmac = hmac;
+  return 0;
+}
+
+int mbedtls_md_starts(mbedtls_md_context_t *ctx)
+{
+  return ctx->md_info ? mbedtls_sha256_starts(&ctx->sha, 0) : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
+
+int mbedtls_md_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen)
+{
+  return ctx->md_info ? mbedtls_sha256_update(&ctx->sha, input, ilen) : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
+
+int mbedtls_md_finish(mbedtls_md_context_t *ctx, unsigned char *output)
+{
+  return ctx->md_info ? mbedtls_sha256_finish(&ctx->sha, output) : MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+}
+
+int mbedtls_md_hmac_starts(mbedtls_md_context_t *ctx, const unsigned char *key, size_t keylen)
+{
+  if( !ctx->md_info || !ctx->hmac )
+    return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+
+  unsigned char sum[32];
+  if( keylen > 64 )
+  {
+    mbedtls_sha256(key, keylen, sum, 0);
+    key = sum;
+    keylen = 32;
+  }
+
+  memset(ctx->ipad, 0x36, 64);
+  memset(ctx->opad, 0x5C, 64);
+  for( size_t i = 0; i < keylen; i++ )
+  {
+    ctx->ipad[i] ^= key[i];
+    ctx->opad[i] ^= key[i];
+  }
+
+  mbedtls_sha256_starts(&ctx->sha, 0);
+  return mbedtls_sha256_update(&ctx->sha, ctx->ipad, 64);
+}
+
+int mbedtls_md_hmac_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen)
+{
+  return mbedtls_md_update(ctx, input, ilen);
+}
+
+int mbedtls_md_hmac_finish(mbedtls_md_context_t *ctx, unsigned char *output)
+{
+  if( !ctx->md_info || !ctx->hmac )
+    return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+
+  unsigned char inner[32];
+  mbedtls_sha256_finish(&ctx->sha, inner);
+
+  mbedtls_sha256_starts(&ctx->sha, 0);
+  mbedtls_sha256_update(&ctx->sha, ctx->opad, 64);
+  mbedtls_sha256_update(&ctx->sha, inner, 32);
+  return mbedtls_sha256_finish(&ctx->sha, output);
+}
+
+/* Base64 */
+
+static const char s_b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+  size_t n = (slen + 2) / 3 * 4;
+  if( dlen < n + 1 )
+  {
+    *olen = n + 1;
+    return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+  }
+
+  unsigned char *p = dst;
+  size_t i;
+  for( i = 0; i + 2 < slen; i += 3 )
+  {
+    uint32_t v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+    *p++ = s_b64[(v >> 18) & 0x3F];
+    *p++ = s_b64[(v >> 12) & 0x3F];
+    *p++ = s_b64[(v >> 6) & 0x3F];
+    *p++ = s_b64[v & 0x3F];
+  }
+
+  if( i < slen )
+  {
+    uint32_t v = src[i] << 16;
+    if( i + 1 < slen )
+      v |= src[i + 1] << 8;
+
+    *p++ = s_b64[(v >> 18) & 0x3F];
+    *p++ = s_b64[(v >> 12) & 0x3F];
+    *p++ = i + 1 < slen ? s_b64[(v >> 6) & 0x3F] : '=';
+    *p++ = '=';
+  }
+
+  *p = 0;
+  *olen = p - dst;
+  return 0;
+}
+
+int mbedtls_base64_decode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen)
+{
+  uint32_t v = 0;
+  int bits = 0;
+  size_t n = 0;
+
+  for( size_t i = 0; i < slen; i++ )
+  {
+    if( src[i] == '=' )
+      break;
+
+    const char *pos = (const char *)memchr(s_b64, src[i], 64);
+    if( !pos || !src[i] )
+      return MBEDTLS_ERR_BASE64_INVALID_CHARACTER;
+
+    v = (v << 6) | (uint32_t)(pos - s_b64);
+    bits += 6;
+    if( bits >= 8 )
+    {
+      bits -= 8;
+      if( n >= dlen )
+      {
+        *olen = n + 1;
+        return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+      }
+      dst[n++] = (unsigned char)(v >> bits);
+    }
+  }
+
+  *olen = n;
+  return 0;
+}
+
+#endif
+
+/* TLS, without the TLS */
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt)
+{
+  memset(crt, 0, sizeof(*crt));
+}
+
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt)
+{
+  memset(crt, 0, sizeof(*crt));
+}
+
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen)
+{
+  if( !buf || !buflen )
+    return -1;
+  chain->parsed = 1;
+  return 0;
+}
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config *conf)
+{
+  memset(conf, 0, sizeof(*conf));
+}
+
+void mbedtls_ssl_config_free(mbedtls_ssl_config *conf)
+{
+  memset(conf, 0, sizeof(*conf));
+}
+
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset)
+{
+  (void)endpoint; (void)transport; (void)preset;
+  conf->session_tickets = MBEDTLS_SSL_SESSION_TICKETS_ENABLED;
+  return 0;
+}
+
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode)
+{
+  conf->authmode = authmode;
+}
+
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+  conf->f_rng = f_rng;
+  conf->p_rng = p_rng;
+}
+
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, mbedtls_x509_crl *ca_crl)
+{
+  (void)ca_crl;
+  conf->ca_chain = ca_chain;
+}
+
+void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *conf, int use_tickets)
+{
+  conf->session_tickets = use_tickets;
+}
+
+void mbedtls_ssl_init(mbedtls_ssl_context *ssl)
+{
+  memset(ssl, 0, sizeof(*ssl));
+}
+
+void mbedtls_ssl_free(mbedtls_ssl_context *ssl)
+{
+  memset(ssl, 0, sizeof(*ssl));
+}
+
+int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf)
+{
+  ssl->conf = conf;
+  ssl->state = MBEDTLS_SSL_HELLO_REQUEST;
+  return 0;
+}
+
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname)
+{
+  (void)ssl; (void)hostname;
+  return 0;
+}
+
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send, mbedtls_ssl_recv_t *f_recv,
+  mbedtls_ssl_recv_timeout_t *f_recv_timeout)
+{
+  (void)f_recv_timeout;
+  ssl->p_bio = p_bio;
+  ssl->f_send = f_send;
+  ssl->f_recv = f_recv;
+}
+
+int mbedtls_ssl_handshake_step(mbedtls_ssl_context *ssl)
+{
+  if( !ssl->conf || ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+
+  if( ssl->state == MBEDTLS_SSL_HELLO_REQUEST )
+  {
+    if( ssl->offered )
+    {
+      ssl->state = MBEDTLS_SSL_SERVER_CHANGE_CIPHER_SPEC;
+      return 0;
+    }
+
+    ssl->session.id_len = sizeof(ssl->session.id);
+    if( ssl->conf->f_rng )
+      ssl->conf->f_rng(ssl->conf->p_rng, ssl->session.id, ssl->session.id_len);
+    ssl->state = MBEDTLS_SSL_SERVER_CERTIFICATE;
+    return 0;
+  }
+
+  ssl->state = MBEDTLS_SSL_HANDSHAKE_OVER;
+  return 0;
+}
+
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len)
+{
+  if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+
+  // Stands in for a record, what's been read off the socket but not handed out yet
+  if( ssl->in_off == ssl->in_len )
+  {
+    int n = ssl->f_recv(ssl->p_bio, ssl->in, sizeof(ssl->in));
+    if( n == 0 )
+      return MBEDTLS_ERR_SSL_CONN_EOF;
+    if( n < 0 )
+      return n;
+    ssl->in_off = 0;
+    ssl->in_len = n;
+  }
+
+  size_t n = ssl->in_len - ssl->in_off;
+  if( n > len )
+    n = len;
+  if( n )
+    memcpy(buf, ssl->in + ssl->in_off, n);
+  ssl->in_off += n;
+  return (int)n;
+}
+
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len)
+{
+  if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+  return ssl->f_send(ssl->p_bio, buf, len);
+}
+
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl)
+{
+  return ssl->in_len - ssl->in_off;
+}
+
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl)
+{
+  (void)ssl;
+  return 0;
+}
+
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session)
+{
+  memset(session, 0, sizeof(*session));
+}
+
+void mbedtls_ssl_session_free(mbedtls_ssl_session *session)
+{
+  memset(session, 0, sizeof(*session));
+}
+
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session)
+{
+  if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER || !ssl->session.id_len )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+  *session = ssl->session;
+  return 0;
+}
+
+int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session)
+{
+  if( ssl->state != MBEDTLS_SSL_HELLO_REQUEST || !session->id_len )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+  ssl->session = *session;
+  ssl->offered = 1;
+  return 0;
+}
+
+int mbedtls_ssl_session_save(const mbedtls_ssl_session *session, unsigned char *buf, size_t buf_len, size_t *olen)
+{
+  *olen = 1 + session->id_len;
+  if( buf_len < *olen )
+    return MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL;
+  buf[0] = (unsigned char)session->id_len;
+  memcpy(buf + 1, session->id, session->id_len);
+  return 0;
+}
+
+int mbedtls_ssl_session_load(mbedtls_ssl_session *session, const unsigned char *buf, size_t len)
+{
+  if( len < 1 || buf[0] > sizeof(session->id) || len != 1 + (size_t)buf[0] )
+    return MBEDTLS_ERR_SSL_BAD_INPUT_DATA;
+  session->id_len = buf[0];
+  memcpy(session->id, buf + 1, session->id_len);
+  return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// env:native_micro times the host's own mbedTLS instead, see bench/micro/micro_bench.cpp
+#ifdef NATIVE_HOST_MBEDTLS
+#include_next <mbedtls/base64.h>
+#else
+#include <stddef.h>
+
+#define MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL -0x002A
+#define MBEDTLS_ERR_BASE64_INVALID_CHARACTER -0x002C
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen);
+int mbedtls_base64_decode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
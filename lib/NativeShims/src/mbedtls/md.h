@@ -0,0 +1,53 @@
+#pragma once
+
+// env:native_micro times the host's own mbedTLS instead, see bench/micro/micro_bench.cpp
+#ifdef NATIVE_HOST_MBEDTLS
+#include_next <mbedtls/md.h>
+#else
+#include "sha256.h"
+
+#define MBEDTLS_ERR_MD_BAD_INPUT_DATA -0x5100
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Only SHA-256 exists on the host, that's all the firmware signs or hashes with
+typedef enum {
+  MBEDTLS_MD_NONE = 0,
+  MBEDTLS_MD_SHA256 = 6
+} mbedtls_md_type_t;
+
+typedef struct {
+  mbedtls_md_type_t type;
+  unsigned char size;
+} mbedtls_md_info_t;
+
+typedef struct {
+  const mbedtls_md_info_t *md_info;
+  mbedtls_sha256_context sha;
+  unsigned char ipad[64];
+  unsigned char opad[64];
+  int hmac;
+} mbedtls_md_context_t;
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t md_type);
+unsigned char mbedtls_md_get_size(const mbedtls_md_info_t *md_info);
+
+void mbedtls_md_init(mbedtls_md_context_t *ctx);
+void mbedtls_md_free(mbedtls_md_context_t *ctx);
+int mbedtls_md_setup(mbedtls_md_context_t *ctx, const mbedtls_md_info_t *md_info, int hmac);
+
+int mbedtls_md_starts(mbedtls_md_context_t *ctx);
+int mbedtls_md_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen);
+int mbedtls_md_finish(mbedtls_md_context_t *ctx, unsigned char *output);
+
+int mbedtls_md_hmac_starts(mbedtls_md_context_t *ctx, const unsigned char *key, size_t keylen);
+int mbedtls_md_hmac_update(mbedtls_md_context_t *ctx, const unsigned char *input, size_t ilen);
+int mbedtls_md_hmac_finish(mbedtls_md_context_t *ctx, unsigned char *output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
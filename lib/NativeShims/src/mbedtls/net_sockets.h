@@ -0,0 +1,6 @@
+#pragma once
+
+// Just the error codes, the firmware does its own TCP through WiFiClient
+#define MBEDTLS_ERR_NET_CONN_RESET -0x0050
+#define MBEDTLS_ERR_NET_SEND_FAILED -0x004E
+#define MBEDTLS_ERR_NET_RECV_FAILED -0x004C
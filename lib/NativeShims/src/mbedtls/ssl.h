@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "x509_crt.h"
+
+#define MBEDTLS_SSL_SESSION_TICKETS
+
+#define MBEDTLS_ERR_SSL_BAD_INPUT_DATA -0x7100
+#define MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL -0x6A00
+#define MBEDTLS_ERR_SSL_CONN_EOF -0x7280
+#define MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY -0x7880
+#define MBEDTLS_ERR_SSL_WANT_READ -0x6900
+#define MBEDTLS_ERR_SSL_WANT_WRITE -0x6880
+
+#define MBEDTLS_SSL_IS_CLIENT 0
+#define MBEDTLS_SSL_TRANSPORT_STREAM 0
+#define MBEDTLS_SSL_PRESET_DEFAULT 0
+#define MBEDTLS_SSL_VERIFY_REQUIRED 2
+#define MBEDTLS_SSL_SESSION_TICKETS_ENABLED 1
+
+#define MBEDTLS_SSL_SIM_RECORD 1024
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The states mbedTLS 2.x steps through, a client that resumes skips from the ServerHello to the server's
+// ChangeCipherSpec. Only the ones a shim handshake goes through are here
+typedef enum {
+  MBEDTLS_SSL_HELLO_REQUEST = 0,
+  MBEDTLS_SSL_SERVER_CERTIFICATE = 3,
+  MBEDTLS_SSL_SERVER_CHANGE_CIPHER_SPEC = 12,
+  MBEDTLS_SSL_HANDSHAKE_OVER = 16
+} mbedtls_ssl_states;
+
+typedef int mbedtls_ssl_send_t(void *ctx, const unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_t(void *ctx, unsigned char *buf, size_t len);
+typedef int mbedtls_ssl_recv_timeout_t(void *ctx, unsigned char *buf, size_t len, uint32_t timeout);
+
+typedef struct mbedtls_ssl_session {
+  unsigned char id[32];
+  size_t id_len;
+} mbedtls_ssl_session;
+
+typedef struct mbedtls_ssl_config {
+  int authmode;
+  int (*f_rng)(void *, unsigned char *, size_t);
+  void *p_rng;
+  const mbedtls_x509_crt *ca_chain;
+  int session_tickets;
+} mbedtls_ssl_config;
+
+// No TLS on the host, records go over the bio as they are. A handshake hands out a session ID,
+// and one that's offered back is always taken, so resumption runs the same path as on the hub
+typedef struct mbedtls_ssl_context {
+  const mbedtls_ssl_config *conf;
+  int state;
+  void *p_bio;
+  mbedtls_ssl_send_t *f_send;
+  mbedtls_ssl_recv_t *f_recv;
+  mbedtls_ssl_session session;
+  int offered;
+  unsigned char in[MBEDTLS_SSL_SIM_RECORD];
+  size_t in_off;
+  size_t in_len;
+} mbedtls_ssl_context;
+
+void mbedtls_ssl_config_init(mbedtls_ssl_config *conf);
+void mbedtls_ssl_config_free(mbedtls_ssl_config *conf);
+int mbedtls_ssl_config_defaults(mbedtls_ssl_config *conf, int endpoint, int transport, int preset);
+void mbedtls_ssl_conf_authmode(mbedtls_ssl_config *conf, int authmode);
+void mbedtls_ssl_conf_rng(mbedtls_ssl_config *conf, int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config *conf, mbedtls_x509_crt *ca_chain, mbedtls_x509_crl *ca_crl);
+void mbedtls_ssl_conf_session_tickets(mbedtls_ssl_config *conf, int use_tickets);
+
+void mbedtls_ssl_init(mbedtls_ssl_context *ssl);
+void mbedtls_ssl_free(mbedtls_ssl_context *ssl);
+int mbedtls_ssl_setup(mbedtls_ssl_context *ssl, const mbedtls_ssl_config *conf);
+int mbedtls_ssl_set_hostname(mbedtls_ssl_context *ssl, const char *hostname);
+void mbedtls_ssl_set_bio(mbedtls_ssl_context *ssl, void *p_bio, mbedtls_ssl_send_t *f_send, mbedtls_ssl_recv_t *f_recv,
+  mbedtls_ssl_recv_timeout_t *f_recv_timeout);
+int mbedtls_ssl_handshake_step(mbedtls_ssl_context *ssl);
+int mbedtls_ssl_read(mbedtls_ssl_context *ssl, unsigned char *buf, size_t len);
+int mbedtls_ssl_write(mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len);
+size_t mbedtls_ssl_get_bytes_avail(const mbedtls_ssl_context *ssl);
+int mbedtls_ssl_close_notify(mbedtls_ssl_context *ssl);
+
+void mbedtls_ssl_session_init(mbedtls_ssl_session *session);
+void mbedtls_ssl_session_free(mbedtls_ssl_session *session);
+int mbedtls_ssl_get_session(const mbedtls_ssl_context *ssl, mbedtls_ssl_session *session);
+int mbedtls_ssl_set_session(mbedtls_ssl_context *ssl, const mbedtls_ssl_session *session);
+int mbedtls_ssl_session_save(const mbedtls_ssl_session *session, unsigned char *buf, size_t buf_len, size_t *olen);
+int mbedtls_ssl_session_load(mbedtls_ssl_session *session, const unsigned char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
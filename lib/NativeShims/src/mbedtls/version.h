@@ -0,0 +1,5 @@
+#pragma once
+
+// The shim follows the 2.28 API, as arduino-esp32 2.x ships it
+#define MBEDTLS_VERSION_NUMBER 0x021C0300
+#define MBEDTLS_VERSION_STRING "2.28.3"
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Nothing gets verified on the host, a parsed certificate is just remembered as parsed
+typedef struct mbedtls_x509_crt {
+  int parsed;
+} mbedtls_x509_crt;
+
+typedef struct mbedtls_x509_crl mbedtls_x509_crl;
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt *crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt *crt);
+int mbedtls_x509_crt_parse(mbedtls_x509_crt *chain, const unsigned char *buf, size_t buflen);
+
+#ifdef __cplusplus
+}
+#endif
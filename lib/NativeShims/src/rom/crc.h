@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+// Same as the ESP32 ROM's, CRC-32 (IEEE 802.3) with the inversion done inside,
+// so crc32_le(0, ...) is the usual CRC and the result can be passed back in to continue it
+static inline uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+  crc = ~crc;
+  for( uint32_t i = 0; i < len; i++ )
+  {
+    crc ^= buf[i];
+    for( int j = 0; j < 8; j++ )
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
@@ -1,47 +1,81 @@
 #include <Arduino.h>
 #include <iothub.h>
+#include <Preferences.h>
 
 #include <azure_ca.h>
 
 #include "IotSettings.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+#include "slavefw.h"
+#include "ota.h"
+#include "capture.h"
+#include "tlsroots.h"
+#include "catalog.h"
+
+#define TWIN_TOPIC_PREFIX "$iothub/twin/"
+
+#define TLS_HANDSHAKE_TIMEOUT 10    // seconds
+#define RECONNECT_BACKOFF_MIN 500   // ms
+#define RECONNECT_BACKOFF_MAX 5000  // ms
+#define TWIN_RESPONSE_TIMEOUT 10000 // ms
+
+// PubSubClient only takes a plain function as the callback, so it needs a way back to the hub object
+static CIoTHub *s_pIoTHub = NULL;
 
 // MQTT is a publish-subscribe based, therefore a callback function is called whenever something is published on a topic that device is subscribed to
 void callback(char *topic, byte *payload, unsigned int length)
 {
-    // It's also a binary-safe protocol, therefore instead of transfering text,
-    // bytes are transfered and they aren't null terminated - so we need ot add \0 to terminate the string 
-    payload[length] = '\0'; 
-     // After it's been terminated, it can be converted to String
-    String message = String((char *)payload);
+    if( s_pIoTHub && strncmp(topic, TWIN_TOPIC_PREFIX, strlen(TWIN_TOPIC_PREFIX)) == 0 )
+    {
+        s_pIoTHub->handleTwinMessage(topic, payload, length);
+        return;
+    }
+
+    if( s_pIoTHub && s_pIoTHub->handleMethodMessage(topic, payload, length) )
+        return;
 
-    Serial.printf("Callback: %s: %s\n", topic, message.c_str());
+    if( s_pIoTHub && s_pIoTHub->handleC2DMessage(topic, payload, length) )
+        return;
+
+    // It's also a binary-safe protocol, therefore instead of transfering text,
+    // bytes are transfered and they aren't null terminated - so we print just as much as we got
+    LOGI(LOG_MOD_HUB, "Callback: %s: %.*s", topic, (int)length, (const char *)payload);
 }
 
-CIoTHub::CIoTHub()
-{
+CIoTHub::CIoTHub() :
     // Authentication token for our specific device
-    sasToken = new AzIoTSasToken(
-	&client, az_span_create_from_str(const_cast<char*>(deviceKey)),
-	AZ_SPAN_FROM_BUFFER(sasSignatureBuffer),
-	AZ_SPAN_FROM_BUFFER(
-		mqttPasswordBuffer));
-
-    mqttClient = new PubSubClient(wifiClient);
+    sasToken(&client, az_span_create_from_str(const_cast<char*>(deviceKey)),
+        AZ_SPAN_FROM_BUFFER(sasSignatureBuffer),
+        AZ_SPAN_FROM_BUFFER(mqttPasswordBuffer)),
+    mqttClient(wifiClient)
+{
+    s_pIoTHub = this;
 }
 
 CIoTHub::~CIoTHub()
 {
-    if( sasToken )
-        delete sasToken;
-
-    if( mqttClient )
-        delete mqttClient;
+    if( s_pIoTHub == this )
+        s_pIoTHub = NULL;
 }
 
 bool CIoTHub::initIoTHub()
 {
-    // We are using TLS to secure the connection, therefore we need to supply a certificate (in the SDK)
-    wifiClient.setCACert((const char*)ca_pem); 
+    // We are using TLS to secure the connection, therefore we need to supply a certificate (in the SDK).
+    // Pinned, only the hub's roots out of it in a bundle made at build time, the whole thing goes in as a fallback
+    int iRoots = 0;
+    const uint8_t *bundle = g_Config.iTlsPinnedRoots ? tlsGetPinnedBundle(&iRoots) : nullptr;
+    if( bundle )
+        wifiClient.setCACertBundle(bundle);
+    else
+    {
+        if( g_Config.iTlsPinnedRoots )
+            LOGW(LOG_MOD_HUB, "None of the pinned roots in the CA bundle, trusting all of it");
+        wifiClient.setCACert((const char*)ca_pem); 
+    }
+    // Default is 120 seconds, way too long to sit blocked on a dead AP
+    wifiClient.setHandshakeTimeout(TLS_HANDSHAKE_TIMEOUT);
 
     // Get a default instance of IoT Hub client options
     az_iot_hub_client_options options = az_iot_hub_client_options_default(); 
@@ -52,7 +86,7 @@ bool CIoTHub::initIoTHub()
             az_span_create((unsigned char *)deviceId, strlen(deviceId)),
             &options)))
     {
-        Serial.println("ERROR: Failed initializing Azure IoT Hub client");
+        LOGE(LOG_MOD_HUB, "Failed initializing Azure IoT Hub client");
         return false;
     }
 
@@ -60,7 +94,7 @@ bool CIoTHub::initIoTHub()
     if (az_result_failed(az_iot_hub_client_get_client_id(
             &client, mqttClientId, sizeof(mqttClientId) - 1, &client_id_length))) // Get the actual client ID (not our internal ID) for the device
     {
-        Serial.println("ERROR: Failed getting client id");
+        LOGE(LOG_MOD_HUB, "Failed getting client id");
         return false;
     }
 
@@ -68,99 +102,548 @@ bool CIoTHub::initIoTHub()
     if (az_result_failed(az_iot_hub_client_get_user_name(
             &client, mqttUsername, sizeof(mqttUsername), &mqttUsernameSize))) // Get the MQTT username for our device
     {
-        Serial.println("ERROR: Failed to get MQTT username ");
+        LOGE(LOG_MOD_HUB, "Failed to get MQTT username");
         return false;
     }
 
-    Serial.println("Great success");
-    Serial.printf("Client ID: %s\n", mqttClientId);
-    Serial.printf("Username: %s\n", mqttUsername);
+    LOGI(LOG_MOD_HUB, "Great success");
+    LOGI(LOG_MOD_HUB, "Client ID: %s", mqttClientId);
+    LOGD(LOG_MOD_HUB, "Username: %s", mqttUsername);
 
-    connectMQTT();
-    mqttReconnect();
+    // The receive topic isn't hardcoded and depends on chosen properties, therefore we need to use az_iot_hub_client_telemetry_get_publish_topic()
+    if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&client, NULL, publishTopic, sizeof(publishTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting publish topic");
+        return false;
+    }
+
+    // Same topic with a property on it, so routing can keep diagnostics apart from the ratings
+    az_iot_message_properties properties;
+    uint8_t propertiesBuffer[32];
+    if (az_result_failed(az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(propertiesBuffer), 0))
+        || az_result_failed(az_iot_message_properties_append(&properties, AZ_SPAN_FROM_STR("type"), AZ_SPAN_FROM_STR("diagnostics")))
+        || az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&client, &properties, diagTopic, sizeof(diagTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting diagnostics topic");
+        return false;
+    }
+
+    if (az_result_failed(az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(propertiesBuffer), 0))
+        || az_result_failed(az_iot_message_properties_append(&properties, AZ_SPAN_FROM_STR("type"), AZ_SPAN_FROM_STR("summary")))
+        || az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&client, &properties, summaryTopic, sizeof(summaryTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting summary topic");
+        return false;
+    }
 
-    sendTestMessageToIoTHub();
+    // The default size is defined in MQTT_MAX_PACKET_SIZE to be 256 bytes, which is too small for Azure MQTT messages,
+    // therefore needs to be increased or it will just crash without any info.
+    // PubSubClient reallocates it on every call, so it's sized once here while we're still in setup()
+    if( !mqttClient.setBufferSize(g_Config.iMqttBufferSize) )
+    {
+        LOGE(LOG_MOD_HUB, "Failed allocating the MQTT buffer");
+        return false;
+    }
 
+    // Don't wait for Wi-Fi and SNTP here, loop() connects as soon as both are up
+    // and the station takes customers in the meantime
     return true;
 }
 
 bool CIoTHub::connectMQTT()
 {
-    // The default size is defined in MQTT_MAX_PACKET_SIZE to be 256 bytes, which is too small for Azure MQTT messages,
-    //therefore needs to be increased or it will just crash without any info
-    mqttClient->setBufferSize(1024); 
-
     // SAS tokens need to be generated in order to generate a password for the connection
-    if (sasToken->Generate(tokenDuration) != 0) 
+    if (sasToken.Generate(g_Config.iTokenDuration) != 0) 
     {
-        Serial.println("Error: Failed generating SAS token");
+        LOGE(LOG_MOD_HUB, "Failed generating SAS token");
         return false;
     }
     else
-        Serial.println("SAS token generated");
+        LOGI(LOG_MOD_HUB, "SAS token generated");
 
-    mqttClient->setServer(iotHubHost, mqttPort);
-    mqttClient->setCallback(callback);
+    mqttClient.setServer(iotHubHost, mqttPort);
+    mqttClient.setCallback(callback);
 
     return true;
 }
 
-void CIoTHub::mqttReconnect() 
+int CIoTHub::mqttReconnect() 
 {
-    while (!mqttClient->connected())
+    if( mqttClient.connected() )
+        return HUB_CONNECT_DONE;
+
+    // Open the TLS connection ourselves so the handshake can be timed on its own, and taken a step per loop()
+    // instead of waiting out the hub's round trips. PubSubClient just keeps using the socket once it's connected
+    if( !wifiClient.connected() )
     {
-        Serial.println("Attempting MQTT connection...");
-        // Just in case that the SAS token has been regenerated since the last MQTT connection, get it again
-        const char *mqttPassword = (const char *)az_span_ptr(sasToken->Get()); 
-        Serial.println(mqttClientId);
-        Serial.println(mqttUsername);
-        Serial.println(mqttPassword);
-        // Either connect or wait for 5 seconds (we can block here since without IoT Hub connection we can't do much)
-        if (mqttClient->connect(mqttClientId, mqttUsername, mqttPassword)) 
+        if( !wifiClient.isConnecting() )
         {
-            Serial.println("MQTT connected");
-            // If connected, (re)subscribe to the topic where we can receive messages sent from the IoT Hub 
-            mqttClient->subscribe(mqttC2DTopic); 
-        } 
-        else 
+            LOGI(LOG_MOD_HUB, "Attempting MQTT connection...");
+            TRACE_SCOPE("tls start");
+
+            // Only the lowest point since boot is kept, so the handshake's own peak is only known if it set a new one
+            uHandshakeFreeBefore = ESP.getFreeHeap();
+            uHandshakeMinBefore = ESP.getMinFreeHeap();
+            if( !wifiClient.connectStart(iotHubHost, mqttPort) )
+            {
+                stats.iFailures++;
+                LOGW(LOG_MOD_HUB, "TCP connection failed");
+                return HUB_CONNECT_FAILED;
+            }
+        }
+
+        int iResult;
+        {
+            TRACE_SCOPE("tls step");
+            iResult = wifiClient.connectStep();
+        }
+        if( iResult == HUB_CONNECT_PENDING )
+            return HUB_CONNECT_PENDING;
+        if( iResult != HUB_CONNECT_DONE )
         {
-            Serial.println("Trying again in 5 seconds");
-            delay(5000);
+            stats.iFailures++;
+            LOGW(LOG_MOD_HUB, "TLS connection failed");
+            return HUB_CONNECT_FAILED;
         }
+
+        unsigned long ulHandshake = wifiClient.GetHandshakeMs();
+        stats.ulLastHandshakeMs = ulHandshake;
+        stats.ulTotalHandshakeMs += ulHandshake;
+        if( stats.ulMinHandshakeMs == 0 || ulHandshake < stats.ulMinHandshakeMs )
+            stats.ulMinHandshakeMs = ulHandshake;
+        if( ulHandshake > stats.ulMaxHandshakeMs )
+            stats.ulMaxHandshakeMs = ulHandshake;
+        stats.bLastResumed = wifiClient.WasResumed();
+        if( stats.bLastResumed )
+        {
+            stats.iResumed++;
+            stats.ulTotalResumedMs += ulHandshake;
+        }
+
+        uint32_t uMinAfter = ESP.getMinFreeHeap();
+        stats.bHandshakePeakExact = uMinAfter < uHandshakeMinBefore;
+        stats.uLastHandshakePeak = uHandshakeFreeBefore - (stats.bHandshakePeakExact ? uMinAfter : uHandshakeMinBefore);
+        stats.uLastHandshakeHeld = uHandshakeFreeBefore - ESP.getFreeHeap();
+        if( stats.bHandshakePeakExact && stats.uLastHandshakePeak > stats.uMaxHandshakePeak )
+            stats.uMaxHandshakePeak = stats.uLastHandshakePeak;
+
+        wifiClient.setKeepAlive(g_Config.iMqttKeepAlive);
+    }
+
+    TRACE_SCOPE("mqtt connect");
+
+    // Just in case that the SAS token has been regenerated since the last MQTT connection, get it again
+    const char *mqttPassword = (const char *)az_span_ptr(sasToken.Get()); 
+    // The password is a live SAS token, anyone with the log could connect as us until it expires
+    LOGD(LOG_MOD_HUB, "Client ID %s, username %s, password <%d chars redacted>", mqttClientId, mqttUsername, (int)strlen(mqttPassword));
+
+    mqttClient.setKeepAlive(g_Config.iMqttKeepAlive);
+
+    unsigned long ulStart = millis();
+    if (!mqttClient.connect(mqttClientId, mqttUsername, mqttPassword)) 
+    {
+        stats.iFailures++;
+        LOGW(LOG_MOD_HUB, "MQTT connection failed, state %d", mqttClient.state());
+        // Don't reuse a socket the hub might have given up on
+        wifiClient.stop();
+        return HUB_CONNECT_FAILED;
     }
+    stats.ulLastMqttConnectMs = millis() - ulStart;
+    stats.iConnects++;
+
+    LOGI(LOG_MOD_HUB, "MQTT connected");
+    stats.Print();
+
+    if( g_BootTimings.ulHubConnected == 0 )
+    {
+        g_BootTimings.ulHubConnected = millis();
+        g_BootTimings.Print();
+    }
+
+    // If connected, (re)subscribe to the topic where we can receive messages sent from the IoT Hub 
+    mqttClient.subscribe(mqttC2DTopic); 
+    mqttClient.subscribe(mqttTwinResponseTopic);
+    mqttClient.subscribe(mqttTwinPatchTopic);
+    mqttClient.subscribe(mqttMethodsTopic);
+
+    // Desired properties might have changed while we were away, so always fetch the whole twin
+    requestTwin();
+
+    if( stats.iConnects == 1 )
+        sendTestMessageToIoTHub();
+
+    return HUB_CONNECT_DONE;
 }
 
-void CIoTHub::sendTelemetryData(String telemetryData)
+void CIoTHub::sendTelemetryData(const char *telemetryData)
 {
-    mqttClient->publish(publishTopic, telemetryData.c_str());
+    publish(publishTopic, (const uint8_t *)telemetryData, strlen(telemetryData));
 }
 
+bool CIoTHub::queueTelemetryData(const char *telemetryData)
+{
+    bool bQueued = true;
+    if( telemetryQueueCount == TELEMETRY_QUEUE_LEN )
+    {
+        // Been offline for a while, the newest rating is worth more than the oldest one
+        telemetryQueueHead = (telemetryQueueHead + 1) % TELEMETRY_QUEUE_LEN;
+        telemetryQueueCount--;
+        iTelemetryDropped++;
+        bQueued = false;
+    }
+
+    char *slot = telemetryQueue[(telemetryQueueHead + telemetryQueueCount) % TELEMETRY_QUEUE_LEN];
+    strncpy(slot, telemetryData, TELEMETRY_MAX_LEN - 1);
+    slot[TELEMETRY_MAX_LEN - 1] = '\0';
+    telemetryQueueCount++;
+    TRACE_COUNTER("telemetry queue", telemetryQueueCount);
+
+    return bQueued;
+}
+
+void CIoTHub::flushTelemetryQueue()
+{
+    // While offline everything just waits in the queue for the reconnect
+    if( telemetryQueueCount == 0 || !mqttClient.connected() )
+        return;
+
+    // One message per loop(), a backlog after an outage shouldn't stall the station
+    const char *data = telemetryQueue[telemetryQueueHead];
+    size_t length = strlen(data);
+    if( 5 + 2 + strlen(publishTopic) + length > (size_t)GetBufferSize() )
+    {
+        // Never going to fit, retrying won't help
+        LOGE(LOG_MOD_HUB, "Telemetry of %u bytes doesn't fit the %d byte MQTT buffer, dropped", (unsigned)length, GetBufferSize());
+        iTelemetryDropped++;
+    }
+    else if( publish(publishTopic, (const uint8_t *)data, length) )
+        iTelemetrySent++;
+    else
+        return; // The connection went while writing, it stays at the head for the reconnect
+
+    telemetryQueueHead = (telemetryQueueHead + 1) % TELEMETRY_QUEUE_LEN;
+    telemetryQueueCount--;
+    TRACE_COUNTER("telemetry queue", telemetryQueueCount);
+}
+
+
+bool CIoTHub::publish(const char *topic, const uint8_t *payload, size_t length)
+{
+    // Fixed header, topic length and topic, then the payload, all of it has to fit in PubSubClient's buffer
+    size_t packet = 5 + 2 + strlen(topic) + length;
+    if( packet > uPublishPeak )
+        uPublishPeak = packet;
+
+    TRACE_SCOPE("mqtt publish");
+
+    bool bSent = mqttClient.publish(topic, payload, length);
+    CAPTURE(CAPTURE_PUBLISH, bSent, topic, strlen(topic) + 1, payload, length);
+    return bSent;
+}
+
+bool CIoTHub::publishDiagnostics(const char *data, size_t length)
+{
+    // Nice to have, never worth queueing
+    if( !mqttClient.connected() )
+        return false;
+
+    return publish(diagTopic, (const uint8_t *)data, length);
+}
+
+bool CIoTHub::publishSummary(const char *data, size_t length)
+{
+    if( !mqttClient.connected() )
+        return false;
+
+    return publish(summaryTopic, (const uint8_t *)data, length);
+}
+
+bool CIoTHub::publishForStation(const char *stationId, const char *data, size_t length)
+{
+    if( !mqttClient.connected() )
+        return false;
+
+    // Plain IoT Hub only lets a device send as itself, child device identities need IoT Edge in between.
+    // So it goes out under our identity and the station rides along as a property for routing to key on
+    az_iot_message_properties properties;
+    uint8_t propertiesBuffer[80];
+    if (az_result_failed(az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(propertiesBuffer), 0))
+        || az_result_failed(az_iot_message_properties_append(&properties, AZ_SPAN_FROM_STR("stationId"), az_span_create_from_str((char *)stationId)))
+        || az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&client, &properties, stationTopic, sizeof(stationTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting the topic for station %s", stationId);
+        return false;
+    }
+
+    return publish(stationTopic, (const uint8_t *)data, length);
+}
 
 void CIoTHub::sendTestMessageToIoTHub()
 {
-    Serial.println("Sending...");
-     // The receive topic isn't hardcoded and depends on chosen properties, therefore we need to use az_iot_hub_client_telemetry_get_publish_topic()
-    az_result res = az_iot_hub_client_telemetry_get_publish_topic(&client, NULL, publishTopic, 200, NULL );
-    Serial.println(publishTopic);
+    LOGI(LOG_MOD_HUB, "Sending test message to %s", publishTopic);
 
     // Use https://github.com/Azure/azure-iot-explorer/releases to read the telemetry
-    mqttClient->publish(publishTopic, deviceId); 
+    publish(publishTopic, (const uint8_t *)deviceId, strlen(deviceId));
 }
 
 void CIoTHub::EnsureMQTTConnectivity()
 {
-    if( !mqttClient->connected() )
-        mqttReconnect();
+    // Can't make a SAS token without a clock, nor connect without Wi-Fi
+    if( !isTimeValid() )
+        return;
 
-    if( sasToken->IsExpired() )
+    // Renew first, the hub drops us when the old token expires and the reconnect needs the new one
+    if( sasToken.IsExpired() )
         connectMQTT();
+
+    if( mqttClient.connected() )
+        return;
+
+    unsigned long ulNow = millis();
+    if( ulDisconnectedAt == 0 )
+    {
+        ulDisconnectedAt = ulNow;
+        ulNextReconnect = ulNow;
+        ulReconnectBackoff = 0;
+    }
+
+    // No point in a handshake while the station isn't associated
+    if( (long)(ulNow - ulNextReconnect) < 0 || WiFi.status() != WL_CONNECTED )
+        return;
+
+    int iResult = mqttReconnect();
+    if( iResult == HUB_CONNECT_PENDING )
+        return;
+    if( iResult == HUB_CONNECT_DONE )
+    {
+        stats.ulLastOutageMs = millis() - ulDisconnectedAt;
+        ulDisconnectedAt = 0;
+        return;
+    }
+
+    ulReconnectBackoff = ulReconnectBackoff ? min(ulReconnectBackoff * 2, (unsigned long)RECONNECT_BACKOFF_MAX) : RECONNECT_BACKOFF_MIN;
+    ulNextReconnect = millis() + ulReconnectBackoff;
 }
 
 void CIoTHub::loop()
 {
     EnsureMQTTConnectivity();
 
-    mqttClient->loop();
+    mqttClient.loop();
+
+    flushTelemetryQueue();
+
+    // PubSubClient drops whatever doesn't fit in its buffer without a word, a twin that's grown too big included
+    if( ulTwinRequestedAt && millis() - ulTwinRequestedAt > TWIN_RESPONSE_TIMEOUT )
+    {
+        // Lost with the connection otherwise, the reconnect asks again
+        if( mqttClient.connected() )
+            LOGW(LOG_MOD_HUB, "No answer to the twin GET, is the twin over the %d byte MQTT buffer?", GetBufferSize());
+        ulTwinRequestedAt = 0;
+    }
+
+    if( bTwinReportPending )
+    {
+        bTwinReportPending = false;
+        reportTwin();
+    }
+
+    if( bMethodResponsePending )
+    {
+        bMethodResponsePending = false;
+        sendMethodResponse();
+    }
+}
+
+// Every twin request needs an ID, the response carries the same one back
+static az_span NextRequestId(int &iRequestId, char *buffer, size_t size)
+{
+    iRequestId++;
+    int iLen = snprintf(buffer, size, "%d", iRequestId);
+    return az_span_create((uint8_t *)buffer, iLen);
+}
+
+void CIoTHub::requestTwin()
+{
+    char requestId[12];
+    if (az_result_failed(az_iot_hub_client_twin_document_get_publish_topic(
+            &client, NextRequestId(iTwinRequestId, requestId, sizeof(requestId)), twinTopic, sizeof(twinTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting twin document topic");
+        return;
+    }
+
+    if( publish(twinTopic, (const uint8_t *)"", 0) )
+        ulTwinRequestedAt = millis() | 1;
+}
+
+void CIoTHub::handleTwinMessage(char *topic, byte *payload, unsigned int length)
+{
+    az_iot_hub_client_twin_response response;
+    if (az_result_failed(az_iot_hub_client_twin_parse_received_topic(
+            &client, az_span_create_from_str(topic), &response)))
+    {
+        LOGE(LOG_MOD_HUB, "Unknown twin topic %s", topic);
+        return;
+    }
+
+    if( response.response_type == AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_REPORTED_PROPERTIES )
+    {
+        if( response.status != AZ_IOT_STATUS_NO_CONTENT )
+            LOGE(LOG_MOD_HUB, "Reported properties rejected, status %d", response.status);
+        return;
+    }
+
+    if( response.status != AZ_IOT_STATUS_OK && response.status != AZ_IOT_STATUS_NO_CONTENT )
+    {
+        LOGE(LOG_MOD_HUB, "Twin request failed, status %d", response.status);
+        return;
+    }
+
+    bool bGet = response.response_type == AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_GET;
+    if( bGet )
+        ulTwinRequestedAt = 0;
+
+    // Just the settings, a GET's reported half is only what we sent and a catalog delta gets parsed
+    // on its own, so neither of them can push the settings out of the document
+    StaticJsonDocument<JSON_OBJECT_SIZE(3)> filter;
+    if( bGet )
+    {
+        filter["desired"]["*"] = true;
+        filter["desired"]["catalog"] = false;
+    }
+    else
+    {
+        filter["*"] = true;
+        filter["catalog"] = false;
+    }
+
+    StaticJsonDocument<512> doc;
+    if( deserializeJson(doc, (const char *)payload, length, DeserializationOption::Filter(filter)) )
+    {
+        LOGE(LOG_MOD_HUB, "Failed parsing twin JSON");
+        return;
+    }
+
+    // A full GET has both halves of the twin, a PATCH is just the desired properties
+    JsonObjectConst desired = bGet ? doc["desired"].as<JsonObjectConst>() : doc.as<JsonObjectConst>();
+
+    bool bChanged = g_Config.ApplyDesired(desired);
+    if( bChanged )
+    {
+        LOGI(LOG_MOD_CFG, "Config changed by device twin:");
+        g_Config.Print();
+        g_Config.Save();
+    }
+
+    bool bCatalogChanged = catalogReceiveTwin(payload, length, bGet);
+    slaveFwApplyDesired(desired);
+
+    // Always answer a GET, so the reported side matches what's on the device after a reflash or NVS wipe
+    if( bChanged || bCatalogChanged || bGet )
+        bTwinReportPending = true;
+}
+
+bool CIoTHub::handleMethodMessage(char *topic, byte *payload, unsigned int length)
+{
+    az_iot_hub_client_method_request request;
+    if (az_result_failed(az_iot_hub_client_methods_parse_received_topic(&client, az_span_create_from_str(topic), &request)))
+        return false;
+
+    if( az_span_size(request.request_id) >= (int32_t)sizeof(methodRequestId) )
+    {
+        LOGE(LOG_MOD_HUB, "Direct method request ID too long");
+        return true;
+    }
+    memcpy(methodRequestId, az_span_ptr(request.request_id), az_span_size(request.request_id));
+    methodRequestId[az_span_size(request.request_id)] = 0;
+
+    if( az_span_is_content_equal(request.name, AZ_SPAN_FROM_STR(OTA_METHOD)) )
+        iMethodStatus = otaRequest((const char *)payload, length);
+    else
+    {
+        LOGW(LOG_MOD_HUB, "Unknown direct method %.*s", (int)az_span_size(request.name), (const char *)az_span_ptr(request.name));
+        iMethodStatus = AZ_IOT_STATUS_NOT_FOUND;
+    }
+
+    // The hub waits for an answer, a long running method just says it's started
+    bMethodResponsePending = true;
+    return true;
+}
+
+void CIoTHub::sendMethodResponse()
+{
+    char topic[128];
+    if (az_result_failed(az_iot_hub_client_methods_response_get_publish_topic(
+            &client, az_span_create_from_str(methodRequestId), (uint16_t)iMethodStatus, topic, sizeof(topic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting method response topic");
+        return;
+    }
+
+    char response[32];
+    int iLen = snprintf(response, sizeof(response), "{\"status\":%d}", iMethodStatus);
+    publish(topic, (const uint8_t *)response, iLen);
+}
+
+bool CIoTHub::handleC2DMessage(char *topic, byte *payload, unsigned int length)
+{
+    az_iot_hub_client_c2d_request request;
+    if (az_result_failed(az_iot_hub_client_c2d_parse_received_topic(&client, az_span_create_from_str(topic), &request)))
+        return false;
+
+    // Menu catalog delta, catalog=delta with its JSON. The new version goes into the reported properties
+    az_span part;
+    if (!az_result_failed(az_iot_message_properties_find(&request.properties, AZ_SPAN_FROM_STR("catalog"), &part)))
+    {
+        if( catalogReceiveDelta(payload, length) )
+            bTwinReportPending = true;
+        return true;
+    }
+
+    // Camera slave image, slavefw=begin with the size/crc/version JSON, then slavefw=chunk&offset=N with the raw bytes, then slavefw=end
+    if (az_result_failed(az_iot_message_properties_find(&request.properties, AZ_SPAN_FROM_STR("slavefw"), &part)))
+        return false;
+
+    if( az_span_is_content_equal(part, AZ_SPAN_FROM_STR("begin")) )
+        slaveFwReceiveBegin((const char *)payload, length);
+    else if( az_span_is_content_equal(part, AZ_SPAN_FROM_STR("end")) )
+        slaveFwReceiveEnd();
+    else
+    {
+        az_span offset;
+        uint32_t uOffset;
+        if (az_result_failed(az_iot_message_properties_find(&request.properties, AZ_SPAN_FROM_STR("offset"), &offset))
+            || az_result_failed(az_span_atou32(offset, &uOffset)))
+        {
+            LOGW(LOG_MOD_HUB, "Slave image chunk without an offset");
+            return true;
+        }
+        slaveFwReceiveChunk(uOffset, payload, length);
+    }
+    return true;
+}
+
+void CIoTHub::reportTwin()
+{
+    char requestId[12];
+    if (az_result_failed(az_iot_hub_client_twin_patch_get_publish_topic(
+            &client, NextRequestId(iTwinRequestId, requestId, sizeof(requestId)), twinTopic, sizeof(twinTopic), NULL)))
+    {
+        LOGE(LOG_MOD_HUB, "Failed getting twin patch topic");
+        return;
+    }
+
+    char reported[512];
+    size_t reportedLen = g_Config.WriteReported(reported, sizeof(reported));
+
+    publish(twinTopic, (const uint8_t *)reported, reportedLen);
+}
+
+void CIoTHub::disconnect()
+{
+    mqttClient.disconnect();
+    wifiClient.stop();
 }
 
 char *CIoTHub::GetDeviceID()
@@ -168,40 +651,224 @@ char *CIoTHub::GetDeviceID()
     return deviceId;
 }
 
-short timeoutCounter = 0;
+char *CIoTHub::GetGatewayKey()
+{
+    return gatewayKey;
+}
+
+void connectionStats::Print()
+{
+    LOGI(LOG_MOD_HUB, "Connects: %d, failures: %d", iConnects, iFailures);
+    LOGI(LOG_MOD_HUB, "Handshake: last %lu ms%s, min %lu ms, max %lu ms, avg %lu ms, %d resumed (avg %lu ms)",
+        ulLastHandshakeMs, bLastResumed ? " (resumed)" : "", ulMinHandshakeMs, ulMaxHandshakeMs, iConnects ? ulTotalHandshakeMs / iConnects : 0,
+        iResumed, iResumed ? ulTotalResumedMs / iResumed : 0);
+    LOGI(LOG_MOD_HUB, "Handshake heap: peak %s%u bytes (max %u), %u held by the connection", bHandshakePeakExact ? "" : "under ",
+        (unsigned)uLastHandshakePeak, (unsigned)uMaxHandshakePeak, (unsigned)uLastHandshakeHeld);
+    LOGI(LOG_MOD_HUB, "MQTT connect: %lu ms, last outage: %lu ms", ulLastMqttConnectMs, ulLastOutageMs);
+}
+
+bootTimings g_BootTimings;
+
+void bootTimings::Print()
+{
+    LOGI(LOG_MOD_MAIN, "Boot: slave %lu ms, nfc %lu ms, display %lu ms, wifi %lu ms (%s), time %lu ms (%s), hub %lu ms",
+        ulSlaveReady, ulNfcReady, ulDisplayReady,
+        ulWiFiConnected, bFastConnect ? "cached AP" : "full scan",
+        ulTimeValid, bTimeFromRtc ? "RTC" : "SNTP",
+        ulHubConnected);
+}
+
+#define WIFI_NAMESPACE "wifi"
+#define FAST_CONNECT_TIMEOUT 3000 // ms, a connect to a known channel/BSSID takes a few hundred
+#define WIFI_RETRY_INTERVAL 10000 // ms
+#define TIME_SAVE_INTERVAL 86400  // s, the saved clock is only a sanity floor, no need to wear out the flash
+
+// Last AP we were on. RTC memory survives soft resets and deep sleep, NVS covers power cycles
+struct cachedAP {
+    uint32_t uMagic;
+    int32_t iChannel;
+    uint8_t bssid[6];
+};
+#define CACHED_AP_MAGIC 0x57494649
+
+RTC_NOINIT_ATTR static cachedAP s_rtcAP;
+
+static cachedAP s_AP;
+static bool s_bFastConnect = false;
+static bool s_bConnecting = false; // Since WiFi.begin(), until it's connected
+static unsigned long s_ulWiFiBegin = 0;
+static time_t s_tmTimeFloor = 0;
+
+static void LoadCachedAP()
+{
+    if( s_rtcAP.uMagic == CACHED_AP_MAGIC )
+    {
+        s_AP = s_rtcAP;
+        return;
+    }
+
+    s_AP = {};
+    Preferences prefs;
+    if( !prefs.begin(WIFI_NAMESPACE, true) )
+        return;
+
+    s_AP.iChannel = prefs.getInt("channel", 0);
+    if( s_AP.iChannel && prefs.getBytes("bssid", s_AP.bssid, sizeof(s_AP.bssid)) == sizeof(s_AP.bssid) )
+        s_AP.uMagic = CACHED_AP_MAGIC;
+    prefs.end();
+}
+
+static void SaveCachedAP()
+{
+    cachedAP ap = {};
+    ap.uMagic = CACHED_AP_MAGIC;
+    ap.iChannel = WiFi.channel();
+    memcpy(ap.bssid, WiFi.BSSID(), sizeof(ap.bssid));
+    s_rtcAP = ap;
+
+    // Same AP as last time, nothing to write
+    if( s_AP.uMagic == CACHED_AP_MAGIC && memcmp(&ap, &s_AP, sizeof(ap)) == 0 )
+        return;
+
+    s_AP = ap;
+    Preferences prefs;
+    if( prefs.begin(WIFI_NAMESPACE, false) )
+    {
+        prefs.putInt("channel", ap.iChannel);
+        prefs.putBytes("bssid", ap.bssid, sizeof(ap.bssid));
+        prefs.end();
+    }
+}
+
+static void BeginWiFi()
+{
+    // With a known channel and BSSID the driver skips the full scan
+    s_bFastConnect = s_AP.uMagic == CACHED_AP_MAGIC;
+    if( s_bFastConnect )
+    {
+        LOGI(LOG_MOD_NET, "Connecting to WiFi, channel %d", (int)s_AP.iChannel);
+        WiFi.begin(ssid, pass, s_AP.iChannel, s_AP.bssid);
+    }
+    else
+    {
+        LOGI(LOG_MOD_NET, "Connecting to WiFi");
+        WiFi.begin(ssid, pass);
+    }
+    s_ulWiFiBegin = millis();
+    s_bConnecting = true;
+}
 
 void setupWiFi()
 {
-	Serial.println("Connecting to WiFi");
+    LoadCachedAP();
 
-	WiFi.mode(WIFI_STA);
-	WiFi.begin(ssid, pass);
+    // We keep our own cache, no need for the core to write the credentials to flash on every boot
+    WiFi.persistent(false);
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(true);
+    BeginWiFi();
+}
 
-	while (WiFi.status() != WL_CONNECTED)
-    { // Wait until we connect...
-		Serial.print(".");
-		delay(500);
+void suspendWiFi()
+{
+    // Off altogether, light sleep powers the radio down whether it's stopped or not
+    WiFi.disconnect(true);
+    s_bConnecting = false;
+}
+
+void resumeWiFi()
+{
+    WiFi.mode(WIFI_STA);
+    BeginWiFi();
+}
+
+void updateWiFi()
+{
+    unsigned long ulNow = millis();
 
-		timeoutCounter++;
-		if (timeoutCounter >= 20) ESP.restart(); // Or restart if we waited for too long, not much else can you do
-	}
+    if( WiFi.status() == WL_CONNECTED )
+    {
+        if( s_bConnecting )
+        {
+            s_bConnecting = false;
+            if( g_BootTimings.ulWiFiConnected == 0 )
+            {
+                g_BootTimings.ulWiFiConnected = ulNow;
+                g_BootTimings.bFastConnect = s_bFastConnect;
+            }
+            LOGI(LOG_MOD_NET, "WiFi connected in %lu ms", ulNow - s_ulWiFiBegin);
+            SaveCachedAP();
+        }
+        return;
+    }
 
-	Serial.println("WiFi connected");
+    // AP moved or changed channel, forget it and do a proper scan
+    if( s_bFastConnect && ulNow - s_ulWiFiBegin > FAST_CONNECT_TIMEOUT )
+    {
+        LOGW(LOG_MOD_NET, "Cached AP didn't answer, scanning");
+        s_bFastConnect = false;
+        s_rtcAP.uMagic = 0;
+        WiFi.disconnect();
+        WiFi.begin(ssid, pass);
+        s_ulWiFiBegin = ulNow;
+    }
+    // Keep trying instead of restarting, the station works offline and queues its ratings
+    else if( s_bConnecting && ulNow - s_ulWiFiBegin > WIFI_RETRY_INTERVAL )
+    {
+        WiFi.begin(ssid, pass);
+        s_ulWiFiBegin = ulNow;
+    }
 }
 
 void initializeTime()
 {
     // MANDATORY or SAS tokens won't generate
-  Serial.println("Setting time using SNTP");
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
-  time_t now = time(NULL);
-  std::tm tm{};
-  tm.tm_year = 2023; // Define a date on 1.1.2023. and wait until the current time has the same year (by default it's 1.1.1970.)
-
-  while (now < std::mktime(&tm)) // Since we are using an Internet clock, it may take a moment for clocks to sychronize
-  {
-    delay(500);
-    Serial.print(".");
-    now = time(NULL);
-  }
-}
\ No newline at end of file
+    LOGI(LOG_MOD_NET, "Setting time using SNTP");
+    configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+
+    // Anything before 1.1.2023. is the clock still counting from 1.1.1970., and
+    // anything before the last time we had a good clock can't be right either
+    std::tm tm{};
+    tm.tm_year = 2023 - 1900;
+    tm.tm_mday = 1;
+    s_tmTimeFloor = std::mktime(&tm);
+
+    Preferences prefs;
+    if( prefs.begin(WIFI_NAMESPACE, true) )
+    {
+        time_t tmSaved = (time_t)prefs.getUInt("time", 0);
+        if( tmSaved > s_tmTimeFloor )
+            s_tmTimeFloor = tmSaved;
+        prefs.end();
+    }
+
+    // The RTC keeps counting through soft resets and deep sleep, SNTP only corrects it then
+    g_BootTimings.bTimeFromRtc = isTimeValid();
+}
+
+static void SaveTime(time_t now)
+{
+    if( now - s_tmTimeFloor < TIME_SAVE_INTERVAL )
+        return;
+
+    Preferences prefs;
+    if( prefs.begin(WIFI_NAMESPACE, false) )
+    {
+        prefs.putUInt("time", (uint32_t)now);
+        prefs.end();
+    }
+}
+
+bool isTimeValid()
+{
+    if( g_BootTimings.ulTimeValid )
+        return true;
+
+    time_t now = time(NULL);
+    if( now < s_tmTimeFloor )
+        return false;
+
+    g_BootTimings.ulTimeValid = millis();
+    SaveTime(now);
+    return true;
+}
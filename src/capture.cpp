@@ -0,0 +1,128 @@
+#include <Arduino.h>
+#include <esp_partition.h>
+
+#include "capture.h"
+#include "log.h"
+#include "trace.h"
+
+bool g_bCapturing = false;
+
+static const esp_partition_t *s_pPartition = nullptr;
+static uint8_t s_buffer[CAPTURE_BUFFER];
+static size_t s_uBuffered = 0;
+static uint32_t s_uFlashPos = 0;  // Where the next flush goes
+static uint32_t s_uErasedTo = 0;  // Everything below is erased or written
+static unsigned long s_ulLastRecord = 0;
+static int s_iDropped = 0;
+
+static void Append(uint8_t uType, uint8_t uArg, uint16_t uDeltaMs, const void *data, size_t length, const void *data2, size_t length2)
+{
+    captureRecord record = { uType, uArg, (uint16_t)(length + length2), uDeltaMs };
+    if( sizeof(record) + length + length2 > sizeof(s_buffer) - s_uBuffered )
+    {
+        s_iDropped++;
+        return;
+    }
+
+    memcpy(s_buffer + s_uBuffered, &record, sizeof(record));
+    s_uBuffered += sizeof(record);
+    if( length )
+        memcpy(s_buffer + s_uBuffered, data, length);
+    s_uBuffered += length;
+    if( length2 )
+        memcpy(s_buffer + s_uBuffered, data2, length2);
+    s_uBuffered += length2;
+}
+
+void captureWrite(uint8_t uType, uint8_t uArg, const void *data, size_t length, const void *data2, size_t length2)
+{
+    if( length + length2 > 0xFFFF )
+    {
+        s_iDropped++;
+        return;
+    }
+
+    unsigned long ulNow = millis();
+    unsigned long ulDelta = ulNow - s_ulLastRecord;
+    if( ulDelta > 0xFFFF )
+    {
+        uint32_t ulMillis = ulNow;
+        Append(CAPTURE_CLOCK, 0, 0, &ulMillis, sizeof(ulMillis), nullptr, 0);
+        ulDelta = 0;
+    }
+    s_ulLastRecord = ulNow;
+    Append(uType, uArg, (uint16_t)ulDelta, data, length, data2, length2);
+}
+
+void setupCapture()
+{
+    if( !g_Config.iCapture )
+        return;
+
+    s_pPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CAPTURE_SUBTYPE, CAPTURE_PARTITION);
+    if( !s_pPartition )
+    {
+        LOGW(LOG_MOD_LOG, "No %s partition, can't capture", CAPTURE_PARTITION);
+        return;
+    }
+
+    // The last capture is gone from here on. The rest is erased a sector at a time as the records get there,
+    // so whatever is after the last record is always erased and the replay knows where to stop
+    if( esp_partition_erase_range(s_pPartition, 0, SPI_FLASH_SEC_SIZE) != ESP_OK )
+    {
+        LOGE(LOG_MOD_LOG, "Erasing %s failed, can't capture", CAPTURE_PARTITION);
+        return;
+    }
+    s_uFlashPos = 0;
+    s_uErasedTo = SPI_FLASH_SEC_SIZE;
+    s_uBuffered = 0;
+    s_iDropped = 0;
+
+    captureStart start = {};
+    start.uMagic = CAPTURE_MAGIC;
+    start.uVersion = CAPTURE_VERSION;
+    start.uConfigSize = sizeof(stationConfig);
+    start.ulMillis = millis();
+    start.config = g_Config;
+    s_ulLastRecord = start.ulMillis;
+    Append(CAPTURE_START, 0, 0, &start, sizeof(start), nullptr, 0);
+
+    g_bCapturing = true;
+    LOGI(LOG_MOD_LOG, "Capturing I/O into %s, %u KB", CAPTURE_PARTITION, (unsigned)(s_pPartition->size / 1024));
+}
+
+void updateCapture()
+{
+    if( !g_bCapturing || s_uBuffered == 0 )
+        return;
+
+    TRACE_SCOPE("capture flush");
+
+    // Leaves room for the end marker, a full partition still reads back to the end
+    if( s_uFlashPos + s_uBuffered >= s_pPartition->size )
+    {
+        g_bCapturing = false;
+        LOGW(LOG_MOD_LOG, "Capture partition full after %u bytes, %d records dropped", (unsigned)s_uFlashPos, s_iDropped);
+        return;
+    }
+
+    while( s_uErasedTo < s_uFlashPos + s_uBuffered + 1 )
+    {
+        esp_partition_erase_range(s_pPartition, s_uErasedTo, SPI_FLASH_SEC_SIZE);
+        s_uErasedTo += SPI_FLASH_SEC_SIZE;
+    }
+
+    if( esp_partition_write(s_pPartition, s_uFlashPos, s_buffer, s_uBuffered) != ESP_OK )
+    {
+        g_bCapturing = false;
+        LOGE(LOG_MOD_LOG, "Capture write failed at %u, stopped", (unsigned)s_uFlashPos);
+        return;
+    }
+    s_uFlashPos += s_uBuffered;
+    s_uBuffered = 0;
+}
+
+int captureGetDropped()
+{
+    return s_iDropped;
+}
@@ -0,0 +1,409 @@
+#include <Arduino.h>
+#include <algorithm>
+#include <esp_partition.h>
+#include <rom/crc.h>
+
+#include "catalog.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+#define CATALOG_MAX_ITEMS ((CATALOG_SLOT_SIZE - sizeof(catalogHeader)) / sizeof(catalogItem))
+#define CATALOG_WRITE_BATCH 16 // Items per flash write
+
+static const esp_partition_t *s_pPartition = nullptr;
+static const uint8_t *s_pFlash = nullptr; // Both halves, mapped for good
+static spi_flash_mmap_handle_t s_hMap;
+static int s_iActive = -1;                // Half in use, -1 without a catalog
+static const catalogItem *s_pItems = nullptr;
+static uint32_t s_uCount = 0;
+static uint32_t s_uVersion = 0;
+
+// The delta being applied, sorted by ID
+static catalogItem s_set[CATALOG_MAX_DELTA];
+static uint16_t s_removed[CATALOG_MAX_DELTA];
+
+// The half being written
+static catalogItem s_batch[CATALOG_WRITE_BATCH];
+static int s_iBatched = 0;
+static uint32_t s_uSlotBase = 0;
+static uint32_t s_uWritten = 0;   // Item bytes so far
+static uint32_t s_uErasedTo = 0;  // Partition offset, everything below is erased
+static uint32_t s_uWriteCrc = 0;
+static bool s_bWriteOk = false;
+
+// A whole catalog coming in parts, -1 if there's none on the way
+static int s_iPart = -1;
+static uint32_t s_uReplaceTo = 0;
+static int s_iLastId = -1; // Parts have to go up in ID, this is where the last one ended
+
+static int s_iMaxDelta = 0;
+
+static StaticJsonDocument<CATALOG_DELTA_DOC> s_doc;
+
+static const catalogHeader *Header(int iSlot)
+{
+    return (const catalogHeader *)(s_pFlash + iSlot * CATALOG_SLOT_SIZE);
+}
+
+static const catalogItem *Items(int iSlot)
+{
+    return (const catalogItem *)(s_pFlash + iSlot * CATALOG_SLOT_SIZE + sizeof(catalogHeader));
+}
+
+static bool IsIntact(int iSlot)
+{
+    const catalogHeader *header = Header(iSlot);
+    if( header->uMagic != CATALOG_MAGIC || header->uCount > CATALOG_MAX_ITEMS )
+        return false;
+    return crc32_le(0, (const uint8_t *)Items(iSlot), header->uCount * sizeof(catalogItem)) == header->uCrc;
+}
+
+static void Use(int iSlot)
+{
+    s_iActive = iSlot;
+    s_pItems = Items(iSlot);
+    s_uCount = Header(iSlot)->uCount;
+    s_uVersion = Header(iSlot)->uVersion;
+}
+
+void setupCatalog()
+{
+    s_iActive = -1;
+    s_pItems = nullptr;
+    s_uCount = 0;
+    s_uVersion = 0;
+    s_iPart = -1;
+
+    // Whichever is smaller, what PubSubClient can take or what the document can. The buffer is only sized
+    // at boot, so a new size from the twin counts from the next one, same as for the hub
+    s_iMaxDelta = min((g_Config.iMqttBufferSize - CATALOG_C2D_OVERHEAD) / CATALOG_ITEM_JSON, (int)(CATALOG_DELTA_DOC - JSON_OBJECT_SIZE(6)) / CATALOG_ITEM_DOC);
+    s_iMaxDelta = constrain(s_iMaxDelta, 0, CATALOG_MAX_DELTA);
+
+    s_pPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CATALOG_SUBTYPE, CATALOG_PARTITION);
+    if( !s_pPartition || s_pPartition->size < 2 * CATALOG_SLOT_SIZE )
+    {
+        LOGW(LOG_MOD_MENU, "No %s partition, menu items show as numbers", CATALOG_PARTITION);
+        return;
+    }
+
+    if( esp_partition_mmap(s_pPartition, 0, 2 * CATALOG_SLOT_SIZE, ESP_PARTITION_MMAP_DATA, (const void **)&s_pFlash, &s_hMap) != ESP_OK )
+    {
+        LOGE(LOG_MOD_MENU, "Mapping %s failed", CATALOG_PARTITION);
+        s_pFlash = nullptr;
+        return;
+    }
+
+    int iBest = -1;
+    for( int i = 0; i < 2; i++ )
+    {
+        if( IsIntact(i) && (iBest < 0 || Header(i)->uVersion > Header(iBest)->uVersion) )
+            iBest = i;
+    }
+    if( iBest < 0 )
+    {
+        LOGI(LOG_MOD_MENU, "No menu catalog yet");
+        return;
+    }
+
+    Use(iBest);
+    LOGI(LOG_MOD_MENU, "Menu catalog v%u, %u items", (unsigned)s_uVersion, (unsigned)s_uCount);
+}
+
+const catalogItem *catalogFind(int iId)
+{
+    const catalogItem *end = s_pItems + s_uCount;
+    const catalogItem *item = std::lower_bound(s_pItems, end, iId, [](const catalogItem &item, int iId) { return item.uId < iId; });
+    return item != end && item->uId == iId ? item : nullptr;
+}
+
+uint32_t catalogGetVersion()
+{
+    return s_uVersion;
+}
+
+int catalogGetCount()
+{
+    return (int)s_uCount;
+}
+
+int catalogGetMaxDelta()
+{
+    return s_iMaxDelta;
+}
+
+static void Flush()
+{
+    if( !s_iBatched || !s_bWriteOk )
+        return;
+
+    size_t length = s_iBatched * sizeof(catalogItem);
+    uint32_t uOffset = s_uSlotBase + sizeof(catalogHeader) + s_uWritten;
+    while( s_uErasedTo < uOffset + length )
+    {
+        s_bWriteOk &= esp_partition_erase_range(s_pPartition, s_uErasedTo, SPI_FLASH_SEC_SIZE) == ESP_OK;
+        s_uErasedTo += SPI_FLASH_SEC_SIZE;
+    }
+    s_bWriteOk &= esp_partition_write(s_pPartition, uOffset, s_batch, length) == ESP_OK;
+    s_uWriteCrc = crc32_le(s_uWriteCrc, (const uint8_t *)s_batch, length);
+    s_uWritten += length;
+    s_iBatched = 0;
+}
+
+static void Emit(const catalogItem &item)
+{
+    if( s_uWritten / sizeof(catalogItem) + s_iBatched >= CATALOG_MAX_ITEMS )
+    {
+        s_bWriteOk = false;
+        return;
+    }
+
+    s_batch[s_iBatched++] = item;
+    if( s_iBatched == CATALOG_WRITE_BATCH )
+        Flush();
+}
+
+// Into the half that isn't live, its first sector goes right away so it's never taken for intact again
+static void BeginWrite()
+{
+    int iSlot = s_iActive < 0 ? 0 : s_iActive ^ 1;
+    s_uSlotBase = iSlot * CATALOG_SLOT_SIZE;
+    s_uWritten = 0;
+    s_iBatched = 0;
+    s_uWriteCrc = 0;
+    s_bWriteOk = esp_partition_erase_range(s_pPartition, s_uSlotBase, SPI_FLASH_SEC_SIZE) == ESP_OK;
+    s_uErasedTo = s_uSlotBase + SPI_FLASH_SEC_SIZE;
+}
+
+// Header of the half that's been written, then it's the live one
+static bool EndWrite(uint32_t uTo)
+{
+    Flush();
+
+    uint32_t uCount = s_uWritten / sizeof(catalogItem);
+    if( !s_bWriteOk )
+    {
+        LOGE(LOG_MOD_MENU, "Writing catalog v%u failed or it's over %u items", (unsigned)uTo, (unsigned)CATALOG_MAX_ITEMS);
+        return false;
+    }
+
+    // Flash only clears bits, so the header goes in with the magic still erased and the magic after it
+    catalogHeader header = {};
+    header.uMagic = 0xFFFFFFFF;
+    header.uVersion = uTo;
+    header.uCount = uCount;
+    header.uCrc = s_uWriteCrc;
+    uint32_t uMagic = CATALOG_MAGIC;
+    esp_partition_write(s_pPartition, s_uSlotBase, &header, sizeof(header));
+    esp_partition_write(s_pPartition, s_uSlotBase, &uMagic, sizeof(uMagic));
+
+    // Read back through the cache, like the next boot would
+    int iSlot = s_uSlotBase / CATALOG_SLOT_SIZE;
+    if( !IsIntact(iSlot) )
+    {
+        LOGE(LOG_MOD_MENU, "Catalog v%u didn't read back intact, staying on v%u", (unsigned)uTo, (unsigned)s_uVersion);
+        return false;
+    }
+
+    Use(iSlot);
+    return true;
+}
+
+// Sorted, so the delta and the catalog merge in one pass. Stable, so the later of two sets of an ID wins
+static void SortDelta(int iSet, int iRemoved)
+{
+    std::stable_sort(s_set, s_set + iSet, [](const catalogItem &a, const catalogItem &b) { return a.uId < b.uId; });
+    std::sort(s_removed, s_removed + iRemoved);
+}
+
+// The delta in s_set and s_removed on top of the live catalog
+static bool Merge(uint32_t uFrom, uint32_t uTo, int iSet, int iRemoved)
+{
+    TRACE_SCOPE("catalog delta");
+
+    SortDelta(iSet, iRemoved);
+    BeginWrite();
+
+    // Removes go to the catalog as it was, sets come after them
+    uint32_t i = 0;
+    int j = 0;
+    int k = 0;
+    while( s_bWriteOk && (i < s_uCount || j < iSet) )
+    {
+        while( j + 1 < iSet && s_set[j + 1].uId == s_set[j].uId )
+            j++;
+
+        if( i < s_uCount && (j == iSet || s_pItems[i].uId <= s_set[j].uId) )
+        {
+            const catalogItem &item = s_pItems[i++];
+            if( j < iSet && s_set[j].uId == item.uId )
+                continue;
+            while( k < iRemoved && s_removed[k] < item.uId )
+                k++;
+            if( k < iRemoved && s_removed[k] == item.uId )
+                continue;
+            Emit(item);
+        }
+        else
+            Emit(s_set[j++]);
+    }
+
+    if( !EndWrite(uTo) )
+        return false;
+
+    LOGI(LOG_MOD_MENU, "Menu catalog v%u->v%u, %d set, %d removed, %u items", (unsigned)uFrom, (unsigned)uTo, iSet, iRemoved, (unsigned)s_uCount);
+    return true;
+}
+
+// One part of a whole new catalog, the items in s_set. Appended to the half being written, the last part switches to it
+static bool Replace(uint32_t uTo, int iPart, int iParts, int iSet)
+{
+    TRACE_SCOPE("catalog replace");
+
+    if( iPart == 0 )
+    {
+        // Starts over, whatever became of the one before
+        BeginWrite();
+        s_iPart = 0;
+        s_uReplaceTo = uTo;
+        s_iLastId = -1;
+    }
+    else if( iPart != s_iPart || uTo != s_uReplaceTo )
+    {
+        // C2D doesn't promise the order or that it gets here at all, the cloud has to send it again from part 0
+        LOGW(LOG_MOD_MENU, "Catalog v%u part %d where part %d of v%u was next, dropping the replace", (unsigned)uTo, iPart, s_iPart, (unsigned)s_uReplaceTo);
+        s_iPart = -1;
+        return false;
+    }
+
+    SortDelta(iSet, 0);
+    if( iSet && s_set[0].uId <= s_iLastId )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog v%u part %d doesn't go up from ID %d, dropping the replace", (unsigned)uTo, iPart, s_iLastId);
+        s_iPart = -1;
+        return false;
+    }
+
+    for( int j = 0; j < iSet && s_bWriteOk; j++ )
+    {
+        while( j + 1 < iSet && s_set[j + 1].uId == s_set[j].uId )
+            j++;
+        Emit(s_set[j]);
+        s_iLastId = s_set[j].uId;
+    }
+
+    if( ++s_iPart < iParts )
+    {
+        LOGD(LOG_MOD_MENU, "Catalog v%u part %d of %d", (unsigned)uTo, s_iPart, iParts);
+        return false;
+    }
+
+    s_iPart = -1;
+    if( !EndWrite(uTo) )
+        return false;
+
+    LOGI(LOG_MOD_MENU, "Menu catalog replaced with v%u, %u items", (unsigned)uTo, (unsigned)s_uCount);
+    return true;
+}
+
+bool catalogApplyDelta(JsonObjectConst delta)
+{
+    if( !s_pFlash )
+        return false;
+
+    // The twin keeps its last delta and hands it back with every GET, so older ones are just skipped
+    uint32_t uFrom = delta["from"] | 0u;
+    uint32_t uTo = delta["to"] | 0u;
+    if( uTo <= s_uVersion )
+        return false;
+    if( uFrom != 0 && uFrom != s_uVersion )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog delta v%u->v%u doesn't go with v%u", (unsigned)uFrom, (unsigned)uTo, (unsigned)s_uVersion);
+        return false;
+    }
+
+    int iPart = delta["part"] | 0;
+    int iParts = delta["parts"] | 1;
+    JsonArrayConst set = delta["set"];
+    JsonArrayConst remove = delta["remove"];
+    int iSet = (int)set.size();
+    int iRemoved = (int)remove.size();
+    if( iSet + iRemoved > CATALOG_MAX_DELTA || iPart < 0 || iPart >= iParts || (uFrom == 0 && iRemoved) )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog delta v%u doesn't add up, %d set, %d removed, part %d of %d. At most %d items go in one",
+            (unsigned)uTo, iSet, iRemoved, iPart, iParts, catalogGetMaxDelta());
+        return false;
+    }
+
+    for( int i = 0; i < iSet; i++ )
+    {
+        JsonArrayConst entry = set[i];
+        long lId = entry[0] | -1L;
+        long lPrice = entry[2] | -1L;
+        if( lId < 0 || lId > 0xFFFF || lPrice < 0 )
+        {
+            LOGW(LOG_MOD_MENU, "Catalog delta v%u has a bad item, not applied", (unsigned)uTo);
+            return false;
+        }
+
+        catalogItem &item = s_set[i];
+        memset(&item, 0, sizeof(item));
+        item.uId = (uint16_t)lId;
+        item.uPrice = (uint32_t)lPrice;
+        item.uCategory = entry[3] | 0;
+        strncpy(item.szName, entry[1] | "", sizeof(item.szName) - 1);
+    }
+
+    if( uFrom == 0 )
+        return Replace(uTo, iPart, iParts, iSet);
+
+    for( int i = 0; i < iRemoved; i++ )
+    {
+        // Cut down to 16 bits a bad ID would remove some other item
+        long lId = remove[i] | -1L;
+        if( lId < 0 || lId > 0xFFFF )
+        {
+            LOGW(LOG_MOD_MENU, "Catalog delta v%u removes a bad item, not applied", (unsigned)uTo);
+            return false;
+        }
+        s_removed[i] = (uint16_t)lId;
+    }
+
+    // Writes into the same half a replace on the way would
+    if( s_iPart >= 0 )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog delta v%u->v%u cuts the replace with v%u short", (unsigned)uFrom, (unsigned)uTo, (unsigned)s_uReplaceTo);
+        s_iPart = -1;
+    }
+    return Merge(uFrom, uTo, iSet, iRemoved);
+}
+
+bool catalogReceiveDelta(const uint8_t *payload, size_t length)
+{
+    DeserializationError error = deserializeJson(s_doc, (const char *)payload, length);
+    if( error )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog delta of %u bytes didn't parse (%s), at most %d items go in one", (unsigned)length, error.c_str(), catalogGetMaxDelta());
+        return false;
+    }
+    return catalogApplyDelta(s_doc.as<JsonObjectConst>());
+}
+
+bool catalogReceiveTwin(const uint8_t *payload, size_t length, bool bFull)
+{
+    StaticJsonDocument<JSON_OBJECT_SIZE(2)> filter;
+    if( bFull )
+        filter["desired"]["catalog"] = true;
+    else
+        filter["catalog"] = true;
+
+    DeserializationError error = deserializeJson(s_doc, (const char *)payload, length, DeserializationOption::Filter(filter));
+    if( error )
+    {
+        LOGW(LOG_MOD_MENU, "Catalog delta in the twin didn't parse (%s), at most %d items go in one", error.c_str(), catalogGetMaxDelta());
+        return false;
+    }
+
+    JsonObjectConst delta = bFull ? s_doc["desired"]["catalog"].as<JsonObjectConst>() : s_doc["catalog"].as<JsonObjectConst>();
+    return !delta.isNull() && catalogApplyDelta(delta);
+}
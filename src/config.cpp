@@ -0,0 +1,214 @@
+#include <Arduino.h>
+#include <Preferences.h>
+
+#include "config.h"
+#include "catalog.h"
+#include "log.h"
+
+#define CONFIG_NAMESPACE "station"
+
+stationConfig g_Config;
+
+static const float s_flaDefaultThresholds[NUM_RATING_THRESHOLDS] = { 0.6f, 0.48f, 0.36f, 0.24f };
+
+void stationConfig::Defaults()
+{
+    iRequestDelay = DEFAULT_REQUEST_DELAY;
+    iDisplayDelay = DEFAULT_DISPLAY_DELAY;
+    iI2CFreq = DEFAULT_I2C_FREQ;
+    iTokenDuration = DEFAULT_TOKEN_DURATION;
+    iMqttBufferSize = DEFAULT_MQTT_BUFFER_SIZE;
+    iMqttKeepAlive = DEFAULT_MQTT_KEEPALIVE;
+    iSleepDelay = DEFAULT_SLEEP_DELAY;
+    iSleepMode = DEFAULT_SLEEP_MODE;
+    iDiagInterval = DEFAULT_DIAG_INTERVAL;
+    iSummaryInterval = DEFAULT_SUMMARY_INTERVAL;
+    iRawUpload = DEFAULT_RAW_UPLOAD;
+    iGatewayMode = DEFAULT_GATEWAY_MODE;
+    iCapture = DEFAULT_CAPTURE;
+    iTlsPinnedRoots = DEFAULT_TLS_PINNED_ROOTS;
+    memcpy(flaRatingThresholds, s_flaDefaultThresholds, sizeof(flaRatingThresholds));
+    iTwinVersion = 0;
+}
+
+void stationConfig::Load()
+{
+    Defaults();
+
+    Preferences prefs;
+    if( !prefs.begin(CONFIG_NAMESPACE, true) ) // Namespace doesn't exist yet on a fresh device
+        return;
+
+    iRequestDelay = prefs.getInt("reqDelay", iRequestDelay);
+    iDisplayDelay = prefs.getInt("dispDelay", iDisplayDelay);
+    iI2CFreq = prefs.getInt("i2cFreq", iI2CFreq);
+    iTokenDuration = prefs.getInt("tokenDur", iTokenDuration);
+    iMqttBufferSize = prefs.getInt("mqttBuf", iMqttBufferSize);
+    iMqttKeepAlive = prefs.getInt("keepAlive", iMqttKeepAlive);
+    iSleepDelay = prefs.getInt("sleepDelay", iSleepDelay);
+    iSleepMode = prefs.getInt("sleepMode", iSleepMode);
+    iDiagInterval = prefs.getInt("diagInterval", iDiagInterval);
+    iSummaryInterval = prefs.getInt("summaryInt", iSummaryInterval);
+    iRawUpload = prefs.getInt("rawUpload", iRawUpload);
+    iGatewayMode = prefs.getInt("gatewayMode", iGatewayMode);
+    iCapture = prefs.getInt("capture", iCapture);
+    iTlsPinnedRoots = prefs.getInt("tlsPinned", iTlsPinnedRoots);
+    iTwinVersion = prefs.getInt("twinVer", iTwinVersion);
+    if( prefs.getBytesLength("thresholds") == sizeof(flaRatingThresholds) )
+        prefs.getBytes("thresholds", flaRatingThresholds, sizeof(flaRatingThresholds));
+
+    prefs.end();
+}
+
+void stationConfig::Save()
+{
+    Preferences prefs;
+    if( !prefs.begin(CONFIG_NAMESPACE, false) )
+    {
+        LOGE(LOG_MOD_CFG, "Failed opening NVS for config");
+        return;
+    }
+
+    prefs.putInt("reqDelay", iRequestDelay);
+    prefs.putInt("dispDelay", iDisplayDelay);
+    prefs.putInt("i2cFreq", iI2CFreq);
+    prefs.putInt("tokenDur", iTokenDuration);
+    prefs.putInt("mqttBuf", iMqttBufferSize);
+    prefs.putInt("keepAlive", iMqttKeepAlive);
+    prefs.putInt("sleepDelay", iSleepDelay);
+    prefs.putInt("sleepMode", iSleepMode);
+    prefs.putInt("diagInterval", iDiagInterval);
+    prefs.putInt("summaryInt", iSummaryInterval);
+    prefs.putInt("rawUpload", iRawUpload);
+    prefs.putInt("gatewayMode", iGatewayMode);
+    prefs.putInt("capture", iCapture);
+    prefs.putInt("tlsPinned", iTlsPinnedRoots);
+    prefs.putInt("twinVer", iTwinVersion);
+    prefs.putBytes("thresholds", flaRatingThresholds, sizeof(flaRatingThresholds));
+
+    prefs.end();
+}
+
+// Only accept a value if it's present and sane, a typo in the portal shouldn't brick the station
+static bool ApplyInt(JsonObjectConst desired, const char *name, int &value, int min, int max)
+{
+    JsonVariantConst var = desired[name];
+    if( !var.is<int>() )
+        return false;
+
+    int newValue = var.as<int>();
+    if( newValue < min || newValue > max || newValue == value )
+        return false;
+
+    value = newValue;
+    return true;
+}
+
+bool stationConfig::ApplyDesired(JsonObjectConst desired)
+{
+    bool bChanged = false;
+
+    bChanged |= ApplyInt(desired, "requestDelay", iRequestDelay, 0, 1000);
+    bChanged |= ApplyInt(desired, "displayDelay", iDisplayDelay, 0, 10000);
+    bChanged |= ApplyInt(desired, "i2cFreq", iI2CFreq, 10000, 1000000);
+    bChanged |= ApplyInt(desired, "tokenDuration", iTokenDuration, 5, 24 * 60);
+    bChanged |= ApplyInt(desired, "mqttBufferSize", iMqttBufferSize, 512, 8192);
+    bChanged |= ApplyInt(desired, "mqttKeepAlive", iMqttKeepAlive, 5, 1177); // Hub's upper limit
+    bChanged |= ApplyInt(desired, "sleepDelay", iSleepDelay, 0, 24 * 60 * 60);
+    bChanged |= ApplyInt(desired, "sleepMode", iSleepMode, SLEEP_MODE_LIGHT, SLEEP_MODE_DEEP);
+    bChanged |= ApplyInt(desired, "diagInterval", iDiagInterval, 0, 24 * 60 * 60);
+    bChanged |= ApplyInt(desired, "summaryInterval", iSummaryInterval, 0, 24 * 60);
+    bChanged |= ApplyInt(desired, "rawUpload", iRawUpload, 0, 1);
+    bChanged |= ApplyInt(desired, "gatewayMode", iGatewayMode, 0, 2);
+    bChanged |= ApplyInt(desired, "capture", iCapture, 0, 1);
+    bChanged |= ApplyInt(desired, "tlsPinnedRoots", iTlsPinnedRoots, 0, 1);
+
+    JsonArrayConst thresholds = desired["ratingThresholds"];
+    if( !thresholds.isNull() && thresholds.size() == NUM_RATING_THRESHOLDS )
+    {
+        float flaNew[NUM_RATING_THRESHOLDS];
+        bool bValid = true;
+        for( int i = 0; i < NUM_RATING_THRESHOLDS; i++ )
+        {
+            flaNew[i] = thresholds[i] | -1.0f;
+            // Has to be descending, otherwise some ratings can never be reached
+            if( flaNew[i] < 0.0f || flaNew[i] > 1.0f || (i > 0 && flaNew[i] > flaNew[i - 1]) )
+                bValid = false;
+        }
+
+        if( bValid && memcmp(flaNew, flaRatingThresholds, sizeof(flaNew)) != 0 )
+        {
+            memcpy(flaRatingThresholds, flaNew, sizeof(flaNew));
+            bChanged = true;
+        }
+    }
+
+    JsonVariantConst version = desired["$version"];
+    if( version.is<int>() && version.as<int>() != iTwinVersion )
+    {
+        iTwinVersion = version.as<int>();
+        bChanged = true;
+    }
+
+    return bChanged;
+}
+
+size_t stationConfig::WriteReported(char *buffer, size_t size)
+{
+    StaticJsonDocument<512> doc;
+
+    doc["requestDelay"] = iRequestDelay;
+    doc["displayDelay"] = iDisplayDelay;
+    doc["i2cFreq"] = iI2CFreq;
+    doc["tokenDuration"] = iTokenDuration;
+    doc["mqttBufferSize"] = iMqttBufferSize;
+    doc["mqttKeepAlive"] = iMqttKeepAlive;
+    doc["sleepDelay"] = iSleepDelay;
+    doc["sleepMode"] = iSleepMode;
+    doc["diagInterval"] = iDiagInterval;
+    doc["summaryInterval"] = iSummaryInterval;
+    doc["rawUpload"] = iRawUpload;
+    doc["gatewayMode"] = iGatewayMode;
+    doc["capture"] = iCapture;
+    doc["tlsPinnedRoots"] = iTlsPinnedRoots;
+
+    JsonArray thresholds = doc.createNestedArray("ratingThresholds");
+    for( int i = 0; i < NUM_RATING_THRESHOLDS; i++ )
+        thresholds.add(flaRatingThresholds[i]);
+
+    // Lets the backend see which desired version the station actually runs with
+    doc["appliedVersion"] = iTwinVersion;
+    // And which menu catalog, the next delta goes from there
+    doc["catalogVersion"] = catalogGetVersion();
+    // And how many items a delta can have, over that it doesn't make it through the MQTT buffer
+    doc["catalogMaxDelta"] = catalogGetMaxDelta();
+
+    return serializeJson(doc, buffer, size);
+}
+
+int stationConfig::GetRating(float flPercentage)
+{
+    for( int i = 0; i < NUM_RATING_THRESHOLDS; i++ )
+    {
+        if( flPercentage >= flaRatingThresholds[i] )
+            return i;
+    }
+
+    return NUM_RATING_THRESHOLDS;
+}
+
+void stationConfig::Print()
+{
+    // Each under LOG_LINE_LEN, even with every value at its longest
+    LOGI(LOG_MOD_CFG, "RequestDelay %d, DisplayDelay %d, I2CFreq %d, TokenDuration %d, MqttBufferSize %d, MqttKeepAlive %d",
+        iRequestDelay, iDisplayDelay, iI2CFreq, iTokenDuration, iMqttBufferSize, iMqttKeepAlive);
+    LOGI(LOG_MOD_CFG, "SleepDelay %d, SleepMode %d, DiagInterval %d, SummaryInterval %d, RawUpload %d",
+        iSleepDelay, iSleepMode, iDiagInterval, iSummaryInterval, iRawUpload);
+    LOGI(LOG_MOD_CFG, "GatewayMode %d, Capture %d, TlsPinnedRoots %d", iGatewayMode, iCapture, iTlsPinnedRoots);
+
+    char szThresholds[NUM_RATING_THRESHOLDS * 8] = "";
+    int iLen = 0;
+    for( int i = 0; i < NUM_RATING_THRESHOLDS && iLen < (int)sizeof(szThresholds); i++ )
+        iLen += snprintf(szThresholds + iLen, sizeof(szThresholds) - iLen, " %.2f", flaRatingThresholds[i]);
+    LOGI(LOG_MOD_CFG, "Thresholds%s, TwinVersion %d", szThresholds, iTwinVersion);
+}
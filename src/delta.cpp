@@ -0,0 +1,171 @@
+#include <Arduino.h>
+
+#include "delta.h"
+
+void CDeltaDecoder::Reset()
+{
+    m_header = {};
+    m_iStep = STEP_HEADER;
+    m_iResult = DELTA_OK;
+    m_uHeaderRead = 0;
+    m_uVarint = 0;
+    m_iVarintShift = 0;
+    m_uWritten = 0;
+}
+
+int CDeltaDecoder::ReadVarint(uint8_t b, uint32_t &uValue)
+{
+    // 5 bytes hold 32 bits, a longer one is garbage
+    if( m_iVarintShift > 28 )
+        return DELTA_ERR_OP;
+
+    m_uVarint |= (uint32_t)(b & 0x7F) << m_iVarintShift;
+    m_iVarintShift += 7;
+    if( b & 0x80 )
+        return DELTA_OK;
+
+    uValue = m_uVarint;
+    m_uVarint = 0;
+    m_iVarintShift = 0;
+    return DELTA_DONE;
+}
+
+// Everything that goes out also goes into the window, that's what back-references read
+int CDeltaDecoder::Emit(const uint8_t *data, size_t length)
+{
+    if( length > m_header.uTargetSize - m_uWritten )
+        return DELTA_ERR_RANGE;
+    if( !m_sink.write(data, length) )
+        return DELTA_ERR_IO;
+
+    for( size_t i = 0; i < length; )
+    {
+        size_t uPos = (m_uWritten + i) & (DELTA_WINDOW - 1);
+        size_t uRun = min(length - i, (size_t)DELTA_WINDOW - uPos);
+        memcpy(m_window + uPos, data + i, uRun);
+        i += uRun;
+    }
+    m_uWritten += length;
+    return DELTA_OK;
+}
+
+// Copy and back-reference have both their numbers, they need no more input
+int CDeltaDecoder::RunOp()
+{
+    uint32_t uLength = m_uArg2;
+    if( uLength > m_header.uTargetSize - m_uWritten )
+        return DELTA_ERR_RANGE;
+
+    if( m_uOp == DELTA_OP_COPY )
+    {
+        if( m_uArg1 > m_header.uBaseSize || uLength > m_header.uBaseSize - m_uArg1 )
+            return DELTA_ERR_RANGE;
+
+        for( uint32_t uDone = 0; uDone < uLength; )
+        {
+            size_t uChunk = min((size_t)(uLength - uDone), sizeof(m_buffer));
+            if( !m_sink.readBase(m_uArg1 + uDone, m_buffer, uChunk) )
+                return DELTA_ERR_IO;
+            int iResult = Emit(m_buffer, uChunk);
+            if( iResult != DELTA_OK )
+                return iResult;
+            uDone += uChunk;
+        }
+        return DELTA_OK;
+    }
+
+    uint32_t uDistance = m_uArg1;
+    if( uDistance == 0 || uDistance > DELTA_WINDOW || uDistance > m_uWritten )
+        return DELTA_ERR_RANGE;
+
+    // A distance shorter than the length repeats what it just wrote, so it goes a byte at a time
+    // through the window rather than reading it in one go
+    for( uint32_t uDone = 0; uDone < uLength; )
+    {
+        size_t uChunk = min((size_t)(uLength - uDone), sizeof(m_buffer));
+        for( size_t i = 0; i < uChunk; i++ )
+        {
+            uint32_t uPos = m_uWritten + i;
+            uint8_t b = m_window[(uPos - uDistance) & (DELTA_WINDOW - 1)];
+            m_window[uPos & (DELTA_WINDOW - 1)] = b;
+            m_buffer[i] = b;
+        }
+        if( !m_sink.write(m_buffer, uChunk) )
+            return DELTA_ERR_IO;
+        m_uWritten += uChunk;
+        uDone += uChunk;
+    }
+    return DELTA_OK;
+}
+
+int CDeltaDecoder::Feed(const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+    while( m_iResult == DELTA_OK && i < length )
+    {
+        switch( m_iStep )
+        {
+            case STEP_HEADER:
+            {
+                size_t uCopy = min(length - i, sizeof(m_header) - m_uHeaderRead);
+                memcpy((uint8_t *)&m_header + m_uHeaderRead, data + i, uCopy);
+                m_uHeaderRead += uCopy;
+                i += uCopy;
+                if( m_uHeaderRead < sizeof(m_header) )
+                    break;
+
+                if( m_header.uMagic != DELTA_MAGIC || (m_sink.onHeader && !m_sink.onHeader(m_header)) )
+                    m_iResult = DELTA_ERR_HEADER;
+                m_iStep = STEP_OP;
+            }
+            break;
+
+            case STEP_OP:
+                m_uOp = data[i++];
+                if( m_uOp < DELTA_OP_COPY || m_uOp > DELTA_OP_BACKREF )
+                    m_iResult = DELTA_ERR_OP;
+                m_iStep = STEP_ARG1;
+            break;
+
+            case STEP_ARG1:
+            {
+                int iResult = ReadVarint(data[i++], m_uArg1);
+                if( iResult == DELTA_DONE )
+                    m_iStep = m_uOp == DELTA_OP_LITERAL ? (m_uArg1 ? STEP_LITERAL : STEP_OP) : STEP_ARG2;
+                else if( iResult != DELTA_OK )
+                    m_iResult = iResult;
+            }
+            break;
+
+            case STEP_ARG2:
+            {
+                int iResult = ReadVarint(data[i++], m_uArg2);
+                if( iResult == DELTA_DONE )
+                {
+                    m_iResult = RunOp();
+                    m_iStep = STEP_OP;
+                }
+                else if( iResult != DELTA_OK )
+                    m_iResult = iResult;
+            }
+            break;
+
+            case STEP_LITERAL:
+            {
+                // Straight from the download buffer, however the pieces fall
+                size_t uCopy = min(length - i, (size_t)m_uArg1);
+                m_iResult = Emit(data + i, uCopy);
+                i += uCopy;
+                m_uArg1 -= uCopy;
+                if( m_uArg1 == 0 )
+                    m_iStep = STEP_OP;
+            }
+            break;
+        }
+
+        if( m_iResult == DELTA_OK && m_iStep == STEP_OP && m_uHeaderRead == sizeof(m_header) && m_uWritten == m_header.uTargetSize )
+            m_iResult = DELTA_DONE;
+    }
+
+    return m_iResult;
+}
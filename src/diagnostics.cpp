@@ -0,0 +1,268 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <WiFi.h>
+#include <esp_system.h>
+
+#include "diagnostics.h"
+#include "config.h"
+#include "iothub.h"
+#include "log.h"
+#include "i2cbus.h"
+
+extern CIoTHub g_IoTHub;
+
+#define DIAG_RING_MAGIC 0x44494148 // Change whenever diagSample does
+
+// Lives through panics, watchdog and software resets, which is exactly when we need it.
+// After a power on its contents are garbage, the magic and the bounds catch that
+struct diagRing {
+  uint32_t uMagic;
+  uint32_t uBoots;
+  uint32_t uHead;
+  uint32_t uCount;
+  diagSample samples[DIAG_RING_LEN];
+};
+
+RTC_NOINIT_ATTR static diagRing s_ring;
+
+struct diagTask {
+  const char *name;
+  TaskHandle_t hTask;
+};
+
+static diagTask s_tasks[DIAG_MAX_TASKS];
+
+static CI2CBus *s_paBuses[DIAG_I2C_BUSES] = { &g_CamBus, &g_NfcBus };
+static int s_iTasks = 0;
+
+static esp_reset_reason_t s_resetReason = ESP_RST_UNKNOWN;
+// Last sample of the previous boot, goes out with the first message
+static diagSample s_prevSample;
+static bool s_bHavePrev = false;
+
+static uint64_t s_ullUptimeMs = 0;
+static unsigned long s_ulLastMillis = 0;
+static uint64_t s_ullNextSample = 0;
+static uint64_t s_ullNextPublish = 0;
+
+void registerDiagTask(const char *name, TaskHandle_t hTask)
+{
+    if( s_iTasks == DIAG_MAX_TASKS )
+        return;
+
+    s_tasks[s_iTasks].name = name;
+    s_tasks[s_iTasks].hTask = hTask;
+    s_iTasks++;
+}
+
+static void PrintSample(const diagSample &sample)
+{
+    Serial.printf("  %lu s: heap %u (largest %u, min %u), stack", (unsigned long)sample.ulUptimeS,
+        (unsigned)sample.uFreeHeap, (unsigned)sample.uLargestBlock, (unsigned)sample.uMinFreeHeap);
+    for( int i = 0; i < s_iTasks; i++ )
+        Serial.printf(" %s %u", s_tasks[i].name, sample.uaStackFree[i]);
+    Serial.printf(", mqtt %u/%u, rssi %d, connects %u, failures %u",
+        sample.uMqttPeak, sample.uMqttBuffer, sample.iRssi, sample.uConnects, sample.uFailures);
+    for( int i = 0; i < DIAG_I2C_BUSES; i++ )
+        Serial.printf(", %s %u.%u%% busy, %u errors, %u resets", s_paBuses[i]->GetName(), sample.uaI2CUtil[i] / 10, sample.uaI2CUtil[i] % 10,
+            sample.uaI2CErrors[i], sample.uaI2CRecoveries[i]);
+    Serial.println();
+}
+
+void setupDiagnostics()
+{
+    s_resetReason = esp_reset_reason();
+    registerDiagTask("loopTask", xTaskGetCurrentTaskHandle());
+
+    bool bValid = s_ring.uMagic == DIAG_RING_MAGIC && s_ring.uHead < DIAG_RING_LEN && s_ring.uCount <= DIAG_RING_LEN;
+    if( !bValid || s_resetReason == ESP_RST_POWERON || s_resetReason == ESP_RST_BROWNOUT )
+    {
+        memset(&s_ring, 0, sizeof(s_ring));
+        s_ring.uMagic = DIAG_RING_MAGIC;
+    }
+    s_ring.uBoots++;
+
+    if( s_ring.uCount == 0 )
+        return;
+
+    Serial.printf("Reset reason %d, last %u samples before it:\n", (int)s_resetReason, (unsigned)s_ring.uCount);
+    for( uint32_t i = 0; i < s_ring.uCount; i++ )
+        PrintSample(s_ring.samples[(s_ring.uHead + DIAG_RING_LEN - s_ring.uCount + i) % DIAG_RING_LEN]);
+
+    s_prevSample = s_ring.samples[(s_ring.uHead + DIAG_RING_LEN - 1) % DIAG_RING_LEN];
+    s_bHavePrev = true;
+    s_ring.uCount = 0;
+}
+
+static void TakeSample(diagSample &sample)
+{
+    memset(&sample, 0, sizeof(sample));
+    sample.ulUptimeS = (uint32_t)(s_ullUptimeMs / 1000);
+    sample.uFreeHeap = ESP.getFreeHeap();
+    sample.uLargestBlock = ESP.getMaxAllocHeap();
+    sample.uMinFreeHeap = ESP.getMinFreeHeap();
+
+    // ESP-IDF gives the high-water mark in bytes, not words
+    for( int i = 0; i < s_iTasks; i++ )
+        sample.uaStackFree[i] = (uint16_t)min((UBaseType_t)0xFFFF, uxTaskGetStackHighWaterMark(s_tasks[i].hTask));
+
+    sample.uMqttPeak = (uint16_t)min((size_t)0xFFFF, g_IoTHub.GetPublishPeak());
+    sample.uMqttBuffer = (uint16_t)g_IoTHub.GetBufferSize();
+    sample.iRssi = WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : 0;
+
+    const connectionStats &stats = g_IoTHub.GetStats();
+    sample.uConnects = (uint16_t)stats.iConnects;
+    sample.uFailures = (uint16_t)stats.iFailures;
+
+    for( int i = 0; i < DIAG_I2C_BUSES; i++ )
+    {
+        CI2CBus *bus = s_paBuses[i];
+        sample.uaI2CUtil[i] = (uint16_t)(bus->GetUtilisation() * 10);
+        sample.uaI2CErrors[i] = (uint16_t)min(bus->GetErrors(), (uint32_t)0xFFFF);
+        sample.uaI2CRecoveries[i] = (uint16_t)min(bus->GetRecoveries(), (uint32_t)0xFFFF);
+        bus->ResetWindow();
+    }
+}
+
+static void WriteSample(JsonObject obj, const diagSample &sample)
+{
+    obj["uptime"] = sample.ulUptimeS;
+
+    JsonObject heap = obj.createNestedObject("heap");
+    heap["free"] = sample.uFreeHeap;
+    heap["largest"] = sample.uLargestBlock;
+    heap["min"] = sample.uMinFreeHeap;
+    // How much of the free heap can't be had in one piece
+    heap["frag"] = sample.uFreeHeap ? 100 - (int)((uint64_t)sample.uLargestBlock * 100 / sample.uFreeHeap) : 0;
+
+    JsonObject stack = obj.createNestedObject("stackFree");
+    for( int i = 0; i < s_iTasks; i++ )
+        stack[s_tasks[i].name] = sample.uaStackFree[i];
+
+    obj["mqttPeak"] = sample.uMqttPeak;
+    obj["mqttBuffer"] = sample.uMqttBuffer;
+    obj["rssi"] = sample.iRssi;
+    obj["connects"] = sample.uConnects;
+    obj["failures"] = sample.uFailures;
+
+    JsonObject i2c = obj.createNestedObject("i2c");
+    for( int i = 0; i < DIAG_I2C_BUSES; i++ )
+    {
+        JsonObject bus = i2c.createNestedObject(s_paBuses[i]->GetName());
+        bus["util"] = sample.uaI2CUtil[i] / 10.0f;
+        bus["errors"] = sample.uaI2CErrors[i];
+        bus["resets"] = sample.uaI2CRecoveries[i];
+    }
+}
+
+// Per device, only what this boot has seen
+static void WriteI2CDevices(JsonObject obj)
+{
+    for( int i = 0; i < DIAG_I2C_BUSES; i++ )
+    {
+        CI2CBus *bus = s_paBuses[i];
+        JsonObject devices = obj.createNestedObject(bus->GetName());
+        for( int j = 0; j < bus->GetDeviceCount(); j++ )
+        {
+            const i2cDeviceStats &device = bus->GetDevice(j);
+            char szAddress[8];
+            snprintf(szAddress, sizeof(szAddress), "0x%02x", device.uAddress);
+
+            // Transactions, errors, NACKs, timeouts
+            JsonArray counts = devices.createNestedArray(szAddress);
+            counts.add(device.uTransactions);
+            counts.add(device.uErrors);
+            counts.add(device.uNacks);
+            counts.add(device.uTimeouts);
+        }
+    }
+}
+
+static char s_szData[896];
+
+static bool Fits(JsonDocument &doc)
+{
+    return !doc.overflowed() && measureJson(doc) < sizeof(s_szData);
+}
+
+static void WriteMessage(JsonDocument &doc, const diagSample &sample, bool bBeforeReset)
+{
+    doc.clear();
+    JsonObject root = doc.to<JsonObject>();
+    root["boot"] = s_ring.uBoots;
+    root["resetReason"] = (int)s_resetReason;
+    root["lastOutageMs"] = g_IoTHub.GetStats().ulLastOutageMs;
+    root["logDropped"] = logGetDropped();
+    WriteSample(root, sample);
+    WriteI2CDevices(root.createNestedObject("i2cDevices"));
+    if( bBeforeReset )
+        WriteSample(root.createNestedObject("beforeReset"), s_prevSample);
+}
+
+// The sample from before the reset on its own, when it doesn't fit along with the rest
+static void PublishBeforeReset()
+{
+    StaticJsonDocument<640> doc;
+    JsonObject root = doc.to<JsonObject>();
+    root["boot"] = s_ring.uBoots;
+    root["resetReason"] = (int)s_resetReason;
+    WriteSample(root.createNestedObject("beforeReset"), s_prevSample);
+    if( !Fits(doc) )
+    {
+        LOGE(LOG_MOD_DIAG, "Sample from before the reset doesn't fit %u bytes, dropped", (unsigned)sizeof(s_szData));
+        s_bHavePrev = false;
+        return;
+    }
+
+    size_t len = serializeJson(doc, s_szData, sizeof(s_szData));
+    if( g_IoTHub.publishDiagnostics(s_szData, len) )
+        s_bHavePrev = false;
+}
+
+static void Publish(const diagSample &sample)
+{
+    // What things looked like right before the reset, only once per boot. Along with the rest
+    // if there's room, a message of its own otherwise. More I2C devices or tasks make it grow
+    StaticJsonDocument<1280> doc;
+    bool bBeforeReset = s_bHavePrev;
+    WriteMessage(doc, sample, bBeforeReset);
+    if( bBeforeReset && !Fits(doc) )
+    {
+        bBeforeReset = false;
+        WriteMessage(doc, sample, false);
+        PublishBeforeReset();
+    }
+
+    if( !Fits(doc) )
+    {
+        LOGE(LOG_MOD_DIAG, "Diagnostics don't fit %u bytes, not sent", (unsigned)sizeof(s_szData));
+        return;
+    }
+
+    size_t len = serializeJson(doc, s_szData, sizeof(s_szData));
+    if( g_IoTHub.publishDiagnostics(s_szData, len) && bBeforeReset )
+        s_bHavePrev = false;
+}
+
+void updateDiagnostics()
+{
+    unsigned long ulNow = millis();
+    s_ullUptimeMs += ulNow - s_ulLastMillis; // millis() wraps after 49 days, this doesn't
+    s_ulLastMillis = ulNow;
+
+    if( s_ullUptimeMs < s_ullNextSample )
+        return;
+    s_ullNextSample = s_ullUptimeMs + DIAG_SAMPLE_INTERVAL * 1000ULL;
+
+    diagSample &sample = s_ring.samples[s_ring.uHead];
+    TakeSample(sample);
+    s_ring.uHead = (s_ring.uHead + 1) % DIAG_RING_LEN;
+    if( s_ring.uCount < DIAG_RING_LEN )
+        s_ring.uCount++;
+
+    if( g_Config.iDiagInterval == 0 || s_ullUptimeMs < s_ullNextPublish || !g_IoTHub.IsConnected() )
+        return;
+    s_ullNextPublish = s_ullUptimeMs + g_Config.iDiagInterval * 1000ULL;
+
+    Publish(sample);
+}
@@ -0,0 +1,169 @@
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "events.h"
+
+CEventQueue g_Events;
+
+static int s_iButtonPin = -1;
+static int s_iNfcIrqPin = -1;
+static TaskHandle_t s_hConsumer = NULL;
+static std::atomic<bool> s_bWakeRequested{false};
+
+static uint32_t s_ulLastButtonEdgeUs = 0;
+static int s_iButtonLevel = HIGH;
+static bool s_bPressCandidate = false;
+static uint32_t s_ulCandidateUs = 0;
+
+bool IRAM_ATTR CEventQueue::Push(const inputEvent &event)
+{
+    uint32_t uTail = m_uTail.load(std::memory_order_relaxed);
+    if( uTail - m_uHead.load(std::memory_order_acquire) == EVENT_QUEUE_LEN )
+    {
+        m_uDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_events[uTail & (EVENT_QUEUE_LEN - 1)] = event;
+    m_uTail.store(uTail + 1, std::memory_order_release);
+    return true;
+}
+
+bool CEventQueue::Pop(inputEvent &event)
+{
+    uint32_t uHead = m_uHead.load(std::memory_order_relaxed);
+    if( uHead == m_uTail.load(std::memory_order_acquire) )
+        return false;
+
+    event = m_events[uHead & (EVENT_QUEUE_LEN - 1)];
+    m_uHead.store(uHead + 1, std::memory_order_release);
+    return true;
+}
+
+static void IRAM_ATTR PushFromISR(uint8_t type, int iPin)
+{
+    inputEvent event;
+    event.type = type;
+    event.level = digitalRead(iPin);
+    event.ulTimeUs = micros();
+    g_Events.Push(event);
+
+    BaseType_t bWoken = pdFALSE;
+    if( s_hConsumer )
+        vTaskNotifyGiveFromISR(s_hConsumer, &bWoken);
+    if( bWoken )
+        portYIELD_FROM_ISR();
+}
+
+static void IRAM_ATTR ButtonInterrupt()
+{
+    PushFromISR(EVENT_BUTTON_EDGE, s_iButtonPin);
+}
+
+static void IRAM_ATTR NfcInterrupt()
+{
+    PushFromISR(EVENT_NFC_IRQ, s_iNfcIrqPin);
+}
+
+void attachEventInterrupts()
+{
+    // Both edges, debouncing needs to know when the line last moved
+    attachInterrupt(s_iButtonPin, ButtonInterrupt, CHANGE);
+    attachInterrupt(s_iNfcIrqPin, NfcInterrupt, RISING);
+}
+
+void setupEvents(int iButtonPin, int iNfcIrqPin)
+{
+    s_iButtonPin = iButtonPin;
+    s_iNfcIrqPin = iNfcIrqPin;
+    s_hConsumer = xTaskGetCurrentTaskHandle();
+
+    pinMode(iButtonPin, INPUT_PULLUP);
+    attachEventInterrupts();
+}
+
+// Presses pull the line low. The level read in the ISR is only a snapshot of a bouncing line, so the
+// first edge after a quiet period just makes a candidate, and it's a press if the line is still low
+// BUTTON_DEBOUNCE_MS later. Edges in between are the bouncing, and so is anything right after it
+static void OnButtonEdge(const inputEvent &event)
+{
+    bool bQuiet = event.ulTimeUs - s_ulLastButtonEdgeUs > BUTTON_DEBOUNCE_MS * 1000UL;
+    s_ulLastButtonEdgeUs = event.ulTimeUs;
+    // The last edge's snapshot is right, nothing moved the line after it
+    s_iButtonLevel = event.level;
+
+    if( bQuiet && !s_bPressCandidate )
+    {
+        s_bPressCandidate = true;
+        s_ulCandidateUs = event.ulTimeUs;
+    }
+}
+
+// µs until the candidate can be looked at as of ulNowUs, 0 if it's due
+static uint32_t CandidateDueUs(uint32_t ulNowUs)
+{
+    uint32_t ulElapsedUs = ulNowUs - s_ulCandidateUs;
+    return ulElapsedUs >= BUTTON_DEBOUNCE_MS * 1000UL ? 0 : BUTTON_DEBOUNCE_MS * 1000UL - ulElapsedUs;
+}
+
+// iLevel is the line's level once the candidate was due, high again means it was the release or a glitch
+static bool ConfirmPress(inputEvent &event, int iLevel)
+{
+    s_bPressCandidate = false;
+    if( iLevel != LOW )
+        return false;
+
+    event.type = EVENT_BUTTON_PRESS;
+    event.level = LOW;
+    event.ulTimeUs = s_ulCandidateUs;
+    return true;
+}
+
+bool getEvent(inputEvent &event, unsigned long ulTimeoutMs)
+{
+    unsigned long ulStart = millis();
+    for( ;; )
+    {
+        while( g_Events.Pop(event) )
+        {
+            if( event.type != EVENT_BUTTON_EDGE )
+                return true;
+
+            // loop() was busy past the candidate's time, the line only moved after it so it was at the level before this edge
+            inputEvent press;
+            bool bPress = s_bPressCandidate && CandidateDueUs(event.ulTimeUs) == 0 && ConfirmPress(press, s_iButtonLevel);
+            OnButtonEdge(event);
+            if( bPress )
+            {
+                event = press;
+                return true;
+            }
+        }
+
+        // Nothing since the last edge, the line is still where it went
+        if( s_bPressCandidate && CandidateDueUs(micros()) == 0 && ConfirmPress(event, digitalRead(s_iButtonPin)) )
+            return true;
+
+        if( s_bWakeRequested.exchange(false, std::memory_order_acq_rel) )
+            return false;
+
+        unsigned long ulWaited = millis() - ulStart;
+        if( ulWaited >= ulTimeoutMs )
+            return false;
+
+        // Back in time to look at a candidate press. An ISR that pushed after the Pop() above
+        // has already notified us, so this returns right away
+        unsigned long ulWait = ulTimeoutMs - ulWaited;
+        if( s_bPressCandidate )
+            ulWait = min(ulWait, (unsigned long)(CandidateDueUs(micros()) + 999) / 1000);
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ulWait));
+    }
+}
+
+void wakeEventLoop()
+{
+    s_bWakeRequested.store(true, std::memory_order_release);
+    if( s_hConsumer )
+        xTaskNotifyGive(s_hConsumer);
+}
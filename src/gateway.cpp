@@ -0,0 +1,496 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_now.h>
+#include <esp_system.h>
+#include <atomic>
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+
+#include "gateway.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+#include "events.h"
+
+extern CIoTHub g_IoTHub;
+
+#define GATEWAY_STATION_IDLE 600000 // ms without a frame before a station's slot can go to a new one
+
+static const uint8_t s_broadcastMac[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+static gatewayStats s_stats = {};
+static bool s_bStarted = false;
+static int s_iMode = GATEWAY_MODE_OFF; // Taken from the config at boot, a twin change applies after a restart
+// Gateway: the key every station's is derived from. Downstream: our own station key
+static uint8_t s_key[GATEWAY_KEY_LEN];
+
+/* Gateway side */
+
+struct gatewayFrame {
+  char szId[GATEWAY_MAX_ID_LEN + 1];
+  uint8_t mac[ESP_NOW_ETH_ALEN];
+  bool bHaveMac; // Came over ESP-NOW and gets an ack
+  uint32_t uBoot;
+  uint16_t uSeq;
+  uint16_t uLength;
+  char szPayload[TELEMETRY_MAX_LEN];
+};
+
+struct gatewayStation {
+  char szId[GATEWAY_MAX_ID_LEN + 1]; // Empty for a free slot
+  uint32_t uLastBoot;
+  uint16_t uLastSeq;
+  bool bHaveSeq;
+  unsigned long ulLastSeen;
+  char aQueue[GATEWAY_STATION_QUEUE][TELEMETRY_MAX_LEN];
+  int iHead;
+  int iCount;
+};
+
+// Filled by the Wi-Fi task, emptied by loop(), same single producer/single consumer deal as the input events
+static gatewayFrame s_rxFrames[GATEWAY_RX_QUEUE];
+static std::atomic<uint32_t> s_uRxHead{0};
+static std::atomic<uint32_t> s_uRxTail{0};
+static std::atomic<uint32_t> s_uRxRejected{0};
+
+static gatewayStation s_stations[GATEWAY_MAX_STATIONS];
+static int s_iNextStation = 0; // Round robin, where the next publish starts looking
+
+/* Downstream side */
+
+static char s_aOutQueue[TELEMETRY_QUEUE_LEN][TELEMETRY_MAX_LEN];
+static uint16_t s_uaOutSeq[TELEMETRY_QUEUE_LEN];
+static int s_iOutHead = 0;
+static int s_iOutCount = 0;
+static uint16_t s_uNextSeq = 1;
+static uint32_t s_uBoot = 0; // Every deep sleep wake is a boot, so the gateway tells our sequences apart by this
+static unsigned long s_ulLastSend = 0;
+static bool s_bSentOnce = false;
+
+// Written by the Wi-Fi task when the gateway acks, the low 16 bits are the sequence, bit 16 says there's one
+static std::atomic<uint32_t> s_uAcked{0};
+static uint8_t s_gatewayMac[ESP_NOW_ETH_ALEN];
+static std::atomic<bool> s_bHaveGatewayMac{false};
+
+// Ends up in an MQTT property, so keep it to what device IDs are made of
+static bool IsValidId(const char *id, size_t length)
+{
+    if( length == 0 || length > GATEWAY_MAX_ID_LEN )
+        return false;
+
+    for( size_t i = 0; i < length; i++ )
+    {
+        char c = id[i];
+        if( !isalnum((unsigned char)c) && c != '-' && c != '.' && c != '_' && c != ':' )
+            return false;
+    }
+    return true;
+}
+
+static bool AddPeer(const uint8_t *mac)
+{
+    if( esp_now_is_peer_exist(mac) )
+        return true;
+
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, mac, ESP_NOW_ETH_ALEN);
+    peer.channel = 0; // Whatever the station interface is on, i.e. the AP's channel
+    peer.ifidx = WIFI_IF_STA;
+    // ESP-NOW's own encryption wants every peer's MAC and key added up front and takes a few peers at
+    // most, the tag on each frame is what tells us who sent it
+    peer.encrypt = false;
+    return esp_now_add_peer(&peer) == ESP_OK;
+}
+
+static void Hmac(const uint8_t *key, const uint8_t *data, size_t length, uint8_t *out)
+{
+    mbedtls_md_context_t ctx;
+    mbedtls_md_init(&ctx);
+    mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+    mbedtls_md_hmac_starts(&ctx, key, GATEWAY_KEY_LEN);
+    mbedtls_md_hmac_update(&ctx, data, length);
+    mbedtls_md_hmac_finish(&ctx, out);
+    mbedtls_md_free(&ctx);
+}
+
+static void StationKey(const char *id, size_t idLength, uint8_t *key)
+{
+    if( s_iMode == GATEWAY_MODE_GATEWAY )
+        Hmac(s_key, (const uint8_t *)id, idLength, key);
+    else
+        memcpy(key, s_key, GATEWAY_KEY_LEN);
+}
+
+// Same time whichever byte differs
+static bool TagMatches(const uint8_t *frame, size_t length, const uint8_t *key)
+{
+    uint8_t expected[32];
+    Hmac(key, frame, length, expected);
+
+    uint8_t uDiff = 0;
+    for( int i = 0; i < GATEWAY_TAG_LEN; i++ )
+        uDiff |= expected[i] ^ frame[length + i];
+    return uDiff == 0;
+}
+
+static bool SendFrame(const uint8_t *mac, uint8_t uType, const char *id, uint32_t uBoot, uint16_t uSeq, const char *payload, size_t length)
+{
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    size_t idLength = strlen(id);
+    if( sizeof(gatewayHeader) + idLength + length + GATEWAY_TAG_LEN > sizeof(frame) )
+        return false;
+
+    gatewayHeader header = { GATEWAY_MAGIC, uType, (uint8_t)idLength, uBoot, uSeq };
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), id, idLength);
+    if( length )
+        memcpy(frame + sizeof(header) + idLength, payload, length);
+
+    size_t frameLength = sizeof(header) + idLength + length;
+    uint8_t key[GATEWAY_KEY_LEN];
+    uint8_t tag[32];
+    StationKey(id, idLength, key);
+    Hmac(key, frame, frameLength, tag);
+    memcpy(frame + frameLength, tag, GATEWAY_TAG_LEN);
+
+    return esp_now_send(mac, frame, frameLength + GATEWAY_TAG_LEN) == ESP_OK;
+}
+
+// Wi-Fi task
+static void OnReceive(const uint8_t *mac, const uint8_t *data, int length)
+{
+    if( length < (int)sizeof(gatewayHeader) )
+        return;
+
+    gatewayHeader header;
+    memcpy(&header, data, sizeof(header));
+    if( header.uMagic != GATEWAY_MAGIC || sizeof(header) + header.uIdLen + GATEWAY_TAG_LEN > (size_t)length )
+        return;
+
+    const char *id = (const char *)data + sizeof(header);
+    const uint8_t *payload = data + sizeof(header) + header.uIdLen;
+    size_t payloadLength = length - sizeof(header) - header.uIdLen - GATEWAY_TAG_LEN;
+    uint8_t key[GATEWAY_KEY_LEN];
+
+    if( header.uType == GATEWAY_FRAME_TELEMETRY && s_iMode == GATEWAY_MODE_GATEWAY )
+    {
+        // Anyone in radio range can send us frames, only the station with the key for that ID gets published
+        char szId[GATEWAY_MAX_ID_LEN + 1];
+        if( !IsValidId(id, header.uIdLen) )
+        {
+            s_uRxRejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        StationKey(id, header.uIdLen, key);
+        if( !TagMatches(data, length - GATEWAY_TAG_LEN, key) )
+        {
+            s_uRxRejected.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        memcpy(szId, id, header.uIdLen);
+        szId[header.uIdLen] = '\0';
+        gatewaySubmit(szId, header.uBoot, header.uSeq, payload, payloadLength, mac);
+    }
+    else if( header.uType == GATEWAY_FRAME_ACK && s_iMode == GATEWAY_MODE_DOWNSTREAM )
+    {
+        // Only acks for us, the gateway answers every station on the same channel. And for this boot,
+        // a late ack from before a reset could have the same sequence
+        const char *ourId = g_IoTHub.GetDeviceID();
+        if( strlen(ourId) != header.uIdLen || memcmp(ourId, id, header.uIdLen) != 0 || header.uBoot != s_uBoot )
+            return;
+
+        // A forged ack would have us drop ratings the gateway never got
+        StationKey(id, header.uIdLen, key);
+        if( !TagMatches(data, length - GATEWAY_TAG_LEN, key) )
+            return;
+
+        if( !s_bHaveGatewayMac.load(std::memory_order_acquire) )
+        {
+            memcpy(s_gatewayMac, mac, ESP_NOW_ETH_ALEN);
+            s_bHaveGatewayMac.store(true, std::memory_order_release);
+        }
+        s_uAcked.store(0x10000 | header.uSeq, std::memory_order_release);
+    }
+}
+
+bool gatewaySubmit(const char *stationId, uint32_t uBoot, uint16_t uSeq, const uint8_t *payload, size_t length, const uint8_t *mac)
+{
+    uint32_t uTail = s_uRxTail.load(std::memory_order_relaxed);
+    if( uTail - s_uRxHead.load(std::memory_order_acquire) >= GATEWAY_RX_QUEUE || length >= TELEMETRY_MAX_LEN )
+    {
+        // No ack goes out for it, the station sends it again
+        s_uRxRejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    gatewayFrame &frame = s_rxFrames[uTail % GATEWAY_RX_QUEUE];
+    strncpy(frame.szId, stationId, GATEWAY_MAX_ID_LEN);
+    frame.szId[GATEWAY_MAX_ID_LEN] = '\0';
+    frame.bHaveMac = mac != nullptr;
+    if( mac )
+        memcpy(frame.mac, mac, ESP_NOW_ETH_ALEN);
+    frame.uBoot = uBoot;
+    frame.uSeq = uSeq;
+    frame.uLength = (uint16_t)length;
+    memcpy(frame.szPayload, payload, length);
+    frame.szPayload[length] = '\0';
+
+    s_uRxTail.store(uTail + 1, std::memory_order_release);
+
+    // loop() may be sitting in getEvent() waiting for a customer
+    wakeEventLoop();
+    return true;
+}
+
+static gatewayStation *FindStation(const char *id)
+{
+    gatewayStation *pFree = nullptr;
+    gatewayStation *pStale = nullptr;
+    unsigned long ulNow = millis();
+
+    for( int i = 0; i < GATEWAY_MAX_STATIONS; i++ )
+    {
+        gatewayStation &station = s_stations[i];
+        if( !station.szId[0] )
+        {
+            if( !pFree )
+                pFree = &station;
+            continue;
+        }
+        if( strcmp(station.szId, id) == 0 )
+            return &station;
+
+        // Nothing waiting and not heard from in a while, likely moved to another gateway or switched off
+        if( station.iCount == 0 && ulNow - station.ulLastSeen >= GATEWAY_STATION_IDLE
+            && (!pStale || (long)(station.ulLastSeen - pStale->ulLastSeen) < 0) )
+            pStale = &station;
+    }
+
+    gatewayStation *station = pFree ? pFree : pStale;
+    if( !station )
+        return nullptr;
+
+    if( station == pStale )
+        LOGI(LOG_MOD_NET, "Station %s idle, its slot goes to %s", station->szId, id);
+    else
+        s_stats.iStations++;
+
+    memset(station, 0, sizeof(*station));
+    strcpy(station->szId, id);
+    return station;
+}
+
+static void DrainReceived()
+{
+    for( ;; )
+    {
+        uint32_t uHead = s_uRxHead.load(std::memory_order_relaxed);
+        if( uHead == s_uRxTail.load(std::memory_order_acquire) )
+            break;
+
+        const gatewayFrame &frame = s_rxFrames[uHead % GATEWAY_RX_QUEUE];
+        gatewayStation *station = FindStation(frame.szId);
+        if( !station )
+        {
+            // No ack, the station keeps it and tries again later
+            s_stats.uRejected++;
+            s_uRxHead.store(uHead + 1, std::memory_order_release);
+            continue;
+        }
+
+        s_stats.uReceived++;
+        station->ulLastSeen = millis();
+
+        // The station didn't get our ack and sent it again, or someone's playing back an older frame of this
+        // boot, its tag is still good. After a reboot it counts from 1 again under a new uBoot
+        if( station->bHaveSeq && station->uLastBoot == frame.uBoot && (int16_t)(frame.uSeq - station->uLastSeq) <= 0 )
+        {
+            s_stats.uDuplicates++;
+        }
+        else
+        {
+            if( station->iCount == GATEWAY_STATION_QUEUE )
+            {
+                station->iHead = (station->iHead + 1) % GATEWAY_STATION_QUEUE;
+                station->iCount--;
+                s_stats.uDropped++;
+            }
+
+            memcpy(station->aQueue[(station->iHead + station->iCount) % GATEWAY_STATION_QUEUE], frame.szPayload, frame.uLength + 1);
+            station->iCount++;
+            station->uLastBoot = frame.uBoot;
+            station->uLastSeq = frame.uSeq;
+            station->bHaveSeq = true;
+        }
+
+        if( frame.bHaveMac && AddPeer(frame.mac) )
+            SendFrame(frame.mac, GATEWAY_FRAME_ACK, frame.szId, frame.uBoot, frame.uSeq, nullptr, 0);
+
+        s_uRxHead.store(uHead + 1, std::memory_order_release);
+    }
+
+    s_stats.uRejected += s_uRxRejected.exchange(0, std::memory_order_relaxed);
+}
+
+// One message per loop(), like our own telemetry queue, starting after the station that went last.
+// Each station gets a turn before any gets a second one, however much it has queued
+static void ForwardOne()
+{
+    if( !g_IoTHub.IsConnected() )
+        return;
+
+    for( int i = 0; i < GATEWAY_MAX_STATIONS; i++ )
+    {
+        int iStation = (s_iNextStation + i) % GATEWAY_MAX_STATIONS;
+        gatewayStation &station = s_stations[iStation];
+        if( station.iCount == 0 )
+            continue;
+
+        const char *data = station.aQueue[station.iHead];
+        if( !g_IoTHub.publishForStation(station.szId, data, strlen(data)) )
+            return;
+
+        TRACE_INSTANT("gateway forward");
+        station.iHead = (station.iHead + 1) % GATEWAY_STATION_QUEUE;
+        station.iCount--;
+        s_stats.uForwarded++;
+        s_iNextStation = (iStation + 1) % GATEWAY_MAX_STATIONS;
+        return;
+    }
+}
+
+/* Downstream side */
+
+int gatewaySendTelemetry(const char *telemetryData)
+{
+    size_t length = strlen(telemetryData);
+    if( length + strlen(g_IoTHub.GetDeviceID()) > ESP_NOW_MAX_DATA_LEN - sizeof(gatewayHeader) - GATEWAY_TAG_LEN )
+        return GATEWAY_SEND_TOO_BIG;
+
+    int iResult = GATEWAY_SEND_QUEUED;
+    if( s_iOutCount == TELEMETRY_QUEUE_LEN )
+    {
+        s_iOutHead = (s_iOutHead + 1) % TELEMETRY_QUEUE_LEN;
+        s_iOutCount--;
+        s_stats.uDropped++;
+        iResult = GATEWAY_SEND_DROPPED;
+    }
+
+    int iSlot = (s_iOutHead + s_iOutCount) % TELEMETRY_QUEUE_LEN;
+    memcpy(s_aOutQueue[iSlot], telemetryData, length + 1);
+    s_uaOutSeq[iSlot] = s_uNextSeq++;
+    s_iOutCount++;
+    return iResult;
+}
+
+static void SendDownstream()
+{
+    uint32_t uAcked = s_uAcked.load(std::memory_order_acquire);
+    while( s_iOutCount && (uAcked & 0x10000) && (uint16_t)uAcked == s_uaOutSeq[s_iOutHead] )
+    {
+        s_iOutHead = (s_iOutHead + 1) % TELEMETRY_QUEUE_LEN;
+        s_iOutCount--;
+        s_stats.uForwarded++;
+        s_bSentOnce = false;
+    }
+
+    if( !s_iOutCount )
+        return;
+
+    unsigned long ulNow = millis();
+    if( s_bSentOnce && ulNow - s_ulLastSend < GATEWAY_RETRY_INTERVAL )
+        return;
+
+    // Until the gateway has answered once we don't know where it is
+    const uint8_t *mac = s_bHaveGatewayMac.load(std::memory_order_acquire) ? s_gatewayMac : s_broadcastMac;
+    if( !AddPeer(mac) )
+        return;
+
+    const char *data = s_aOutQueue[s_iOutHead];
+    SendFrame(mac, GATEWAY_FRAME_TELEMETRY, g_IoTHub.GetDeviceID(), s_uBoot, s_uaOutSeq[s_iOutHead], data, strlen(data));
+    s_ulLastSend = ulNow;
+    s_bSentOnce = true;
+}
+
+void setupGateway()
+{
+    s_iMode = g_Config.iGatewayMode;
+    if( s_iMode == GATEWAY_MODE_OFF )
+        return;
+
+    // Without a key anyone could publish as any station through us, so no key, no ESP-NOW
+    const char *keyBase64 = g_IoTHub.GetGatewayKey();
+    size_t keyLength = 0;
+    if( mbedtls_base64_decode(s_key, sizeof(s_key), &keyLength, (const unsigned char *)keyBase64, strlen(keyBase64)) != 0
+        || keyLength != GATEWAY_KEY_LEN )
+    {
+        LOGE(LOG_MOD_NET, "Gateway key missing or not %d bytes of base64, gateway mode off", GATEWAY_KEY_LEN);
+        return;
+    }
+
+    // Hardware RNG, with the radio about to come up it's a true random number
+    s_uBoot = esp_random();
+
+    if( esp_now_init() != ESP_OK || esp_now_register_recv_cb(OnReceive) != ESP_OK )
+    {
+        LOGE(LOG_MOD_NET, "Failed starting ESP-NOW, gateway mode off");
+        return;
+    }
+
+    s_bStarted = true;
+    LOGI(LOG_MOD_NET, "ESP-NOW up as %s", s_iMode == GATEWAY_MODE_GATEWAY ? "gateway" : "downstream station");
+}
+
+void suspendGateway()
+{
+    if( s_bStarted )
+        esp_now_deinit();
+}
+
+void resumeGateway()
+{
+    if( !s_bStarted )
+        return;
+
+    // Peers went with the deinit, AddPeer() puts them back as they're sent to
+    if( esp_now_init() != ESP_OK || esp_now_register_recv_cb(OnReceive) != ESP_OK )
+    {
+        LOGE(LOG_MOD_NET, "Failed restarting ESP-NOW, gateway mode off");
+        s_bStarted = false;
+    }
+}
+
+void updateGateway()
+{
+    if( !s_bStarted )
+        return;
+
+    if( s_iMode == GATEWAY_MODE_GATEWAY )
+    {
+        DrainReceived();
+        ForwardOne();
+    }
+    else
+        SendDownstream();
+}
+
+int getGatewayMode()
+{
+    return s_iMode;
+}
+
+int getGatewayPending()
+{
+    if( s_iMode == GATEWAY_MODE_DOWNSTREAM )
+        return s_iOutCount;
+
+    int iPending = 0;
+    for( int i = 0; i < GATEWAY_MAX_STATIONS; i++ )
+        iPending += s_stations[i].iCount;
+    return iPending;
+}
+
+const gatewayStats &getGatewayStats()
+{
+    return s_stats;
+}
@@ -0,0 +1,387 @@
+#include <Arduino.h>
+#include <esp_system.h>
+#include <esp_crt_bundle.h>
+#include <lwip/sockets.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/version.h>
+
+#include "hubclient.h"
+#include "log.h"
+
+#define TLS_WRITE_TIMEOUT 5000 // ms
+#define RTC_SESSION_MAGIC 0x544C5353
+
+// What the hub handed out last, a full handshake replaces it and a failed one throws it away
+static mbedtls_ssl_session s_session;
+static bool s_bSession = false;
+
+// Serialized, mbedtls_ssl_session_load() refuses one from a build with another mbedTLS config, so an
+// update just means one full handshake. RTC_DATA_ATTR is zeroed on power on, the magic catches the rest
+struct rtcSession {
+    uint32_t uMagic;
+    uint32_t uLength;
+    uint8_t data[TLS_SESSION_RTC_SIZE];
+};
+
+RTC_DATA_ATTR static rtcSession s_rtcSession;
+
+static int Random(void *ctx, unsigned char *data, size_t length)
+{
+    (void)ctx;
+    // The hardware RNG, Wi-Fi is up whenever we're handshaking so it's a true random source
+    esp_fill_random(data, length);
+    return 0;
+}
+
+// The TCP side, WiFiClient reads -1 or 0 for both nothing yet and gone, connected() tells them apart
+static int Send(void *ctx, const unsigned char *data, size_t length)
+{
+    WiFiClient *tcp = (WiFiClient *)ctx;
+    size_t sent = tcp->write(data, length);
+    if( sent > 0 )
+        return (int)sent;
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_CONN_RESET;
+}
+
+static int Recv(void *ctx, unsigned char *data, size_t length)
+{
+    WiFiClient *tcp = (WiFiClient *)ctx;
+    int iRead = tcp->read(data, length);
+    if( iRead > 0 )
+        return iRead;
+    return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : 0; // 0 is EOF to mbedTLS
+}
+
+// mbedTLS 3 keeps the handshake state and the session's fields to itself, arduino-esp32 2.x is still on 2.28
+static bool HandshakeOver(mbedtls_ssl_context *ssl)
+{
+#if MBEDTLS_VERSION_NUMBER >= 0x03020000
+    return mbedtls_ssl_is_handshake_over(ssl);
+#else
+    return ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER;
+#endif
+}
+
+// The hub hands the offered session ID back when it resumes and a new one, or none, when it doesn't. An offered
+// ticket goes out under a random ID instead, so a ticket resumption counts as a full handshake here
+static bool SameSessionId(const mbedtls_ssl_session *a, const mbedtls_ssl_session *b)
+{
+#if MBEDTLS_VERSION_NUMBER >= 0x03040000
+    size_t length = mbedtls_ssl_session_get_id_len(a);
+    return length > 0 && length == mbedtls_ssl_session_get_id_len(b) && memcmp(mbedtls_ssl_session_get_id(a), mbedtls_ssl_session_get_id(b), length) == 0;
+#else
+    return a->id_len > 0 && a->id_len == b->id_len && memcmp(a->id, b->id, a->id_len) == 0;
+#endif
+}
+
+static void ForgetSession()
+{
+    mbedtls_ssl_session_free(&s_session);
+    s_bSession = false;
+    s_rtcSession.uMagic = 0;
+}
+
+// Back from deep sleep or a soft reset, RAM is gone but the RTC copy isn't
+static void LoadSession()
+{
+    if( s_bSession || s_rtcSession.uMagic != RTC_SESSION_MAGIC || s_rtcSession.uLength > sizeof(s_rtcSession.data) )
+        return;
+
+    mbedtls_ssl_session_init(&s_session);
+    if( mbedtls_ssl_session_load(&s_session, s_rtcSession.data, s_rtcSession.uLength) != 0 )
+    {
+        LOGI(LOG_MOD_HUB, "TLS session from before the reset doesn't load, a full handshake it is");
+        ForgetSession();
+        return;
+    }
+    s_bSession = true;
+}
+
+CHubClient::CHubClient()
+{
+    mbedtls_ssl_init(&m_ssl);
+    mbedtls_ssl_config_init(&m_conf);
+    mbedtls_x509_crt_init(&m_ca);
+}
+
+CHubClient::~CHubClient()
+{
+    stop();
+}
+
+void CHubClient::setCACert(const char *rootCA)
+{
+    m_szCACert = rootCA;
+    m_bundle = nullptr;
+}
+
+void CHubClient::setCACertBundle(const uint8_t *bundle)
+{
+    m_bundle = bundle;
+    m_szCACert = nullptr;
+}
+
+int CHubClient::connect(IPAddress ip, uint16_t port)
+{
+    char host[16];
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    return connect(host, port);
+}
+
+int CHubClient::connect(const char *host, uint16_t port)
+{
+    if( !connectStart(host, port) )
+        return 0;
+
+    int iResult;
+    while( (iResult = connectStep()) == HUB_CONNECT_PENDING )
+        delay(2);
+    return iResult == HUB_CONNECT_DONE;
+}
+
+bool CHubClient::connectStart(const char *host, uint16_t port)
+{
+    stop();
+
+    // The TCP connect itself still blocks, for a round trip to the hub
+    m_ulHandshakeStart = millis();
+    if( !m_tcp.connect(host, port, (int32_t)m_ulHandshakeTimeout) )
+        return false;
+
+    if( !Setup(host) )
+    {
+        stop();
+        return false;
+    }
+
+    m_bHandshaking = true;
+    return true;
+}
+
+bool CHubClient::Setup(const char *host)
+{
+    int iResult = mbedtls_ssl_config_defaults(&m_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if( iResult != 0 )
+    {
+        LOGE(LOG_MOD_HUB, "TLS config failed, -0x%04x", -iResult);
+        return false;
+    }
+    mbedtls_ssl_conf_authmode(&m_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_rng(&m_conf, Random, nullptr);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&m_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
+    if( m_bundle )
+    {
+        arduino_esp_crt_bundle_set(m_bundle);
+        arduino_esp_crt_bundle_attach(&m_conf);
+    }
+    else if( m_szCACert && mbedtls_x509_crt_parse(&m_ca, (const unsigned char *)m_szCACert, strlen(m_szCACert) + 1) == 0 )
+        mbedtls_ssl_conf_ca_chain(&m_conf, &m_ca, nullptr);
+    else
+    {
+        LOGE(LOG_MOD_HUB, "No CA certificates to check the hub against");
+        return false;
+    }
+
+    iResult = mbedtls_ssl_setup(&m_ssl, &m_conf);
+    if( iResult == 0 )
+        iResult = mbedtls_ssl_set_hostname(&m_ssl, host);
+    if( iResult != 0 )
+    {
+        LOGE(LOG_MOD_HUB, "TLS setup failed, -0x%04x", -iResult);
+        return false;
+    }
+    mbedtls_ssl_set_bio(&m_ssl, &m_tcp, Send, Recv, nullptr);
+
+    LoadSession();
+    m_bOffered = s_bSession && mbedtls_ssl_set_session(&m_ssl, &s_session) == 0;
+    m_bResumed = false;
+    return true;
+}
+
+int CHubClient::connectStep()
+{
+    if( !m_bHandshaking )
+        return m_bConnected ? HUB_CONNECT_DONE : HUB_CONNECT_FAILED;
+
+    // Nothing from the hub yet comes back as WANT_READ right away, with the socket non-blocking
+    int iResult = mbedtls_ssl_handshake_step(&m_ssl);
+    if( iResult == MBEDTLS_ERR_SSL_WANT_READ || iResult == MBEDTLS_ERR_SSL_WANT_WRITE )
+    {
+        if( millis() - m_ulHandshakeStart <= m_ulHandshakeTimeout )
+            return HUB_CONNECT_PENDING;
+        LOGW(LOG_MOD_HUB, "TLS handshake timed out");
+        stop();
+        return HUB_CONNECT_FAILED;
+    }
+    if( iResult != 0 )
+    {
+        LOGW(LOG_MOD_HUB, "TLS handshake failed, -0x%04x", -iResult);
+        // Whatever the hub didn't like, the next try is a clean full handshake
+        if( m_bOffered )
+            ForgetSession();
+        stop();
+        return HUB_CONNECT_FAILED;
+    }
+    if( !HandshakeOver(&m_ssl) )
+        return HUB_CONNECT_PENDING;
+
+    m_bHandshaking = false;
+    m_bConnected = true;
+    m_ulHandshakeMs = millis() - m_ulHandshakeStart;
+
+    CacheSession();
+    return HUB_CONNECT_DONE;
+}
+
+void CHubClient::CacheSession()
+{
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+    bool bGot = mbedtls_ssl_get_session(&m_ssl, &session) == 0;
+    m_bResumed = bGot && m_bOffered && SameSessionId(&session, &s_session);
+
+    // A resumption can come with a fresh ticket, so it's taken either way
+    mbedtls_ssl_session_free(&s_session);
+    s_session = session;
+    s_bSession = bGot;
+    s_rtcSession.uMagic = 0;
+    if( !s_bSession )
+        return;
+
+    size_t length = 0;
+    if( mbedtls_ssl_session_save(&s_session, s_rtcSession.data, sizeof(s_rtcSession.data), &length) != 0 )
+    {
+        if( !m_bResumed )
+            LOGW(LOG_MOD_HUB, "TLS session of %u bytes doesn't fit the %d byte RTC copy, kept until the next reset", (unsigned)length, TLS_SESSION_RTC_SIZE);
+        return;
+    }
+    s_rtcSession.uLength = length;
+    s_rtcSession.uMagic = RTC_SESSION_MAGIC;
+}
+
+size_t CHubClient::write(const uint8_t *buf, size_t size)
+{
+    if( !m_bConnected )
+        return 0;
+
+    size_t sent = 0;
+    unsigned long ulStart = millis();
+    while( sent < size )
+    {
+        int iResult = mbedtls_ssl_write(&m_ssl, buf + sent, size - sent);
+        if( iResult > 0 )
+            sent += iResult;
+        else if( (iResult == MBEDTLS_ERR_SSL_WANT_WRITE || iResult == MBEDTLS_ERR_SSL_WANT_READ) && millis() - ulStart < TLS_WRITE_TIMEOUT )
+            delay(1);
+        else
+        {
+            stop();
+            break;
+        }
+    }
+    return sent;
+}
+
+int CHubClient::available()
+{
+    if( !m_bConnected )
+        return 0;
+
+    // Pulls a record off the socket if one's there, only what's been decrypted counts
+    int iResult = mbedtls_ssl_read(&m_ssl, nullptr, 0);
+    int iPeeked = m_iPeeked >= 0 ? 1 : 0;
+    if( iResult < 0 && iResult != MBEDTLS_ERR_SSL_WANT_READ && iResult != MBEDTLS_ERR_SSL_WANT_WRITE )
+    {
+        stop();
+        return iPeeked;
+    }
+    return iPeeked + (int)mbedtls_ssl_get_bytes_avail(&m_ssl);
+}
+
+int CHubClient::read()
+{
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+}
+
+int CHubClient::read(uint8_t *buf, size_t size)
+{
+    if( size == 0 )
+        return 0;
+
+    size_t got = 0;
+    if( m_iPeeked >= 0 )
+    {
+        buf[got++] = (uint8_t)m_iPeeked;
+        m_iPeeked = -1;
+    }
+    if( !m_bConnected || got == size )
+        return got ? (int)got : -1;
+
+    int iResult = mbedtls_ssl_read(&m_ssl, buf + got, size - got);
+    if( iResult > 0 )
+        got += iResult;
+    else if( iResult != MBEDTLS_ERR_SSL_WANT_READ && iResult != MBEDTLS_ERR_SSL_WANT_WRITE )
+        stop(); // 0 or the hub's close_notify, it's gone
+
+    return got ? (int)got : -1;
+}
+
+int CHubClient::peek()
+{
+    if( m_iPeeked < 0 && m_bConnected )
+    {
+        uint8_t c;
+        if( mbedtls_ssl_read(&m_ssl, &c, 1) == 1 )
+            m_iPeeked = c;
+    }
+    return m_iPeeked;
+}
+
+void CHubClient::stop()
+{
+    if( m_bConnected )
+        mbedtls_ssl_close_notify(&m_ssl);
+    m_bConnected = false;
+    m_bHandshaking = false;
+    m_iPeeked = -1;
+    m_tcp.stop();
+
+    // Nothing of the connection stays on the heap, ready for the next one
+    mbedtls_ssl_free(&m_ssl);
+    mbedtls_ssl_config_free(&m_conf);
+    mbedtls_x509_crt_free(&m_ca);
+    mbedtls_ssl_init(&m_ssl);
+    mbedtls_ssl_config_init(&m_conf);
+    mbedtls_x509_crt_init(&m_ca);
+}
+
+uint8_t CHubClient::connected()
+{
+    if( m_bConnected && !m_tcp.connected() )
+        stop();
+    return m_bConnected;
+}
+
+bool CHubClient::setKeepAlive(int iIdleSec)
+{
+    if( m_tcp.fd() < 0 )
+        return false;
+
+    // Probe well before the MQTT keepalive would notice, so a dead link is found in seconds
+    int iEnable = 1;
+    int iIdle = max(iIdleSec / 2, 1);
+    int iInterval = 2;
+    int iCount = 3;
+
+    bool bOk = m_tcp.setSocketOption(SOL_SOCKET, SO_KEEPALIVE, &iEnable, sizeof(iEnable)) == 0;
+#ifdef TCP_KEEPIDLE
+    bOk &= m_tcp.setSocketOption(IPPROTO_TCP, TCP_KEEPIDLE, &iIdle, sizeof(iIdle)) == 0;
+    bOk &= m_tcp.setSocketOption(IPPROTO_TCP, TCP_KEEPINTVL, &iInterval, sizeof(iInterval)) == 0;
+    bOk &= m_tcp.setSocketOption(IPPROTO_TCP, TCP_KEEPCNT, &iCount, sizeof(iCount)) == 0;
+#endif
+    return bOk;
+}
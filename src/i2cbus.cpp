@@ -0,0 +1,224 @@
+#include <Arduino.h>
+#include <Wire.h>
+
+#include "i2cbus.h"
+#include "log.h"
+
+#define I2C_RECOVERY_CLOCKS 9 // A slave stuck mid-byte lets go of SDA once it's clocked out the rest of it and the ACK
+#define I2C_RECOVERY_HALF_PERIOD 5 // us, 100 kHz
+
+CI2CBus g_CamBus(Wire, "cam");
+CI2CBus g_NfcBus(Wire1, "nfc");
+
+bool CI2CBus::begin(int iSda, int iScl, uint32_t uFrequency)
+{
+    m_iSda = iSda;
+    m_iScl = iScl;
+    m_uFrequency = uFrequency;
+    m_ulWindowStart = millis();
+
+    bool bOk = m_wire.begin(iSda, iScl, uFrequency);
+    m_wire.setTimeOut(I2C_BUS_TIMEOUT);
+    return bOk;
+}
+
+void CI2CBus::setClock(uint32_t uFrequency)
+{
+    m_uFrequency = uFrequency;
+    m_wire.setClock(uFrequency);
+}
+
+i2cDeviceStats *CI2CBus::FindDevice(uint16_t address)
+{
+    for( int i = 0; i < m_iDevices; i++ )
+    {
+        if( m_devices[i].uAddress == address )
+            return &m_devices[i];
+    }
+
+    if( m_iDevices == I2C_MAX_DEVICES )
+        return nullptr;
+
+    i2cDeviceStats &device = m_devices[m_iDevices++];
+    device.uAddress = address;
+    return &device;
+}
+
+bool CI2CBus::IsQuarantined(i2cDeviceStats *device)
+{
+    if( !device || !device->ulQuarantinedUntil )
+        return false;
+
+    // Once it's over, the next transaction is the test whether it's back
+    if( (long)(millis() - device->ulQuarantinedUntil) >= 0 )
+    {
+        device->ulQuarantinedUntil = 0;
+        return false;
+    }
+    return true;
+}
+
+int CI2CBus::Finish(i2cDeviceStats *device, int iResult, uint32_t ulStartUs)
+{
+    m_ullBusyUs += micros() - ulStartUs;
+
+    if( device )
+        device->uTransactions++;
+
+    if( iResult == I2C_OK )
+    {
+        if( device )
+        {
+            if( device->ulQuarantineMs )
+                LOGI(LOG_MOD_I2C, "%s 0x%02x is back", m_name, device->uAddress);
+            device->iFailsInRow = 0;
+            device->ulQuarantineMs = 0;
+        }
+        return iResult;
+    }
+
+    m_uErrors++;
+    if( device )
+    {
+        device->uErrors++;
+        if( iResult == I2C_ERR_NACK_ADDR || iResult == I2C_ERR_NACK_DATA )
+            device->uNacks++;
+        else if( iResult == I2C_ERR_TIMEOUT )
+            device->uTimeouts++;
+
+        // Keep a dead device from eating a timeout on every loop(). A card pulled away mid exchange isn't the device's fault
+        if( iResult != I2C_ERR_NO_ANSWER )
+            device->iFailsInRow++;
+        if( iResult != I2C_ERR_NO_ANSWER && device->iFailsInRow >= I2C_QUARANTINE_AFTER )
+        {
+            device->ulQuarantineMs = device->ulQuarantineMs ? min(device->ulQuarantineMs * 2, (unsigned long)I2C_QUARANTINE_MAX_MS) : I2C_QUARANTINE_MS;
+            device->ulQuarantinedUntil = millis() + device->ulQuarantineMs;
+            LOGW(LOG_MOD_I2C, "%s 0x%02x failed %d times in a row (%d), leaving it alone for %lu ms",
+                m_name, device->uAddress, device->iFailsInRow, iResult, device->ulQuarantineMs);
+        }
+    }
+
+    // A NACK is the device's business, a timeout or an arbitration/bus error means the bus itself is in trouble
+    if( iResult == I2C_ERR_TIMEOUT || iResult == I2C_ERR_OTHER )
+        recover();
+
+    return iResult;
+}
+
+int CI2CBus::write(uint16_t address, const uint8_t *data, size_t length)
+{
+    i2cDeviceStats *device = FindDevice(address);
+    if( IsQuarantined(device) )
+        return I2C_ERR_QUARANTINED;
+
+    uint32_t ulStartUs = micros();
+    m_wire.beginTransmission(address);
+    if( m_wire.write(data, length) != length )
+    {
+        m_wire.endTransmission();
+        return Finish(device, I2C_ERR_TOO_LONG, ulStartUs);
+    }
+
+    int iResult = m_wire.endTransmission();
+    return Finish(device, iResult <= I2C_ERR_TIMEOUT ? iResult : I2C_ERR_OTHER, ulStartUs);
+}
+
+int CI2CBus::read(uint16_t address, uint8_t *data, size_t length)
+{
+    i2cDeviceStats *device = FindDevice(address);
+    if( IsQuarantined(device) )
+        return I2C_ERR_QUARANTINED;
+
+    uint32_t ulStartUs = micros();
+    size_t received = m_wire.requestFrom(address, length);
+    if( received != length )
+    {
+        // Whatever did come in is stale for the next read
+        while( m_wire.available() )
+            m_wire.read();
+
+        // The driver doesn't say why, no bytes at all is an address NACK or a hung bus, which one is down to the time it took
+        int iResult = I2C_ERR_SHORT_READ;
+        if( received == 0 )
+            iResult = micros() - ulStartUs >= I2C_BUS_TIMEOUT * 1000UL ? I2C_ERR_TIMEOUT : I2C_ERR_NACK_ADDR;
+        return Finish(device, iResult, ulStartUs);
+    }
+
+    m_wire.readBytes((char *)data, length);
+    return Finish(device, I2C_OK, ulStartUs);
+}
+
+int CI2CBus::account(uint16_t address, int iResult, uint32_t ulStartUs)
+{
+    return Finish(FindDevice(address), iResult <= I2C_ERR_NO_ANSWER ? iResult : I2C_ERR_OTHER, ulStartUs);
+}
+
+bool CI2CBus::recover()
+{
+    if( m_iSda < 0 || m_iScl < 0 )
+        return false;
+
+    m_uRecoveries++;
+    m_wire.end();
+
+    // Bit-bang the lines, open drain like the peripheral would
+    pinMode(m_iSda, INPUT_PULLUP);
+    pinMode(m_iScl, OUTPUT_OPEN_DRAIN);
+    digitalWrite(m_iScl, HIGH);
+    delayMicroseconds(I2C_RECOVERY_HALF_PERIOD);
+
+    int iClocks = 0;
+    while( digitalRead(m_iSda) == LOW && iClocks < I2C_RECOVERY_CLOCKS )
+    {
+        digitalWrite(m_iScl, LOW);
+        delayMicroseconds(I2C_RECOVERY_HALF_PERIOD);
+        digitalWrite(m_iScl, HIGH);
+        delayMicroseconds(I2C_RECOVERY_HALF_PERIOD);
+        iClocks++;
+    }
+
+    // STOP, SDA going high while SCL is high, so every slave drops whatever it thought was going on
+    pinMode(m_iSda, OUTPUT_OPEN_DRAIN);
+    digitalWrite(m_iSda, LOW);
+    delayMicroseconds(I2C_RECOVERY_HALF_PERIOD);
+    digitalWrite(m_iSda, HIGH);
+    delayMicroseconds(I2C_RECOVERY_HALF_PERIOD);
+    pinMode(m_iSda, INPUT_PULLUP);
+    bool bFree = digitalRead(m_iSda) == HIGH;
+
+    m_wire.begin(m_iSda, m_iScl, m_uFrequency);
+    m_wire.setTimeOut(I2C_BUS_TIMEOUT);
+
+    LOGW(LOG_MOD_I2C, "%s bus reset, %d clocks, SDA %s", m_name, iClocks, bFree ? "free" : "still low");
+    return bFree;
+}
+
+void CI2CBus::update()
+{
+    if( m_iSda < 0 )
+        return;
+
+    unsigned long ulNow = millis();
+    if( (long)(ulNow - m_ulNextIdleCheck) < 0 )
+        return;
+    m_ulNextIdleCheck = ulNow + I2C_IDLE_CHECK_INTERVAL;
+
+    // Nothing is on the bus between transactions, so SDA should be up.
+    // Once could be bad luck, twice a second apart is a slave holding it
+    bool bSdaLow = digitalRead(m_iSda) == LOW;
+    if( bSdaLow && m_bSdaWasLow )
+        recover();
+    m_bSdaWasLow = bSdaLow;
+}
+
+float CI2CBus::GetUtilisation()
+{
+    unsigned long ulElapsed = millis() - m_ulWindowStart;
+    return ulElapsed ? m_ullBusyUs / (ulElapsed * 10.0f) : 0;
+}
+
+void CI2CBus::ResetWindow()
+{
+    m_ullBusyUs = 0;
+    m_ulWindowStart = millis();
+}
@@ -0,0 +1,132 @@
+#include <Arduino.h>
+#include <atomic>
+#include <stdarg.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "log.h"
+#include "diagnostics.h"
+
+#define LOG_TASK_STACK 3072
+#define LOG_FLUSH_TIMEOUT 200 // ms
+
+struct logLine {
+  std::atomic<bool> bReady; // Set once the producer is done formatting it
+  uint8_t iLevel;
+  uint8_t iModule;
+  uint32_t ulTime;
+  char szText[LOG_LINE_LEN];
+};
+
+static const char s_caLevels[] = { '-', 'E', 'W', 'I', 'D' };
+static const char *s_szaModules[LOG_MOD_COUNT] = { "main", "nfc", "hub", "net", "cfg", "power", "diag", "mem", "log", "i2c", "ota", "menu" };
+
+// Any task can write, so a slot is claimed with a CAS on the tail. Only the log task reads
+static logLine s_lines[LOG_RING_LEN];
+static std::atomic<uint32_t> s_uHead{0};
+static std::atomic<uint32_t> s_uTail{0};
+static std::atomic<uint32_t> s_uDropped{0};
+static uint32_t s_uReportedDropped = 0;
+static std::atomic<bool> s_bHold{false};
+
+static TaskHandle_t s_hTask = NULL;
+
+void logWrite(int iLevel, int iModule, const char *format, ...)
+{
+    uint32_t uTail = s_uTail.load(std::memory_order_relaxed);
+    do
+    {
+        if( uTail - s_uHead.load(std::memory_order_acquire) >= LOG_RING_LEN )
+        {
+            s_uDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while( !s_uTail.compare_exchange_weak(uTail, uTail + 1, std::memory_order_acq_rel, std::memory_order_relaxed) );
+
+    logLine &line = s_lines[uTail % LOG_RING_LEN];
+    line.iLevel = iLevel;
+    line.iModule = iModule;
+    line.ulTime = millis();
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line.szText, sizeof(line.szText), format, args);
+    va_end(args);
+
+    line.bReady.store(true, std::memory_order_release);
+}
+
+static bool DrainOne()
+{
+    uint32_t uHead = s_uHead.load(std::memory_order_relaxed);
+    if( uHead == s_uTail.load(std::memory_order_acquire) )
+        return false;
+
+    // Claimed but still being formatted, it'll be there next time
+    logLine &line = s_lines[uHead % LOG_RING_LEN];
+    if( !line.bReady.load(std::memory_order_acquire) )
+        return false;
+
+    // Written in pieces, Print::printf() would malloc for anything over 64 characters
+    char szHeader[32];
+    int iLen = snprintf(szHeader, sizeof(szHeader), "[%lu][%c][%s] ", (unsigned long)line.ulTime,
+        s_caLevels[line.iLevel < sizeof(s_caLevels) ? line.iLevel : 0], line.iModule < LOG_MOD_COUNT ? s_szaModules[line.iModule] : "?");
+    Serial.write((const uint8_t *)szHeader, iLen);
+    Serial.write((const uint8_t *)line.szText, strlen(line.szText));
+    Serial.write('\n');
+
+    line.bReady.store(false, std::memory_order_relaxed);
+    s_uHead.store(uHead + 1, std::memory_order_release);
+    return true;
+}
+
+static void ReportDropped()
+{
+    uint32_t uDropped = s_uDropped.load(std::memory_order_relaxed);
+    if( uDropped == s_uReportedDropped )
+        return;
+
+    LOGW(LOG_MOD_LOG, "%u lines dropped, ring full (%u total)", (unsigned)(uDropped - s_uReportedDropped), (unsigned)uDropped);
+    s_uReportedDropped = uDropped;
+}
+
+static void LogTask(void *pParam)
+{
+    (void)pParam;
+    for( ;; )
+    {
+        if( !s_bHold.load(std::memory_order_acquire) )
+        {
+            while( DrainOne() )
+                ;
+            ReportDropped();
+        }
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL));
+    }
+}
+
+void setupLog()
+{
+    // Below everything else, it only matters that it gets done eventually. Core 0, away from loop()
+    xTaskCreatePinnedToCore(LogTask, "log", LOG_TASK_STACK, NULL, tskIDLE_PRIORITY + 1, &s_hTask, 0);
+    registerDiagTask("log", s_hTask);
+}
+
+void logFlush()
+{
+    unsigned long ulStart = millis();
+    while( s_uHead.load(std::memory_order_acquire) != s_uTail.load(std::memory_order_acquire) && millis() - ulStart < LOG_FLUSH_TIMEOUT )
+        delay(1);
+
+    Serial.flush();
+}
+
+void logHold(bool bHold)
+{
+    s_bHold.store(bHold, std::memory_order_release);
+}
+
+int logGetDropped()
+{
+    return (int)s_uDropped.load(std::memory_order_relaxed);
+}
@@ -13,24 +13,31 @@
 #include "nfc.h"
 
 #include "iothub.h"
+#include "config.h"
+#include "power.h"
+#include "events.h"
+#include "memguard.h"
+#include "diagnostics.h"
+#include "log.h"
+#include "trace.h"
+#include "i2cbus.h"
+#include "ratings.h"
+#include "gateway.h"
+#include "statemachine.h"
+#include "slave.h"
+#include "slavefw.h"
+#include "ota.h"
+#include "capture.h"
+#include "catalog.h"
 /*
 TwoWire Wire2(2);
 */
 #define START_SCAN_BUTTON 21
 
-bool g_bScanButtonPressed = false;
+// How long loop() waits for a button press or a card while there's nobody to poll the slave for
+#define INPUT_WAIT 500 // ms
 
-volatile bool buttonPressed = false;
-unsigned long lastInterruptTime = 0;
-
-void IRAM_ATTR scanButtonInterrupt()
-{
-  if (millis() - lastInterruptTime > 200)
-  {
-    g_bScanButtonPressed = true;
-    lastInterruptTime = millis();
-  }
-}
+#define MENU_ITEM_INTERVAL 1500 // ms each of the customer's items stays on screen
 
 #define CAM_SDA0_Pin 19
 #define CAM_SCL0_Pin 18
@@ -40,106 +47,150 @@ void IRAM_ATTR scanButtonInterrupt()
 #define NFC_IRQ_Pin 13
 #define NFC_VEN_Pin 12
 
-#define I2C_Freq 100000
-#define I2C_DEV_ADDR 0x10
-
-#define REQUEST_DELAY 0
-#define DISPLAY_DELAY 1000
-
-typedef struct
-{
-  int requestCount;
-  byte command;
-} __attribute__((packed)) request;
-
-template <class T>
-void requestNum(int requestNumber, byte registerNumber, T *response); //string
-void requestString(int requestNumber, byte registerNumber, char *response, int length); //string
-void I2cTransmit(int requestNumber, byte registerNumber);
-template <class T>
-void I2cRead(T *response, int length); //string
-
 CNFCHandler g_NFC;
 CIoTHub g_IoTHub;
 
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 64
+#define SCREEN_ADDRESS 0x3C
 Adafruit_SSD1306 g_Screen(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire1, -1); //OLED
 
+// Whole frame goes out over Wire1 every time, this is where the NFC bus spends most of its time
+void FlushScreen()
+{
+  TRACE_SCOPE("display");
+  uint32_t ulStartUs = micros();
+  g_Screen.display();
+  // The driver drops endTransmission()'s result, so an empty write right after says whether the OLED took the frame
+  Wire1.beginTransmission(SCREEN_ADDRESS);
+  g_NfcBus.account(SCREEN_ADDRESS, Wire1.endTransmission(), ulStartUs);
+}
+
 void setup() 
 {
   Serial.begin(115200);
 
-  if(!Wire.begin(CAM_SDA0_Pin, CAM_SCL0_Pin, I2C_Freq)) //starting I2C Wire
+  g_Config.Load();
+  g_Config.Print();
+
+  setupPower(NFC_IRQ_Pin, NFC_VEN_Pin, START_SCAN_BUTTON);
+  setupDiagnostics();
+  setupLog();
+
+  // Radio first, associating and SNTP take the longest and run on their own while the rest comes up
+  setupWiFi();
+  initializeTime();
+
+  if(!g_CamBus.begin(CAM_SDA0_Pin, CAM_SCL0_Pin, g_Config.iI2CFreq)) //starting I2C Wire
   {
-    Serial.println("I2C Wire Error. Going idle.");
+    LOGE(LOG_MOD_MAIN, "I2C Wire Error. Going idle.");
   }
+  g_BootTimings.ulSlaveReady = millis();
+  setupSlaveFw();
+  setupCatalog();
 
+  // The NFC handler starts Wire1 too, by then it's already running and the bus knows its pins for a reset
+  g_NfcBus.begin(NFC_SDA_Pin, NFC_SCL_Pin, NFC_I2C_FREQ);
   g_NFC.setup( &Wire1, NFC_SDA_Pin, NFC_SCL_Pin, NFC_IRQ_Pin, NFC_VEN_Pin);
+  g_BootTimings.ulNfcReady = millis();
 
-  if(!g_Screen.begin(SSD1306_SWITCHCAPVCC, 0x3C))
+  if(!g_Screen.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
   {
-    Serial.println("Screen not present.");
+    LOGE(LOG_MOD_MAIN, "Screen not present.");
+    logFlush();
     while(1)
       delay(1);
   }
   g_Screen.clearDisplay();
   g_Screen.setTextColor(WHITE);
   g_Screen.setTextSize(0);
-  g_Screen.display();
+  FlushScreen();
+  g_BootTimings.ulDisplayReady = millis();
 
-  Serial.println("Master engaged.");
-
-  setupWiFi();
-  initializeTime();
+  LOGI(LOG_MOD_MAIN, "Master engaged.");
 
+  // Only sets up the client, it connects from loop() once Wi-Fi and the clock are there
   g_IoTHub.initIoTHub();
+  setupGateway();
 
-  pinMode( START_SCAN_BUTTON, INPUT_PULLUP );
-  attachInterrupt(START_SCAN_BUTTON, scanButtonInterrupt, RISING);
-}
+  setupEvents(START_SCAN_BUTTON, NFC_IRQ_Pin);
+
+  updatePower(false);
+
+  // Last, so the capture starts with the station ready and the config it'll run with
+  setupCapture();
 
-void informSlave(int requestNumber, byte cmd);
+  // Everything is in place, from here on nothing should need the heap
+  armHeapGuard();
+}
 
- // Get the data and pack it in a JSON message
-String createTelemetryData(char *deviceId, menu menu, float rating)
+ // Get the data and pack it in a JSON message, returns its length or 0 if it didn't fit
+size_t createTelemetryData(char *buffer, size_t size, const char *deviceId, const menu &menu, float rating)
 {
-  StaticJsonDocument<128> doc; // Create a JSON document we'll reuse to serialize our data into JSON
-  String output = "";
+  // Sized for a full menu, the device ID is only referenced, not copied
+  StaticJsonDocument<JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(MENU_MAX_ITEMS)> doc;
 
 	doc["UserID"] = menu.iUserID;
   doc["Rating"] = rating;
 
-	doc["DeviceID"] = (String)deviceId;
+	doc["DeviceID"] = deviceId;
 
   auto menuArray = doc.createNestedArray("Menu");
   for( int i = 0; i < menu.iMenuLen; i++ )
     menuArray.add(menu.iaMenu[i]);
 
-	serializeJson(doc, output);
+  if( doc.overflowed() || measureJson(doc) >= size )
+    return 0;
+
+	size_t len = serializeJson(doc, buffer, size);
 
-	Serial.println(output.c_str());
-  return output;
+	LOGD(LOG_MOD_MAIN, "%s", buffer);
+  return len;
 }
 
 float g_Percentage = -1;
 
-enum {
-  CMD_IS_SCANNING = 2,
-  CMD_START_SCAN,
-  CMD_GET_RESULT
-};
+#define SCAN_PROGRESS_INTERVAL 250 // ms, each poll is two more round trips on the camera bus
 
-enum {
-  STATE_IDLE = 0,
-  STATE_CONFIRM_SCAN,
-  STATE_SCANNING,
-  STATE_CONFIRM_RESULT
-};
+menu currMenu;
 
-int state = STATE_IDLE;
+// The confirming customer's card is still on the reader, don't start a new session with it
+bool g_bAwaitingRemoval = false;
 
-menu currMenu;
+// Short message at the bottom of the screen that doesn't hold up the state machine
+char g_szToast[64] = "";
+unsigned long g_ulToastUntil = 0;
+
+void ShowToast(const char *text)
+{
+  strncpy(g_szToast, text, sizeof(g_szToast) - 1);
+  g_szToast[sizeof(g_szToast) - 1] = '\0';
+  g_ulToastUntil = millis() + g_Config.iDisplayDelay;
+}
+
+void DrawToast()
+{
+  static int iLastSent = 0;
+  static int iLastDropped = 0;
+
+  // How the background sends went since we last looked
+  if( g_IoTHub.GetDroppedCount() != iLastDropped )
+  {
+    iLastDropped = g_IoTHub.GetDroppedCount();
+    ShowToast("Slanje podataka nije uspjelo!");
+  }
+  else if( g_IoTHub.GetSentCount() != iLastSent )
+  {
+    iLastSent = g_IoTHub.GetSentCount();
+    ShowToast("Podatci uspjesno poslani!");
+  }
+
+  if( (long)(millis() - g_ulToastUntil) >= 0 )
+    return;
+
+  g_Screen.setCursor(0, SCREEN_HEIGHT - 16);
+  g_Screen.println(g_szToast);
+}
 
 const char *rating [] = 
 {
@@ -150,207 +201,392 @@ const char *rating [] =
   ":(("
 };
 
-void loop() 
+// What this loop() saw, for the state actions
+struct stationInput {
+  bool bScanPressed;
+  bool bNfcIrq;
+  bool bIsScanning;
+  float flPercentage;
+};
+
+stationInput g_Input;
+
+// The customer's items one at a time, by name and price once the catalog has them
+void DrawMenuItem()
 {
-  g_Screen.clearDisplay();
-  g_Screen.setCursor(0, 1);
+  if( currMenu.iMenuLen <= 0 )
+    return;
+
+  int iItem = currMenu.iaMenu[(millis() / MENU_ITEM_INTERVAL) % currMenu.iMenuLen];
+  const catalogItem *item = catalogFind(iItem);
+  if( item )
+    g_Screen.printf("%-14.14s%3u.%02u\n", item->szName, (unsigned)(item->uPrice / 100), (unsigned)(item->uPrice % 100));
+  else
+    g_Screen.printf("Artikl %d\n", iItem);
+}
 
-  static int requestCount = 0;
-  int responseReqCount;
-  float flPercentage = -1;
-  bool bIsScanning = false;
+void EnterIdle(int iFrom)
+{
+  (void)iFrom;
+  currMenu.Clear();
+}
 
-  requestNum<float>(requestCount, CMD_GET_RESULT, &flPercentage);
-  //Serial.printf("Request %d, command 4 (len): %f\n",requestCount,flPercentage);
-  requestCount++;
+int UpdateIdle()
+{
+  g_Screen.println("Prislonite karticu.");
 
-  requestNum<bool>(requestCount, CMD_IS_SCANNING, &bIsScanning);
-  requestCount++;
-  //Serial.printf("Request %d, command 2 (len): %d\n",requestCount, bIsScanning);
+  // Discovery is still running since the last Reset(), without an IRQ there's no card to look at
+  if( !g_Input.bNfcIrq )
+  {
+    g_bAwaitingRemoval = false;
+    return TRIGGER_NONE;
+  }
 
-  g_IoTHub.loop();
+  bool bCardExists = g_NFC.CheckCard();
+  if( g_bAwaitingRemoval )
+  {
+    g_bAwaitingRemoval = bCardExists;
+    bCardExists = false;
+  }
 
-  switch( state )
+  if( !bCardExists )
   {
-    case STATE_IDLE:
-    {
-      // Debounce scan unless we're in confirm scan
-      g_bScanButtonPressed = false;
-      g_Screen.println("Prislonite karticu.");
-
-      bool bCardExists = g_NFC.CheckCard();
-      if( bCardExists )
-      {
-        int iRetCode = g_NFC.ReadMenu(currMenu);
-        if( iRetCode != 0 )
-        {
-          g_Screen.clearDisplay();
-          g_Screen.setCursor(0, 1);
-          switch( iRetCode )
-          {
-            case 1:
-              g_Screen.println("Pogreska kod detekcije kartice!\nOdmaknite kartu.");
-            break;
-            default:
-            case 2:
-              g_Screen.println("Pogreska kod citanja kartice!\nOdmaknite kartu.");
-            break;
-            case 3:
-              g_Screen.println("Neispravna vrsta kartice!\nOdmaknite kartu.");
-            break;
-          }
-          
-          g_Screen.display();
-          g_NFC.WaitForRemoval();
-
-          currMenu.Clear();
-        }
-        else
-        {
-          state = STATE_CONFIRM_SCAN;
-
-          g_Screen.clearDisplay();
-          g_Screen.setCursor(0, 1);
-          g_Screen.println("Uspjeh!\nOdmaknite kartu.");
-          g_Screen.display();
-          g_NFC.WaitForRemoval();
-        }
-      }
-      g_NFC.Reset();
-    }
-    break;
-    case STATE_CONFIRM_SCAN:
-    {
-      g_Screen.printf("Pozdrav korisnik: %d.\n", currMenu.iUserID);
-      g_Screen.println("Pritisnite gumb za pocetak skena.");
-      g_Screen.println("Prislonite ponovno karticu za prekid.");
-
-      bool bCardExists = g_NFC.CheckCard();
-      if( bCardExists )
-      {
-        state = STATE_IDLE;
-
-        g_Screen.clearDisplay();
-        g_Screen.setCursor(0, 1);
-        g_Screen.println("Prekid uspjesan!\nOdmaknite kartu.");
-        g_Screen.display();
-        g_NFC.WaitForRemoval();
-        g_NFC.Reset();
-        break;
-      }
-      g_NFC.Reset();
-
-      if( g_bScanButtonPressed )
-      {
-        informSlave(requestCount, CMD_START_SCAN);
-        requestCount++;
-        g_bScanButtonPressed = false;
-        Serial.println("Pressed!");
-        state = STATE_SCANNING;
-      }
-    }
+    g_NFC.Reset();
+    return TRIGGER_NONE;
+  }
+
+  int iRetCode = g_NFC.ReadMenu(currMenu);
+  if( iRetCode == 0 )
+    return TRIGGER_CARD_READ; // The card is still there, entering the next state waits for it to go
+
+  g_Screen.clearDisplay();
+  g_Screen.setCursor(0, 1);
+  switch( iRetCode )
+  {
+    case 1:
+      g_Screen.println("Pogreska kod detekcije kartice!\nOdmaknite kartu.");
     break;
-    case STATE_SCANNING:
-    {
-      g_Screen.println("Skeniranje...");
-
-      if( !bIsScanning )
-      {
-        if( flPercentage != -1 )
-        {
-          g_Percentage = flPercentage;
-          state = STATE_CONFIRM_RESULT;
-          break;
-        }
-      }
-    }
+    default:
+    case 2:
+      g_Screen.println("Pogreska kod citanja kartice!\nOdmaknite kartu.");
     break;
-    case STATE_CONFIRM_RESULT:
-    {
-      int iRating = 0;
-
-      if( g_Percentage >= 0.6f )
-        iRating = 0;
-      else if( g_Percentage >= 0.48 )
-        iRating = 1;
-      else if( g_Percentage >= 0.36 )
-        iRating = 2;
-      else if( g_Percentage >= 0.24 )
-        iRating = 3;
-      else
-        iRating = 4;
-
-      g_Screen.printf("Rating: %s\n", rating[iRating] );
-      g_Screen.println("Prislonite karticu za potvrdu.");
-
-      bool bCardExists = g_NFC.CheckCard();
-      if( bCardExists )
-      {
-        state = STATE_IDLE;
-        g_Screen.clearDisplay();
-        g_Screen.setCursor(0, 1);
-        g_Screen.println("Uspjeh!\nOdmaknite kartu za slanje podataka.");
-        g_Screen.display();
-        g_NFC.WaitForRemoval();
-        g_NFC.Reset();
-        Serial.println("Sending telemetry...");
-        String data = createTelemetryData(g_IoTHub.GetDeviceID(), currMenu, g_Percentage);
-        g_IoTHub.sendTelemetryData(data);
-
-        currMenu.Clear();
-
-        g_Screen.clearDisplay();
-        g_Screen.setCursor(0, 1);
-        g_Screen.println("Podatci uspjesno poslani!");
-        g_Screen.display();
-        delay(3000);
-        break;
-      }
-    }
+    case 3:
+      g_Screen.println("Neispravna vrsta kartice!\nOdmaknite kartu.");
     break;
   }
-  
-  g_Screen.display();
+
+  FlushScreen();
+  g_NFC.WaitForRemoval();
+  g_NFC.Reset();
+
+  currMenu.Clear();
+  return TRIGGER_NONE;
+}
+
+void EnterConfirmScan(int iFrom)
+{
+  // Back from a scan that timed out, the menu is still there and the customer can go again
+  if( iFrom != STATE_IDLE )
+    return;
+
+  g_Screen.clearDisplay();
+  g_Screen.setCursor(0, 1);
+  g_Screen.println("Uspjeh!\nOdmaknite kartu.");
+  FlushScreen();
+  g_NFC.WaitForRemoval();
+  g_NFC.Reset();
 }
 
-void informSlave(int requestNumber, byte cmd)
+int UpdateConfirmScan()
 {
-  I2cTransmit(requestNumber, cmd); //send register command
-  delay(REQUEST_DELAY);
-  if(Wire.requestFrom(I2C_DEV_ADDR,1) == 1)
-    Wire.read(); //read old dummy
+  g_Screen.printf("Pozdrav korisnik: %d.\n", currMenu.iUserID);
+  DrawMenuItem();
+  g_Screen.println("Pritisnite gumb za pocetak skena.");
+  g_Screen.println("Prislonite ponovno karticu za prekid.");
+
+  if( g_Input.bScanPressed )
+  {
+    LOGD(LOG_MOD_MAIN, "Pressed!");
+    return TRIGGER_SCAN_PRESSED;
+  }
+
+  if( !g_Input.bNfcIrq )
+    return TRIGGER_NONE;
+
+  bool bCardExists = g_NFC.CheckCard();
+  if( bCardExists )
+  {
+    g_Screen.clearDisplay();
+    g_Screen.setCursor(0, 1);
+    g_Screen.println("Prekid uspjesan!\nOdmaknite kartu.");
+    FlushScreen();
+    g_NFC.WaitForRemoval();
+  }
+  g_NFC.Reset();
+
+  return bCardExists ? TRIGGER_CANCEL : TRIGGER_NONE;
 }
 
-void requestString(int requestNumber, byte cmd, char *response, int length)
+// Where the slave says the running scan is
+uint8_t g_uScanProgress = SCAN_PROGRESS_UNKNOWN;
+uint32_t g_ulScanEta = SCAN_ETA_UNKNOWN;
+unsigned long g_ulNextProgressPoll = 0;
+
+void EnterScanning(int iFrom)
 {
-  informSlave(requestNumber, cmd);
-  //again - after ESP32 buffer prefill
-  delay(REQUEST_DELAY);
-  I2cRead<char>(response, length); //read register
+  (void)iFrom;
+  informSlave(g_iRequestCount, CMD_START_SCAN);
+  g_iRequestCount++;
+
+  g_uScanProgress = SCAN_PROGRESS_UNKNOWN;
+  g_ulScanEta = SCAN_ETA_UNKNOWN;
+  g_ulNextProgressPoll = millis();
 }
 
-template < class T >
-void requestNum(int requestNumber, byte cmd, T *response)
+void PollScanProgress()
 {
-  informSlave(requestNumber, cmd);
-  //again - after ESP32 buffer prefill
-  delay(REQUEST_DELAY);
-  I2cRead<T>(response, sizeof(T)); //read register
+  if( (long)(millis() - g_ulNextProgressPoll) < 0 )
+    return;
+  g_ulNextProgressPoll = millis() + SCAN_PROGRESS_INTERVAL;
+
+  // A read that fails leaves these as they were, so start from unknown. Slaves that predate
+  // the commands answer with whatever, anything out of range is taken as unknown too
+  uint8_t uProgress = SCAN_PROGRESS_UNKNOWN;
+  requestNum<uint8_t>(g_iRequestCount, CMD_GET_PROGRESS, &uProgress);
+  g_iRequestCount++;
+  g_uScanProgress = uProgress <= 100 ? uProgress : SCAN_PROGRESS_UNKNOWN;
+
+  uint32_t ulEta = SCAN_ETA_UNKNOWN;
+  requestNum<uint32_t>(g_iRequestCount, CMD_GET_ETA, &ulEta);
+  g_iRequestCount++;
+  g_ulScanEta = ulEta <= g_stateInfo[STATE_SCANNING].ulBudgetMs ? ulEta : SCAN_ETA_UNKNOWN;
 }
 
-void I2cTransmit(int requestNumber, byte cmd)
+void DrawScanProgress()
 {
-  request command;
-  command.command = cmd;
-  command.requestCount = requestNumber;
-  Wire.beginTransmission(I2C_DEV_ADDR); //start condition
-  Wire.write((uint8_t*)&command, sizeof(request)); //write to slave register
-  Wire.endTransmission(); // end condition
+  g_Screen.println("Skeniranje...");
+  if( g_uScanProgress != SCAN_PROGRESS_UNKNOWN )
+  {
+    if( g_ulScanEta != SCAN_ETA_UNKNOWN )
+      g_Screen.printf("%d %%, jos %lu s\n", g_uScanProgress, (unsigned long)(g_ulScanEta + 999) / 1000);
+    else
+      g_Screen.printf("%d %%\n", g_uScanProgress);
+
+    g_Screen.drawRect(0, 18, SCREEN_WIDTH, 8, WHITE);
+    g_Screen.fillRect(2, 20, (SCREEN_WIDTH - 4) * g_uScanProgress / 100, 4, WHITE);
+  }
+  g_Screen.setCursor(0, 30);
+  g_Screen.println("Gumb ili kartica za prekid.");
 }
 
-template <class T>
-void I2cRead(T *response, int length)
+int UpdateScanning()
 {
-  if(Wire.requestFrom(I2C_DEV_ADDR,length) == length) //read from device register
-    Wire.readBytes((char *)response, length); //read register
-}
\ No newline at end of file
+  // The customer walked off or changed their mind, the station is free for the next one straight away
+  bool bCancel = g_Input.bScanPressed;
+  if( !bCancel && g_Input.bNfcIrq )
+  {
+    bCancel = g_NFC.CheckCard();
+    g_NFC.Reset();
+    g_bAwaitingRemoval |= bCancel;
+  }
+  if( bCancel )
+  {
+    ShowToast("Sken prekinut.");
+    return TRIGGER_CANCEL;
+  }
+
+  if( g_Input.bIsScanning )
+    PollScanProgress();
+  DrawScanProgress();
+
+  if( g_Input.bIsScanning || g_Input.flPercentage == -1 )
+    return TRIGGER_NONE;
+
+  g_Percentage = g_Input.flPercentage;
+  return TRIGGER_SCAN_DONE;
+}
+
+void ExitScanning(int iTo)
+{
+  if( iTo == STATE_CONFIRM_RESULT )
+    return;
+
+  // Cancelled or timed out, don't leave the camera busy with a scan nobody is waiting for
+  TRACE_INSTANT("scan cancel");
+  informSlave(g_iRequestCount, CMD_CANCEL_SCAN);
+  g_iRequestCount++;
+}
+
+int UpdateConfirmResult()
+{
+  int iRating = g_Config.GetRating(g_Percentage);
+
+  g_Screen.printf("Rating: %s\n", rating[iRating] );
+  DrawMenuItem();
+  g_Screen.println("Prislonite karticu za potvrdu.");
+
+  if( !g_Input.bNfcIrq )
+    return TRIGGER_NONE;
+
+  bool bCardExists = g_NFC.CheckCard();
+  g_NFC.Reset();
+  if( !bCardExists )
+    return TRIGGER_NONE;
+
+  recordRating(currMenu, g_Percentage);
+
+  // Hand the rating over to the send queue and take the next customer straight away
+  if( g_Config.iRawUpload )
+  {
+    static char szData[TELEMETRY_MAX_LEN];
+    if( !createTelemetryData(szData, sizeof(szData), g_IoTHub.GetDeviceID(), currMenu, g_Percentage) )
+      LOGW(LOG_MOD_MAIN, "Telemetry didn't fit, not sent");
+    else if( getGatewayMode() == GATEWAY_MODE_DOWNSTREAM )
+    {
+      int iResult = gatewaySendTelemetry(szData);
+      if( iResult == GATEWAY_SEND_TOO_BIG )
+        LOGW(LOG_MOD_MAIN, "Telemetry too big for an ESP-NOW frame, not sent");
+      else if( iResult == GATEWAY_SEND_DROPPED )
+        LOGW(LOG_MOD_MAIN, "Telemetry queue full, dropped the oldest message");
+    }
+    else if( !g_IoTHub.queueTelemetryData(szData) )
+      LOGW(LOG_MOD_MAIN, "Telemetry queue full, dropped the oldest message");
+  }
+
+  g_bAwaitingRemoval = true;
+  ShowToast("Uspjeh! Odmaknite kartu.");
+  return TRIGGER_CARD_CONFIRM;
+}
+
+const stateActions g_StateActions[STATE_COUNT] =
+{
+  { EnterIdle, UpdateIdle, nullptr },
+  { EnterConfirmScan, UpdateConfirmScan, nullptr },
+  { EnterScanning, UpdateScanning, ExitScanning },
+  { nullptr, UpdateConfirmResult, nullptr }
+};
+
+// State spans run across loop() calls on their own track
+void OnStateChange(int iFrom, int iTo, int iTrigger)
+{
+  TRACE_END(g_stateInfo[iFrom].szName, TRACE_TRACK_STATE);
+  TRACE_BEGIN(g_stateInfo[iTo].szName, TRACE_TRACK_STATE);
+
+  if( iTrigger != TRIGGER_TIMEOUT )
+    return;
+
+  LOGW(LOG_MOD_MAIN, "No progress in %s for %lu ms, going to %s", g_stateInfo[iFrom].szName, g_stateInfo[iFrom].ulBudgetMs, g_stateInfo[iTo].szName);
+  if( iFrom == STATE_SCANNING )
+    ShowToast("Sken nije uspio, pokusajte ponovno.");
+  else
+    ShowToast("Isteklo vrijeme.");
+}
+
+CStateMachine g_Flow(g_StateActions, OnStateChange);
+
+void loop() 
+{
+  TRACE_SCOPE("loop");
+
+  if( g_Flow.GetState() == STATE_NONE )
+  {
+    g_Flow.Start(STATE_IDLE, millis());
+    TRACE_BEGIN(g_Flow.GetStateName(), TRACE_TRACK_STATE);
+  }
+
+  g_Screen.clearDisplay();
+  g_Screen.setCursor(0, 1);
+
+  g_Input.flPercentage = -1;
+  g_Input.bIsScanning = false;
+
+  // A new slave image only goes out between customers, and while it does the slave can't scan
+  bool bUpdatingSlave = updateSlaveFw(g_Flow.GetState() == STATE_IDLE && !g_bAwaitingRemoval);
+  if( !bUpdatingSlave )
+  {
+    requestNum<float>(g_iRequestCount, CMD_GET_RESULT, &g_Input.flPercentage);
+    //Serial.printf("Request %d, command 4 (len): %f\n",g_iRequestCount,g_Input.flPercentage);
+    g_iRequestCount++;
+
+    requestNum<bool>(g_iRequestCount, CMD_IS_SCANNING, &g_Input.bIsScanning);
+    g_iRequestCount++;
+    //Serial.printf("Request %d, command 2 (len): %d\n",g_iRequestCount, g_Input.bIsScanning);
+  }
+
+  updateWiFi();
+  // A downstream station has no hub connection of its own, the gateway sends for it
+  if( getGatewayMode() != GATEWAY_MODE_DOWNSTREAM )
+    g_IoTHub.loop();
+  updateGateway();
+  checkHeapGuard();
+  updateDiagnostics();
+  updateRatings();
+  // Switches to a new image only once nobody's at the station and every rating is out
+  bool bDownloadingOta = updateOta(g_Flow.GetState() == STATE_IDLE && !g_bAwaitingRemoval && g_IoTHub.GetQueuedCount() == 0);
+  updateTrace();
+  updateCapture();
+  g_CamBus.update();
+  g_NfcBus.update();
+
+  // The device twin can change the bus speed at any time
+  static int iAppliedI2CFreq = g_Config.iI2CFreq;
+  if( iAppliedI2CFreq != g_Config.iI2CFreq )
+  {
+    g_CamBus.setClock(g_Config.iI2CFreq);
+    iAppliedI2CFreq = g_Config.iI2CFreq;
+  }
+
+  // Everything but a running scan waits on the customer, so wait for them to do something.
+  // A press only means something in the state that's asking for one, elsewhere it's just dropped
+  g_Input.bScanPressed = false;
+  g_Input.bNfcIrq = false;
+  unsigned long ulWait = g_Flow.GetState() == STATE_SCANNING || bUpdatingSlave || bDownloadingOta ? 0 : INPUT_WAIT;
+  inputEvent event;
+  while( getEvent(event, ulWait) )
+  {
+    ulWait = 0;
+    if( event.type == EVENT_BUTTON_PRESS )
+    {
+      TRACE_INSTANT("button");
+      CAPTURE(CAPTURE_BUTTON, 0, nullptr, 0);
+      g_Input.bScanPressed = true;
+    }
+    else if( event.type == EVENT_NFC_IRQ )
+    {
+      TRACE_INSTANT("nfc irq");
+      g_Input.bNfcIrq = true;
+    }
+  }
+  // IRQ stays up until the notification is read, a card that was already there didn't make an edge
+  g_Input.bNfcIrq |= digitalRead(NFC_IRQ_Pin) == HIGH;
+  static bool bLastNfcIrq = false;
+  if( g_Input.bNfcIrq != bLastNfcIrq )
+  {
+    CAPTURE(CAPTURE_NFC_IRQ, g_Input.bNfcIrq, nullptr, 0);
+    bLastNfcIrq = g_Input.bNfcIrq;
+  }
+
+  if( bUpdatingSlave )
+    g_Screen.printf("Azuriranje skenera...\n%d %%", getSlaveFwStats().GetProgress());
+  else
+    g_Flow.Step(millis());
+
+  DrawToast();
+  FlushScreen();
+
+  // Nobody around and nothing left to send, no point in polling at full speed
+  // A gateway has to keep listening for its stations
+  bool bIdle = g_Flow.GetState() == STATE_IDLE && !g_bAwaitingRemoval && !bUpdatingSlave && !bDownloadingOta && g_IoTHub.GetQueuedCount() == 0
+    && getGatewayMode() != GATEWAY_MODE_GATEWAY && getGatewayPending() == 0;
+  if( updatePower(bIdle) )
+  {
+    TRACE_SCOPE("sleep");
+    g_Screen.ssd1306_command(SSD1306_DISPLAYOFF);
+    // Discovery again whatever the last card left it in, it's the only thing that wakes us
+    g_NFC.Reset();
+    enterSleep();
+    g_Screen.ssd1306_command(SSD1306_DISPLAYON);
+
+    attachEventInterrupts();
+  }
+}
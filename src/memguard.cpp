@@ -0,0 +1,134 @@
+#include <Arduino.h>
+#include <atomic>
+#include <new>
+
+#include "memguard.h"
+#include "log.h"
+
+#define HEAP_GUARD_REPORT_INTERVAL 60000 // ms, a leak in a loop shouldn't drown the log
+
+static std::atomic<bool> s_bArmed{false};
+static std::atomic<int> s_iAllocations{0};
+static std::atomic<size_t> s_uBytes{0};
+static std::atomic<size_t> s_uLastSize{0};
+static std::atomic<void *> s_pLastCaller{nullptr};
+
+static int s_iReported = 0;
+static unsigned long s_ulLastReport = 0;
+
+// Can be called from any task, so it only counts, checkHeapGuard() does the talking
+static inline void NoteAllocation(size_t uSize, void *pCaller)
+{
+    if( !s_bArmed.load(std::memory_order_relaxed) )
+        return;
+
+    s_iAllocations.fetch_add(1, std::memory_order_relaxed);
+    s_uBytes.fetch_add(uSize, std::memory_order_relaxed);
+    s_uLastSize.store(uSize, std::memory_order_relaxed);
+    s_pLastCaller.store(pCaller, std::memory_order_relaxed);
+}
+
+#ifdef HEAP_GUARD_WRAP_MALLOC
+
+// env:native_micro links with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, so the C side gets counted too,
+// mbedTLS and the Azure SDK included. A realloc counts as a new allocation of the new size, it may well be one
+extern "C" void *__real_malloc(size_t uSize);
+extern "C" void *__real_calloc(size_t uCount, size_t uSize);
+extern "C" void *__real_realloc(void *p, size_t uSize);
+
+extern "C" void *__wrap_malloc(size_t uSize)
+{
+    NoteAllocation(uSize, __builtin_return_address(0));
+    return __real_malloc(uSize);
+}
+
+extern "C" void *__wrap_calloc(size_t uCount, size_t uSize)
+{
+    NoteAllocation(uCount * uSize, __builtin_return_address(0));
+    return __real_calloc(uCount, uSize);
+}
+
+extern "C" void *__wrap_realloc(void *p, size_t uSize)
+{
+    if( uSize )
+        NoteAllocation(uSize, __builtin_return_address(0));
+    return __real_realloc(p, uSize);
+}
+
+// operator new has counted it already
+#define HEAP_MALLOC __real_malloc
+
+#else
+
+#define HEAP_MALLOC malloc
+
+#endif
+
+void *operator new(size_t uSize)
+{
+    NoteAllocation(uSize, __builtin_return_address(0));
+    void *p = HEAP_MALLOC(uSize ? uSize : 1);
+    if( !p )
+        abort();
+    return p;
+}
+
+void *operator new[](size_t uSize)
+{
+    NoteAllocation(uSize, __builtin_return_address(0));
+    void *p = HEAP_MALLOC(uSize ? uSize : 1);
+    if( !p )
+        abort();
+    return p;
+}
+
+void *operator new(size_t uSize, const std::nothrow_t &) noexcept
+{
+    NoteAllocation(uSize, __builtin_return_address(0));
+    return HEAP_MALLOC(uSize ? uSize : 1);
+}
+
+void *operator new[](size_t uSize, const std::nothrow_t &) noexcept
+{
+    NoteAllocation(uSize, __builtin_return_address(0));
+    return HEAP_MALLOC(uSize ? uSize : 1);
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+void armHeapGuard()
+{
+    s_bArmed = true;
+    LOGI(LOG_MOD_MEM, "Heap guard armed, %u bytes free", ESP.getFreeHeap());
+}
+
+void checkHeapGuard()
+{
+    int iAllocations = s_iAllocations.load(std::memory_order_relaxed);
+    if( iAllocations == s_iReported )
+        return;
+
+    unsigned long ulNow = millis();
+    if( s_iReported != 0 && ulNow - s_ulLastReport < HEAP_GUARD_REPORT_INTERVAL )
+        return;
+
+    heapGuardStats stats = getHeapGuardStats();
+    LOGW(LOG_MOD_MEM, "%d heap allocations after setup() (%u bytes), last one %u bytes from %p",
+        stats.iAllocations, (unsigned)stats.uBytes, (unsigned)stats.uLastSize, stats.pLastCaller);
+
+    s_iReported = iAllocations;
+    s_ulLastReport = ulNow;
+}
+
+heapGuardStats getHeapGuardStats()
+{
+    heapGuardStats stats;
+    stats.iAllocations = s_iAllocations.load(std::memory_order_relaxed);
+    stats.uBytes = s_uBytes.load(std::memory_order_relaxed);
+    stats.uLastSize = s_uLastSize.load(std::memory_order_relaxed);
+    stats.pLastCaller = s_pLastCaller.load(std::memory_order_relaxed);
+    return stats;
+}
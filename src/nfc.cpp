@@ -12,8 +12,14 @@
  * Distributed as-is; no warranty is given.
  */
 
+#include <new>
+
 #include "Electroniccats_PN7150.h"
 #include "nfc.h"
+#include "capture.h"
+#include "i2cbus.h"
+#include "log.h"
+#include "trace.h"
 
 #define PN7150_ADDR (0x28)
 #define PN7150_ADDR (0x28)
@@ -27,43 +33,39 @@
 // Structure AUTHCODE_1, AUTHCODE_2, USERID, MENULEN, MENU_ITEM
 #define DATA_WRITE_MFC AUTH_CODE, 1, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
 
-#define I2C_Freq 100000
-
 void CNFCHandler::setup( TwoWire *wire, int SDA_Pin, int SCL_Pin, int IRQ_Pin, int VEN_Pin ) 
 {
   m_Wire = wire;
-  if(!m_Wire->begin(SDA_Pin, SCL_Pin, I2C_Freq)) //starting I2C Wire
+  if(!m_Wire->begin(SDA_Pin, SCL_Pin, NFC_I2C_FREQ)) //starting I2C Wire
   {
-    Serial.println("I2C Wire Error. Going idle.");
+    LOGE(LOG_MOD_NFC, "I2C Wire Error. Going idle.");
   }
 
-  m_NFC = new Electroniccats_PN7150(IRQ_Pin, VEN_Pin, PN7150_ADDR, m_Wire);  // creates a global NFC device interface object, attached to pins 7 (IRQ) and 8 (VEN) and using the default I2C address 0x28
-
-  Serial.println("Read ISO14443-3A(T2T) data block 5 with PN7150");
+  if( !m_NFC )
+    m_NFC = new (m_NFCStorage) Electroniccats_PN7150(IRQ_Pin, VEN_Pin, PN7150_ADDR, m_Wire);  // creates the NFC device interface object in our own storage, attached to the IRQ and VEN pins and using the default I2C address 0x28
 
-  Serial.println("Initializing...");
+  LOGI(LOG_MOD_NFC, "Initializing PN7150...");
   if (m_NFC->connectNCI()) {  // Wake up the board
-    Serial.println("Error while setting up the mode, check connections!");
+    LOGE(LOG_MOD_NFC, "Error while setting up the mode, check connections!");
   }
 
   if (m_NFC->configureSettings()) {
-    Serial.println("The Configure Settings failed!");
+    LOGE(LOG_MOD_NFC, "The Configure Settings failed!");
   }
 
   if (m_NFC->configMode()) {  // Set up the configuration mode
-    Serial.println("The Configure Mode failed!!");
+    LOGE(LOG_MOD_NFC, "The Configure Mode failed!!");
   }
   m_NFC->startDiscovery();  // NCI Discovery mode
-  Serial.println("Waiting for an ISO14443-3A Card...");
+  LOGI(LOG_MOD_NFC, "Waiting for an ISO14443-3A Card...");
 }
 
 void CNFCHandler::loop()
 {
   if( m_NFC->isTagDetected() )
   {
-    Serial.println(m_NFC->remoteDevice.getProtocol());
-    Serial.println(m_NFC->remoteDevice.getModeTech());
-    Serial.println(m_NFC->remoteDevice.getInterface());
+    LOGD(LOG_MOD_NFC, "Protocol %d, tech %d, interface %d", (int)m_NFC->remoteDevice.getProtocol(),
+      (int)m_NFC->remoteDevice.getModeTech(), (int)m_NFC->remoteDevice.getInterface());
     
     menu TempMenu;
     TempMenu.iUserID = 1; // User id number 1
@@ -79,34 +81,52 @@ void CNFCHandler::loop()
 
     out.Print();
 
-    Serial.println("Remove the Card");
+    LOGI(LOG_MOD_NFC, "Remove the Card");
     m_NFC->waitForTagRemoval();
-    Serial.println("CARD REMOVED!");
+    LOGI(LOG_MOD_NFC, "CARD REMOVED!");
   }
 
-  Serial.println("Restarting...");
+  LOGD(LOG_MOD_NFC, "Restarting...");
   m_NFC->reset();
-  Serial.println("Waiting for an ISO14443-3A Card...");
+  LOGD(LOG_MOD_NFC, "Waiting for an ISO14443-3A Card...");
 }
 
 bool CNFCHandler::CheckCard(bool bWait)
 {
-  return m_NFC->isTagDetected();
+  TRACE_SCOPE("nfc detect");
+  bool bDetected = m_NFC->isTagDetected();
+  CAPTURE(CAPTURE_NFC_DETECT, bDetected, nullptr, 0);
+  return bDetected;
 }
 
 void CNFCHandler::WaitForRemoval()
 {
+  TRACE_SCOPE("nfc wait removal");
   m_NFC->waitForTagRemoval();
+  CAPTURE(CAPTURE_NFC_REMOVED, 0, nullptr, 0);
 }
 
 void CNFCHandler::Reset()
 {
+  TRACE_SCOPE("nfc reset");
   m_NFC->reset();
 }
 
-int CNFCHandler::WriteMenu(menu newMenu)
+bool CNFCHandler::TagCmd(unsigned char *cmd, unsigned char cmdSize, unsigned char *resp, unsigned char *respSize)
+{
+  CAPTURE(CAPTURE_NFC_CMD, 0, cmd, cmdSize);
+  uint32_t ulStartUs = micros();
+  bool status = m_NFC->readerTagCmd(cmd, cmdSize, resp, respSize);
+  // The driver talks to Wire1 itself, this is the only result it gives back
+  g_NfcBus.account(PN7150_ADDR, status == NFC_ERROR ? I2C_ERR_NO_ANSWER : I2C_OK, ulStartUs);
+  CAPTURE(CAPTURE_NFC_RESP, status, resp, status == NFC_ERROR ? 0 : *respSize); // The size isn't set when the card didn't answer
+  return status;
+}
+
+int CNFCHandler::WriteMenu(const menu &newMenu)
 {
-  Serial.println("Start reading process...");
+  TRACE_SCOPE("nfc write menu");
+  LOGD(LOG_MOD_NFC, "Start writing process...");
   bool status;
   unsigned char Resp[256];
   unsigned char RespSize;
@@ -137,21 +157,21 @@ int CNFCHandler::WriteMenu(menu newMenu)
   }
 
   /* Authenticate */
-  status = m_NFC->readerTagCmd(Auth, sizeof(Auth), Resp, &RespSize);
+  status = TagCmd(Auth, sizeof(Auth), Resp, &RespSize);
   if ((status == NFC_ERROR) || (Resp[RespSize - 1] != 0)) {
-    Serial.println("Auth error!");
+    LOGW(LOG_MOD_NFC, "Auth error!");
     return 1;
   }
 
   /* Write block */
-  status = m_NFC->readerTagCmd(WritePart1, sizeof(WritePart1), Resp, &RespSize);
+  status = TagCmd(WritePart1, sizeof(WritePart1), Resp, &RespSize);
   if ((status == NFC_ERROR) || (Resp[RespSize - 1] != 0)) {
-    Serial.print("Error writing block!");
+    LOGW(LOG_MOD_NFC, "Error writing block!");
     return 3;
   }
-  status = m_NFC->readerTagCmd(WritePart2, sizeof(WritePart2), Resp, &RespSize);
+  status = TagCmd(WritePart2, sizeof(WritePart2), Resp, &RespSize);
   if ((status == NFC_ERROR) || (Resp[RespSize - 1] != 0)) {
-    Serial.print("Error writing block!");
+    LOGW(LOG_MOD_NFC, "Error writing block!");
     return 4;
   }
 
@@ -160,7 +180,8 @@ int CNFCHandler::WriteMenu(menu newMenu)
 
 int CNFCHandler::ReadMenu(menu &out)
 {
-  Serial.println("Start reading process...");
+  TRACE_SCOPE("nfc read menu");
+  LOGD(LOG_MOD_NFC, "Start reading process...");
   bool status;
   unsigned char Resp[256];
   unsigned char RespSize;
@@ -170,16 +191,16 @@ int CNFCHandler::ReadMenu(menu &out)
   unsigned char Read[] = {0x10, 0x30, BLK_NB_MFC};
 
   /* Authenticate */
-  status = m_NFC->readerTagCmd(Auth, sizeof(Auth), Resp, &RespSize);
+  status = TagCmd(Auth, sizeof(Auth), Resp, &RespSize);
   if ((status == NFC_ERROR) || (Resp[RespSize - 1] != 0)) {
-    Serial.println("Auth error!");
+    LOGW(LOG_MOD_NFC, "Auth error!");
     return 1;
   }
 
   /* Read block again to see te changes*/
-  status = m_NFC->readerTagCmd(Read, sizeof(Read), Resp, &RespSize);
+  status = TagCmd(Read, sizeof(Read), Resp, &RespSize);
   if ((status == NFC_ERROR) || (Resp[RespSize - 1] != 0)) {
-    Serial.print("Error reading block!");
+    LOGW(LOG_MOD_NFC, "Error reading block!");
     return 2;
   }
 
@@ -188,7 +209,7 @@ int CNFCHandler::ReadMenu(menu &out)
 
   if( data[0] != 'o' && data[1] != 'p' )
   {
-    Serial.println("KARTICA NIJE ISPRAVNO AUTENTIFICIRANA!");
+    LOGW(LOG_MOD_NFC, "KARTICA NIJE ISPRAVNO AUTENTIFICIRANA!");
     return 3;
   }
 
@@ -197,11 +218,11 @@ int CNFCHandler::ReadMenu(menu &out)
 
   out.iUserID = data[0];
   data++; numBytes--;
-  out.iMenuLen = data[0];
+  out.iMenuLen = min((int)data[0], MENU_MAX_ITEMS);
   data++; numBytes--;
   
   uint32_t iPos;
-  for( iPos = 0; iPos < numBytes; iPos++ )
+  for( iPos = 0; iPos < numBytes && iPos < MENU_MAX_ITEMS; iPos++ )
   {
     out.iaMenu[iPos] = data[iPos];
   }
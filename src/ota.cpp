@@ -0,0 +1,394 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <HTTPClient.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/md.h>
+
+#include <azure_ca.h>
+
+#include "ota.h"
+#include "delta.h"
+#include "log.h"
+#include "trace.h"
+
+static otaStats s_stats = {};
+static char s_szUrl[OTA_URL_LEN] = "";
+static uint8_t s_expectedHash[DELTA_HASH_LEN];
+
+static HTTPClient s_http;
+static WiFiClient *s_pStream = nullptr;
+static int s_iContentLength = -1;
+static unsigned long s_ulLastByte = 0;
+static uint8_t s_buffer[1024];
+
+static const esp_partition_t *s_pBase = nullptr;   // Running, what a delta copies from
+static const esp_partition_t *s_pTarget = nullptr; // The other one, written as the download comes in
+static esp_ota_handle_t s_handle = 0;
+static bool s_bOtaBegun = false;
+static bool s_bFormatKnown = false;
+static bool s_bDownloaded = false; // All of it is in flash, waiting on the base check to finish
+static mbedtls_md_context_t s_md;
+
+// The running image a delta copies from, hashed a slice per loop() alongside the download
+static mbedtls_md_context_t s_mdBase;
+static bool s_bBaseHashing = false;
+static bool s_bBaseChecked = false;
+static uint32_t s_uBaseHashed = 0;
+static uint32_t s_uBaseSize = 0;
+static uint8_t s_baseHash[DELTA_HASH_LEN];
+
+static bool OnDeltaHeader(const deltaHeader &header);
+static bool ReadBase(uint32_t uOffset, uint8_t *data, size_t length);
+static bool WriteTarget(const uint8_t *data, size_t length);
+
+static const deltaSink s_sink = { OnDeltaHeader, ReadBase, WriteTarget };
+static CDeltaDecoder s_decoder(s_sink);
+
+static bool ParseHash(const char *szHex, uint8_t *hash)
+{
+    if( strlen(szHex) != DELTA_HASH_LEN * 2 )
+        return false;
+
+    for( int i = 0; i < DELTA_HASH_LEN; i++ )
+    {
+        char byte[3] = { szHex[i * 2], szHex[i * 2 + 1], 0 };
+        char *end;
+        hash[i] = (uint8_t)strtoul(byte, &end, 16);
+        if( *end )
+            return false;
+    }
+    return true;
+}
+
+int otaRequest(const char *json, size_t length)
+{
+    StaticJsonDocument<384> doc;
+    if( deserializeJson(doc, json, length) )
+        return 400;
+
+    // The hash comes over the hub's authenticated connection, the image over whatever the URL says.
+    // A delta carries a target hash of its own, but anyone who can change the download can change that too
+    const char *szUrl = doc["url"];
+    const char *szHash = doc["sha256"];
+    if( !szUrl || strlen(szUrl) >= sizeof(s_szUrl) || !szHash || !ParseHash(szHash, s_expectedHash) )
+    {
+        LOGE(LOG_MOD_OTA, "Bad firmware update request, it needs a url and the image's sha256");
+        return 400;
+    }
+    if( strncmp(szUrl, "https://", 8) != 0 && !OTA_ALLOW_HTTP )
+    {
+        LOGE(LOG_MOD_OTA, "Firmware update refused, only https:// URLs");
+        return 400;
+    }
+    if( s_stats.iState == OTA_DOWNLOADING || s_stats.iState == OTA_READY )
+    {
+        LOGW(LOG_MOD_OTA, "Firmware update already running, request refused");
+        return 409;
+    }
+
+    strcpy(s_szUrl, szUrl);
+    s_stats = {};
+    s_stats.iState = OTA_DOWNLOADING;
+    LOGI(LOG_MOD_OTA, "Firmware update from %s", s_szUrl);
+    return 202;
+}
+
+static void Fail(const char *reason)
+{
+    LOGE(LOG_MOD_OTA, "Firmware update failed after %u bytes: %s", (unsigned)s_stats.uDownloaded, reason);
+    if( s_bOtaBegun )
+        esp_ota_abort(s_handle);
+    s_bOtaBegun = false;
+    s_http.end();
+    s_pStream = nullptr;
+    mbedtls_md_free(&s_md);
+    mbedtls_md_free(&s_mdBase);
+    s_bBaseHashing = false;
+    s_bDownloaded = false;
+    s_stats.iState = OTA_FAILED;
+}
+
+static bool Start()
+{
+    s_pBase = esp_ota_get_running_partition();
+    s_pTarget = esp_ota_get_next_update_partition(nullptr);
+    if( !s_pBase || !s_pTarget )
+    {
+        Fail("no partition to update into");
+        return false;
+    }
+
+    // A stream with no chunked encoding to undo, the body goes straight into the decoder.
+    // Images live in blob storage, which chains up to the same roots as the hub
+    s_http.useHTTP10(true);
+    s_http.setTimeout(OTA_READ_TIMEOUT);
+    bool bHttps = strncmp(s_szUrl, "https://", 8) == 0;
+    if( !(bHttps ? s_http.begin(s_szUrl, (const char *)ca_pem) : s_http.begin(s_szUrl)) )
+    {
+        Fail("bad URL");
+        return false;
+    }
+
+    int iCode = s_http.GET();
+    s_pStream = iCode == HTTP_CODE_OK ? s_http.getStreamPtr() : nullptr;
+    if( !s_pStream )
+    {
+        LOGE(LOG_MOD_OTA, "HTTP %d %s", iCode, s_http.errorToString(iCode).c_str());
+        Fail("download didn't start");
+        return false;
+    }
+    s_iContentLength = s_http.getSize();
+
+    // Sectors are erased as the writes get to them, erasing the whole partition up front blocks for seconds
+    if( esp_ota_begin(s_pTarget, OTA_WITH_SEQUENTIAL_WRITES, &s_handle) != ESP_OK )
+    {
+        Fail("couldn't start writing the partition");
+        return false;
+    }
+    s_bOtaBegun = true;
+
+    mbedtls_md_init(&s_md);
+    mbedtls_md_setup(&s_md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&s_md);
+    mbedtls_md_init(&s_mdBase);
+
+    s_decoder.Reset();
+    s_bFormatKnown = false;
+    s_bDownloaded = false;
+    s_bBaseHashing = false;
+    s_bBaseChecked = false;
+    s_stats.ulStartMs = millis();
+    s_ulLastByte = millis();
+    LOGI(LOG_MOD_OTA, "Downloading %d bytes into %s", s_iContentLength, s_pTarget->label);
+    return true;
+}
+
+static bool OnDeltaHeader(const deltaHeader &header)
+{
+    if( header.uTargetSize > s_pTarget->size || header.uBaseSize > s_pBase->size )
+    {
+        LOGE(LOG_MOD_OTA, "Delta sizes don't fit, base %u, target %u", (unsigned)header.uBaseSize, (unsigned)header.uTargetSize);
+        return false;
+    }
+    if( memcmp(s_expectedHash, header.targetHash, DELTA_HASH_LEN) != 0 )
+    {
+        LOGE(LOG_MOD_OTA, "Delta is for a different image than the request said");
+        return false;
+    }
+
+    // Against any other image than the one it was made from, the copies would just make garbage. Hashing all of
+    // it here would hold up loop() for the whole partition, so it goes a slice at a time and the new image
+    // isn't taken before it's done. Garbage would fail the target hash anyway, this just says why
+    mbedtls_md_setup(&s_mdBase, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+    mbedtls_md_starts(&s_mdBase);
+    memcpy(s_baseHash, header.baseHash, DELTA_HASH_LEN);
+    s_uBaseSize = header.uBaseSize;
+    s_uBaseHashed = 0;
+    s_bBaseHashing = true;
+
+    s_stats.uTargetSize = header.uTargetSize;
+    return true;
+}
+
+static void HashBase()
+{
+    if( !s_bBaseHashing )
+        return;
+
+    TRACE_SCOPE("ota base check");
+
+    unsigned long ulStart = millis();
+    while( s_uBaseHashed < s_uBaseSize && millis() - ulStart < OTA_BASE_SLICE )
+    {
+        size_t uLength = min((uint32_t)sizeof(s_buffer), s_uBaseSize - s_uBaseHashed);
+        if( esp_partition_read(s_pBase, s_uBaseHashed, s_buffer, uLength) != ESP_OK )
+        {
+            Fail("couldn't read the running image");
+            return;
+        }
+        mbedtls_md_update(&s_mdBase, s_buffer, uLength);
+        s_uBaseHashed += uLength;
+    }
+    if( s_uBaseHashed < s_uBaseSize )
+        return;
+
+    uint8_t hash[DELTA_HASH_LEN];
+    mbedtls_md_finish(&s_mdBase, hash);
+    mbedtls_md_free(&s_mdBase);
+    s_bBaseHashing = false;
+
+    if( memcmp(hash, s_baseHash, DELTA_HASH_LEN) != 0 )
+    {
+        Fail("delta was made against a different image than the one running");
+        return;
+    }
+    s_bBaseChecked = true;
+    LOGI(LOG_MOD_OTA, "Running image matches the delta's base, %u bytes checked by %lu ms in", (unsigned)s_uBaseSize, millis() - s_stats.ulStartMs);
+}
+
+static bool ReadBase(uint32_t uOffset, uint8_t *data, size_t length)
+{
+    return esp_partition_read(s_pBase, uOffset, data, length) == ESP_OK;
+}
+
+static bool WriteTarget(const uint8_t *data, size_t length)
+{
+    if( esp_ota_write(s_handle, data, length) != ESP_OK )
+        return false;
+    mbedtls_md_update(&s_md, data, length);
+    s_stats.uWritten += length;
+    return true;
+}
+
+// The whole image has come in, the connection isn't needed any more
+static void EndDownload()
+{
+    s_http.end();
+    s_pStream = nullptr;
+    s_bDownloaded = true;
+}
+
+static void Complete()
+{
+    uint8_t hash[DELTA_HASH_LEN];
+    mbedtls_md_finish(&s_md, hash);
+    mbedtls_md_free(&s_md);
+
+    if( s_stats.uTargetSize && s_stats.uWritten != s_stats.uTargetSize )
+    {
+        Fail("download cut short");
+        return;
+    }
+    if( memcmp(hash, s_expectedHash, DELTA_HASH_LEN) != 0 )
+    {
+        Fail("SHA-256 of the new image doesn't match");
+        return;
+    }
+
+    s_bOtaBegun = false;
+    s_bDownloaded = false;
+    if( esp_ota_end(s_handle) != ESP_OK )
+    {
+        Fail("new image didn't validate");
+        return;
+    }
+
+    s_stats.iState = OTA_READY;
+    s_stats.ulDurationMs = millis() - s_stats.ulStartMs;
+    LOGI(LOG_MOD_OTA, "New %s image verified, %u bytes from %u downloaded in %lu ms, switching once the station is idle",
+        s_stats.bDelta ? "delta" : "full", (unsigned)s_stats.uWritten, (unsigned)s_stats.uDownloaded, s_stats.ulDurationMs);
+}
+
+// False once the download is over, whichever way
+static bool Consume(const uint8_t *data, size_t length)
+{
+    if( !s_bFormatKnown )
+    {
+        s_bFormatKnown = true;
+        s_stats.bDelta = data[0] != OTA_IMAGE_MAGIC;
+        if( !s_stats.bDelta )
+            s_stats.uTargetSize = s_iContentLength > 0 ? s_iContentLength : 0;
+    }
+
+    if( s_stats.bDelta )
+    {
+        int iResult = s_decoder.Feed(data, length);
+        if( iResult == DELTA_DONE )
+        {
+            EndDownload();
+            return false;
+        }
+        if( iResult != DELTA_OK )
+        {
+            LOGE(LOG_MOD_OTA, "Delta error %d at %u bytes written", iResult, (unsigned)s_decoder.GetWritten());
+            Fail("bad delta");
+            return false;
+        }
+        return true;
+    }
+
+    if( !WriteTarget(data, length) )
+    {
+        Fail("writing the partition failed");
+        return false;
+    }
+    if( s_stats.uTargetSize && s_stats.uWritten >= s_stats.uTargetSize )
+    {
+        EndDownload();
+        return false;
+    }
+    return true;
+}
+
+static void Download()
+{
+    TRACE_SCOPE("ota download");
+
+    unsigned long ulStart = millis();
+    while( millis() - ulStart < OTA_SLICE )
+    {
+        int iAvailable = s_pStream->available();
+        if( iAvailable <= 0 )
+        {
+            // A full image without a length ends when the server closes, a delta knows its own end
+            if( !s_pStream->connected() )
+            {
+                if( s_stats.bDelta )
+                    Fail("download cut short");
+                else
+                    EndDownload();
+            }
+            else if( millis() - s_ulLastByte > OTA_READ_TIMEOUT )
+                Fail("download stalled");
+            return;
+        }
+
+        int iRead = s_pStream->read(s_buffer, min((size_t)iAvailable, sizeof(s_buffer)));
+        if( iRead <= 0 )
+            return;
+        s_ulLastByte = millis();
+        s_stats.uDownloaded += iRead;
+        if( !Consume(s_buffer, iRead) )
+            return;
+    }
+}
+
+bool updateOta(bool bStationIdle)
+{
+    switch( s_stats.iState )
+    {
+        case OTA_DOWNLOADING:
+            if( !s_bDownloaded )
+            {
+                if( !s_pStream && !Start() )
+                    return false;
+                Download();
+            }
+            if( s_stats.iState == OTA_DOWNLOADING )
+                HashBase();
+            // A delta only once the base it copied from checked out
+            if( s_stats.iState == OTA_DOWNLOADING && s_bDownloaded && (!s_stats.bDelta || s_bBaseChecked) )
+                Complete();
+            return s_stats.iState == OTA_DOWNLOADING;
+
+        case OTA_READY:
+            if( !bStationIdle )
+                return false;
+            if( esp_ota_set_boot_partition(s_pTarget) != ESP_OK )
+            {
+                Fail("couldn't switch the boot partition");
+                return false;
+            }
+            LOGI(LOG_MOD_OTA, "Restarting into %s", s_pTarget->label);
+            logFlush();
+            ESP.restart();
+            return false;
+    }
+
+    return false;
+}
+
+otaStats &getOtaStats()
+{
+    return s_stats;
+}
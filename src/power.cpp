@@ -0,0 +1,189 @@
+#include <Arduino.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <sys/time.h>
+
+#include "power.h"
+#include "config.h"
+#include "gateway.h"
+#include "iothub.h"
+#include "log.h"
+
+extern CIoTHub g_IoTHub;
+
+RTC_DATA_ATTR powerStats g_PowerStats;
+
+// Wall clock at which we went into deep sleep, the RTC keeps counting through it
+RTC_DATA_ATTR static int64_t s_llDeepSleepStartMs = 0;
+
+static int s_iNfcIrqPin = -1;
+static int s_iNfcVenPin = -1;
+static int s_iButtonPin = -1;
+
+static unsigned long s_ulLastUpdate = 0;
+static unsigned long s_ulIdleSince = 0;
+
+// Set on a deep sleep wake up until setup() is done, and until the hub is back after any wake up
+static bool s_bWaking = false;
+static bool s_bWaitingForHub = false;
+static unsigned long s_ulWokeAt = 0;
+
+static int64_t WallClockMs()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void OnWake(esp_sleep_wakeup_cause_t cause, unsigned long ulWokeAt)
+{
+    g_PowerStats.iLastWakeCause = cause;
+    s_ulWokeAt = ulWokeAt;
+    s_bWaitingForHub = true;
+}
+
+void setupPower(int iNfcIrqPin, int iNfcVenPin, int iButtonPin)
+{
+    s_iNfcIrqPin = iNfcIrqPin;
+    s_iNfcVenPin = iNfcVenPin;
+    s_iButtonPin = iButtonPin;
+
+    // Still held from the deep sleep, the NFC driver can't toggle it otherwise
+    gpio_hold_dis((gpio_num_t)s_iNfcVenPin);
+    gpio_deep_sleep_hold_dis();
+
+    esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+    if( cause == ESP_SLEEP_WAKEUP_UNDEFINED || s_llDeepSleepStartMs == 0 )
+    {
+        // Power on or reset, not a wake up
+        s_llDeepSleepStartMs = 0;
+        return;
+    }
+
+    int64_t llSlept = WallClockMs() - s_llDeepSleepStartMs;
+    if( llSlept > 0 )
+        g_PowerStats.ullDeepSleepMs += llSlept;
+    s_llDeepSleepStartMs = 0;
+
+    // millis() restarted at boot, so that's when we woke up. We're ready once setup() is through
+    OnWake(cause, 0);
+    s_bWaking = true;
+}
+
+bool updatePower(bool bIdle)
+{
+    unsigned long ulNow = millis();
+    g_PowerStats.ullActiveMs += ulNow - s_ulLastUpdate;
+    s_ulLastUpdate = ulNow;
+
+    if( s_bWaking )
+    {
+        s_bWaking = false;
+        g_PowerStats.ulLastWakeToReadyMs = ulNow - s_ulWokeAt;
+    }
+
+    if( s_bWaitingForHub && g_IoTHub.IsConnected() )
+    {
+        s_bWaitingForHub = false;
+        g_PowerStats.ulLastWakeToHubMs = ulNow - s_ulWokeAt;
+        g_PowerStats.Print();
+    }
+
+    if( !bIdle || g_Config.iSleepDelay == 0 )
+    {
+        s_ulIdleSince = ulNow;
+        return false;
+    }
+
+    return ulNow - s_ulIdleSince >= (unsigned long)g_Config.iSleepDelay * 1000;
+}
+
+static void EnterDeepSleep()
+{
+    LOGI(LOG_MOD_POWER, "Going to deep sleep");
+
+    g_IoTHub.disconnect();
+
+    // Pins float once the chip is off. With VEN low the PN7150 powers down and no card would ever wake us
+    gpio_hold_en((gpio_num_t)s_iNfcVenPin);
+    gpio_deep_sleep_hold_en();
+
+    // Only RTC GPIOs can wake the chip from deep sleep, the scan button on GPIO21 isn't one
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+    esp_sleep_enable_ext0_wakeup((gpio_num_t)s_iNfcIrqPin, HIGH);
+    esp_sleep_enable_timer_wakeup((uint64_t)DEEP_SLEEP_TIMER_WAKE * 1000000);
+
+    s_llDeepSleepStartMs = WallClockMs();
+    g_PowerStats.iDeepSleeps++;
+    g_PowerStats.ullActiveMs += millis() - s_ulLastUpdate;
+
+    // Whatever is still in the log ring is lost once the chip is off
+    logFlush();
+    esp_deep_sleep_start();
+}
+
+void enterSleep()
+{
+    if( g_Config.iSleepMode == SLEEP_MODE_DEEP )
+    {
+        EnterDeepSleep();
+        return;
+    }
+
+    LOGI(LOG_MOD_POWER, "Going to light sleep");
+
+    // Wi-Fi isn't kept up in light sleep, the AP and the hub would drop us sooner or later anyway.
+    // So like deep sleep, close everything cleanly now and connect again once a customer wakes us
+    g_IoTHub.disconnect();
+    suspendGateway();
+    suspendWiFi();
+    logFlush();
+
+    // Card in front of the reader raises the PN7150's IRQ, the button pulls its pin low
+    esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+    gpio_wakeup_enable((gpio_num_t)s_iNfcIrqPin, GPIO_INTR_HIGH_LEVEL);
+    gpio_wakeup_enable((gpio_num_t)s_iButtonPin, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+
+    unsigned long ulStart = millis();
+    g_PowerStats.ullActiveMs += ulStart - s_ulLastUpdate;
+    esp_light_sleep_start();
+
+    // millis() keeps counting through light sleep
+    unsigned long ulNow = millis();
+    g_PowerStats.ullLightSleepMs += ulNow - ulStart;
+    g_PowerStats.iLightSleeps++;
+    s_ulLastUpdate = ulNow;
+
+    gpio_wakeup_disable((gpio_num_t)s_iNfcIrqPin);
+    gpio_wakeup_disable((gpio_num_t)s_iButtonPin);
+
+    // The customer is served offline meanwhile, the rating waits in the queue for the hub
+    resumeWiFi();
+    resumeGateway();
+
+    // Everything else is still where we left it, we're ready as soon as we're back here
+    OnWake(esp_sleep_get_wakeup_cause(), ulNow);
+    g_PowerStats.ulLastWakeToReadyMs = millis() - ulNow;
+    s_ulIdleSince = ulNow;
+}
+
+float powerStats::GetAverageCurrent()
+{
+    uint64_t ullTotal = ullActiveMs + ullLightSleepMs + ullDeepSleepMs;
+    if( ullTotal == 0 )
+        return 0;
+
+    double flCharge = ullActiveMs * (double)CURRENT_ACTIVE_MA
+        + ullLightSleepMs * (double)CURRENT_LIGHT_SLEEP_MA
+        + ullDeepSleepMs * (double)CURRENT_DEEP_SLEEP_MA;
+    return (float)(flCharge / ullTotal);
+}
+
+void powerStats::Print()
+{
+    LOGI(LOG_MOD_POWER, "Power: active %llu s, light sleep %llu s (%d), deep sleep %llu s (%d), avg %.1f mA",
+        (unsigned long long)(ullActiveMs / 1000), (unsigned long long)(ullLightSleepMs / 1000), iLightSleeps,
+        (unsigned long long)(ullDeepSleepMs / 1000), iDeepSleeps, GetAverageCurrent());
+    LOGI(LOG_MOD_POWER, "Last wake (cause %d): ready in %lu ms, hub in %lu ms", iLastWakeCause, ulLastWakeToReadyMs, ulLastWakeToHubMs);
+}
@@ -0,0 +1,157 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <time.h>
+
+#include "ratings.h"
+#include "config.h"
+#include "iothub.h"
+#include "log.h"
+
+extern CIoTHub g_IoTHub;
+
+// Open addressing with linear probing. Nothing is ever removed on its own, the whole table is
+// cleared once a summary is out, so an empty slot always ends a probe
+static ratingStats s_table[RATING_TABLE_SIZE];
+static int s_iItems = 0;
+static uint32_t s_uRatings = 0;
+static uint32_t s_uDropped = 0; // Item ratings that didn't fit in the table
+
+static time_t s_tWindowStart = 0;
+static unsigned long s_ulWindowStart = 0;
+static unsigned long s_ulNextAttempt = 0;
+
+#define RATING_RETRY_DELAY 60000 // ms
+
+static ratingStats *FindItem(int iItem)
+{
+    // Fibonacci hashing, consecutive IDs land far apart
+    uint32_t uSlot = ((uint32_t)iItem * 2654435761u) >> (32 - RATING_TABLE_BITS);
+    for( int i = 0; i < RATING_TABLE_SIZE; i++ )
+    {
+        ratingStats &stats = s_table[(uSlot + i) & (RATING_TABLE_SIZE - 1)];
+        if( stats.uCount == 0 )
+        {
+            stats.iItem = iItem;
+            s_iItems++;
+            return &stats;
+        }
+        if( stats.iItem == iItem )
+            return &stats;
+    }
+
+    return nullptr;
+}
+
+void recordRating(const menu &menu, float flPercentage)
+{
+    if( s_uRatings == 0 )
+    {
+        s_ulWindowStart = millis();
+        s_tWindowStart = isTimeValid() ? time(nullptr) : 0;
+    }
+    s_uRatings++;
+
+    float flValue = constrain(flPercentage, 0.0f, 1.0f);
+    int iBucket = min((int)(flValue * RATING_BUCKETS), RATING_BUCKETS - 1);
+
+    for( int i = 0; i < menu.iMenuLen && i < MENU_MAX_ITEMS; i++ )
+    {
+        ratingStats *stats = FindItem(menu.iaMenu[i]);
+        if( !stats )
+        {
+            s_uDropped++;
+            continue;
+        }
+
+        // Welford's, doesn't lose precision the way a sum of squares does in a float
+        stats->uCount++;
+        float flDelta = flValue - stats->flMean;
+        stats->flMean += flDelta / stats->uCount;
+        stats->flM2 += flDelta * (flValue - stats->flMean);
+
+        if( stats->uaHistogram[iBucket] < 0xFFFF )
+            stats->uaHistogram[iBucket]++;
+    }
+}
+
+uint32_t getRatingCount()
+{
+    return s_uRatings;
+}
+
+// One message with up to RATING_ITEMS_PER_MESSAGE items, starting at table slot *piSlot
+static bool PublishPart(int *piSlot, int iPart, int iParts, time_t tNow)
+{
+    StaticJsonDocument<JSON_OBJECT_SIZE(8) + JSON_ARRAY_SIZE(RATING_ITEMS_PER_MESSAGE)
+        + RATING_ITEMS_PER_MESSAGE * (JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(RATING_BUCKETS))> doc;
+
+    doc["DeviceID"] = (const char *)g_IoTHub.GetDeviceID();
+    doc["from"] = (long long)s_tWindowStart;
+    doc["to"] = (long long)tNow;
+    doc["ratings"] = s_uRatings;
+    doc["dropped"] = s_uDropped;
+    doc["part"] = iPart;
+    doc["parts"] = iParts;
+
+    JsonArray items = doc.createNestedArray("items");
+    int iAdded = 0;
+    for( ; *piSlot < RATING_TABLE_SIZE && iAdded < RATING_ITEMS_PER_MESSAGE; (*piSlot)++ )
+    {
+        ratingStats &stats = s_table[*piSlot];
+        if( stats.uCount == 0 )
+            continue;
+
+        JsonObject item = items.createNestedObject();
+        item["id"] = stats.iItem;
+        item["n"] = stats.uCount;
+        item["mean"] = stats.flMean;
+        item["var"] = stats.GetVariance();
+        JsonArray histogram = item.createNestedArray("hist");
+        for( int i = 0; i < RATING_BUCKETS; i++ )
+            histogram.add(stats.uaHistogram[i]);
+        iAdded++;
+    }
+
+    static char szData[768];
+    if( doc.overflowed() || measureJson(doc) >= sizeof(szData) )
+    {
+        LOGE(LOG_MOD_MAIN, "Rating summary part %d didn't fit", iPart);
+        return false;
+    }
+
+    size_t len = serializeJson(doc, szData, sizeof(szData));
+    return g_IoTHub.publishSummary(szData, len);
+}
+
+void updateRatings()
+{
+    if( g_Config.iSummaryInterval == 0 || s_uRatings == 0 )
+        return;
+
+    unsigned long ulNow = millis();
+    if( ulNow - s_ulWindowStart < (unsigned long)g_Config.iSummaryInterval * 60000 || (long)(ulNow - s_ulNextAttempt) < 0
+        || !g_IoTHub.IsConnected() )
+        return;
+
+    // A window that didn't make it out keeps going and goes out whole next time.
+    // Parts that did go out are sent again then with the same "from", the one with the latest "to" wins
+    time_t tNow = isTimeValid() ? time(nullptr) : 0;
+    int iParts = (s_iItems + RATING_ITEMS_PER_MESSAGE - 1) / RATING_ITEMS_PER_MESSAGE;
+    int iSlot = 0;
+    for( int iPart = 1; iPart <= iParts; iPart++ )
+    {
+        if( !PublishPart(&iSlot, iPart, iParts, tNow) )
+        {
+            LOGW(LOG_MOD_MAIN, "Rating summary not sent, retrying later");
+            s_ulNextAttempt = ulNow + RATING_RETRY_DELAY;
+            return;
+        }
+    }
+
+    LOGI(LOG_MOD_MAIN, "Rating summary sent, %u ratings of %d items", (unsigned)s_uRatings, s_iItems);
+
+    memset(s_table, 0, sizeof(s_table));
+    s_iItems = 0;
+    s_uRatings = 0;
+    s_uDropped = 0;
+}
@@ -0,0 +1,54 @@
+#include <Arduino.h>
+#include <Wire.h>
+
+#include "slave.h"
+#include "config.h"
+#include "i2cbus.h"
+#include "trace.h"
+
+int g_iRequestCount = 0;
+
+void informSlave(int requestNumber, byte cmd)
+{
+  I2cTransmit(requestNumber, cmd); //send register command
+  delay(g_Config.iRequestDelay);
+  TRACE_SCOPE("i2c dummy read");
+  uint8_t dummy;
+  int iResult = g_CamBus.read(I2C_DEV_ADDR, &dummy, 1); //read old dummy
+  CAPTURE(CAPTURE_I2C_READ, iResult, &dummy, 1);
+}
+
+void requestString(int requestNumber, byte cmd, char *response, int length)
+{
+  informSlave(requestNumber, cmd);
+  //again - after ESP32 buffer prefill
+  delay(g_Config.iRequestDelay);
+  I2cRead<char>(response, length); //read register
+}
+
+void I2cTransmit(int requestNumber, byte cmd)
+{
+  TRACE_SCOPE("i2c write");
+  request command;
+  command.command = cmd;
+  command.requestCount = requestNumber;
+  int iResult = g_CamBus.write(I2C_DEV_ADDR, (uint8_t*)&command, sizeof(request)); //write to slave register, errors are counted and handled by the bus
+  CAPTURE(CAPTURE_I2C_WRITE, iResult, &command, sizeof(request));
+}
+
+int I2cTransmitData(int requestNumber, byte cmd, const void *data, size_t length)
+{
+  TRACE_SCOPE("i2c write");
+  uint8_t buffer[I2C_BUFFER_LENGTH];
+  if( sizeof(request) + length > sizeof(buffer) )
+    return I2C_ERR_TOO_LONG;
+
+  request command;
+  command.command = cmd;
+  command.requestCount = requestNumber;
+  memcpy(buffer, &command, sizeof(command));
+  memcpy(buffer + sizeof(command), data, length);
+  int iResult = g_CamBus.write(I2C_DEV_ADDR, buffer, sizeof(command) + length);
+  CAPTURE(CAPTURE_I2C_WRITE, iResult, buffer, sizeof(command) + length);
+  return iResult;
+}
@@ -0,0 +1,455 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <esp_partition.h>
+#include <rom/crc.h>
+
+#include "slavefw.h"
+#include "slave.h"
+#include "log.h"
+#include "trace.h"
+
+#define SLAVEFW_REBOOT_POLL 100 // ms between version reads while the slave boots the new image
+#define SLAVEFW_MAX_STALLS 20   // Windows in a row the slave took nothing from before giving up for now
+
+static const esp_partition_t *s_pPartition = nullptr;
+static slaveFwHeader s_header = {};
+static slaveFwStats s_stats = {};
+static bool s_bInBootloader = false; // The slave took CMD_FW_BEGIN and won't scan until it has a good image
+static unsigned long s_ulTransferStart = 0;
+static unsigned long s_ulRetryAt = 0;
+static int s_iStalls = 0;
+static uint32_t s_uSlaveVersion = 0; // What it ran before the update
+
+// What updateSlaveFw() waits on the slave for, asked again on every call instead of blocking loop()
+enum {
+    WAIT_NONE = 0,
+    WAIT_BEGIN,  // Status after CMD_FW_BEGIN, erasing its update area takes the slave the longest
+    WAIT_WINDOW, // Status after a window of chunks
+    WAIT_FINISH, // Status after CMD_FW_FINISH, the slave checks the whole image
+    WAIT_REBOOT  // Version, once the slave boots the new image
+};
+
+#define STATUS_WAITING 0
+#define STATUS_ANSWERED 1
+#define STATUS_NO_ANSWER 2
+
+static int s_iWait = WAIT_NONE;
+static unsigned long s_ulWaitStart = 0;
+static unsigned long s_ulLastPoll = 0;
+static uint32_t s_uWindowEnd = 0; // Where the last window stopped sending
+static bool s_bRetrySeen = false;
+static int s_iRetry = 0;
+
+// C2D side, the image coming in
+static slaveFwHeader s_incoming = {};
+static bool s_bReceiving = false;
+static uint32_t s_uReceived = 0;
+static uint32_t s_uReceivedCrc = 0;
+static uint32_t s_uErasedTo = 0; // Image offset, everything below is erased
+
+static int NextRequest()
+{
+    return g_iRequestCount++;
+}
+
+// Reads the image back from flash rather than trusting what was written
+static bool IsImageIntact(uint32_t uSize, uint32_t uExpectedCrc)
+{
+    uint8_t buffer[256];
+    uint32_t uCrc = 0;
+    for( uint32_t uOffset = 0; uOffset < uSize; uOffset += sizeof(buffer) )
+    {
+        uint32_t uLength = min((uint32_t)sizeof(buffer), uSize - uOffset);
+        if( esp_partition_read(s_pPartition, SLAVEFW_DATA_OFFSET + uOffset, buffer, uLength) != ESP_OK )
+            return false;
+        uCrc = crc32_le(uCrc, buffer, uLength);
+    }
+    return uCrc == uExpectedCrc;
+}
+
+void setupSlaveFw()
+{
+    s_pPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)SLAVEFW_SUBTYPE, SLAVEFW_PARTITION);
+    if( !s_pPartition )
+    {
+        LOGW(LOG_MOD_I2C, "No %s partition, camera slave updates are off", SLAVEFW_PARTITION);
+        return;
+    }
+
+    if( esp_partition_read(s_pPartition, 0, &s_header, sizeof(s_header)) != ESP_OK || s_header.uMagic != SLAVEFW_MAGIC )
+        return;
+
+    if( s_header.uSize == 0 || SLAVEFW_DATA_OFFSET + s_header.uSize > s_pPartition->size || !IsImageIntact(s_header.uSize, s_header.uCrc) )
+    {
+        LOGE(LOG_MOD_I2C, "Camera slave image in flash is broken, ignoring it");
+        return;
+    }
+
+    // Whether the slave already runs it is only known once we ask, which waits for the station to be idle
+    s_stats.iState = SLAVEFW_PENDING;
+    s_stats.uVersion = s_header.uVersion;
+    s_stats.uSize = s_header.uSize;
+    LOGI(LOG_MOD_I2C, "Camera slave image v%u in flash, %u bytes", (unsigned)s_header.uVersion, (unsigned)s_header.uSize);
+}
+
+// One status read per call, the slave answers busy while it writes to its flash. It gets until
+// SLAVEFW_STATUS_WAIT after what we asked, loop() keeps going in the meantime
+static int ReadStatus(slaveFwStatus &status)
+{
+    // A read that fails leaves this as it was
+    status.uStatus = 0xFF;
+    requestNum<slaveFwStatus>(NextRequest(), CMD_FW_STATUS, &status);
+    if( status.uStatus != FW_STATUS_BUSY && status.uStatus != 0xFF )
+        return STATUS_ANSWERED;
+    return millis() - s_ulWaitStart < SLAVEFW_STATUS_WAIT ? STATUS_WAITING : STATUS_NO_ANSWER;
+}
+
+static void WaitFor(int iWait)
+{
+    s_iWait = iWait;
+    s_ulWaitStart = millis();
+}
+
+static void Fail(const char *reason)
+{
+    LOGW(LOG_MOD_I2C, "Camera slave update stopped at %u/%u bytes: %s", (unsigned)s_stats.uNextOffset, (unsigned)s_stats.uSize, reason);
+    s_iWait = WAIT_NONE;
+    s_stats.iAttempts++;
+    if( s_stats.iAttempts >= SLAVEFW_MAX_ATTEMPTS )
+    {
+        // Something a retry won't fix, a new image or slaveFwRetry in the twin starts over
+        LOGE(LOG_MOD_I2C, "Camera slave update failed %d times, giving up", s_stats.iAttempts);
+        s_stats.iState = SLAVEFW_STOPPED;
+        return;
+    }
+
+    // Twice as long after every failure in a row
+    unsigned long ulDelay = s_bInBootloader ? SLAVEFW_RESUME_DELAY : SLAVEFW_RETRY_DELAY;
+    ulDelay = min(ulDelay << (s_stats.iAttempts - 1), (unsigned long)SLAVEFW_RETRY_MAX_DELAY);
+    s_stats.iState = SLAVEFW_FAILED;
+    s_ulRetryAt = millis() + ulDelay;
+}
+
+static void Start()
+{
+    // Nothing to do if it already runs this one, also how a finish whose answer got lost ends up
+    s_uSlaveVersion = 0;
+    requestNum<uint32_t>(NextRequest(), CMD_GET_VERSION, &s_uSlaveVersion);
+    if( s_uSlaveVersion == s_header.uVersion )
+    {
+        s_bInBootloader = false;
+        LOGI(LOG_MOD_I2C, "Camera slave already runs v%u", (unsigned)s_uSlaveVersion);
+        s_stats.iState = SLAVEFW_DONE;
+        return;
+    }
+
+    slaveFwBegin begin = { s_header.uSize, s_header.uCrc, s_header.uVersion };
+    if( I2cTransmitData(NextRequest(), CMD_FW_BEGIN, &begin, sizeof(begin)) != I2C_OK )
+    {
+        Fail("slave didn't take the begin");
+        return;
+    }
+    WaitFor(WAIT_BEGIN);
+}
+
+static void Begun(const slaveFwStatus &status)
+{
+    s_iWait = WAIT_NONE;
+    if( status.uStatus != FW_STATUS_OK )
+    {
+        Fail("slave didn't take the begin");
+        return;
+    }
+
+    // The slave keeps what it got of the same image (same CRC) across interruptions, ours or its own
+    s_bInBootloader = true;
+    s_stats.iState = SLAVEFW_TRANSFER;
+    s_stats.uNextOffset = min(status.uNextOffset, s_header.uSize);
+    s_stats.uResumedAt = s_stats.uNextOffset;
+    s_stats.uBytesSent = 0;
+    s_stats.uChunksResent = 0;
+    s_iStalls = 0;
+    s_ulTransferStart = millis();
+    LOGI(LOG_MOD_I2C, "Camera slave update from v%u to v%u, starting at %u/%u bytes",
+        (unsigned)s_uSlaveVersion, (unsigned)s_header.uVersion, (unsigned)s_stats.uNextOffset, (unsigned)s_header.uSize);
+}
+
+// Go-back-N, the chunks go out back to back and one status read says how far the slave got.
+// A chunk that failed its CRC and everything after it is sent again from there
+static bool SendWindow()
+{
+    TRACE_SCOPE("slave fw window");
+
+    uint8_t buffer[sizeof(slaveFwChunk) + SLAVEFW_CHUNK];
+    uint32_t uOffset = s_stats.uNextOffset;
+    for( int i = 0; i < SLAVEFW_WINDOW && uOffset < s_header.uSize; i++ )
+    {
+        slaveFwChunk chunk;
+        chunk.uOffset = uOffset;
+        chunk.uLength = (uint16_t)min((uint32_t)SLAVEFW_CHUNK, s_header.uSize - uOffset);
+
+        uint8_t *data = buffer + sizeof(chunk);
+        if( esp_partition_read(s_pPartition, SLAVEFW_DATA_OFFSET + uOffset, data, chunk.uLength) != ESP_OK )
+            return false;
+        chunk.uCrc = crc32_le(0, data, chunk.uLength);
+        memcpy(buffer, &chunk, sizeof(chunk));
+
+        s_stats.uBytesSent += chunk.uLength;
+        if( I2cTransmitData(NextRequest(), CMD_FW_CHUNK, buffer, sizeof(chunk) + chunk.uLength) != I2C_OK )
+            break; // The slave says where to go from
+        uOffset += chunk.uLength;
+    }
+
+    s_uWindowEnd = uOffset;
+    WaitFor(WAIT_WINDOW);
+    return true;
+}
+
+static bool WindowDone(const slaveFwStatus &status)
+{
+    s_iWait = WAIT_NONE;
+    if( status.uStatus == FW_STATUS_NOT_READY )
+        return false; // Reset or lost track, begin again and it resumes
+
+    uint32_t uNext = min(status.uNextOffset, s_header.uSize);
+    if( uNext < s_uWindowEnd )
+        s_stats.uChunksResent += (s_uWindowEnd - uNext + SLAVEFW_CHUNK - 1) / SLAVEFW_CHUNK;
+
+    s_iStalls = uNext > s_stats.uNextOffset ? 0 : s_iStalls + 1;
+    s_stats.uNextOffset = uNext;
+    return s_iStalls < SLAVEFW_MAX_STALLS;
+}
+
+static void Finished(const slaveFwStatus &status)
+{
+    if( status.uStatus != FW_STATUS_OK )
+    {
+        // The slave starts over with this image next time
+        Fail(status.uStatus == FW_STATUS_BAD_IMAGE ? "image CRC didn't match on the slave" : "no answer to finish");
+        return;
+    }
+
+    // It boots the new image, then it has to say it runs it
+    WaitFor(WAIT_REBOOT);
+    s_ulLastPoll = millis();
+}
+
+static void Rebooting()
+{
+    if( millis() - s_ulLastPoll < SLAVEFW_REBOOT_POLL )
+        return;
+    s_ulLastPoll = millis();
+
+    uint32_t uVersion = 0;
+    requestNum<uint32_t>(NextRequest(), CMD_GET_VERSION, &uVersion);
+    if( uVersion != s_header.uVersion )
+    {
+        if( millis() - s_ulWaitStart >= SLAVEFW_REBOOT_WAIT )
+            Fail("slave didn't come back on the new image");
+        return;
+    }
+
+    s_iWait = WAIT_NONE;
+    s_bInBootloader = false;
+    s_stats.iState = SLAVEFW_DONE;
+    s_stats.iAttempts = 0;
+    s_stats.ulTransferMs = millis() - s_ulTransferStart;
+    s_stats.flBytesPerSec = s_stats.ulTransferMs ? (s_header.uSize - s_stats.uResumedAt) * 1000.0f / s_stats.ulTransferMs : 0;
+    LOGI(LOG_MOD_I2C, "Camera slave runs v%u, %u bytes in %lu ms (%.0f B/s), %u chunks sent again",
+        (unsigned)uVersion, (unsigned)(s_header.uSize - s_stats.uResumedAt), s_stats.ulTransferMs, s_stats.flBytesPerSec, (unsigned)s_stats.uChunksResent);
+}
+
+// The answer to whatever went to the slave last, false while it's not there yet
+static bool Answered()
+{
+    if( s_iWait == WAIT_REBOOT )
+    {
+        Rebooting();
+        return false;
+    }
+
+    slaveFwStatus status;
+    int iStatus = ReadStatus(status);
+    if( iStatus == STATUS_WAITING )
+        return false;
+
+    int iWait = s_iWait;
+    if( iStatus == STATUS_NO_ANSWER )
+    {
+        Fail(iWait == WAIT_BEGIN ? "slave didn't take the begin" : iWait == WAIT_FINISH ? "no answer to finish" : "slave stopped taking chunks");
+        return false;
+    }
+
+    if( iWait == WAIT_BEGIN )
+        Begun(status);
+    else if( iWait == WAIT_FINISH )
+        Finished(status);
+    else if( !WindowDone(status) )
+    {
+        Fail("slave stopped taking chunks");
+        return false;
+    }
+    return true;
+}
+
+bool updateSlaveFw(bool bStationIdle)
+{
+    // The slave's busy with what we asked, it can't scan meanwhile either
+    if( s_iWait != WAIT_NONE && !Answered() )
+        return s_bInBootloader || s_iWait != WAIT_NONE;
+
+    switch( s_stats.iState )
+    {
+        case SLAVEFW_FAILED:
+            if( (long)(millis() - s_ulRetryAt) < 0 )
+                return s_bInBootloader;
+            s_stats.iState = SLAVEFW_PENDING;
+            // fall through
+        case SLAVEFW_PENDING:
+            // Once the slave is in its bootloader there's no customer to wait for
+            if( !bStationIdle && !s_bInBootloader )
+                return false;
+            Start();
+            return s_bInBootloader || s_iWait != WAIT_NONE;
+        case SLAVEFW_TRANSFER:
+        {
+            // A window at a time, as long as the slave answers right away
+            unsigned long ulStart = millis();
+            while( s_iWait == WAIT_NONE && s_stats.iState == SLAVEFW_TRANSFER && s_stats.uNextOffset < s_header.uSize && millis() - ulStart < SLAVEFW_SLICE )
+            {
+                if( !SendWindow() )
+                {
+                    Fail("slave stopped taking chunks");
+                    return s_bInBootloader;
+                }
+                Answered();
+            }
+
+            if( s_iWait == WAIT_NONE && s_stats.iState == SLAVEFW_TRANSFER && s_stats.uNextOffset == s_header.uSize )
+            {
+                // Asked right away, the slave reboots soon after it answers
+                I2cTransmit(NextRequest(), CMD_FW_FINISH);
+                WaitFor(WAIT_FINISH);
+                Answered();
+            }
+            return s_bInBootloader;
+        }
+        case SLAVEFW_NONE:
+            // A new image coming in after one that gave up, the slave can still be sitting in its bootloader
+        case SLAVEFW_STOPPED:
+            return s_bInBootloader;
+    }
+
+    return false;
+}
+
+void slaveFwApplyDesired(JsonObjectConst desired)
+{
+    // A new value of slaveFwRetry has a station that gave up try again, the first one seen is just remembered
+    JsonVariantConst retry = desired["slaveFwRetry"];
+    if( retry.isNull() )
+        return;
+
+    int iRetry = retry.as<int>();
+    bool bChanged = s_bRetrySeen && iRetry != s_iRetry;
+    s_bRetrySeen = true;
+    s_iRetry = iRetry;
+    if( !bChanged || s_stats.iState != SLAVEFW_STOPPED )
+        return;
+
+    LOGI(LOG_MOD_I2C, "Camera slave update tried again, as the twin asks");
+    s_stats.iAttempts = 0;
+    s_stats.iState = SLAVEFW_PENDING;
+}
+
+void slaveFwReceiveBegin(const char *json, size_t length)
+{
+    StaticJsonDocument<JSON_OBJECT_SIZE(3)> doc;
+    if( deserializeJson(doc, json, length) )
+    {
+        LOGE(LOG_MOD_I2C, "Bad camera slave image header");
+        return;
+    }
+
+    s_incoming.uMagic = SLAVEFW_MAGIC;
+    s_incoming.uSize = doc["size"] | 0u;
+    s_incoming.uCrc = doc["crc"] | 0u;
+    s_incoming.uVersion = doc["version"] | 0u;
+
+    if( !s_pPartition || s_incoming.uSize == 0 || SLAVEFW_DATA_OFFSET + s_incoming.uSize > s_pPartition->size )
+    {
+        LOGE(LOG_MOD_I2C, "Camera slave image of %u bytes doesn't fit", (unsigned)s_incoming.uSize);
+        return;
+    }
+    // One that gave up takes a new image, even with the slave left in its bootloader
+    if( (s_stats.iState == SLAVEFW_TRANSFER || s_bInBootloader) && s_stats.iState != SLAVEFW_STOPPED )
+    {
+        LOGW(LOG_MOD_I2C, "Camera slave update running, new image refused");
+        return;
+    }
+
+    // The old image is gone from here on
+    esp_partition_erase_range(s_pPartition, 0, SLAVEFW_DATA_OFFSET);
+    s_stats.iState = SLAVEFW_NONE;
+    s_bReceiving = true;
+    s_uReceived = 0;
+    s_uReceivedCrc = 0;
+    s_uErasedTo = 0;
+    LOGI(LOG_MOD_I2C, "Receiving camera slave image v%u, %u bytes", (unsigned)s_incoming.uVersion, (unsigned)s_incoming.uSize);
+}
+
+void slaveFwReceiveChunk(uint32_t uOffset, const uint8_t *data, size_t length)
+{
+    if( !s_bReceiving )
+        return;
+
+    // C2D keeps the order, a gap means one got lost and the whole image has to be sent again
+    if( uOffset != s_uReceived || length > s_incoming.uSize - s_uReceived )
+    {
+        LOGE(LOG_MOD_I2C, "Camera slave image chunk at %u, expected %u", (unsigned)uOffset, (unsigned)s_uReceived);
+        s_bReceiving = false;
+        return;
+    }
+
+    // Erased a sector at a time as the image gets there, one big erase would block MQTT for seconds
+    while( s_uErasedTo < uOffset + length )
+    {
+        esp_partition_erase_range(s_pPartition, SLAVEFW_DATA_OFFSET + s_uErasedTo, SPI_FLASH_SEC_SIZE);
+        s_uErasedTo += SPI_FLASH_SEC_SIZE;
+    }
+
+    esp_partition_write(s_pPartition, SLAVEFW_DATA_OFFSET + uOffset, data, length);
+    s_uReceivedCrc = crc32_le(s_uReceivedCrc, data, length);
+    s_uReceived += length;
+}
+
+void slaveFwReceiveEnd()
+{
+    if( !s_bReceiving )
+        return;
+    s_bReceiving = false;
+
+    if( s_uReceived != s_incoming.uSize || s_uReceivedCrc != s_incoming.uCrc || !IsImageIntact(s_incoming.uSize, s_incoming.uCrc) )
+    {
+        LOGE(LOG_MOD_I2C, "Camera slave image incomplete or corrupt, %u/%u bytes", (unsigned)s_uReceived, (unsigned)s_incoming.uSize);
+        return;
+    }
+
+    // Flash only clears bits, so the header goes in with the magic still erased and the magic after it
+    slaveFwHeader header = s_incoming;
+    header.uMagic = 0xFFFFFFFF;
+    esp_partition_write(s_pPartition, 0, &header, sizeof(header));
+    esp_partition_write(s_pPartition, 0, &s_incoming.uMagic, sizeof(s_incoming.uMagic));
+
+    s_header = s_incoming;
+    s_stats = {};
+    s_stats.iState = SLAVEFW_PENDING;
+    s_stats.uVersion = s_header.uVersion;
+    s_stats.uSize = s_header.uSize;
+    LOGI(LOG_MOD_I2C, "Camera slave image v%u stored, goes out when the station is idle", (unsigned)s_header.uVersion);
+}
+
+slaveFwStats &getSlaveFwStats()
+{
+    return s_stats;
+}
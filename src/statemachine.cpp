@@ -0,0 +1,54 @@
+#include <Arduino.h>
+
+#include "statemachine.h"
+
+void CStateMachine::Start(int iState, unsigned long ulNow)
+{
+    m_iState = iState;
+    m_ulEntered = ulNow;
+    if( m_actions[iState].onEnter )
+        m_actions[iState].onEnter(STATE_NONE);
+}
+
+bool CStateMachine::Dispatch(int iTrigger, unsigned long ulNow)
+{
+    if( m_iState == STATE_NONE || iTrigger <= TRIGGER_NONE || iTrigger >= TRIGGER_COUNT )
+        return false;
+
+    int iFrom = m_iState;
+    int iTo = g_stateTable[iFrom][iTrigger];
+    if( iTo == STATE_NONE )
+        return false;
+
+    if( m_actions[iFrom].onExit )
+        m_actions[iFrom].onExit(iTo);
+
+    // The new state is in place before its entry action runs, so anything that looks while it blocks sees it
+    m_iState = iTo;
+    m_ulEntered = ulNow;
+    m_uTransitions++;
+
+    if( m_onTransition )
+        m_onTransition(iFrom, iTo, iTrigger);
+    if( m_actions[iTo].onEnter )
+        m_actions[iTo].onEnter(iFrom);
+    return true;
+}
+
+bool CStateMachine::Step(unsigned long ulNow)
+{
+    if( m_iState == STATE_NONE )
+        return false;
+
+    const stateActions &actions = m_actions[m_iState];
+    int iTrigger = actions.onUpdate ? actions.onUpdate() : TRIGGER_NONE;
+    if( iTrigger != TRIGGER_NONE && Dispatch(iTrigger, ulNow) )
+        return true;
+
+    unsigned long ulBudget = g_stateInfo[m_iState].ulBudgetMs;
+    if( ulBudget == STATE_NO_BUDGET || ulNow - m_ulEntered < ulBudget )
+        return false;
+
+    m_uaOverruns[m_iState]++;
+    return Dispatch(TRIGGER_TIMEOUT, ulNow);
+}
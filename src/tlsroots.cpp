@@ -0,0 +1,10 @@
+#include <Arduino.h>
+
+#include "tlsroots.h"
+#include "tlsbundle.h" // Made by tools/mktlsroots.py into the build directory
+
+const uint8_t *tlsGetPinnedBundle(int *piRoots)
+{
+    *piRoots = TLS_BUNDLE_ROOTS;
+    return TLS_BUNDLE_ROOTS ? s_tlsBundle : nullptr;
+}
@@ -0,0 +1,152 @@
+#include <Arduino.h>
+
+#include "trace.h"
+#include "log.h"
+
+#if TRACE_ENABLED
+
+#define TRACE_DUMP_COMMAND 't'
+#define TRACE_MAX_TRACKS 4
+
+struct traceEvent {
+  const char *name;
+  uint32_t ulTimeUs; // Start for a complete event
+  int32_t iValue;    // Duration for a complete event, the value for a counter
+  char phase;        // Chrome's: B, E, X, i or C
+  uint8_t track;
+};
+
+static traceEvent s_events[TRACE_RING_LEN];
+static uint32_t s_uWritten = 0;
+
+static const char *s_szaTracks[TRACE_MAX_TRACKS] = { "", "loop", "state", "" };
+
+static inline void Record(const char *name, char phase, uint8_t track, uint32_t ulTimeUs, int32_t iValue)
+{
+    traceEvent &event = s_events[s_uWritten % TRACE_RING_LEN];
+    event.name = name;
+    event.ulTimeUs = ulTimeUs;
+    event.iValue = iValue;
+    event.phase = phase;
+    event.track = track < TRACE_MAX_TRACKS ? track : 0;
+    s_uWritten++;
+}
+
+void traceBegin(const char *name, uint8_t track)
+{
+    Record(name, 'B', track, micros(), 0);
+}
+
+void traceEnd(const char *name, uint8_t track)
+{
+    Record(name, 'E', track, micros(), 0);
+}
+
+void traceInstant(const char *name, uint8_t track)
+{
+    Record(name, 'i', track, micros(), 0);
+}
+
+void traceCounter(const char *name, int32_t value)
+{
+    Record(name, 'C', 0, micros(), value);
+}
+
+void traceComplete(const char *name, uint32_t ulStartUs, uint8_t track)
+{
+    Record(name, 'X', track, ulStartUs, (int32_t)(micros() - ulStartUs));
+}
+
+void traceDump(Print &out)
+{
+    uint32_t uCount = s_uWritten < TRACE_RING_LEN ? s_uWritten : TRACE_RING_LEN;
+    uint32_t uFirst = s_uWritten - uCount;
+    if( !uCount )
+    {
+        out.write("{\"traceEvents\":[]}\n");
+        return;
+    }
+
+    // Complete events go in when they end, so the oldest start isn't necessarily the first one
+    uint32_t ulBaseUs = s_events[uFirst % TRACE_RING_LEN].ulTimeUs;
+    for( uint32_t i = uFirst; i != s_uWritten; i++ )
+    {
+        uint32_t ulTimeUs = s_events[i % TRACE_RING_LEN].ulTimeUs;
+        if( (int32_t)(ulTimeUs - ulBaseUs) < 0 )
+            ulBaseUs = ulTimeUs;
+    }
+
+    char szLine[160];
+    int iLen;
+
+    out.write("{\"traceEvents\":[\n");
+    for( int i = 1; i < TRACE_MAX_TRACKS; i++ )
+    {
+        if( !*s_szaTracks[i] )
+            continue;
+        iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n", i, s_szaTracks[i]);
+        out.write((const uint8_t *)szLine, iLen);
+    }
+
+    // The ring may have wrapped in the middle of a span, an end without its begin confuses the viewer
+    int iaDepth[TRACE_MAX_TRACKS] = {};
+    for( uint32_t i = uFirst; i != s_uWritten; i++ )
+    {
+        const traceEvent &event = s_events[i % TRACE_RING_LEN];
+        unsigned long ulTs = event.ulTimeUs - ulBaseUs;
+
+        switch( event.phase )
+        {
+            case 'B':
+                iaDepth[event.track]++;
+                iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"ph\":\"B\",\"ts\":%lu,\"pid\":1,\"tid\":%d}", event.name, ulTs, event.track);
+            break;
+            case 'E':
+                if( !iaDepth[event.track] )
+                    continue;
+                iaDepth[event.track]--;
+                iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"ph\":\"E\",\"ts\":%lu,\"pid\":1,\"tid\":%d}", event.name, ulTs, event.track);
+            break;
+            case 'X':
+                iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%ld,\"pid\":1,\"tid\":%d}", event.name, ulTs, (long)event.iValue, event.track);
+            break;
+            case 'i':
+                iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":1,\"tid\":%d}", event.name, ulTs, event.track);
+            break;
+            case 'C':
+                iLen = snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%lu,\"pid\":1,\"args\":{\"value\":%ld}}", event.name, ulTs, (long)event.iValue);
+            break;
+            default:
+                continue;
+        }
+
+        out.write((const uint8_t *)szLine, iLen);
+        out.write(",\n");
+    }
+
+    // Trailing comma needs something after it
+    out.write("{\"name\":\"dump\",\"ph\":\"i\",\"s\":\"g\",\"ts\":");
+    iLen = snprintf(szLine, sizeof(szLine), "%lu,\"pid\":1,\"tid\":1}\n],\"displayTimeUnit\":\"ms\"}\n", (unsigned long)(micros() - ulBaseUs));
+    out.write((const uint8_t *)szLine, iLen);
+}
+
+void updateTrace()
+{
+    bool bDump = false;
+    while( Serial.available() )
+        bDump |= Serial.read() == TRACE_DUMP_COMMAND;
+
+    if( !bDump )
+        return;
+
+    // The log task would end up in the middle of the JSON otherwise
+    logFlush();
+    logHold(true);
+    Serial.write("\n--- trace begin ---\n");
+    traceDump(Serial);
+    Serial.write("--- trace end ---\n");
+    Serial.flush();
+    logHold(false);
+}
+
+#endif
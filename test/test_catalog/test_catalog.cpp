@@ -0,0 +1,156 @@
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <unity.h>
+
+#include "catalog.h"
+#include "config.h"
+
+static bool Apply(const char *json)
+{
+  return catalogReceiveDelta((const uint8_t *)json, strlen(json));
+}
+
+static void AssertItem(int iId, const char *szName, uint32_t uPrice)
+{
+  const catalogItem *item = catalogFind(iId);
+  TEST_ASSERT_NOT_NULL(item);
+  TEST_ASSERT_EQUAL_STRING(szName, item->szName);
+  TEST_ASSERT_EQUAL_UINT32(uPrice, item->uPrice);
+}
+
+// Items 1, 5 and 9 in v1
+static void Start()
+{
+  TEST_ASSERT_TRUE(Apply("{\"from\":0,\"to\":1,\"set\":[[1,\"Kava\",150,1],[5,\"Caj\",120,1],[9,\"Sok\",200,2]]}"));
+  TEST_ASSERT_EQUAL_UINT32(1, catalogGetVersion());
+  TEST_ASSERT_EQUAL(3, catalogGetCount());
+}
+
+void setUp()
+{
+  // Both halves erased, like a new station
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CATALOG_SUBTYPE, CATALOG_PARTITION);
+  TEST_ASSERT_NOT_NULL(partition);
+  esp_partition_erase_range(partition, 0, 2 * CATALOG_SLOT_SIZE);
+  setupCatalog();
+  TEST_ASSERT_EQUAL_UINT32(0, catalogGetVersion());
+}
+
+void tearDown()
+{
+}
+
+void test_merge()
+{
+  Start();
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"set\":[[5,\"Caj veliki\",180,1],[7,\"Voda\",100,2]],\"remove\":[9]}"));
+  TEST_ASSERT_EQUAL_UINT32(2, catalogGetVersion());
+  TEST_ASSERT_EQUAL(3, catalogGetCount());
+  AssertItem(1, "Kava", 150);
+  AssertItem(5, "Caj veliki", 180);
+  AssertItem(7, "Voda", 100);
+  TEST_ASSERT_NULL(catalogFind(9));
+}
+
+void test_duplicate_set_ids()
+{
+  // The later of two sets of the same ID wins, for an item that's there and for a new one
+  Start();
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"set\":[[5,\"A\",1,0],[20,\"X\",3,0],[5,\"B\",2,0],[20,\"Y\",4,0]]}"));
+  TEST_ASSERT_EQUAL(4, catalogGetCount());
+  AssertItem(1, "Kava", 150);
+  AssertItem(5, "B", 2);
+  AssertItem(9, "Sok", 200);
+  AssertItem(20, "Y", 4);
+}
+
+void test_duplicate_remove_ids()
+{
+  Start();
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"remove\":[9,1,9,1,3]}"));
+  TEST_ASSERT_EQUAL(1, catalogGetCount());
+  TEST_ASSERT_NULL(catalogFind(1));
+  AssertItem(5, "Caj", 120);
+  TEST_ASSERT_NULL(catalogFind(9));
+}
+
+void test_set_and_remove_of_one_id()
+{
+  // Removes go to the catalog as it was, the set comes after
+  Start();
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"set\":[[5,\"Caj novi\",130,1]],\"remove\":[5,5]}"));
+  TEST_ASSERT_EQUAL(3, catalogGetCount());
+  AssertItem(5, "Caj novi", 130);
+}
+
+void test_bad_remove_id()
+{
+  // 65545 and -1 would be 9 and 65535 cut down to 16 bits, none of it goes in
+  Start();
+  TEST_ASSERT_FALSE(Apply("{\"from\":1,\"to\":2,\"set\":[[7,\"Voda\",100,2]],\"remove\":[1,65545]}"));
+  TEST_ASSERT_FALSE(Apply("{\"from\":1,\"to\":2,\"remove\":[-1]}"));
+  TEST_ASSERT_FALSE(Apply("{\"from\":1,\"to\":2,\"remove\":[\"9\"]}"));
+  TEST_ASSERT_EQUAL_UINT32(1, catalogGetVersion());
+  TEST_ASSERT_EQUAL(3, catalogGetCount());
+  AssertItem(1, "Kava", 150);
+  AssertItem(9, "Sok", 200);
+  TEST_ASSERT_NULL(catalogFind(7));
+}
+
+void test_delta_for_another_version()
+{
+  Start();
+  TEST_ASSERT_FALSE(Apply("{\"from\":4,\"to\":5,\"remove\":[1]}"));
+  TEST_ASSERT_FALSE(Apply("{\"from\":0,\"to\":1,\"set\":[[2,\"Staro\",1,0]]}"));
+  TEST_ASSERT_EQUAL_UINT32(1, catalogGetVersion());
+  AssertItem(1, "Kava", 150);
+  TEST_ASSERT_NULL(catalogFind(2));
+}
+
+void test_reset_between_header_and_magic()
+{
+  Start();
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"remove\":[9]}"));
+  TEST_ASSERT_EQUAL_UINT32(2, catalogGetVersion());
+
+  // v1 went into the first half and v2 into the second. Put the second back the way it was after
+  // its header went in and before the magic did, with the magic still erased
+  const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CATALOG_SUBTYPE, CATALOG_PARTITION);
+  static uint8_t sector[SPI_FLASH_SEC_SIZE];
+  TEST_ASSERT_EQUAL(ESP_OK, esp_partition_read(partition, CATALOG_SLOT_SIZE, sector, sizeof(sector)));
+  catalogHeader *header = (catalogHeader *)sector;
+  TEST_ASSERT_EQUAL_UINT32(CATALOG_MAGIC, header->uMagic);
+  TEST_ASSERT_EQUAL_UINT32(2, header->uVersion);
+  header->uMagic = 0xFFFFFFFF;
+  esp_partition_erase_range(partition, CATALOG_SLOT_SIZE, SPI_FLASH_SEC_SIZE);
+  esp_partition_write(partition, CATALOG_SLOT_SIZE, sector, sizeof(sector));
+
+  // The next boot stays on v1
+  setupCatalog();
+  TEST_ASSERT_EQUAL_UINT32(1, catalogGetVersion());
+  TEST_ASSERT_EQUAL(3, catalogGetCount());
+  AssertItem(9, "Sok", 200);
+
+  // And takes the delta again into the half that didn't make it
+  TEST_ASSERT_TRUE(Apply("{\"from\":1,\"to\":2,\"remove\":[9]}"));
+  setupCatalog();
+  TEST_ASSERT_EQUAL_UINT32(2, catalogGetVersion());
+  TEST_ASSERT_NULL(catalogFind(9));
+}
+
+int main(int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+  g_Config.Defaults();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_merge);
+  RUN_TEST(test_duplicate_set_ids);
+  RUN_TEST(test_duplicate_remove_ids);
+  RUN_TEST(test_set_and_remove_of_one_id);
+  RUN_TEST(test_bad_remove_id);
+  RUN_TEST(test_delta_for_another_version);
+  RUN_TEST(test_reset_between_header_and_magic);
+  return UNITY_END();
+}
@@ -0,0 +1,283 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <vector>
+
+#include "delta.h"
+
+// Deltas put together op by op against a small base, decoded into a vector
+static uint8_t s_base[64];
+static std::vector<uint8_t> s_out;
+static bool s_bRefuseHeader = false;
+
+static bool OnHeader(const deltaHeader &header)
+{
+  (void)header;
+  return !s_bRefuseHeader;
+}
+
+static bool ReadBase(uint32_t uOffset, uint8_t *data, size_t length)
+{
+  if( uOffset + length > sizeof(s_base) )
+    return false;
+  memcpy(data, s_base + uOffset, length);
+  return true;
+}
+
+static bool Write(const uint8_t *data, size_t length)
+{
+  s_out.insert(s_out.end(), data, data + length);
+  return true;
+}
+
+static const deltaSink s_sink = { OnHeader, ReadBase, Write };
+
+static void Varint(std::vector<uint8_t> &delta, uint32_t uValue)
+{
+  while( uValue >= 0x80 )
+  {
+    delta.push_back((uint8_t)(uValue | 0x80));
+    uValue >>= 7;
+  }
+  delta.push_back((uint8_t)uValue);
+}
+
+static std::vector<uint8_t> Header(uint32_t uTargetSize, uint32_t uMagic = DELTA_MAGIC)
+{
+  deltaHeader header = {};
+  header.uMagic = uMagic;
+  header.uBaseSize = sizeof(s_base);
+  header.uTargetSize = uTargetSize;
+  const uint8_t *p = (const uint8_t *)&header;
+  return std::vector<uint8_t>(p, p + sizeof(header));
+}
+
+static void Op(std::vector<uint8_t> &delta, uint8_t uOp, uint32_t uArg1, uint32_t uArg2)
+{
+  delta.push_back(uOp);
+  Varint(delta, uArg1);
+  Varint(delta, uArg2);
+}
+
+static void Literal(std::vector<uint8_t> &delta, const char *data)
+{
+  delta.push_back(DELTA_OP_LITERAL);
+  Varint(delta, strlen(data));
+  delta.insert(delta.end(), data, data + strlen(data));
+}
+
+static int Decode(const std::vector<uint8_t> &delta)
+{
+  CDeltaDecoder decoder(s_sink);
+  decoder.Reset();
+  return decoder.Feed(delta.data(), delta.size());
+}
+
+// "456789" from the base, "xyz", then a back-reference that runs into what it writes itself
+static std::vector<uint8_t> AllOps()
+{
+  std::vector<uint8_t> delta = Header(16);
+  Op(delta, DELTA_OP_COPY, 4, 6);
+  Literal(delta, "xyz");
+  Op(delta, DELTA_OP_BACKREF, 3, 7);
+  return delta;
+}
+
+void setUp()
+{
+  for( size_t i = 0; i < sizeof(s_base); i++ )
+    s_base[i] = "0123456789abcdef"[i % 16];
+  s_out.clear();
+  s_bRefuseHeader = false;
+}
+
+void tearDown()
+{
+}
+
+void test_ops()
+{
+  TEST_ASSERT_EQUAL(DELTA_DONE, Decode(AllOps()));
+  TEST_ASSERT_EQUAL(16, s_out.size());
+  TEST_ASSERT_EQUAL_MEMORY("456789xyzxyzxyzx", s_out.data(), 16);
+}
+
+void test_zero_length_literal()
+{
+  std::vector<uint8_t> delta = Header(2);
+  Literal(delta, "");
+  Literal(delta, "ab");
+  TEST_ASSERT_EQUAL(DELTA_DONE, Decode(delta));
+  TEST_ASSERT_EQUAL_MEMORY("ab", s_out.data(), 2);
+}
+
+void test_split_feeds()
+{
+  std::vector<uint8_t> delta = AllOps();
+
+  // Every place a download could cut it in two
+  for( size_t uSplit = 0; uSplit <= delta.size(); uSplit++ )
+  {
+    s_out.clear();
+    CDeltaDecoder decoder(s_sink);
+    decoder.Reset();
+    int iFirst = decoder.Feed(delta.data(), uSplit);
+    TEST_ASSERT_EQUAL(uSplit == delta.size() ? DELTA_DONE : DELTA_OK, iFirst);
+    TEST_ASSERT_EQUAL(DELTA_DONE, decoder.Feed(delta.data() + uSplit, delta.size() - uSplit));
+    TEST_ASSERT_EQUAL_MEMORY("456789xyzxyzxyzx", s_out.data(), 16);
+  }
+
+  // And a byte at a time
+  s_out.clear();
+  CDeltaDecoder decoder(s_sink);
+  decoder.Reset();
+  int iResult = DELTA_OK;
+  for( size_t i = 0; i < delta.size(); i++ )
+  {
+    TEST_ASSERT_EQUAL(DELTA_OK, iResult);
+    iResult = decoder.Feed(&delta[i], 1);
+  }
+  TEST_ASSERT_EQUAL(DELTA_DONE, iResult);
+  TEST_ASSERT_EQUAL(16, decoder.GetWritten());
+}
+
+void test_back_reference_across_the_window()
+{
+  // More than a window of literal, so the ring buffer has wrapped when the back-reference reads it
+  std::vector<uint8_t> delta = Header(DELTA_WINDOW + 1000 + 100);
+  std::vector<char> literal(DELTA_WINDOW + 1000 + 1);
+  for( size_t i = 0; i + 1 < literal.size(); i++ )
+    literal[i] = 'a' + (i * 7) % 26;
+  literal.back() = '\0';
+  Literal(delta, literal.data());
+  Op(delta, DELTA_OP_BACKREF, DELTA_WINDOW, 100);
+
+  TEST_ASSERT_EQUAL(DELTA_DONE, Decode(delta));
+  TEST_ASSERT_EQUAL_MEMORY(&s_out[1000], &s_out[DELTA_WINDOW + 1000], 100);
+}
+
+void test_copy_past_the_base()
+{
+  std::vector<uint8_t> delta = Header(16);
+  Op(delta, DELTA_OP_COPY, sizeof(s_base) - 4, 8);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+
+  delta = Header(16);
+  Op(delta, DELTA_OP_COPY, sizeof(s_base) + 1, 0);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+}
+
+void test_back_reference_out_of_range()
+{
+  // Before the start of the target
+  std::vector<uint8_t> delta = Header(16);
+  Literal(delta, "ab");
+  Op(delta, DELTA_OP_BACKREF, 3, 1);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+
+  // Distance 0
+  delta = Header(16);
+  Literal(delta, "ab");
+  Op(delta, DELTA_OP_BACKREF, 0, 1);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+
+  // Further back than the window holds
+  delta = Header(DELTA_WINDOW + 10);
+  std::vector<char> literal(DELTA_WINDOW + 2, 'q');
+  literal.back() = '\0';
+  Literal(delta, literal.data());
+  Op(delta, DELTA_OP_BACKREF, DELTA_WINDOW + 1, 1);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+}
+
+void test_past_the_target()
+{
+  std::vector<uint8_t> delta = Header(4);
+  Literal(delta, "abcde");
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+
+  delta = Header(4);
+  Op(delta, DELTA_OP_COPY, 0, 5);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+
+  delta = Header(4);
+  Literal(delta, "ab");
+  Op(delta, DELTA_OP_BACKREF, 1, 3);
+  TEST_ASSERT_EQUAL(DELTA_ERR_RANGE, Decode(delta));
+}
+
+void test_bad_op()
+{
+  std::vector<uint8_t> delta = Header(4);
+  delta.push_back(0);
+  TEST_ASSERT_EQUAL(DELTA_ERR_OP, Decode(delta));
+
+  delta = Header(4);
+  delta.push_back(DELTA_OP_BACKREF + 1);
+  TEST_ASSERT_EQUAL(DELTA_ERR_OP, Decode(delta));
+
+  // A varint that goes on past 32 bits
+  delta = Header(4);
+  delta.push_back(DELTA_OP_COPY);
+  for( int i = 0; i < 6; i++ )
+    delta.push_back(0x80);
+  TEST_ASSERT_EQUAL(DELTA_ERR_OP, Decode(delta));
+}
+
+void test_bad_header()
+{
+  std::vector<uint8_t> delta = Header(2, DELTA_MAGIC + 1);
+  Literal(delta, "ab");
+  TEST_ASSERT_EQUAL(DELTA_ERR_HEADER, Decode(delta));
+  TEST_ASSERT_EQUAL(0, s_out.size());
+
+  s_bRefuseHeader = true;
+  delta = Header(2);
+  Literal(delta, "ab");
+  TEST_ASSERT_EQUAL(DELTA_ERR_HEADER, Decode(delta));
+  TEST_ASSERT_EQUAL(0, s_out.size());
+}
+
+void test_errors_stick_until_reset()
+{
+  std::vector<uint8_t> bad = Header(4);
+  bad.push_back(0);
+  CDeltaDecoder decoder(s_sink);
+  decoder.Reset();
+  TEST_ASSERT_EQUAL(DELTA_ERR_OP, decoder.Feed(bad.data(), bad.size()));
+
+  std::vector<uint8_t> good = AllOps();
+  TEST_ASSERT_EQUAL(DELTA_ERR_OP, decoder.Feed(good.data(), good.size()));
+
+  decoder.Reset();
+  s_out.clear();
+  TEST_ASSERT_EQUAL(DELTA_DONE, decoder.Feed(good.data(), good.size()));
+  TEST_ASSERT_EQUAL_MEMORY("456789xyzxyzxyzx", s_out.data(), 16);
+}
+
+void test_trailing_bytes_ignored()
+{
+  std::vector<uint8_t> delta = AllOps();
+  delta.push_back(0xEE);
+  delta.push_back(0xEE);
+  TEST_ASSERT_EQUAL(DELTA_DONE, Decode(delta));
+  TEST_ASSERT_EQUAL(16, s_out.size());
+}
+
+int main(int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+  UNITY_BEGIN();
+  RUN_TEST(test_ops);
+  RUN_TEST(test_zero_length_literal);
+  RUN_TEST(test_split_feeds);
+  RUN_TEST(test_back_reference_across_the_window);
+  RUN_TEST(test_copy_past_the_base);
+  RUN_TEST(test_back_reference_out_of_range);
+  RUN_TEST(test_past_the_target);
+  RUN_TEST(test_bad_op);
+  RUN_TEST(test_bad_header);
+  RUN_TEST(test_errors_stick_until_reset);
+  RUN_TEST(test_trailing_bytes_ignored);
+  return UNITY_END();
+}
@@ -0,0 +1,224 @@
+#include <Arduino.h>
+#include <esp_now.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/md.h>
+#include <unity.h>
+#include <vector>
+
+#include "gateway.h"
+#include "config.h"
+
+extern CIoTHub g_IoTHub;
+
+// The hub isn't connected, so whatever the gateway takes stays in the station queues and shows in getGatewayPending()
+static const uint8_t s_mac[ESP_NOW_ETH_ALEN] = { 0x24, 0x0A, 0xC4, 0x00, 0x00, 0x01 };
+static const char s_szPayload[] = "{\"UserID\":1}";
+static int s_iSent = 0;
+static std::vector<uint8_t> s_lastSent;
+
+static void OnSend(const uint8_t *mac, const uint8_t *data, int len)
+{
+  (void)mac;
+  s_lastSent.assign(data, data + len);
+  s_iSent++;
+}
+
+static void Hmac(const uint8_t *key, size_t keyLen, const uint8_t *data, size_t len, uint8_t *out)
+{
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+  mbedtls_md_hmac_starts(&ctx, key, keyLen);
+  mbedtls_md_hmac_update(&ctx, data, len);
+  mbedtls_md_hmac_finish(&ctx, out);
+  mbedtls_md_free(&ctx);
+}
+
+// What the station with that ID gets provisioned with
+static void StationKey(const char *id, uint8_t *key)
+{
+  uint8_t groupKey[GATEWAY_KEY_LEN];
+  size_t groupKeyLen = 0;
+  const char *keyBase64 = g_IoTHub.GetGatewayKey();
+  TEST_ASSERT_EQUAL(0, mbedtls_base64_decode(groupKey, sizeof(groupKey), &groupKeyLen, (const unsigned char *)keyBase64, strlen(keyBase64)));
+  Hmac(groupKey, groupKeyLen, (const uint8_t *)id, strlen(id), key);
+}
+
+static bool TagMatches(const std::vector<uint8_t> &frame, const uint8_t *key)
+{
+  uint8_t tag[32];
+  Hmac(key, GATEWAY_KEY_LEN, frame.data(), frame.size() - GATEWAY_TAG_LEN, tag);
+  return memcmp(tag, frame.data() + frame.size() - GATEWAY_TAG_LEN, GATEWAY_TAG_LEN) == 0;
+}
+
+// A telemetry frame the way a downstream station sends it, tagged with key
+static std::vector<uint8_t> Frame(const char *id, uint32_t uBoot, uint16_t uSeq, const uint8_t *key)
+{
+  gatewayHeader header = { GATEWAY_MAGIC, GATEWAY_FRAME_TELEMETRY, (uint8_t)strlen(id), uBoot, uSeq };
+  std::vector<uint8_t> frame((const uint8_t *)&header, (const uint8_t *)&header + sizeof(header));
+  frame.insert(frame.end(), id, id + strlen(id));
+  frame.insert(frame.end(), s_szPayload, s_szPayload + strlen(s_szPayload));
+
+  uint8_t tag[32];
+  Hmac(key, GATEWAY_KEY_LEN, frame.data(), frame.size(), tag);
+  frame.insert(frame.end(), tag, tag + GATEWAY_TAG_LEN);
+  return frame;
+}
+
+static void Receive(const std::vector<uint8_t> &frame)
+{
+  SimEspNowReceive(s_mac, frame.data(), (int)frame.size());
+}
+
+static void Submit(const char *id, uint32_t uBoot, uint16_t uSeq)
+{
+  TEST_ASSERT_TRUE(gatewaySubmit(id, uBoot, uSeq, (const uint8_t *)s_szPayload, strlen(s_szPayload), s_mac));
+}
+
+// What changed since the test started
+static int s_iPending;
+static uint32_t s_uDuplicates;
+static uint32_t s_uReceived;
+static uint32_t s_uRejected;
+
+void setUp()
+{
+  s_iSent = 0;
+  s_lastSent.clear();
+  s_iPending = getGatewayPending();
+  s_uDuplicates = getGatewayStats().uDuplicates;
+  s_uReceived = getGatewayStats().uReceived;
+  s_uRejected = getGatewayStats().uRejected;
+}
+
+void tearDown()
+{
+}
+
+static void AssertCounts(int iQueued, int iDuplicates)
+{
+  updateGateway();
+  TEST_ASSERT_EQUAL(iQueued, getGatewayPending() - s_iPending);
+  TEST_ASSERT_EQUAL(iDuplicates, (int)(getGatewayStats().uDuplicates - s_uDuplicates));
+  TEST_ASSERT_EQUAL(iQueued + iDuplicates, (int)(getGatewayStats().uReceived - s_uReceived));
+  // Duplicates get their ack too, it's the lost ack that made the station send again
+  TEST_ASSERT_EQUAL(iQueued + iDuplicates, s_iSent);
+}
+
+void test_resend_is_a_duplicate()
+{
+  Submit("station-a", 100, 1);
+  Submit("station-a", 100, 1);
+  AssertCounts(1, 1);
+
+  // Also when the resend comes in a later loop()
+  setUp();
+  Submit("station-a", 100, 1);
+  AssertCounts(0, 1);
+}
+
+void test_next_sequence_is_new()
+{
+  Submit("station-b", 7, 1);
+  Submit("station-b", 7, 2);
+  Submit("station-b", 7, 2);
+  Submit("station-b", 7, 3);
+  AssertCounts(3, 1);
+}
+
+void test_new_boot_starts_over()
+{
+  // After a reboot the station counts from 1 again, under a new boot nonce
+  Submit("station-c", 1, 1);
+  Submit("station-c", 2, 1);
+  AssertCounts(2, 0);
+}
+
+void test_stations_kept_apart()
+{
+  Submit("station-d", 5, 1);
+  Submit("station-e", 5, 1);
+  AssertCounts(2, 0);
+}
+
+void test_older_sequence_is_a_duplicate()
+{
+  // A frame of this boot played back later still has a good tag
+  Submit("station-f", 3, 5);
+  Submit("station-f", 3, 4);
+  Submit("station-f", 3, 6);
+  AssertCounts(2, 1);
+}
+
+void test_tagged_frame_accepted()
+{
+  uint8_t key[GATEWAY_KEY_LEN];
+  StationKey("station-g", key);
+  Receive(Frame("station-g", 9, 1, key));
+  AssertCounts(1, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, getGatewayStats().uRejected - s_uRejected);
+
+  // The ack is tagged with the station's key too
+  TEST_ASSERT_TRUE(s_lastSent.size() > sizeof(gatewayHeader) + GATEWAY_TAG_LEN);
+  TEST_ASSERT_EQUAL(GATEWAY_FRAME_ACK, ((const gatewayHeader *)s_lastSent.data())->uType);
+  TEST_ASSERT_TRUE(TagMatches(s_lastSent, key));
+}
+
+void test_tampered_frame_rejected()
+{
+  uint8_t key[GATEWAY_KEY_LEN];
+  StationKey("station-h", key);
+
+  // A changed payload byte, a changed sequence and a changed station ID
+  std::vector<uint8_t> frame = Frame("station-h", 9, 1, key);
+  frame[frame.size() - GATEWAY_TAG_LEN - 2] ^= 0x01;
+  Receive(frame);
+  frame = Frame("station-h", 9, 1, key);
+  ((gatewayHeader *)frame.data())->uSeq = 2;
+  Receive(frame);
+  frame = Frame("station-h", 9, 1, key);
+  frame[sizeof(gatewayHeader) + strlen("station-")] = 'i';
+  Receive(frame);
+
+  // Tagged with another station's key, with the gateway's own key, and with the tag cut off
+  uint8_t otherKey[GATEWAY_KEY_LEN];
+  StationKey("station-x", otherKey);
+  Receive(Frame("station-h", 9, 1, otherKey));
+  uint8_t groupKey[GATEWAY_KEY_LEN];
+  size_t groupKeyLen = 0;
+  const char *keyBase64 = g_IoTHub.GetGatewayKey();
+  mbedtls_base64_decode(groupKey, sizeof(groupKey), &groupKeyLen, (const unsigned char *)keyBase64, strlen(keyBase64));
+  Receive(Frame("station-h", 9, 1, groupKey));
+  frame = Frame("station-h", 9, 1, key);
+  frame.resize(frame.size() - GATEWAY_TAG_LEN);
+  Receive(frame);
+
+  // Nothing queued, nothing acked. The untagged one is too short to be a frame at all
+  AssertCounts(0, 0);
+  TEST_ASSERT_EQUAL_UINT32(5, getGatewayStats().uRejected - s_uRejected);
+
+  // And the real one still gets in after all that
+  setUp();
+  Receive(Frame("station-h", 9, 1, key));
+  AssertCounts(1, 0);
+}
+
+int main(int argc, char **argv)
+{
+  (void)argc;
+  (void)argv;
+  g_Config.Defaults();
+  g_Config.iGatewayMode = GATEWAY_MODE_GATEWAY;
+  setupGateway();
+  SimSetEspNowSendHook(OnSend);
+
+  UNITY_BEGIN();
+  RUN_TEST(test_resend_is_a_duplicate);
+  RUN_TEST(test_next_sequence_is_new);
+  RUN_TEST(test_new_boot_starts_over);
+  RUN_TEST(test_stations_kept_apart);
+  RUN_TEST(test_older_sequence_is_a_duplicate);
+  RUN_TEST(test_tagged_frame_accepted);
+  RUN_TEST(test_tampered_frame_rejected);
+  return UNITY_END();
+}
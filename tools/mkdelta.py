@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""
+Makes a delta of a new station firmware image against the one the stations run, in the format
+include/delta.h reads. Upload it somewhere the stations can reach over https and call the direct
+method with the sha256 this prints, it's the only thing that vouches for the download:
+
+    tools/mkdelta.py old/firmware.bin .pio/build/nodemcu-32s/firmware.bin station.delta
+    az iot hub invoke-device-method -n <hub> -d <device> --method-name firmwareUpdate \
+        --method-payload '{"url": "https://<storage>/station.delta", "sha256": "<hex>"}'
+
+For a test against python3 -m http.server, the station has to be built with -DOTA_ALLOW_HTTP=1.
+A full image works the same way.
+"""
+
+import hashlib
+import struct
+import sys
+
+DELTA_MAGIC = 0x544C4453
+DELTA_WINDOW = 4096
+OP_COPY, OP_LITERAL, OP_BACKREF = 1, 2, 3
+
+BLOCK = 16       # Shortest match worth an op, anything shorter goes out as a literal
+BASE_STEP = 4    # Code and data in an app image are word aligned, so the base is indexed every 4 bytes
+
+
+def varint(value):
+    out = bytearray()
+    while True:
+        b = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def match_length(a, a_pos, b, b_pos, limit):
+    n = 0
+    while n < limit and a_pos + n < len(a) and b_pos + n < len(b) and a[a_pos + n] == b[b_pos + n]:
+        n += 1
+    return n
+
+
+def make_delta(base, target):
+    index = {}
+    for pos in range(0, len(base) - BLOCK + 1, BASE_STEP):
+        index.setdefault(base[pos:pos + BLOCK], pos)
+
+    recent = {}  # Last place each block was seen in the target, for back-references
+    ops = bytearray()
+    literal = bytearray()
+    shift = 0    # Base offset minus target offset of the last copy, most code just moved along
+
+    def flush_literal():
+        if literal:
+            ops.extend(bytes([OP_LITERAL]) + varint(len(literal)) + literal)
+            literal.clear()
+
+    pos = 0
+    while pos < len(target):
+        best_len, best_op, best_arg = 0, None, 0
+        limit = len(target) - pos
+
+        candidates = []
+        if 0 <= pos + shift < len(base):
+            candidates.append(pos + shift)
+        block = target[pos:pos + BLOCK]
+        if block in index:
+            candidates.append(index[block])
+        for base_pos in candidates:
+            n = match_length(base, base_pos, target, pos, limit)
+            if n > best_len:
+                best_len, best_op, best_arg = n, OP_COPY, base_pos
+
+        prev = recent.get(block)
+        if prev is not None and pos - prev <= DELTA_WINDOW:
+            n = match_length(target, prev, target, pos, limit)
+            if n > best_len:
+                best_len, best_op, best_arg = n, OP_BACKREF, pos - prev
+
+        if best_len >= BLOCK:
+            flush_literal()
+            if best_op == OP_COPY:
+                ops.extend(bytes([OP_COPY]) + varint(best_arg) + varint(best_len))
+                shift = best_arg - pos
+            else:
+                ops.extend(bytes([OP_BACKREF]) + varint(best_arg) + varint(best_len))
+            step = best_len
+        else:
+            literal.append(target[pos])
+            step = 1
+
+        for p in range(pos, min(pos + step, len(target) - BLOCK + 1)):
+            recent[target[p:p + BLOCK]] = p
+        pos += step
+
+    flush_literal()
+
+    header = struct.pack("<III", DELTA_MAGIC, len(base), len(target))
+    header += hashlib.sha256(base).digest() + hashlib.sha256(target).digest()
+    return header + ops
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__)
+        print("Usage: mkdelta.py BASE.bin TARGET.bin OUT.delta")
+        return 2
+
+    with open(sys.argv[1], "rb") as f:
+        base = f.read()
+    with open(sys.argv[2], "rb") as f:
+        target = f.read()
+
+    delta = make_delta(base, target)
+    with open(sys.argv[3], "wb") as f:
+        f.write(delta)
+
+    print("%d bytes against %d, delta %d bytes (%.1f %% of the full image)"
+          % (len(target), len(base), len(delta), 100.0 * len(delta) / max(len(target), 1)))
+    print("sha256 %s" % hashlib.sha256(target).hexdigest())
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+Builds the certificate bundle the station trusts the hub through, in ESP-IDF's format as
+gen_crt_bundle.py makes it, and writes it out as a const array so it stays in flash.
+
+The roots in PINNED_ROOTS are picked by common name out of ca_pem in the Azure SDK's azure_ca.h,
+so nothing is trusted that isn't in the SDK's own bundle already. Per root only its subject and
+public key go in, sorted by subject, that's all the handshake needs to check the hub's chain.
+
+Runs on its own before every build (extra_scripts in platformio.ini) and writes tlsbundle.h into
+the build directory. By hand, from azure_ca.h or any PEM file:
+
+    tools/mktlsroots.py .pio/libdeps/nodemcu-32s/Azure\ SDK\ for\ C/src/azure_ca.h tlsbundle.h
+"""
+
+import base64
+import glob
+import os
+import re
+import sys
+
+# Baltimore CyberTrust Root expired in May 2025, the hub moved to DigiCert Global Root G2 before that
+PINNED_ROOTS = ["DigiCert Global Root G2", "Microsoft RSA Root Certificate Authority 2017"]
+
+DER_VERSION = 0xA0
+COMMON_NAME = bytes([0x55, 0x04, 0x03])  # 2.5.4.3
+
+
+def der_read(data, pos):
+    """Tag, start of the value and end of the element at pos"""
+    tag = data[pos]
+    length = data[pos + 1]
+    pos += 2
+    if length & 0x80:
+        count = length & 0x7F
+        length = int.from_bytes(data[pos:pos + count], "big")
+        pos += count
+    if pos + length > len(data):
+        raise ValueError("DER element runs past the end")
+    return tag, pos, pos + length
+
+
+def der_children(data, start, end):
+    pos = start
+    while pos < end:
+        tag, value, next_pos = der_read(data, pos)
+        yield tag, pos, value, next_pos
+        pos = next_pos
+
+
+def subject_and_key(der):
+    """Subject and public key of a certificate, both with their DER headers"""
+    _, cert, cert_end = der_read(der, 0)
+    _, tbs, tbs_end = der_read(der, cert)
+    fields = [(tag, start, end) for tag, start, _, end in der_children(der, tbs, tbs_end)]
+    if fields and fields[0][0] == DER_VERSION:
+        fields = fields[1:]
+    # Serial, signature algorithm, issuer, validity, subject, public key
+    (_, name_start, name_end), (_, key_start, key_end) = fields[4], fields[5]
+    return der[name_start:name_end], der[key_start:key_end]
+
+
+def common_name(subject):
+    _, value, end = der_read(subject, 0)
+    for _, _, part, part_end in der_children(subject, value, end):
+        _, pair, pair_end = der_read(subject, part)
+        _, oid, oid_end = der_read(subject, pair)
+        if subject[oid:oid_end] == COMMON_NAME:
+            _, name, name_end = der_read(subject, oid_end)
+            return subject[name:name_end].decode("utf-8", "replace")
+    return None
+
+
+def read_pem(path):
+    """The PEM text out of a PEM file, or out of the string literals of a C header like azure_ca.h"""
+    with open(path, encoding="utf-8", errors="replace") as f:
+        text = f.read()
+    if path.endswith(".h"):
+        literals = re.findall(r'"((?:[^"\\]|\\.)*)"', text)
+        if literals:
+            return "".join(literals).encode().decode("unicode_escape")
+        # Or a byte array
+        return bytes(int(b, 16) for b in re.findall(r"0x([0-9a-fA-F]{2})", text)).decode("ascii", "replace")
+    return text
+
+
+def make_bundle(pem):
+    roots = {}
+    for block in re.findall(r"-----BEGIN CERTIFICATE-----(.*?)-----END CERTIFICATE-----", pem, re.S):
+        subject, key = subject_and_key(base64.b64decode("".join(block.split())))
+        name = common_name(subject)
+        if name in PINNED_ROOTS and name not in roots:
+            roots[name] = (subject, key)
+
+    missing = [name for name in PINNED_ROOTS if name not in roots]
+    if missing:
+        print("mktlsroots: not in the CA bundle: " + ", ".join(missing))
+
+    # Binary searched for the issuer of the hub's chain, so sorted by subject, bytewise
+    names = sorted(roots, key=lambda name: roots[name][0])
+    bundle = bytearray(len(names).to_bytes(2, "big"))
+    for subject, key in (roots[name] for name in names):
+        bundle += len(subject).to_bytes(2, "big") + len(key).to_bytes(2, "big") + subject + key
+    return names, bytes(bundle)
+
+
+def write_header(source, names, bundle, path):
+    lines = [
+        "// Made by tools/mktlsroots.py out of %s, don't edit" % os.path.basename(source),
+        "#pragma once",
+        "",
+        "#include <stdint.h>",
+        "",
+    ]
+    lines += ["// %s" % name for name in names]
+    lines += [
+        "#define TLS_BUNDLE_ROOTS %d" % len(names),
+        "",
+        "static const uint8_t s_tlsBundle[%d] = {" % len(bundle),
+    ]
+    for pos in range(0, len(bundle), 16):
+        lines.append("    " + " ".join("0x%02x," % b for b in bundle[pos:pos + 16]))
+    lines += ["};", ""]
+    text = "\n".join(lines)
+
+    # Left alone if nothing changed, so tlsroots.cpp isn't built again every time
+    if os.path.exists(path):
+        with open(path) as f:
+            if f.read() == text:
+                return
+    os.makedirs(os.path.dirname(path) or ".", exist_ok=True)
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def generate(source, path):
+    names, bundle = make_bundle(read_pem(source))
+    write_header(source, names, bundle, path)
+    print("mktlsroots: %d pinned roots, %d byte bundle" % (len(names), len(bundle)))
+
+
+try:
+    Import("env")
+except NameError:
+    env = None
+
+if env is not None:
+    # The SDK comes in with lib_deps, which are in place before the build starts
+    found = glob.glob(os.path.join(env.subst("$PROJECT_LIBDEPS_DIR"), env.subst("$PIOENV"), "**", "azure_ca.h"), recursive=True)
+    if not found:
+        sys.stderr.write("mktlsroots: azure_ca.h not found, is the Azure SDK for C in lib_deps?\n")
+        env.Exit(1)
+    out_dir = os.path.join(env.subst("$BUILD_DIR"), "tlsroots")
+    generate(found[0], os.path.join(out_dir, "tlsbundle.h"))
+    env.Append(CPPPATH=[out_dir])
+elif __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    generate(sys.argv[1], sys.argv[2])